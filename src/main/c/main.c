@@ -7,6 +7,9 @@
 
 #include "pg_server.h"
 #include "pg_protocol.h"
+#include "pg_protocol_logging.h"
+#include "pg_log.h"
+#include "pg_simd.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +17,22 @@
 #include <unistd.h>
 #include <getopt.h>
 
+/* Long options without a short form */
+#define OPTION_UPSTREAM_USER 256
+#define OPTION_UPSTREAM_DB   257
+#define OPTION_IDLE_SESSION_TIMEOUT 258
+#define OPTION_IDLE_IN_TRANSACTION_TIMEOUT 259
+#define OPTION_HIBERNATE_AFTER 260
+#define OPTION_AUTHENTICATION_TIMEOUT 261
+#define OPTION_STATEMENT_TIMEOUT 262
+#define OPTION_CONNECTION_CHECK_INTERVAL 263
+#define OPTION_KEEPALIVES_IDLE 264
+#define OPTION_KEEPALIVES_INTERVAL 265
+#define OPTION_KEEPALIVES_COUNT 266
+#define OPTION_COMPRESSION_THRESHOLD 267
+#define OPTION_HANDOFF_SOCKET 268
+#define OPTION_HANDOFF_TIMEOUT 269
+
 /* Global variables */
 static PGServer *g_server = NULL;
 
@@ -51,7 +70,29 @@ static void print_usage(const char *program_name) {
     printf("  -s, --ssl             Enable SSL\n");
     printf("  -c, --ssl-cert FILE   SSL certificate file\n");
     printf("  -k, --ssl-key FILE    SSL key file\n");
-    printf("  -v, --verbose         Enable verbose logging\n");
+    printf("  -e, --event-backend B Event loop backend: auto, epoll, kqueue, io_uring, select (default: auto)\n");
+    printf("  -w, --worker-threads N Number of event loop threads (default: 1)\n");
+    printf("  -q, --query-cache BYTES Size of the shared reply cache (default: 0, disabled)\n");
+    printf("  -M, --metrics-port PORT Port of the Prometheus metrics endpoint (default: 0, disabled)\n");
+    printf("  -a, --auth-file FILE  SCRAM-SHA-256 credential file (default: DIR/pg_passwd if present, else trust)\n");
+    printf("  -u, --upstream HOST:PORT Forward to this server over a pool of connections (default: none)\n");
+    printf("  -P, --pool-size NUM   Upstream connections, split across the worker threads (default: 10)\n");
+    printf("  -o, --pool-mode MODE  Pooling mode: transaction, statement (default: transaction)\n");
+    printf("      --upstream-user USER Upstream user (default: postgres; password from PGPASSWORD)\n");
+    printf("      --upstream-db NAME Upstream database (default: same as the user)\n");
+    printf("  -C, --capture FILE    Record client traffic to FILE for pg_replay (default: none)\n");
+    printf("      --idle-session-timeout MS Close connections idle outside a transaction (default: 0, never)\n");
+    printf("      --idle-in-transaction-session-timeout MS Close connections idle in a transaction (default: 0, never)\n");
+    printf("      --hibernate-after MS Free the buffers of connections idle this long (default: 1000, 0 never)\n");
+    printf("      --authentication-timeout MS Close connections not logged in by then (default: 60000, 0 never)\n");
+    printf("      --statement-timeout MS Cancel statements running longer (default: 0, never)\n");
+    printf("      --client-connection-check-interval MS Check that the client of a running statement is there (default: 0, never)\n");
+    printf("      --tcp-keepalives-idle S, --tcp-keepalives-interval S, --tcp-keepalives-count N\n");
+    printf("                        TCP keepalive settings of client connections (default: 0, system default)\n");
+    printf("      --compression-threshold BYTES Compress result runs this large for clients asking for it (default: 1024, 0 never)\n");
+    printf("      --handoff-socket PATH Take over from the server on PATH, or let a new one take over here (default: none)\n");
+    printf("      --handoff-timeout MS Close connections still in a transaction this long into a handoff (default: 30000)\n");
+    printf("  -v, --verbose         Enable verbose logging and protocol tracing\n");
     printf("  -?, --help            Show this help message\n");
 }
 
@@ -73,6 +114,29 @@ static int parse_arguments(int argc, char **argv, PGServerConfig *config) {
         {"ssl", no_argument, 0, 's'},
         {"ssl-cert", required_argument, 0, 'c'},
         {"ssl-key", required_argument, 0, 'k'},
+        {"event-backend", required_argument, 0, 'e'},
+        {"worker-threads", required_argument, 0, 'w'},
+        {"query-cache", required_argument, 0, 'q'},
+        {"metrics-port", required_argument, 0, 'M'},
+        {"auth-file", required_argument, 0, 'a'},
+        {"upstream", required_argument, 0, 'u'},
+        {"pool-size", required_argument, 0, 'P'},
+        {"pool-mode", required_argument, 0, 'o'},
+        {"upstream-user", required_argument, 0, OPTION_UPSTREAM_USER},
+        {"upstream-db", required_argument, 0, OPTION_UPSTREAM_DB},
+        {"capture", required_argument, 0, 'C'},
+        {"idle-session-timeout", required_argument, 0, OPTION_IDLE_SESSION_TIMEOUT},
+        {"idle-in-transaction-session-timeout", required_argument, 0, OPTION_IDLE_IN_TRANSACTION_TIMEOUT},
+        {"hibernate-after", required_argument, 0, OPTION_HIBERNATE_AFTER},
+        {"authentication-timeout", required_argument, 0, OPTION_AUTHENTICATION_TIMEOUT},
+        {"statement-timeout", required_argument, 0, OPTION_STATEMENT_TIMEOUT},
+        {"client-connection-check-interval", required_argument, 0, OPTION_CONNECTION_CHECK_INTERVAL},
+        {"tcp-keepalives-idle", required_argument, 0, OPTION_KEEPALIVES_IDLE},
+        {"tcp-keepalives-interval", required_argument, 0, OPTION_KEEPALIVES_INTERVAL},
+        {"tcp-keepalives-count", required_argument, 0, OPTION_KEEPALIVES_COUNT},
+        {"compression-threshold", required_argument, 0, OPTION_COMPRESSION_THRESHOLD},
+        {"handoff-socket", required_argument, 0, OPTION_HANDOFF_SOCKET},
+        {"handoff-timeout", required_argument, 0, OPTION_HANDOFF_TIMEOUT},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, '?'},
         {0, 0, 0, 0}
@@ -89,8 +153,35 @@ static int parse_arguments(int argc, char **argv, PGServerConfig *config) {
     config->ssl_enabled = false;
     config->ssl_cert = NULL;
     config->ssl_key = NULL;
+    config->event_backend = PG_EVENT_BACKEND_AUTO;
+    config->worker_threads = 1;
+    config->executor_threads = 0;
+    config->query_cache_size = 0;
+    config->metrics_port = 0;
+    config->auth_file = NULL;
+    config->upstream_host = NULL;
+    config->upstream_port = 5432;
+    config->upstream_user = "postgres";
+    config->upstream_password = getenv("PGPASSWORD");
+    config->upstream_database = NULL;
+    config->pool_size = 10;
+    config->pool_mode = PG_POOL_TRANSACTION;
+    config->capture_file = NULL;
+    config->idle_session_timeout = 0;
+    config->idle_in_transaction_session_timeout = 0;
+    config->hibernate_after = 1000;
+    config->authentication_timeout = 60000;
+    config->statement_timeout = 0;
+    config->client_connection_check_interval = 0;
+    config->tcp_keepalives_idle = 0;
+    config->tcp_keepalives_interval = 0;
+    config->tcp_keepalives_count = 0;
+    config->compression_threshold = 1024;
+    config->handoff_socket = NULL;
+    config->handoff_timeout = 30000;
+    config->verbose = false;
     
-    while ((c = getopt_long(argc, argv, "h:p:d:l:m:sc:k:v?", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "h:p:d:l:m:sc:k:e:w:q:M:a:u:P:o:C:v?", long_options, &option_index)) != -1) {
         switch (c) {
             case 'h':
                 config->host = optarg;
@@ -124,8 +215,113 @@ static int parse_arguments(int argc, char **argv, PGServerConfig *config) {
                 config->ssl_key = optarg;
                 break;
             
+            case 'e':
+                if (pg_event_backend_parse(optarg, &config->event_backend) != 0) {
+                    fprintf(stderr, "Unknown event backend: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            
+            case 'w':
+                config->worker_threads = atoi(optarg);
+                break;
+            
+            case 'q':
+                config->query_cache_size = strtoul(optarg, NULL, 10);
+                break;
+            
+            case 'M':
+                config->metrics_port = atoi(optarg);
+                break;
+            
+            case 'a':
+                config->auth_file = optarg;
+                break;
+            
+            case 'u': {
+                // HOST:PORT, or HOST alone for the default port
+                char *colon = strrchr(optarg, ':');
+                if (colon) {
+                    *colon = '\0';
+                    config->upstream_port = atoi(colon + 1);
+                }
+                config->upstream_host = optarg;
+                break;
+            }
+            
+            case 'P':
+                config->pool_size = atoi(optarg);
+                break;
+            
+            case 'o':
+                if (pg_pool_mode_parse(optarg, &config->pool_mode) != 0) {
+                    fprintf(stderr, "Unknown pool mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            
+            case OPTION_UPSTREAM_USER:
+                config->upstream_user = optarg;
+                break;
+            
+            case OPTION_UPSTREAM_DB:
+                config->upstream_database = optarg;
+                break;
+            
+            case 'C':
+                config->capture_file = optarg;
+                break;
+            
+            case OPTION_IDLE_SESSION_TIMEOUT:
+                config->idle_session_timeout = atoi(optarg);
+                break;
+            
+            case OPTION_IDLE_IN_TRANSACTION_TIMEOUT:
+                config->idle_in_transaction_session_timeout = atoi(optarg);
+                break;
+            
+            case OPTION_HIBERNATE_AFTER:
+                config->hibernate_after = atoi(optarg);
+                break;
+            
+            case OPTION_AUTHENTICATION_TIMEOUT:
+                config->authentication_timeout = atoi(optarg);
+                break;
+            
+            case OPTION_STATEMENT_TIMEOUT:
+                config->statement_timeout = atoi(optarg);
+                break;
+            
+            case OPTION_CONNECTION_CHECK_INTERVAL:
+                config->client_connection_check_interval = atoi(optarg);
+                break;
+            
+            case OPTION_KEEPALIVES_IDLE:
+                config->tcp_keepalives_idle = atoi(optarg);
+                break;
+            
+            case OPTION_KEEPALIVES_INTERVAL:
+                config->tcp_keepalives_interval = atoi(optarg);
+                break;
+            
+            case OPTION_KEEPALIVES_COUNT:
+                config->tcp_keepalives_count = atoi(optarg);
+                break;
+            
+            case OPTION_COMPRESSION_THRESHOLD:
+                config->compression_threshold = atoi(optarg);
+                break;
+            
+            case OPTION_HANDOFF_SOCKET:
+                config->handoff_socket = optarg;
+                break;
+            
+            case OPTION_HANDOFF_TIMEOUT:
+                config->handoff_timeout = atoi(optarg);
+                break;
+            
             case 'v':
-                // Enable verbose logging
+                config->verbose = true;
                 break;
             
             case '?':
@@ -156,20 +352,74 @@ int main(int argc, char **argv) {
         return 1;
     }
     
-    // Set up signal handlers
+    // Initialize logging
+    FILE *log_file = NULL;
+    if (config.log_file) {
+        log_file = fopen(config.log_file, "a");
+        if (!log_file) {
+            fprintf(stderr, "Could not open log file: %s\n", config.log_file);
+            return 1;
+        }
+    }
+    pg_log_init(log_file ? log_file : stderr, config.verbose ? PG_LOG_DEBUG : PG_LOG_INFO);
+    
+    pg_log_info("Configuration:");
+    pg_log_info("  Host: %s", config.host);
+    pg_log_info("  Port: %d", config.port);
+    pg_log_info("  Data directory: %s", config.data_dir);
+    pg_log_info("  Max connections: %d", config.max_connections);
+    pg_log_info("  SSL enabled: %s", config.ssl_enabled ? "yes" : "no");
+    pg_log_info("  Event backend: %s", pg_event_backend_name(config.event_backend));
+    pg_log_info("  Worker threads: %d", config.worker_threads);
+    pg_log_info("  Query cache: %zu bytes", config.query_cache_size);
+    pg_log_info("  Metrics port: %d", config.metrics_port);
+    pg_log_info("  Auth file: %s", config.auth_file ? config.auth_file : "(data directory)");
+    if (config.upstream_host) {
+        pg_log_info("  Upstream: %s:%d as %s (%d connections, %s pooling)", config.upstream_host,
+                    config.upstream_port, config.upstream_user, config.pool_size,
+                    pg_pool_mode_name(config.pool_mode));
+    }
+    if (config.capture_file) {
+        pg_log_info("  Capture file: %s", config.capture_file);
+    }
+    pg_log_info("  Idle timeouts: %d ms session, %d ms in transaction; hibernate after %d ms",
+                config.idle_session_timeout, config.idle_in_transaction_session_timeout,
+                config.hibernate_after);
+    pg_log_info("  Timeouts: %d ms authentication, %d ms statement; connection check every %d ms",
+                config.authentication_timeout, config.statement_timeout,
+                config.client_connection_check_interval);
+    pg_log_info("  Compression: %s, runs of %d bytes or more", pg_compress_supported(),
+                config.compression_threshold);
+    if (config.handoff_socket) {
+        pg_log_info("  Handoff socket: %s, busy connections closed after %d ms", config.handoff_socket,
+                    config.handoff_timeout);
+    }
+    pg_log_info("  SIMD kernels: %s", pg_simd_level());
+    pg_log_info("  Verbose logging: %s", config.verbose ? "yes" : "no");
+    
+    // Set up signal handlers. sendfile(), splice() and the socket BIO
+    // OpenSSL writes TLS records with cannot be told MSG_NOSIGNAL, so a
+    // client gone in the middle of a reply must surface as EPIPE rather
+    // than kill the server
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
     
     // Create server
     g_server = pg_server_create(&config);
     if (!g_server) {
-        fprintf(stderr, "Failed to create server\n");
+        pg_log_error("Failed to create server");
         return 1;
     }
     
+    // Trace protocol messages when verbose
+    if (config.verbose) {
+        pg_server_set_logging_callbacks(g_server);
+    }
+    
     // Start server
     if (pg_server_start(g_server) != 0) {
-        fprintf(stderr, "Failed to start server\n");
+        pg_log_error("Failed to start server");
         pg_server_destroy(g_server);
         return 1;
     }
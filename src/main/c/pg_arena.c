@@ -0,0 +1,155 @@
+/**
+ * pg_arena.c
+ * Region Allocator
+ *
+ * This file contains the implementation of the arenas declared in
+ * pg_arena.h. Allocations come from a list of blocks; one larger than a
+ * block gets a block of its own. Resetting keeps the first block, so an
+ * arena that is reused (like a pooled connection's) stops allocating once
+ * it has warmed up.
+ */
+
+#include "pg_arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+/* Block of arena memory; the allocations follow the header */
+struct PGArenaBlock {
+    PGArenaBlock *next;      /* Older block */
+    size_t size;             /* Bytes available after the header */
+    alignas(max_align_t) char data[];
+};
+
+/**
+ * Initialize an empty arena
+ *
+ * No memory is allocated until the first allocation.
+ *
+ * @param arena Arena
+ * @param block_size Size of the blocks allocated from (0: the default)
+ */
+void pg_arena_init(PGArena *arena, size_t block_size) {
+    arena->blocks = NULL;
+    arena->used = 0;
+    arena->block_size = block_size ? block_size : PG_ARENA_DEFAULT_BLOCK_SIZE;
+}
+
+/**
+ * Release all memory of an arena
+ *
+ * @param arena Arena
+ */
+void pg_arena_free(PGArena *arena) {
+    PGArenaBlock *block = arena->blocks;
+    while (block) {
+        PGArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->used = 0;
+}
+
+/**
+ * Release every allocation at once, keeping the first block for reuse
+ *
+ * @param arena Arena
+ */
+void pg_arena_reset(PGArena *arena) {
+    PGArenaBlock *block = arena->blocks;
+
+    while (block && block->next) {
+        PGArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    if (block && block->size != arena->block_size) {
+        // An oversized allocation is not worth keeping
+        free(block);
+        block = NULL;
+    }
+    arena->blocks = block;
+    arena->used = 0;
+}
+
+/**
+ * Allocate memory that lives until the arena is reset or freed
+ *
+ * @param arena Arena
+ * @param size Number of bytes
+ * @return Memory aligned for any type, or NULL on allocation failure
+ */
+void *pg_arena_alloc(PGArena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    PGArenaBlock *block = arena->blocks;
+    if (block && block->size - arena->used >= size) {
+        void *p = block->data + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+    block = (PGArenaBlock *)malloc(sizeof(PGArenaBlock) + block_size);
+    if (!block) {
+        return NULL;
+    }
+    block->size = block_size;
+
+    if (block_size > arena->block_size && arena->blocks) {
+        // Keep allocating from the current block; the big one goes behind it
+        block->next = arena->blocks->next;
+        arena->blocks->next = block;
+        return block->data;
+    }
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->used = size;
+    return block->data;
+}
+
+/**
+ * Copy a string into an arena
+ *
+ * @param arena Arena
+ * @param s String
+ * @return Copy, or NULL on allocation failure
+ */
+char *pg_arena_strdup(PGArena *arena, const char *s) {
+    size_t length = strlen(s) + 1;
+    char *copy = (char *)pg_arena_alloc(arena, length);
+    if (copy) {
+        memcpy(copy, s, length);
+    }
+    return copy;
+}
+
+/**
+ * Format a string into an arena, like vsnprintf
+ *
+ * @param arena Arena
+ * @param format printf format
+ * @param args Arguments
+ * @return Formatted string, or NULL on error
+ */
+char *pg_arena_vprintf(PGArena *arena, const char *format, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (length < 0) {
+        return NULL;
+    }
+
+    char *s = (char *)pg_arena_alloc(arena, (size_t)length + 1);
+    if (s) {
+        vsnprintf(s, (size_t)length + 1, format, args);
+    }
+    return s;
+}
@@ -0,0 +1,38 @@
+/**
+ * pg_arena.h
+ * Region Allocator
+ *
+ * This file contains declarations for arenas: memory that is allocated by
+ * bumping a pointer and released all at once. A connection keeps its
+ * startup parameters in one, so disconnecting frees them in a single step
+ * however many there were, and another for the memory callbacks use while
+ * answering a query, which is released at ReadyForQuery.
+ */
+
+#ifndef PG_ARENA_H
+#define PG_ARENA_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/* Default size of the blocks an arena allocates from */
+#define PG_ARENA_DEFAULT_BLOCK_SIZE 1024
+
+typedef struct PGArenaBlock PGArenaBlock;
+
+/* Arena */
+typedef struct {
+    PGArenaBlock *blocks;    /* Newest block first (NULL until first use) */
+    size_t used;             /* Bytes allocated from the newest block */
+    size_t block_size;       /* Size of ordinary blocks */
+} PGArena;
+
+/* Function declarations */
+void pg_arena_init(PGArena *arena, size_t block_size);
+void pg_arena_free(PGArena *arena);
+void pg_arena_reset(PGArena *arena);
+void *pg_arena_alloc(PGArena *arena, size_t size);
+char *pg_arena_strdup(PGArena *arena, const char *s);
+char *pg_arena_vprintf(PGArena *arena, const char *format, va_list args);
+
+#endif /* PG_ARENA_H */
@@ -1,145 +1,804 @@
 /**
  * pg_auth.c
- * PostgreSQL Authentication Handler
- * 
- * This file contains implementations for handling PostgreSQL authentication.
+ * SCRAM-SHA-256 Authentication
+ *
+ * This file contains the implementation of the credential store and the
+ * SCRAM-SHA-256 exchange declared in pg_auth.h (RFC 5802 and 7677, as
+ * PostgreSQL uses them: the user name comes from the startup packet and
+ * channel binding is not offered). Users are found in an open-addressing
+ * hash table that is replaced as a whole on reload; logins copy their
+ * user's keys out under a read lock, so a reload never waits for them for
+ * long. Unknown users get a salt derived from a per-process secret and
+ * fail only at the end, so they cannot be told apart from wrong passwords.
  */
 
+#include "pg_auth.h"
 #include "pg_server.h"
 #include "pg_protocol.h"
+#include "pg_log.h"
+#include "pg_simd.h"
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <errno.h>
 #include <time.h>
-#include <openssl/md5.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 
-/* Default users */
+#define SCRAM_MECHANISM "SCRAM-SHA-256"
+#define SCRAM_KEY_LEN SHA256_DIGEST_LENGTH
+#define SCRAM_SALT_LEN 16                  // salt of passwords hashed at load
+#define SCRAM_SALT_MAX 64                  // longest salt accepted in a verifier
+#define SCRAM_NONCE_LEN 18                 // random bytes in the server's nonce
+#define SCRAM_MESSAGE_MAX 1024             // longest client message accepted
+#define AUTH_LINE_MAX 1024
+#define AUTH_RELOAD_INTERVAL_NS 1000000000LL  // how often logins look for a changed file
+
+/* What a user is authenticated with */
+typedef struct {
+    int iterations;
+    int salt_len;
+    uint8_t salt[SCRAM_SALT_MAX];
+    uint8_t stored_key[SCRAM_KEY_LEN];      /* H(ClientKey) */
+    uint8_t server_key[SCRAM_KEY_LEN];
+} PGScramSecret;
+
+/* Hash table slot */
 typedef struct {
-    const char *username;
-    const char *password;
-} PGUser;
-
-static PGUser default_users[] = {
-    {"postgres", "postgres"},
-    {"test", "test"},
-    {NULL, NULL}
+    char *user;              /* NULL: empty slot */
+    uint8_t source[SCRAM_KEY_LEN]; /* SHA-256 of the line's secret, to reuse its hashing on reload */
+    PGScramSecret secret;
+} PGAuthEntry;
+
+/* Users of one version of the file */
+typedef struct {
+    PGAuthEntry *entries;
+    size_t mask;             /* Number of slots - 1 (a power of two) */
+    size_t count;            /* Number of users */
+} PGAuthTable;
+
+struct PGAuth {
+    char *path;              /* Credential file */
+    PGExecutor *executor;    /* Runs reloads */
+    pthread_rwlock_t lock;   /* Guards the table pointer against a reload swapping it */
+    PGAuthTable *table;      /* Current users */
+    uint8_t mock_key[SCRAM_KEY_LEN];  /* Derives the salts of unknown users */
+    _Atomic int64_t next_check;       /* When a login next looks at the file */
+    atomic_bool reloading;            /* A reload is queued or running */
+    struct timespec mtime;   /* The loaded file's identity; used by reloads only */
+    off_t size;
+    ino_t ino;
+};
+
+/* Exchange state of one connection; lives in its arena */
+struct PGScram {
+    PGScramSecret secret;
+    bool known;              /* The user exists; otherwise the exchange fails at the end */
+    bool first_done;         /* client-first-message received */
+    char *gs2_header;        /* "n,," or "y,," */
+    char *client_first_bare;
+    char *server_first;
+    char *nonce;             /* Client nonce followed by the server's */
 };
 
+/* Hashing */
+
+static void pg_scram_hmac(const uint8_t *key, size_t key_len, const void *data, size_t length,
+                          uint8_t *out) {
+    unsigned int out_len = SCRAM_KEY_LEN;
+    HMAC(EVP_sha256(), key, (int)key_len, (const unsigned char *)data, length, out, &out_len);
+}
+
+// StoredKey and ServerKey of a password, as PostgreSQL's scram_build_secret
+static int pg_scram_derive(const char *password, PGScramSecret *secret) {
+    uint8_t salted[SCRAM_KEY_LEN];
+    uint8_t client_key[SCRAM_KEY_LEN];
+
+    if (PKCS5_PBKDF2_HMAC(password, (int)strlen(password), secret->salt, secret->salt_len,
+                          secret->iterations, EVP_sha256(), SCRAM_KEY_LEN, salted) != 1) {
+        return -1;
+    }
+    pg_scram_hmac(salted, SCRAM_KEY_LEN, "Client Key", 10, client_key);
+    SHA256(client_key, SCRAM_KEY_LEN, secret->stored_key);
+    pg_scram_hmac(salted, SCRAM_KEY_LEN, "Server Key", 10, secret->server_key);
+    OPENSSL_cleanse(salted, sizeof(salted));
+    OPENSSL_cleanse(client_key, sizeof(client_key));
+    return 0;
+}
+
+static size_t pg_base64_encode(const uint8_t *data, size_t length, char *out) {
+    return (size_t)EVP_EncodeBlock((unsigned char *)out, data, (int)length);
+}
+
+// Decode base64 text of the given length; -1 if it is malformed or too long
+static int pg_base64_decode(const char *text, size_t length, uint8_t *out, size_t size) {
+    uint8_t decoded[(SCRAM_MESSAGE_MAX / 4 + 1) * 3];
+
+    if (length == 0 || length % 4 != 0 || length / 4 * 3 > sizeof(decoded)) {
+        return -1;
+    }
+    int n = EVP_DecodeBlock(decoded, (const unsigned char *)text, (int)length);
+    if (n < 0) {
+        return -1;
+    }
+    n -= (text[length - 1] == '=') + (text[length - 2] == '=');
+    if ((size_t)n > size) {
+        return -1;
+    }
+    memcpy(out, decoded, (size_t)n);
+    return n;
+}
+
+/* Credential table */
+
+static uint64_t pg_auth_hash(const char *user) {
+    uint64_t hash = 1469598103934665603ULL;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)user; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static PGAuthEntry *pg_auth_table_find(const PGAuthTable *table, const char *user) {
+    if (!table) {
+        return NULL;
+    }
+    for (size_t i = pg_auth_hash(user) & table->mask;; i = (i + 1) & table->mask) {
+        PGAuthEntry *entry = &table->entries[i];
+        if (!entry->user || strcmp(entry->user, user) == 0) {
+            return entry->user ? entry : NULL;
+        }
+    }
+}
+
+static void pg_auth_table_free(PGAuthTable *table) {
+    if (table) {
+        for (size_t i = 0; i <= table->mask; i++) {
+            free(table->entries[i].user);
+        }
+        OPENSSL_cleanse(table->entries, (table->mask + 1) * sizeof(PGAuthEntry));
+        free(table->entries);
+        free(table);
+    }
+}
+
+// Parse "SCRAM-SHA-256$<iterations>:<salt>$<StoredKey>:<ServerKey>"
+static int pg_auth_parse_verifier(const char *text, PGScramSecret *secret) {
+    const char *p = text + strlen(SCRAM_MECHANISM "$");
+    char *end;
+
+    long iterations = strtol(p, &end, 10);
+    if (end == p || *end != ':' || iterations < 1 || iterations > 100000000) return -1;
+    secret->iterations = (int)iterations;
+
+    const char *salt = end + 1;
+    const char *dollar = strchr(salt, '$');
+    const char *colon = dollar ? strchr(dollar + 1, ':') : NULL;
+    if (!colon) return -1;
+
+    int n = pg_base64_decode(salt, (size_t)(dollar - salt), secret->salt, sizeof(secret->salt));
+    if (n <= 0) return -1;
+    secret->salt_len = n;
+    if (pg_base64_decode(dollar + 1, (size_t)(colon - dollar - 1), secret->stored_key, SCRAM_KEY_LEN) != SCRAM_KEY_LEN ||
+        pg_base64_decode(colon + 1, strlen(colon + 1), secret->server_key, SCRAM_KEY_LEN) != SCRAM_KEY_LEN) {
+        return -1;
+    }
+    return 0;
+}
+
+// Fill in an entry from a line's secret, reusing the previous table's
+// hashing of an unchanged plaintext password
+static int pg_auth_entry_set(PGAuthEntry *entry, const char *text, const PGAuthTable *previous) {
+    SHA256((const unsigned char *)text, strlen(text), entry->source);
+
+    if (strncmp(text, SCRAM_MECHANISM "$", strlen(SCRAM_MECHANISM "$")) == 0) {
+        return pg_auth_parse_verifier(text, &entry->secret);
+    }
+
+    const PGAuthEntry *old = pg_auth_table_find(previous, entry->user);
+    if (old && memcmp(old->source, entry->source, SCRAM_KEY_LEN) == 0) {
+        entry->secret = old->secret;
+        return 0;
+    }
+    entry->secret.iterations = PG_SCRAM_ITERATIONS;
+    entry->secret.salt_len = SCRAM_SALT_LEN;
+    if (RAND_bytes(entry->secret.salt, SCRAM_SALT_LEN) != 1) {
+        return -1;
+    }
+    return pg_scram_derive(text, &entry->secret);
+}
+
+// Read the credential file into a new table
+static PGAuthTable *pg_auth_table_load(const char *path, const PGAuthTable *previous) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        pg_log_error("Cannot open credential file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    // Size the table for the number of lines, at most half full
+    char line[AUTH_LINE_MAX];
+    size_t lines = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lines++;
+    }
+    size_t slots = 16;
+    while (slots < lines * 2) {
+        slots *= 2;
+    }
+
+    PGAuthTable *table = (PGAuthTable *)calloc(1, sizeof(PGAuthTable));
+    if (!table || !(table->entries = (PGAuthEntry *)calloc(slots, sizeof(PGAuthEntry)))) {
+        free(table);
+        fclose(file);
+        return NULL;
+    }
+    table->mask = slots - 1;
+
+    rewind(file);
+    int number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        char *colon = strchr(line, ':');
+        if (!colon || colon == line || colon[1] == '\0') {
+            pg_log_warning("%s:%d: expected user:secret", path, number);
+            continue;
+        }
+        *colon = '\0';
+        if (pg_auth_table_find(table, line)) {
+            pg_log_warning("%s:%d: duplicate user \"%s\" ignored", path, number, line);
+            continue;
+        }
+
+        size_t i = pg_auth_hash(line) & table->mask;
+        while (table->entries[i].user) {
+            i = (i + 1) & table->mask;
+        }
+        PGAuthEntry *entry = &table->entries[i];
+        entry->user = strdup(line);
+        if (!entry->user || pg_auth_entry_set(entry, colon + 1, previous) < 0) {
+            pg_log_warning("%s:%d: invalid secret for user \"%s\"", path, number, line);
+            free(entry->user);
+            memset(entry, 0, sizeof(*entry));
+            continue;
+        }
+        table->count++;
+    }
+    OPENSSL_cleanse(line, sizeof(line));
+    fclose(file);
+    return table;
+}
+
+static int64_t pg_auth_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 /**
- * Convert binary data to hexadecimal string
- * 
- * @param data Binary data
- * @param len Data length
- * @param hex Output hexadecimal string (must be at least 2*len+1 bytes)
+ * Load the credential file
+ *
+ * @param path Credential file
+ * @param executor Thread pool that reloads the file when it changes
+ * @return Store, or NULL on error (logged)
  */
-static void bin_to_hex(unsigned char *data, int len, char *hex) {
-    static const char hex_chars[] = "0123456789abcdef";
-    int i;
-    
-    for (i = 0; i < len; i++) {
-        hex[i*2] = hex_chars[(data[i] >> 4) & 0xF];
-        hex[i*2+1] = hex_chars[data[i] & 0xF];
+PGAuth *pg_auth_create(const char *path, PGExecutor *executor) {
+    PGAuth *auth = (PGAuth *)calloc(1, sizeof(PGAuth));
+    if (!auth) {
+        return NULL;
     }
-    
-    hex[len*2] = '\0';
+    auth->path = strdup(path);
+    auth->executor = executor;
+    atomic_init(&auth->next_check, pg_auth_now() + AUTH_RELOAD_INTERVAL_NS);
+    atomic_init(&auth->reloading, false);
+    if (!auth->path || pthread_rwlock_init(&auth->lock, NULL) != 0) {
+        free(auth->path);
+        free(auth);
+        return NULL;
+    }
+    if (RAND_bytes(auth->mock_key, sizeof(auth->mock_key)) != 1 || pg_auth_reload(auth) < 0) {
+        pg_auth_destroy(auth);
+        return NULL;
+    }
+    return auth;
 }
 
 /**
- * Generate MD5 hash for password authentication
- * 
- * @param password Password
- * @param username Username
- * @param salt Salt
- * @param result Output hash (must be at least 36 bytes)
+ * Free the store; no reload may be running
+ *
+ * @param auth Store (may be NULL)
  */
-static void pg_md5_hash(const char *password, const char *username, const char *salt, char *result) {
-    MD5_CTX ctx;
-    unsigned char md5[MD5_DIGEST_LENGTH];
-    char hex[MD5_DIGEST_LENGTH*2+1];
-    
-    // First hash: password + username
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, password, strlen(password));
-    MD5_Update(&ctx, username, strlen(username));
-    MD5_Final(md5, &ctx);
-    
-    // Convert to hex
-    bin_to_hex(md5, MD5_DIGEST_LENGTH, hex);
-    
-    // Second hash: hex + salt
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, hex, strlen(hex));
-    MD5_Update(&ctx, salt, strlen(salt));
-    MD5_Final(md5, &ctx);
-    
-    // Format result: md5 + hex
-    strcpy(result, "md5");
-    bin_to_hex(md5, MD5_DIGEST_LENGTH, result + 3);
+void pg_auth_destroy(PGAuth *auth) {
+    if (auth) {
+        pg_auth_table_free(auth->table);
+        pthread_rwlock_destroy(&auth->lock);
+        OPENSSL_cleanse(auth->mock_key, sizeof(auth->mock_key));
+        free(auth->path);
+        free(auth);
+    }
 }
 
 /**
- * Default authentication callback
- * 
- * @param client Client connection
- * @param username Username
- * @param password Password
- * @return 0 on success, -1 on error
+ * Read the credential file again and switch logins over to it. Plaintext
+ * passwords are hashed here, so this runs on an executor thread once the
+ * server is up; only one reload may run at a time.
+ *
+ * @param auth Store
+ * @return 0 on success, -1 on error (the previous users stay in effect)
  */
-int pg_default_auth_callback(PGClientConn *client, const char *username, const char *password) {
-    int i;
-    
-    // Check if username exists
-    for (i = 0; default_users[i].username != NULL; i++) {
-        if (strcmp(username, default_users[i].username) == 0) {
-            // If password is NULL, send MD5 password request
-            if (password == NULL) {
-                char salt[5];
-                int32_t auth_type = htonl(PG_AUTH_MD5);
-                
-                // Generate random salt
-                srand(time(NULL));
-                salt[0] = 'a' + (rand() % 26);
-                salt[1] = 'a' + (rand() % 26);
-                salt[2] = 'a' + (rand() % 26);
-                salt[3] = 'a' + (rand() % 26);
-                salt[4] = '\0';
-                
-                // Send MD5 password request
-                pg_send_message(client->fd, PG_MSG_AUTHENTICATION, (char *)&auth_type, 4);
-                pg_send_message(client->fd, 0, salt, 4);
-                
-                return 0;
-            }
-            
-            // Check password
-            if (strcmp(password, default_users[i].password) == 0) {
-                return 0;
-            }
-            
-            return -1;
-        }
+int pg_auth_reload(PGAuth *auth) {
+    struct stat st;
+    if (stat(auth->path, &st) < 0) {
+        pg_log_error("Cannot read credential file %s: %s", auth->path, strerror(errno));
+        return -1;
     }
-    
+
+    // Only reloads replace the table, so it can be read here without the lock
+    PGAuthTable *table = pg_auth_table_load(auth->path, auth->table);
+    if (!table) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&auth->lock);
+    PGAuthTable *old = auth->table;
+    auth->table = table;
+    pthread_rwlock_unlock(&auth->lock);
+    pg_auth_table_free(old);
+
+    auth->mtime = st.st_mtim;
+    auth->size = st.st_size;
+    auth->ino = st.st_ino;
+    pg_log_info("Loaded %zu users from %s", table->count, auth->path);
+    return 0;
+}
+
+static void pg_auth_reload_task(void *arg) {
+    PGAuth *auth = (PGAuth *)arg;
+    struct stat st;
+
+    if (stat(auth->path, &st) == 0 &&
+        (st.st_mtim.tv_sec != auth->mtime.tv_sec || st.st_mtim.tv_nsec != auth->mtime.tv_nsec ||
+         st.st_size != auth->size || st.st_ino != auth->ino)) {
+        pg_auth_reload(auth);
+    }
+    atomic_store(&auth->reloading, false);
+}
+
+// At most once a second, have an executor thread check the file for changes
+static void pg_auth_check_reload(PGAuth *auth) {
+    int64_t now = pg_auth_now();
+    int64_t next = atomic_load_explicit(&auth->next_check, memory_order_relaxed);
+
+    if (now < next || !auth->executor ||
+        !atomic_compare_exchange_strong(&auth->next_check, &next, now + AUTH_RELOAD_INTERVAL_NS)) {
+        return;
+    }
+    if (!atomic_exchange(&auth->reloading, true) &&
+        pg_executor_submit(auth->executor, pg_auth_reload_task, auth) < 0) {
+        atomic_store(&auth->reloading, false);
+    }
+}
+
+// Copy a user's secret; unknown users get a stable mock one
+static bool pg_auth_lookup(PGAuth *auth, const char *user, PGScramSecret *secret) {
+    bool known = false;
+
+    pthread_rwlock_rdlock(&auth->lock);
+    const PGAuthEntry *entry = pg_auth_table_find(auth->table, user);
+    if (entry) {
+        *secret = entry->secret;
+        known = true;
+    }
+    pthread_rwlock_unlock(&auth->lock);
+
+    if (!known) {
+        uint8_t mac[SCRAM_KEY_LEN];
+        pg_scram_hmac(auth->mock_key, sizeof(auth->mock_key), user, strlen(user), mac);
+        memset(secret, 0, sizeof(*secret));
+        secret->iterations = PG_SCRAM_ITERATIONS;
+        secret->salt_len = SCRAM_SALT_LEN;
+        memcpy(secret->salt, mac, SCRAM_SALT_LEN);
+    }
+    return known;
+}
+
+/* Exchange */
+
+static char *pg_scram_printf(PGArena *arena, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static char *pg_scram_printf(PGArena *arena, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char *s = pg_arena_vprintf(arena, format, args);
+    va_end(args);
+    return s;
+}
+
+static int pg_auth_send_request(PGClientConn *client, int32_t type, const char *data, size_t length) {
+    pg_msg_begin(client, PG_MSG_AUTHENTICATION);
+    pg_msg_put_int32(client, type);
+    pg_msg_put_bytes(client, data, length);
+    return pg_msg_end(client);
+}
+
+// Report a failed or malformed exchange; the connection is then closed
+static int pg_auth_fail(PGClientConn *client, const char *code, const char *message) {
+    pg_counter_add(&client->worker->metrics->auth_failed, 1);
+    pg_send_error(client, code, message);
+    pg_server_flush(client);
     return -1;
 }
 
+static int pg_auth_password_failed(PGClientConn *client) {
+    char *message = pg_client_printf(client, "password authentication failed for user \"%s\"",
+                                     client->user);
+    return pg_auth_fail(client, "28P01", message ? message : "password authentication failed");
+}
+
+// Attribute value of "x=value" up to the next comma; the pointer moves past it
+static const char *pg_scram_attribute(char **p, char name) {
+    char *s = *p;
+    if (s[0] != name || s[1] != '=') {
+        return NULL;
+    }
+    char *comma = strchr(s + 2, ',');
+    if (comma) {
+        *comma = '\0';
+        *p = comma + 1;
+    } else {
+        *p = s + strlen(s);
+    }
+    return s + 2;
+}
+
+// client-first-message: gs2 header, then "n=user,r=nonce[,extensions]"
+static int pg_scram_read_client_first(PGClientConn *client, PGScram *scram, char *message) {
+    PGArena *arena = &client->arena;
+    char *p = message;
+
+    if ((p[0] != 'n' && p[0] != 'y') || p[1] != ',') {
+        return p[0] == 'p' ? pg_auth_fail(client, "28000", "channel binding is not supported")
+                           : pg_auth_fail(client, "08P01", "malformed SCRAM message");
+    }
+    if (p[2] != ',') {
+        return pg_auth_fail(client, "0A000", "client uses authorization identity, but it is not supported");
+    }
+    char gs2[4] = {p[0], ',', ',', '\0'};
+    p += 3;
+
+    char *bare = pg_arena_strdup(arena, p);
+    if (!bare) return -1;
+    if (!pg_scram_attribute(&p, 'n')) {
+        return pg_auth_fail(client, "08P01", "malformed SCRAM message");
+    }
+    const char *client_nonce = pg_scram_attribute(&p, 'r');
+    if (!client_nonce || !*client_nonce) {
+        return pg_auth_fail(client, "08P01", "malformed SCRAM message");
+    }
+    for (const char *c = client_nonce; *c; c++) {
+        if (*c < 0x21 || *c > 0x7e) {
+            return pg_auth_fail(client, "08P01", "malformed SCRAM message");
+        }
+    }
+
+    uint8_t random[SCRAM_NONCE_LEN];
+    char server_nonce[SCRAM_NONCE_LEN / 3 * 4 + 1];
+    char salt[SCRAM_SALT_MAX / 3 * 4 + 5];
+    if (RAND_bytes(random, sizeof(random)) != 1) {
+        return -1;
+    }
+    pg_base64_encode(random, sizeof(random), server_nonce);
+    pg_base64_encode(scram->secret.salt, (size_t)scram->secret.salt_len, salt);
+
+    scram->gs2_header = pg_arena_strdup(arena, gs2);
+    scram->client_first_bare = bare;
+    scram->nonce = pg_scram_printf(arena, "%s%s", client_nonce, server_nonce);
+    if (!scram->gs2_header || !scram->nonce) return -1;
+    scram->server_first = pg_scram_printf(arena, "r=%s,s=%s,i=%d", scram->nonce, salt,
+                                          scram->secret.iterations);
+    if (!scram->server_first) return -1;
+    scram->first_done = true;
+
+    if (pg_auth_send_request(client, PG_AUTH_SASL_CONTINUE, scram->server_first,
+                             strlen(scram->server_first)) < 0) {
+        return -1;
+    }
+    return pg_server_flush(client);
+}
+
+// client-final-message: "c=<gs2 header>,r=nonce[,extensions],p=proof"
+static int pg_scram_read_client_final(PGClientConn *client, PGScram *scram, char *message) {
+    char *proof_attribute = strstr(message, ",p=");
+    if (!proof_attribute) {
+        return pg_auth_fail(client, "08P01", "malformed SCRAM message");
+    }
+    char *auth_message = pg_scram_printf(&client->arena, "%s,%s,%.*s", scram->client_first_bare,
+                                         scram->server_first, (int)(proof_attribute - message), message);
+    if (!auth_message) return -1;
+    *proof_attribute = '\0';
+
+    char *p = message;
+    const char *binding = pg_scram_attribute(&p, 'c');
+    char expected[8];
+    pg_base64_encode((const uint8_t *)scram->gs2_header, strlen(scram->gs2_header), expected);
+    if (!binding || strcmp(binding, expected) != 0) {
+        return pg_auth_fail(client, "08P01", "SCRAM channel binding check failed");
+    }
+    const char *nonce = pg_scram_attribute(&p, 'r');
+    if (!nonce || strcmp(nonce, scram->nonce) != 0) {
+        return pg_auth_fail(client, "08P01", "SCRAM nonce does not match");
+    }
+
+    uint8_t proof[SCRAM_KEY_LEN];
+    const char *proof_text = proof_attribute + 3;
+    if (pg_base64_decode(proof_text, strlen(proof_text), proof, sizeof(proof)) != SCRAM_KEY_LEN) {
+        return pg_auth_fail(client, "08P01", "malformed SCRAM message");
+    }
+
+    // ClientKey = ClientProof XOR HMAC(StoredKey, AuthMessage); it must hash to StoredKey
+    uint8_t signature[SCRAM_KEY_LEN];
+    uint8_t client_key[SCRAM_KEY_LEN];
+    uint8_t stored_key[SCRAM_KEY_LEN];
+    pg_scram_hmac(scram->secret.stored_key, SCRAM_KEY_LEN, auth_message, strlen(auth_message), signature);
+    for (int i = 0; i < SCRAM_KEY_LEN; i++) {
+        client_key[i] = proof[i] ^ signature[i];
+    }
+    SHA256(client_key, SCRAM_KEY_LEN, stored_key);
+    if (CRYPTO_memcmp(stored_key, scram->secret.stored_key, SCRAM_KEY_LEN) != 0 || !scram->known) {
+        return pg_auth_password_failed(client);
+    }
+
+    char final[2 + (SCRAM_KEY_LEN / 3 + 1) * 4 + 1] = "v=";
+    pg_scram_hmac(scram->secret.server_key, SCRAM_KEY_LEN, auth_message, strlen(auth_message), signature);
+    size_t length = 2 + pg_base64_encode(signature, SCRAM_KEY_LEN, final + 2);
+    OPENSSL_cleanse(scram, sizeof(*scram));
+    client->scram = NULL;
+    pg_counter_add(&client->worker->metrics->auth_ok, 1);
+
+    if (pg_auth_send_request(client, PG_AUTH_SASL_FINAL, final, length) < 0) {
+        return -1;
+    }
+    return pg_server_send_startup_messages(client);
+}
+
 /**
- * Handle password message
- * 
- * @param client Client connection
- * @param password Password
+ * Begin authenticating a client whose startup packet has been read, by
+ * offering SCRAM-SHA-256
+ *
+ * @param client Client connection (user set)
  * @return 0 on success, -1 on error
  */
-int pg_handle_password(PGClientConn *client, const char *password) {
-    // Call authentication callback
-    if (pg_default_auth_callback(client, client->user, password) != 0) {
-        pg_send_error(client->fd, "28000", "Invalid password");
+int pg_auth_start(PGClientConn *client) {
+    PGAuth *auth = client->server->auth;
+
+    pg_auth_check_reload(auth);
+
+    PGScram *scram = (PGScram *)pg_arena_alloc(&client->arena, sizeof(PGScram));
+    if (!scram) {
         return -1;
     }
-    
-    // Send authentication OK
-    pg_send_auth_ok(client->fd);
-    
-    return 0;
+    memset(scram, 0, sizeof(*scram));
+    scram->known = pg_auth_lookup(auth, client->user ? client->user : "", &scram->secret);
+    client->scram = scram;
+
+    // The mechanism list ends with an empty name
+    if (pg_auth_send_request(client, PG_AUTH_SASL, SCRAM_MECHANISM "\0", sizeof(SCRAM_MECHANISM) + 1) < 0) {
+        return -1;
+    }
+    return pg_server_flush(client);
+}
+
+/**
+ * Handle a password message during the exchange: SASLInitialResponse
+ * first, then SASLResponse. On success the startup messages follow.
+ *
+ * @param client Client connection
+ * @param payload Message contents after the length
+ * @param length Length of the contents
+ * @return 0 on success, -1 if the client failed (reported) or on error
+ */
+int pg_auth_continue(PGClientConn *client, const char *payload, int length) {
+    PGScram *scram = client->scram;
+    const char *data = payload;
+    size_t data_length = (size_t)length;
+    char message[SCRAM_MESSAGE_MAX + 1];
+
+    if (!scram->first_done) {
+        // Mechanism name, then the length of the client's message (-1: none)
+        size_t name_length = pg_simd_find_nul(payload, (size_t)length);
+        if (name_length + 5 > (size_t)length) {
+            return pg_auth_fail(client, "08P01", "malformed SASLInitialResponse message");
+        }
+        if (strcmp(payload, SCRAM_MECHANISM) != 0) {
+            return pg_auth_fail(client, "28000", "client selected an invalid SASL authentication mechanism");
+        }
+        int32_t n;
+        memcpy(&n, payload + name_length + 1, 4);
+        n = (int32_t)ntohl((uint32_t)n);
+        data = payload + name_length + 5;
+        data_length = (size_t)length - name_length - 5;
+        if (n < 0 || (size_t)n != data_length) {
+            return pg_auth_fail(client, "08P01", "malformed SASLInitialResponse message");
+        }
+    }
+
+    if (data_length > SCRAM_MESSAGE_MAX || pg_simd_find_nul(data, data_length) != data_length) {
+        return pg_auth_fail(client, "08P01", "malformed SCRAM message");
+    }
+    memcpy(message, data, data_length);
+    message[data_length] = '\0';
+
+    return scram->first_done ? pg_scram_read_client_final(client, scram, message)
+                             : pg_scram_read_client_first(client, scram, message);
+}
+
+/* Client side */
+
+struct PGScramClient {
+    char *password;
+    char nonce[SCRAM_NONCE_LEN / 3 * 4 + 1];
+    char client_first_bare[sizeof("n=,r=") + SCRAM_NONCE_LEN / 3 * 4];
+    uint8_t server_signature[SCRAM_KEY_LEN];
+};
+
+/**
+ * Start logging in to a server with a password
+ *
+ * @param password Password of the user named in the startup packet
+ * @return Exchange state, or NULL on allocation failure
+ */
+PGScramClient *pg_scram_client_create(const char *password) {
+    PGScramClient *scram = (PGScramClient *)calloc(1, sizeof(PGScramClient));
+    if (scram && !(scram->password = strdup(password ? password : ""))) {
+        free(scram);
+        return NULL;
+    }
+    return scram;
+}
+
+/**
+ * Free an exchange
+ *
+ * @param scram Exchange state (may be NULL)
+ */
+void pg_scram_client_free(PGScramClient *scram) {
+    if (scram) {
+        OPENSSL_cleanse(scram->password, strlen(scram->password));
+        free(scram->password);
+        OPENSSL_cleanse(scram, sizeof(*scram));
+        free(scram);
+    }
+}
+
+/**
+ * Build the client-first-message, sent in SASLInitialResponse. The server
+ * takes the user from the startup packet, so the name is left empty.
+ *
+ * @param scram Exchange state
+ * @param out Message buffer
+ * @param size Size of the buffer
+ * @return Length of the message, or -1 on error
+ */
+int pg_scram_client_first(PGScramClient *scram, char *out, size_t size) {
+    uint8_t random[SCRAM_NONCE_LEN];
+
+    if (RAND_bytes(random, sizeof(random)) != 1) {
+        return -1;
+    }
+    pg_base64_encode(random, sizeof(random), scram->nonce);
+    snprintf(scram->client_first_bare, sizeof(scram->client_first_bare), "n=,r=%s", scram->nonce);
+
+    int n = snprintf(out, size, "n,,%s", scram->client_first_bare);
+    return n < 0 || (size_t)n >= size ? -1 : n;
+}
+
+/**
+ * Answer the server-first-message with the client-final-message, which
+ * carries the proof of the password
+ *
+ * @param scram Exchange state
+ * @param server_first Data of AuthenticationSASLContinue
+ * @param length Length of the data
+ * @param out Message buffer
+ * @param size Size of the buffer
+ * @return Length of the message, or -1 if the server's message is invalid
+ */
+int pg_scram_client_final(PGScramClient *scram, const char *server_first, int length,
+                          char *out, size_t size) {
+    char message[SCRAM_MESSAGE_MAX + 1];
+    PGScramSecret secret;
+
+    if (length <= 0 || length > SCRAM_MESSAGE_MAX || pg_simd_find_nul(server_first, (size_t)length) != (size_t)length) {
+        return -1;
+    }
+    memcpy(message, server_first, (size_t)length);
+    message[length] = '\0';
+
+    // "r=<nonce>,s=<salt>,i=<iterations>"; the nonce must extend ours
+    char *p = message;
+    const char *nonce = pg_scram_attribute(&p, 'r');
+    const char *salt = nonce ? pg_scram_attribute(&p, 's') : NULL;
+    const char *iterations = salt ? pg_scram_attribute(&p, 'i') : NULL;
+    size_t nonce_length = strlen(scram->nonce);
+    if (!iterations || strncmp(nonce, scram->nonce, nonce_length) != 0 || !nonce[nonce_length]) {
+        return -1;
+    }
+    char *end;
+    long rounds = strtol(iterations, &end, 10);
+    int salt_length = pg_base64_decode(salt, strlen(salt), secret.salt, sizeof(secret.salt));
+    if (*end || rounds < 1 || rounds > 100000000 || salt_length <= 0) {
+        return -1;
+    }
+    secret.iterations = (int)rounds;
+    secret.salt_len = salt_length;
+
+    uint8_t salted[SCRAM_KEY_LEN];
+    uint8_t client_key[SCRAM_KEY_LEN];
+    uint8_t stored_key[SCRAM_KEY_LEN];
+    uint8_t server_key[SCRAM_KEY_LEN];
+    uint8_t proof[SCRAM_KEY_LEN];
+    if (PKCS5_PBKDF2_HMAC(scram->password, (int)strlen(scram->password), secret.salt, secret.salt_len,
+                          secret.iterations, EVP_sha256(), SCRAM_KEY_LEN, salted) != 1) {
+        return -1;
+    }
+    pg_scram_hmac(salted, SCRAM_KEY_LEN, "Client Key", 10, client_key);
+    pg_scram_hmac(salted, SCRAM_KEY_LEN, "Server Key", 10, server_key);
+    SHA256(client_key, SCRAM_KEY_LEN, stored_key);
+    OPENSSL_cleanse(salted, sizeof(salted));
+
+    // The attributes were cut out of the copy, so the original text is used
+    char without_proof[SCRAM_MESSAGE_MAX];
+    char auth_message[3 * SCRAM_MESSAGE_MAX];
+    int n = snprintf(without_proof, sizeof(without_proof), "c=biws,r=%s", nonce);
+    int m = snprintf(auth_message, sizeof(auth_message), "%s,%.*s,%s", scram->client_first_bare,
+                     length, server_first, without_proof);
+    if (n < 0 || (size_t)n >= sizeof(without_proof) || m < 0 || (size_t)m >= sizeof(auth_message)) {
+        return -1;
+    }
+
+    uint8_t signature[SCRAM_KEY_LEN];
+    pg_scram_hmac(stored_key, SCRAM_KEY_LEN, auth_message, (size_t)m, signature);
+    for (int i = 0; i < SCRAM_KEY_LEN; i++) {
+        proof[i] = client_key[i] ^ signature[i];
+    }
+    pg_scram_hmac(server_key, SCRAM_KEY_LEN, auth_message, (size_t)m, scram->server_signature);
+    OPENSSL_cleanse(client_key, sizeof(client_key));
+    OPENSSL_cleanse(server_key, sizeof(server_key));
+
+    char encoded[(SCRAM_KEY_LEN / 3 + 1) * 4 + 1];
+    pg_base64_encode(proof, SCRAM_KEY_LEN, encoded);
+    int total = snprintf(out, size, "%s,p=%s", without_proof, encoded);
+    return total < 0 || (size_t)total >= size ? -1 : total;
+}
+
+/**
+ * Check the server's signature in AuthenticationSASLFinal, which proves
+ * that it knows the password too
+ *
+ * @param scram Exchange state
+ * @param server_final Data of AuthenticationSASLFinal
+ * @param length Length of the data
+ * @return 0 if the signature is right, -1 otherwise
+ */
+int pg_scram_client_verify(PGScramClient *scram, const char *server_final, int length) {
+    uint8_t signature[SCRAM_KEY_LEN];
+
+    if (length < 2 || server_final[0] != 'v' || server_final[1] != '=' ||
+        pg_base64_decode(server_final + 2, (size_t)length - 2, signature, sizeof(signature)) != SCRAM_KEY_LEN) {
+        return -1;
+    }
+    return CRYPTO_memcmp(signature, scram->server_signature, SCRAM_KEY_LEN) == 0 ? 0 : -1;
 }
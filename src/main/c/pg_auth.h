@@ -0,0 +1,49 @@
+/**
+ * pg_auth.h
+ * SCRAM-SHA-256 Authentication
+ *
+ * This file contains declarations for password authentication with
+ * SCRAM-SHA-256 against a credential file, shared by all worker threads.
+ * Each line of the file is "user:secret", where the secret is either a
+ * SCRAM verifier in PostgreSQL's format (as stored in pg_authid) or a
+ * plaintext password, which is hashed once when the file is loaded. A
+ * login then costs a few HMACs instead of PBKDF2's thousands. The file is
+ * reloaded on an executor thread when it changes.
+ */
+
+#ifndef PG_AUTH_H
+#define PG_AUTH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pg_executor.h"
+
+/* PBKDF2 rounds for plaintext passwords, PostgreSQL's default */
+#define PG_SCRAM_ITERATIONS 4096
+
+/* Name of the credential file in the data directory */
+#define PG_AUTH_DEFAULT_FILE "pg_passwd"
+
+typedef struct PGClientConn PGClientConn;
+typedef struct PGAuth PGAuth;
+typedef struct PGScram PGScram;
+typedef struct PGScramClient PGScramClient;
+
+/* Function declarations */
+PGAuth *pg_auth_create(const char *path, PGExecutor *executor);
+void pg_auth_destroy(PGAuth *auth);
+int pg_auth_reload(PGAuth *auth);
+
+int pg_auth_start(PGClientConn *client);
+int pg_auth_continue(PGClientConn *client, const char *payload, int length);
+
+/* Client side of the exchange, for logging in to an upstream server */
+PGScramClient *pg_scram_client_create(const char *password);
+void pg_scram_client_free(PGScramClient *scram);
+int pg_scram_client_first(PGScramClient *scram, char *out, size_t size);
+int pg_scram_client_final(PGScramClient *scram, const char *server_first, int length,
+                          char *out, size_t size);
+int pg_scram_client_verify(PGScramClient *scram, const char *server_final, int length);
+
+#endif /* PG_AUTH_H */
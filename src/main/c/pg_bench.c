@@ -0,0 +1,963 @@
+/**
+ * pg_bench.c
+ * Load Generator and Latency Benchmark
+ *
+ * This file contains a pgbench-like client that speaks the wire protocol
+ * directly. Each thread drives its share of the connections from one event
+ * loop, keeping a number of transactions in flight on each, and records
+ * transaction and connection latencies in histograms of its own. The
+ * results are reported as text or as one JSON object.
+ */
+
+#include "pg_event.h"
+#include "pg_buffer.h"
+#include "pg_metrics.h"
+#include "pg_protocol.h"
+#include "pg_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "/usr/local/pgsql/18/include/server/libpq/protocol.h"
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_READ_SIZE (64 * 1024)
+#define BENCH_CONNECT_BATCH 512       // connection attempts in progress per thread
+#define BENCH_POLL_MS 100             // how often threads check for the end of the run
+#define BENCH_STATEMENT "pg_bench"    // statement name in prepared mode
+
+/* Query protocol used for each transaction */
+typedef enum {
+    BENCH_SIMPLE,            /* Query */
+    BENCH_EXTENDED,          /* Parse, Bind, Describe, Execute, Sync */
+    BENCH_PREPARED           /* Parse once per connection, then Bind, Execute, Sync */
+} BenchMode;
+
+/* Run configuration */
+typedef struct {
+    char *hosts[16];         /* Server addresses, used in turn */
+    int num_hosts;
+    int port;
+    int connections;         /* Connections in total */
+    int threads;             /* Threads driving them */
+    int duration;            /* Seconds to run (when transactions is 0) */
+    long transactions;       /* Transactions per connection, or per session in storm mode */
+    BenchMode mode;
+    int pipeline;            /* Transactions in flight per connection */
+    bool storm;              /* Reconnect after every session */
+    const char *query;
+    const char *user;
+    const char *database;
+    const char *password;
+    bool json;
+    PGEventBackend event_backend;
+    const char *compression; /* Algorithms asked for in _pq_.compression, or NULL */
+} BenchOptions;
+
+typedef enum {
+    CONN_IDLE,               /* Not connected */
+    CONN_CONNECTING,         /* Non-blocking connect in progress */
+    CONN_STARTUP,            /* Waiting for the first ReadyForQuery */
+    CONN_RUNNING,            /* Sending transactions */
+    CONN_DONE                /* Finished or failed; not reconnected */
+} BenchConnState;
+
+typedef struct BenchThread BenchThread;
+
+/* One client connection */
+typedef struct {
+    int fd;
+    BenchConnState state;
+    BenchThread *thread;
+    int host;                /* Index into the resolved addresses */
+    PGBuffer in;
+    PGBuffer out;
+    bool watch_write;        /* The loop watches for writability */
+    bool prepared;           /* The named statement has been parsed */
+    uint64_t connect_start;
+    uint64_t *sent_at;       /* Send times of the transactions in flight, a ring */
+    int head;                /* Oldest transaction in flight */
+    int inflight;
+    long session_done;       /* Transactions finished since connecting */
+    PGDecompressor *decompressor; /* The server's CompressedData stream, once it reported an algorithm */
+    PGBuffer plain;          /* Messages of the CompressedData being handled */
+} BenchConn;
+
+/* Thread state; its counters are written by the thread only */
+struct BenchThread {
+    int id;
+    pthread_t thread;
+    PGEventLoop *loop;
+    BenchConn *conns;
+    int num_conns;
+    int next_start;          /* First connection not yet started */
+    int connecting;          /* Connections in CONN_CONNECTING or CONN_STARTUP */
+    int active;              /* Connections not in CONN_DONE */
+    PGHistogram latency;     /* Transaction latency */
+    PGHistogram connect;     /* From connect() to the first ReadyForQuery */
+    uint64_t transactions;
+    uint64_t rows;
+    uint64_t bytes;          /* Bytes read from the server */
+    uint64_t errors;         /* ErrorResponse messages */
+    uint64_t connect_errors; /* Failed connects and startups, and dropped connections */
+    uint64_t sessions;       /* Startups completed */
+};
+
+static BenchOptions options;
+static struct sockaddr_storage addrs[16];
+static socklen_t addr_lens[16];
+static atomic_bool running = true;
+
+/* Wire bytes of one transaction, and of the Parse sent first in prepared mode */
+static PGBuffer transaction;
+static PGBuffer prepare;
+
+static void bench_connect(BenchConn *conn);
+static void bench_close(BenchConn *conn, bool failed);
+static int bench_handle_message(BenchConn *conn, char type, const char *payload, size_t length);
+
+/**
+ * Signal handler: ends the run early
+ *
+ * @param sig Signal number
+ */
+static void bench_signal(int sig) {
+    (void)sig;
+    atomic_store(&running, false);
+}
+
+/**
+ * Print usage information
+ *
+ * @param program_name Program name
+ */
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [options]\n", program_name);
+    printf("Options:\n");
+    printf("  -h, --host HOST[,HOST...] Server addresses, used in turn (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT         Server port (default: 5432)\n");
+    printf("  -c, --clients NUM       Number of connections (default: 1)\n");
+    printf("  -j, --threads NUM       Number of threads (default: 1)\n");
+    printf("  -T, --time SECONDS      Duration of the run (default: 10)\n");
+    printf("  -t, --transactions NUM  Transactions per connection instead of a duration;\n");
+    printf("                          in storm mode, per session (default: 1)\n");
+    printf("  -M, --protocol MODE     simple, extended or prepared (default: simple)\n");
+    printf("  -P, --pipeline NUM      Transactions in flight per connection (default: 1)\n");
+    printf("  -S, --storm             Reconnect after each session of -t transactions\n");
+    printf("  -q, --query SQL         Query to run (default: SELECT 1)\n");
+    printf("  -r, --rows NUM          Run SELECT * FROM generate_series(1, NUM) instead\n");
+    printf("  -U, --user NAME         User name (default: bench)\n");
+    printf("  -d, --dbname NAME       Database name (default: postgres)\n");
+    printf("  -W, --password PASS     Password for cleartext authentication\n");
+    printf("  -e, --event-backend B   Event loop backend: auto, epoll, kqueue, io_uring, select (default: auto)\n");
+    printf("  -Z, --compression ALGS  Ask for compressed results: zstd, lz4, or a list (built with: %s)\n",
+           pg_compress_supported());
+    printf("  -J, --json              Print the results as one JSON object\n");
+    printf("  -?, --help              Show this help message\n");
+}
+
+/**
+ * Parse command line arguments
+ *
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return 0 on success, 1 after --help, -1 on error
+ */
+static int parse_arguments(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 'h'},
+        {"port", required_argument, 0, 'p'},
+        {"clients", required_argument, 0, 'c'},
+        {"threads", required_argument, 0, 'j'},
+        {"time", required_argument, 0, 'T'},
+        {"transactions", required_argument, 0, 't'},
+        {"protocol", required_argument, 0, 'M'},
+        {"pipeline", required_argument, 0, 'P'},
+        {"storm", no_argument, 0, 'S'},
+        {"query", required_argument, 0, 'q'},
+        {"rows", required_argument, 0, 'r'},
+        {"user", required_argument, 0, 'U'},
+        {"dbname", required_argument, 0, 'd'},
+        {"password", required_argument, 0, 'W'},
+        {"event-backend", required_argument, 0, 'e'},
+        {"json", no_argument, 0, 'J'},
+        {"compression", required_argument, 0, 'Z'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+    static char rows_query[96];
+    char *hosts = "127.0.0.1";
+    int option_index = 0;
+    int c;
+
+    options.port = 5432;
+    options.connections = 1;
+    options.threads = 1;
+    options.duration = 10;
+    options.transactions = 0;
+    options.mode = BENCH_SIMPLE;
+    options.pipeline = 1;
+    options.storm = false;
+    options.query = "SELECT 1";
+    options.user = "bench";
+    options.database = "postgres";
+    options.password = NULL;
+    options.json = false;
+    options.event_backend = PG_EVENT_BACKEND_AUTO;
+    options.compression = NULL;
+
+    while ((c = getopt_long(argc, argv, "h:p:c:j:T:t:M:P:Sq:r:U:d:W:e:JZ:?", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'h': hosts = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'j': options.threads = atoi(optarg); break;
+            case 'T': options.duration = atoi(optarg); break;
+            case 't': options.transactions = atol(optarg); break;
+            case 'P': options.pipeline = atoi(optarg); break;
+            case 'S': options.storm = true; break;
+            case 'q': options.query = optarg; break;
+            case 'U': options.user = optarg; break;
+            case 'd': options.database = optarg; break;
+            case 'W': options.password = optarg; break;
+            case 'J': options.json = true; break;
+            case 'Z': options.compression = optarg; break;
+
+            case 'M':
+                if (strcmp(optarg, "simple") == 0) {
+                    options.mode = BENCH_SIMPLE;
+                } else if (strcmp(optarg, "extended") == 0) {
+                    options.mode = BENCH_EXTENDED;
+                } else if (strcmp(optarg, "prepared") == 0) {
+                    options.mode = BENCH_PREPARED;
+                } else {
+                    fprintf(stderr, "Unknown protocol: %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'r':
+                snprintf(rows_query, sizeof(rows_query), "SELECT * FROM generate_series(1, %ld)", atol(optarg));
+                options.query = rows_query;
+                break;
+
+            case 'e':
+                if (pg_event_backend_parse(optarg, &options.event_backend) != 0) {
+                    fprintf(stderr, "Unknown event backend: %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case '?':
+                print_usage(argv[0]);
+                return 1;
+
+            default:
+                return -1;
+        }
+    }
+
+    if (options.connections < 1 || options.threads < 1 || options.pipeline < 1 ||
+        options.port <= 0 || options.transactions < 0 || (options.transactions == 0 && options.duration < 1)) {
+        fprintf(stderr, "Invalid arguments\n");
+        return -1;
+    }
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+    if (options.storm && options.transactions == 0) {
+        options.transactions = 1;
+    }
+
+    // Split the host list
+    for (char *save = NULL, *host = strtok_r(strdup(hosts), ",", &save);
+         host && options.num_hosts < 16; host = strtok_r(NULL, ",", &save)) {
+        options.hosts[options.num_hosts++] = host;
+    }
+    return options.num_hosts > 0 ? 0 : -1;
+}
+
+/**
+ * Resolve the server addresses
+ *
+ * @return 0 on success, -1 if a host cannot be resolved
+ */
+static int bench_resolve(void) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", options.port);
+
+    for (int i = 0; i < options.num_hosts; i++) {
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int rc = getaddrinfo(options.hosts[i], port, &hints, &result);
+        if (rc != 0) {
+            fprintf(stderr, "Cannot resolve %s: %s\n", options.hosts[i], gai_strerror(rc));
+            return -1;
+        }
+        memcpy(&addrs[i], result->ai_addr, result->ai_addrlen);
+        addr_lens[i] = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+    return 0;
+}
+
+/* Append a message with the given payload to a buffer */
+static void bench_put_message(PGBuffer *buf, char type, const void *payload, size_t length) {
+    uint32_t len = htonl((uint32_t)length + 4);
+    pg_buffer_append(buf, &type, 1);
+    pg_buffer_append(buf, &len, 4);
+    if (length > 0) {
+        pg_buffer_append(buf, payload, length);
+    }
+}
+
+/* Append a Parse of the query as the given statement */
+static void bench_put_parse(PGBuffer *buf, const char *name) {
+    size_t name_len = strlen(name) + 1;
+    size_t query_len = strlen(options.query) + 1;
+    char *payload = malloc(name_len + query_len + 2);
+
+    memcpy(payload, name, name_len);
+    memcpy(payload + name_len, options.query, query_len);
+    memset(payload + name_len + query_len, 0, 2);  // no parameter types
+    bench_put_message(buf, PqMsg_Parse, payload, name_len + query_len + 2);
+    free(payload);
+}
+
+/**
+ * Build the wire bytes of a transaction for the protocol mode
+ */
+static void bench_build_transaction(void) {
+    // Bind of the unnamed portal: no parameters, text results
+    static const char bind_tail[6] = {0, 0, 0, 0, 0, 0};
+    static const char describe[2] = {'P', 0};
+    static const char execute[5] = {0, 0, 0, 0, 0};
+    char bind[sizeof(BENCH_STATEMENT) + 1 + sizeof(bind_tail)];
+
+    pg_buffer_init(&transaction);
+    pg_buffer_init(&prepare);
+
+    switch (options.mode) {
+        case BENCH_SIMPLE:
+            bench_put_message(&transaction, PqMsg_Query, options.query, strlen(options.query) + 1);
+            return;
+
+        case BENCH_EXTENDED:
+            bench_put_parse(&transaction, "");
+            bind[0] = 0;                       // portal ""
+            bind[1] = 0;                       // statement ""
+            memcpy(bind + 2, bind_tail, sizeof(bind_tail));
+            bench_put_message(&transaction, PqMsg_Bind, bind, 2 + sizeof(bind_tail));
+            bench_put_message(&transaction, PqMsg_Describe, describe, sizeof(describe));
+            break;
+
+        case BENCH_PREPARED:
+            bench_put_parse(&prepare, BENCH_STATEMENT);
+            bind[0] = 0;                       // portal ""
+            memcpy(bind + 1, BENCH_STATEMENT, sizeof(BENCH_STATEMENT));
+            memcpy(bind + 1 + sizeof(BENCH_STATEMENT), bind_tail, sizeof(bind_tail));
+            bench_put_message(&transaction, PqMsg_Bind, bind, sizeof(bind));
+            break;
+    }
+    bench_put_message(&transaction, PqMsg_Execute, execute, sizeof(execute));
+    bench_put_message(&transaction, PqMsg_Sync, NULL, 0);
+}
+
+/* Watch a connection for reading, and for writing while output is queued */
+static void bench_watch(BenchConn *conn, bool write) {
+    if (write != conn->watch_write) {
+        pg_event_modify(conn->thread->loop, conn->fd, PG_EVENT_READ | (write ? PG_EVENT_WRITE : 0), conn);
+        conn->watch_write = write;
+    }
+}
+
+/* Write queued output; -1 if the connection failed */
+static int bench_flush(BenchConn *conn) {
+    PGBuffer *out = &conn->out;
+
+    while (pg_buffer_length(out) > 0) {
+        ssize_t sent = send(conn->fd, pg_buffer_read_ptr(out), pg_buffer_length(out), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        pg_buffer_consume(out, (size_t)sent);
+    }
+    bench_watch(conn, pg_buffer_length(out) > 0);
+    return 0;
+}
+
+/* Whether the connection should start another transaction */
+static bool bench_more(const BenchConn *conn) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+        return false;
+    }
+    return options.transactions == 0 || conn->session_done + conn->inflight < options.transactions;
+}
+
+/* Queue transactions until the pipeline is full */
+static void bench_fill_pipeline(BenchConn *conn) {
+    while (conn->inflight < options.pipeline && bench_more(conn)) {
+        if (options.mode == BENCH_PREPARED && !conn->prepared) {
+            pg_buffer_append(&conn->out, pg_buffer_read_ptr(&prepare), pg_buffer_length(&prepare));
+            conn->prepared = true;
+        }
+        pg_buffer_append(&conn->out, pg_buffer_read_ptr(&transaction), pg_buffer_length(&transaction));
+        conn->sent_at[(conn->head + conn->inflight) % options.pipeline] = pg_metrics_now();
+        conn->inflight++;
+    }
+}
+
+/* The run or the session is over for a connection with nothing in flight */
+static void bench_finish_session(BenchConn *conn) {
+    static const char terminate[5] = {PqMsg_Terminate, 0, 0, 0, 4};
+
+    // Terminate is best effort; the connection is closed either way
+    ssize_t n = send(conn->fd, terminate, sizeof(terminate), MSG_NOSIGNAL);
+    (void)n;
+    bench_close(conn, false);
+
+    if (options.storm && atomic_load_explicit(&running, memory_order_relaxed)) {
+        bench_connect(conn);
+    }
+}
+
+/* The server reported the algorithm of its CompressedData messages */
+static int bench_start_decompression(BenchConn *conn, const char *payload, size_t length) {
+    PGCompressAlgorithm algorithm;
+    size_t name_len = strnlen(payload, length);
+
+    if (name_len == length || strcmp(payload, PG_COMPRESSION_OPTION) != 0) {
+        return 0;
+    }
+    const char *value = payload + name_len + 1;
+    if (strnlen(value, length - name_len - 1) == length - name_len - 1 ||
+        pg_compress_parse(value, &algorithm) < 0) {
+        return -1;
+    }
+    if (algorithm != PG_COMPRESS_NONE && !conn->decompressor) {
+        conn->decompressor = pg_decompressor_create(algorithm);
+        if (!conn->decompressor) return -1;
+    }
+    return 0;
+}
+
+/* Handle the messages held by a CompressedData message */
+static int bench_decompress(BenchConn *conn, const char *payload, size_t length) {
+    PGBuffer *plain = &conn->plain;
+
+    if (!conn->decompressor ||
+        pg_decompressor_decompress(conn->decompressor, payload, length, plain) < 0) {
+        return -1;
+    }
+
+    // Only DataRow and CopyData are compressed, so a message cannot end the session here
+    while (pg_buffer_length(plain) >= 5) {
+        const char *p = pg_buffer_read_ptr(plain);
+        uint32_t msg_len;
+        memcpy(&msg_len, p + 1, 4);
+        msg_len = ntohl(msg_len);
+        if (msg_len < 4 || pg_buffer_length(plain) < 1 + (size_t)msg_len) {
+            break;
+        }
+        if (bench_handle_message(conn, p[0], p + 5, msg_len - 4) != 0) {
+            return -1;
+        }
+        pg_buffer_consume(plain, 1 + (size_t)msg_len);
+    }
+
+    // A run is always whole messages
+    return pg_buffer_length(plain) == 0 ? 0 : -1;
+}
+
+/**
+ * Handle one message from the server
+ *
+ * @param conn Connection
+ * @param type Message type
+ * @param payload Message payload
+ * @param length Payload length
+ * @return 0 to go on, 1 if the connection was closed or replaced, -1 on error
+ */
+static int bench_handle_message(BenchConn *conn, char type, const char *payload, size_t length) {
+    BenchThread *thread = conn->thread;
+
+    switch (type) {
+        case PqMsg_AuthenticationRequest: {
+            int32_t code;
+            if (length < 4) return -1;
+            memcpy(&code, payload, 4);
+            code = ntohl(code);
+            if (code == 0) return 0;
+            if (code == 3 && options.password) {
+                bench_put_message(&conn->out, PqMsg_PasswordMessage, options.password,
+                                  strlen(options.password) + 1);
+                return 0;
+            }
+            return -1;  // other methods are not supported
+        }
+
+        case PqMsg_DataRow:
+            thread->rows++;
+            return 0;
+
+        case PqMsg_ErrorResponse:
+            thread->errors++;
+            return conn->state == CONN_STARTUP ? -1 : 0;
+
+        case PqMsg_ParameterStatus:
+            return bench_start_decompression(conn, payload, length);
+
+        case PG_MSG_COMPRESSED_DATA:
+            return bench_decompress(conn, payload, length);
+
+        case PqMsg_ReadyForQuery:
+            break;
+
+        default:
+            return 0;
+    }
+
+    uint64_t now = pg_metrics_now();
+    if (conn->state == CONN_STARTUP) {
+        conn->state = CONN_RUNNING;
+        thread->connecting--;
+        thread->sessions++;
+        pg_histogram_record(&thread->connect, now - conn->connect_start);
+    } else if (conn->inflight > 0) {
+        pg_histogram_record(&thread->latency, now - conn->sent_at[conn->head]);
+        conn->head = (conn->head + 1) % options.pipeline;
+        conn->inflight--;
+        conn->session_done++;
+        thread->transactions++;
+    }
+
+    bench_fill_pipeline(conn);
+    if (conn->inflight == 0) {
+        bench_finish_session(conn);
+        return 1;
+    }
+    return 0;
+}
+
+/* Read and handle what the server sent; -1 if the connection failed */
+static int bench_read(BenchConn *conn) {
+    PGBuffer *in = &conn->in;
+
+    if (pg_buffer_reserve(in, BENCH_READ_SIZE) < 0) {
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = recv(conn->fd, pg_buffer_write_ptr(in), pg_buffer_writable(in), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    pg_buffer_commit(in, (size_t)n);
+    conn->thread->bytes += (uint64_t)n;
+
+    while (pg_buffer_length(in) >= 5) {
+        const char *p = pg_buffer_read_ptr(in);
+        uint32_t length;
+        memcpy(&length, p + 1, 4);
+        length = ntohl(length);
+        if (length < 4) {
+            return -1;
+        }
+        if (pg_buffer_length(in) < 1 + (size_t)length) {
+            if (pg_buffer_reserve(in, 1 + (size_t)length - pg_buffer_length(in)) < 0) return -1;
+            break;
+        }
+
+        int result = bench_handle_message(conn, p[0], p + 5, length - 4);
+        if (result != 0) {
+            return result < 0 ? -1 : 0;
+        }
+        pg_buffer_consume(in, 1 + (size_t)length);
+    }
+
+    pg_buffer_shrink(in, BENCH_READ_SIZE);
+    return bench_flush(conn);
+}
+
+/* Send the startup packet */
+static void bench_send_startup(BenchConn *conn) {
+    char packet[512];
+    int n = 8;
+
+    n += snprintf(packet + n, sizeof(packet) - n, "user%c%s%cdatabase%c%s%c",
+                  0, options.user, 0, 0, options.database, 0);
+    if (options.compression && n < (int)sizeof(packet)) {
+        n += snprintf(packet + n, sizeof(packet) - n, "%s%c%s%c",
+                      PG_COMPRESSION_OPTION, 0, options.compression, 0);
+    }
+    if (n < (int)sizeof(packet)) {
+        packet[n++] = 0;
+    }
+    if (n > (int)sizeof(packet)) {
+        n = sizeof(packet);
+    }
+    uint32_t length = htonl((uint32_t)n);
+    uint32_t version = htonl(196608);  // 3.0
+    memcpy(packet, &length, 4);
+    memcpy(packet + 4, &version, 4);
+    pg_buffer_append(&conn->out, packet, (size_t)n);
+}
+
+/* The non-blocking connect finished */
+static int bench_connected(BenchConn *conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+        return -1;
+    }
+    conn->state = CONN_STARTUP;
+    bench_send_startup(conn);
+    return bench_flush(conn);
+}
+
+/**
+ * Open a connection; a failure is counted and the connection closed
+ *
+ * @param conn Connection
+ */
+static void bench_connect(BenchConn *conn) {
+    BenchThread *thread = conn->thread;
+    const struct sockaddr *addr = (const struct sockaddr *)&addrs[conn->host];
+    int one = 1;
+
+    conn->fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        thread->connect_errors++;
+        conn->state = CONN_DONE;
+        thread->active--;
+        return;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->state = CONN_CONNECTING;
+    conn->connect_start = pg_metrics_now();
+    conn->head = 0;
+    conn->inflight = 0;
+    conn->session_done = 0;
+    conn->prepared = false;
+    conn->watch_write = true;
+    thread->connecting++;
+
+    int rc = connect(conn->fd, addr, addr_lens[conn->host]);
+    if ((rc < 0 && errno != EINPROGRESS) ||
+        pg_event_add(thread->loop, conn->fd, PG_EVENT_READ | PG_EVENT_WRITE, conn) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        thread->connecting--;
+        thread->connect_errors++;
+        conn->state = CONN_DONE;
+        thread->active--;
+    }
+}
+
+/**
+ * Close a connection
+ *
+ * @param conn Connection
+ * @param failed Whether it failed; a failed connection is not reopened
+ */
+static void bench_close(BenchConn *conn, bool failed) {
+    BenchThread *thread = conn->thread;
+
+    if (conn->fd >= 0) {
+        pg_event_remove(thread->loop, conn->fd);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if (conn->state == CONN_CONNECTING || conn->state == CONN_STARTUP) {
+        thread->connecting--;
+    }
+    if (failed) {
+        thread->connect_errors++;
+    }
+    pg_buffer_truncate(&conn->in, 0);
+    pg_buffer_truncate(&conn->out, 0);
+    pg_buffer_truncate(&conn->plain, 0);
+    pg_buffer_shrink(&conn->in, 0);
+    pg_buffer_shrink(&conn->out, 0);
+    pg_buffer_shrink(&conn->plain, 0);
+    pg_decompressor_destroy(conn->decompressor);
+    conn->decompressor = NULL;
+
+    // In storm mode the caller reconnects a connection that ended normally
+    conn->state = CONN_IDLE;
+    if (failed || !options.storm || !atomic_load_explicit(&running, memory_order_relaxed)) {
+        conn->state = CONN_DONE;
+        thread->active--;
+    }
+}
+
+/* Start connections that have not connected yet, a batch at a time so a
+   large run does not overflow the server's listen backlog */
+static void bench_start_connections(BenchThread *thread) {
+    while (thread->next_start < thread->num_conns && thread->connecting < BENCH_CONNECT_BATCH &&
+           atomic_load_explicit(&running, memory_order_relaxed)) {
+        bench_connect(&thread->conns[thread->next_start++]);
+    }
+}
+
+/* Thread body: drive the connections until they are all done */
+static void *bench_thread_main(void *arg) {
+    BenchThread *thread = (BenchThread *)arg;
+    PGEvent events[BENCH_MAX_EVENTS];
+
+    bench_start_connections(thread);
+
+    while (thread->active > 0) {
+        if (!atomic_load(&running)) {
+            break;
+        }
+
+        int n = pg_event_wait(thread->loop, events, BENCH_MAX_EVENTS, BENCH_POLL_MS);
+        for (int i = 0; i < n; i++) {
+            BenchConn *conn = (BenchConn *)events[i].data;
+            if (!events[i].events || !conn) continue;
+
+            int result = 0;
+            if (conn->state == CONN_CONNECTING) {
+                result = bench_connected(conn);
+            } else if (events[i].events & (PG_EVENT_READ | PG_EVENT_ERROR)) {
+                result = bench_read(conn);
+            } else if (events[i].events & PG_EVENT_WRITE) {
+                result = bench_flush(conn);
+            }
+            if (result < 0) {
+                bench_close(conn, true);
+            }
+        }
+
+        bench_start_connections(thread);
+    }
+
+    // Connections still open at the end of the run
+    for (int i = 0; i < thread->num_conns; i++) {
+        if (thread->conns[i].fd >= 0) {
+            close(thread->conns[i].fd);
+            thread->conns[i].fd = -1;
+        }
+    }
+    return NULL;
+}
+
+/* Sum the histograms of all threads */
+static void bench_sum(const BenchThread *threads, size_t offset, PGHistogramTotals *total) {
+    memset(total, 0, sizeof(*total));
+    for (int t = 0; t < options.threads; t++) {
+        const PGHistogram *histogram = (const PGHistogram *)((const char *)&threads[t] + offset);
+        for (int b = 0; b < PG_HISTOGRAM_BUCKETS; b++) {
+            total->buckets[b] += histogram->buckets[b];
+        }
+        total->count += histogram->count;
+        total->sum += histogram->sum;
+        if (histogram->max > total->max) {
+            total->max = histogram->max;
+        }
+    }
+}
+
+/* Print the quantiles of a histogram in microseconds */
+static void bench_print_latency(const char *name, const PGHistogramTotals *histogram, bool last) {
+    double mean = histogram->count ? histogram->sum / 1e3 / histogram->count : 0;
+
+    if (options.json) {
+        printf("\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}%s",
+               name, (unsigned long long)histogram->count, mean,
+               pg_histogram_quantile(histogram, 0.5) / 1e3, pg_histogram_quantile(histogram, 0.99) / 1e3,
+               pg_histogram_quantile(histogram, 0.999) / 1e3, histogram->max / 1e3, last ? "" : ",");
+    } else {
+        printf("%s latency (us): mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f (%llu samples)\n",
+               name, mean, pg_histogram_quantile(histogram, 0.5) / 1e3,
+               pg_histogram_quantile(histogram, 0.99) / 1e3, pg_histogram_quantile(histogram, 0.999) / 1e3,
+               histogram->max / 1e3, (unsigned long long)histogram->count);
+    }
+}
+
+/**
+ * Print the results of the run
+ *
+ * @param threads Thread states
+ * @param elapsed Seconds the run took
+ */
+static void bench_report(const BenchThread *threads, double elapsed) {
+    static const char *mode_names[] = {"simple", "extended", "prepared"};
+    uint64_t transactions = 0, rows = 0, bytes = 0, errors = 0, connect_errors = 0, sessions = 0;
+    PGHistogramTotals latency, connect;
+
+    for (int t = 0; t < options.threads; t++) {
+        transactions += threads[t].transactions;
+        rows += threads[t].rows;
+        bytes += threads[t].bytes;
+        errors += threads[t].errors;
+        connect_errors += threads[t].connect_errors;
+        sessions += threads[t].sessions;
+    }
+    bench_sum(threads, offsetof(BenchThread, latency), &latency);
+    bench_sum(threads, offsetof(BenchThread, connect), &connect);
+
+    if (options.json) {
+        printf("{\"protocol\":\"%s\",\"clients\":%d,\"threads\":%d,\"pipeline\":%d,\"storm\":%s,"
+               "\"elapsed_s\":%.3f,\"transactions\":%llu,\"tps\":%.1f,\"rows\":%llu,\"rows_per_s\":%.1f,"
+               "\"bytes_received\":%llu,"
+               "\"errors\":%llu,\"connect_errors\":%llu,\"sessions\":%llu,\"sessions_per_s\":%.1f,\"latency_us\":{",
+               mode_names[options.mode], options.connections, options.threads, options.pipeline,
+               options.storm ? "true" : "false", elapsed, (unsigned long long)transactions,
+               transactions / elapsed, (unsigned long long)rows, rows / elapsed,
+               (unsigned long long)bytes, (unsigned long long)errors, (unsigned long long)connect_errors,
+               (unsigned long long)sessions, sessions / elapsed);
+        bench_print_latency("transaction", &latency, false);
+        bench_print_latency("connect", &connect, true);
+        printf("}}\n");
+        return;
+    }
+
+    printf("protocol: %s, clients: %d, threads: %d, pipeline: %d%s\n",
+           mode_names[options.mode], options.connections, options.threads, options.pipeline,
+           options.storm ? ", connection storm" : "");
+    printf("transactions: %llu in %.3f s, %.1f tps\n",
+           (unsigned long long)transactions, elapsed, transactions / elapsed);
+    printf("rows: %llu, %.1f per second\n", (unsigned long long)rows, rows / elapsed);
+    printf("received: %llu bytes, %.1f MB per second\n", (unsigned long long)bytes, bytes / elapsed / 1e6);
+    printf("sessions: %llu, %.1f per second\n", (unsigned long long)sessions, sessions / elapsed);
+    printf("errors: %llu, connection errors: %llu\n",
+           (unsigned long long)errors, (unsigned long long)connect_errors);
+    bench_print_latency("transaction", &latency, false);
+    bench_print_latency("connect", &connect, true);
+}
+
+/* Allow as many descriptors as the hard limit permits */
+static void bench_raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        (rlim_t)options.connections + 64 > limit.rlim_cur) {
+        fprintf(stderr, "Warning: the descriptor limit (%llu) is below the number of clients\n",
+                (unsigned long long)limit.rlim_cur);
+    }
+}
+
+/**
+ * Main entry point
+ *
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return Exit code
+ */
+int main(int argc, char **argv) {
+    int rc = parse_arguments(argc, argv);
+    if (rc != 0) {
+        return rc < 0 ? 1 : 0;
+    }
+    if (bench_resolve() < 0) {
+        return 1;
+    }
+    bench_raise_fd_limit();
+    bench_build_transaction();
+
+    signal(SIGINT, bench_signal);
+    signal(SIGTERM, bench_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    BenchThread *threads = (BenchThread *)calloc(options.threads, sizeof(BenchThread));
+    BenchConn *conns = (BenchConn *)calloc(options.connections, sizeof(BenchConn));
+    uint64_t *sent_at = (uint64_t *)calloc((size_t)options.connections * options.pipeline, sizeof(uint64_t));
+    if (!threads || !conns || !sent_at) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Connections are split evenly; each uses the hosts in turn
+    for (int t = 0, first = 0; t < options.threads; t++) {
+        BenchThread *thread = &threads[t];
+        int count = options.connections / options.threads + (t < options.connections % options.threads);
+
+        thread->id = t;
+        thread->conns = conns + first;
+        thread->num_conns = count;
+        thread->active = count;
+        thread->loop = pg_event_loop_create(options.event_backend);
+        if (!thread->loop) {
+            fprintf(stderr, "Cannot create event loop\n");
+            return 1;
+        }
+        for (int i = 0; i < count; i++) {
+            BenchConn *conn = &thread->conns[i];
+            conn->fd = -1;
+            conn->thread = thread;
+            conn->host = (first + i) % options.num_hosts;
+            conn->sent_at = sent_at + (size_t)(first + i) * options.pipeline;
+            pg_buffer_init(&conn->in);
+            pg_buffer_init(&conn->out);
+            pg_buffer_init(&conn->plain);
+        }
+        first += count;
+    }
+
+    uint64_t start = pg_metrics_now();
+    int started = 0;
+    for (; started < options.threads; started++) {
+        if (pthread_create(&threads[started].thread, NULL, bench_thread_main, &threads[started]) != 0) {
+            atomic_store(&running, false);
+            break;
+        }
+    }
+
+    // A timed run ends on the clock; a counted one when the threads finish
+    if (options.transactions == 0 || options.storm) {
+        uint64_t end = start + (uint64_t)options.duration * 1000000000u;
+        while (atomic_load(&running) && pg_metrics_now() < end) {
+            usleep(BENCH_POLL_MS * 1000);
+        }
+        atomic_store(&running, false);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    double elapsed = (pg_metrics_now() - start) / 1e9;
+
+    bench_report(threads, elapsed);
+
+    for (int t = 0; t < options.threads; t++) {
+        pg_event_loop_destroy(threads[t].loop);
+    }
+    for (int i = 0; i < options.connections; i++) {
+        pg_buffer_free(&conns[i].in);
+        pg_buffer_free(&conns[i].out);
+        pg_buffer_free(&conns[i].plain);
+    }
+    free(sent_at);
+    free(conns);
+    free(threads);
+    return started == options.threads ? 0 : 1;
+}
@@ -0,0 +1,220 @@
+/**
+ * pg_buffer.c
+ * Growable Byte Buffers
+ *
+ * This file contains the implementation of the byte buffers declared in
+ * pg_buffer.h.
+ */
+
+#include "pg_buffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Initialize an empty buffer
+ *
+ * No memory is allocated until the buffer is first written to.
+ *
+ * @param buf Buffer
+ */
+void pg_buffer_init(PGBuffer *buf) {
+    pg_buffer_init_pooled(buf, NULL);
+}
+
+/**
+ * Initialize an empty buffer whose storage comes from a pool
+ *
+ * The buffer takes a block from the pool when it is first written to, and
+ * gives it back when it is freed. Only the pool's thread may use it.
+ *
+ * @param buf Buffer
+ * @param pool Pool, or NULL for malloc
+ */
+void pg_buffer_init_pooled(PGBuffer *buf, PGBufferPool *pool) {
+    buf->data = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->capacity = 0;
+    buf->pool = pool;
+}
+
+/**
+ * Release the storage of a buffer
+ *
+ * Storage of the pool's block size goes back to the pool while it has
+ * room. The buffer stays usable, with the same pool.
+ *
+ * @param buf Buffer
+ */
+void pg_buffer_free(PGBuffer *buf) {
+    PGBufferPool *pool = buf->pool;
+
+    if (buf->data && pool && buf->capacity == PG_BUFFER_DEFAULT_CAPACITY &&
+        pool->count < pool->max_blocks) {
+        pool->blocks[pool->count++] = buf->data;
+    } else {
+        free(buf->data);
+    }
+    pg_buffer_init_pooled(buf, pool);
+}
+
+/**
+ * Make room for at least n more bytes at the end of a buffer
+ *
+ * Unread bytes are first moved to the front of the storage; the storage is
+ * only reallocated if that does not free enough space.
+ *
+ * @param buf Buffer
+ * @param n Number of bytes needed
+ * @return 0 on success, -1 on allocation failure
+ */
+int pg_buffer_reserve(PGBuffer *buf, size_t n) {
+    size_t length = buf->end - buf->start;
+
+    if (buf->capacity - buf->end >= n) {
+        return 0;
+    }
+
+    // Compact
+    if (buf->start > 0) {
+        if (length > 0) {
+            memmove(buf->data, buf->data + buf->start, length);
+        }
+        buf->start = 0;
+        buf->end = length;
+        if (buf->capacity - buf->end >= n) {
+            return 0;
+        }
+    }
+
+    // First use: take a block from the pool if there is one
+    if (!buf->data && buf->pool && buf->pool->count > 0 && n <= PG_BUFFER_DEFAULT_CAPACITY) {
+        buf->data = buf->pool->blocks[--buf->pool->count];
+        buf->capacity = PG_BUFFER_DEFAULT_CAPACITY;
+        return 0;
+    }
+
+    // Grow
+    size_t capacity = buf->capacity ? buf->capacity : PG_BUFFER_DEFAULT_CAPACITY;
+    while (capacity - length < n) {
+        capacity *= 2;
+    }
+
+    char *data = (char *)realloc(buf->data, capacity);
+    if (!data) {
+        return -1;
+    }
+
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Append bytes to a buffer
+ *
+ * @param buf Buffer
+ * @param data Bytes to append
+ * @param n Number of bytes
+ * @return 0 on success, -1 on allocation failure
+ */
+int pg_buffer_append(PGBuffer *buf, const void *data, size_t n) {
+    if (pg_buffer_reserve(buf, n) < 0) {
+        return -1;
+    }
+
+    memcpy(buf->data + buf->end, data, n);
+    buf->end += n;
+    return 0;
+}
+
+/**
+ * Discard unread bytes from the start of a buffer
+ *
+ * @param buf Buffer
+ * @param n Number of bytes to discard
+ */
+void pg_buffer_consume(PGBuffer *buf, size_t n) {
+    buf->start += n;
+    if (buf->start >= buf->end) {
+        // Empty: rewind so the next write needs no compaction
+        buf->start = 0;
+        buf->end = 0;
+    }
+}
+
+/**
+ * Return the storage of an empty buffer that grew past max_capacity
+ *
+ * Used after an unusually large message so that one big message does not
+ * pin its memory for the rest of the connection.
+ *
+ * @param buf Buffer
+ * @param max_capacity Largest capacity kept while the buffer is empty
+ */
+void pg_buffer_shrink(PGBuffer *buf, size_t max_capacity) {
+    if (buf->start == buf->end && buf->capacity > max_capacity) {
+        pg_buffer_free(buf);
+    }
+}
+
+/**
+ * Drop unread bytes from the end of a buffer
+ *
+ * @param buf Buffer
+ * @param length Number of unread bytes to keep
+ */
+void pg_buffer_truncate(PGBuffer *buf, size_t length) {
+    if (length < buf->end - buf->start) {
+        buf->end = buf->start + length;
+    }
+}
+
+/**
+ * Exchange the contents of two buffers
+ *
+ * Each buffer keeps its pool, so storage taken from one thread's pool may
+ * end up in a buffer freed with malloc, but never the other way round.
+ *
+ * @param a Buffer
+ * @param b Buffer
+ */
+void pg_buffer_swap(PGBuffer *a, PGBuffer *b) {
+    PGBuffer tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+    b->pool = a->pool;
+    a->pool = tmp.pool;
+}
+
+/**
+ * Initialize an empty pool
+ *
+ * @param pool Pool
+ * @param max_blocks Most free blocks kept
+ * @return 0 on success, -1 on allocation failure
+ */
+int pg_buffer_pool_init(PGBufferPool *pool, int max_blocks) {
+    pool->blocks = (char **)malloc((size_t)max_blocks * sizeof(char *));
+    pool->count = 0;
+    pool->max_blocks = pool->blocks ? max_blocks : 0;
+    return pool->blocks ? 0 : -1;
+}
+
+/**
+ * Release a pool and its free blocks
+ *
+ * Buffers still holding blocks from it free them with malloc's free.
+ *
+ * @param pool Pool
+ */
+void pg_buffer_pool_destroy(PGBufferPool *pool) {
+    for (int i = 0; i < pool->count; i++) {
+        free(pool->blocks[i]);
+    }
+    free(pool->blocks);
+    pool->blocks = NULL;
+    pool->count = 0;
+    pool->max_blocks = 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * pg_buffer.h
+ * Growable Byte Buffers
+ *
+ * This file contains declarations for the byte buffers used for
+ * per-connection network I/O. Bytes are appended at the end and consumed
+ * from the start; consumed space is reclaimed by compaction, so the unread
+ * bytes are always contiguous and a framed message can be handed to a
+ * callback without copying. A buffer may draw its storage from a pool of
+ * blocks kept by its thread, so connections that go idle can give their
+ * storage back and take it again when they wake up without calling malloc.
+ */
+
+#ifndef PG_BUFFER_H
+#define PG_BUFFER_H
+
+#include <stddef.h>
+
+/* Default initial capacity */
+#define PG_BUFFER_DEFAULT_CAPACITY 8192
+
+/* Storage blocks of PG_BUFFER_DEFAULT_CAPACITY bytes kept for reuse by the
+   buffers of one thread */
+typedef struct {
+    char **blocks;           /* Free blocks, a stack */
+    int count;               /* Number of free blocks */
+    int max_blocks;          /* Blocks kept at most; the rest go back to malloc */
+} PGBufferPool;
+
+/* Byte buffer */
+typedef struct {
+    char *data;              /* Storage (NULL until first use) */
+    size_t start;            /* Offset of the first unread byte */
+    size_t end;              /* Offset one past the last byte */
+    size_t capacity;         /* Size of the storage */
+    PGBufferPool *pool;      /* Where storage comes from and goes back to (NULL: malloc) */
+} PGBuffer;
+
+/* Function declarations */
+void pg_buffer_init(PGBuffer *buf);
+void pg_buffer_init_pooled(PGBuffer *buf, PGBufferPool *pool);
+void pg_buffer_free(PGBuffer *buf);
+int pg_buffer_reserve(PGBuffer *buf, size_t n);
+int pg_buffer_append(PGBuffer *buf, const void *data, size_t n);
+void pg_buffer_consume(PGBuffer *buf, size_t n);
+void pg_buffer_shrink(PGBuffer *buf, size_t max_capacity);
+void pg_buffer_truncate(PGBuffer *buf, size_t length);
+void pg_buffer_swap(PGBuffer *a, PGBuffer *b);
+
+int pg_buffer_pool_init(PGBufferPool *pool, int max_blocks);
+void pg_buffer_pool_destroy(PGBufferPool *pool);
+
+/* Number of unread bytes */
+static inline size_t pg_buffer_length(const PGBuffer *buf) {
+    return buf->end - buf->start;
+}
+
+/* First unread byte */
+static inline char *pg_buffer_read_ptr(const PGBuffer *buf) {
+    return buf->data + buf->start;
+}
+
+/* Where the next appended byte goes */
+static inline char *pg_buffer_write_ptr(const PGBuffer *buf) {
+    return buf->data + buf->end;
+}
+
+/* Space available at the end without compacting or growing */
+static inline size_t pg_buffer_writable(const PGBuffer *buf) {
+    return buf->capacity - buf->end;
+}
+
+/* Mark n bytes written directly at pg_buffer_write_ptr as appended */
+static inline void pg_buffer_commit(PGBuffer *buf, size_t n) {
+    buf->end += n;
+}
+
+#endif /* PG_BUFFER_H */
@@ -0,0 +1,463 @@
+/**
+ * pg_cache.c
+ * Shared Query Response Cache
+ *
+ * This file contains the implementation of the cache declared in
+ * pg_cache.h. The cache is split into shards by key hash, each behind its
+ * own reader-writer lock, so lookups from different workers only share a
+ * read lock. Entries are reference counted: a hit can be sent after the
+ * lock is dropped even if the entry is evicted meanwhile. Within a shard,
+ * eviction follows the CLOCK policy, which approximates LRU while letting
+ * a hit mark its entry with a plain atomic store under the read lock.
+ */
+
+#include "pg_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define CACHE_SHARDS 16              // power of two
+#define INITIAL_BUCKETS 64
+#define MAX_QUERY_LENGTH 4096        // longer queries are not cached
+
+/* Cached reply, allocated in one block with its key and data */
+struct PGCacheEntry {
+    atomic_int refs;         /* One for the cache, one per reader holding it */
+    atomic_bool referenced;  /* Hit since the clock hand last passed */
+    uint32_t hash;           /* Hash of the normalized query */
+    char kind;               /* PG_CACHE_DESCRIBE or PG_CACHE_RESULT */
+    int num_params;          /* Number of parameter types in the key */
+    uint32_t *param_types;   /* Parameter type OIDs */
+    char *query;             /* Normalized query text */
+    char *data;              /* Wire bytes */
+    size_t length;           /* Length of data */
+    size_t size;             /* Bytes charged against the shard limit */
+    PGCacheEntry *next;      /* Bucket chain */
+    PGCacheEntry *clock_prev; /* Clock order, oldest first */
+    PGCacheEntry *clock_next;
+};
+
+/* Independent part of the cache */
+typedef struct {
+    pthread_rwlock_t lock;
+    PGCacheEntry **buckets;  /* Bucket chains (NULL until first insert) */
+    size_t num_buckets;      /* Number of buckets (power of two) */
+    size_t count;            /* Number of entries */
+    PGCacheEntry *clock_head; /* Next entry the clock hand looks at */
+    PGCacheEntry *clock_tail; /* Most recently inserted or spared entry */
+    size_t bytes;            /* Bytes held by the entries */
+    size_t max_bytes;        /* Limit on bytes */
+} PGCacheShard;
+
+struct PGCache {
+    PGCacheShard shards[CACHE_SHARDS];
+};
+
+/**
+ * Normalize query text for use as a key
+ *
+ * Runs of whitespace become one space, unquoted text is folded to lower
+ * case and trailing semicolons are dropped. Quoted text is kept as it is;
+ * after a comment, a dollar quote or a backslash in a literal the rest of
+ * the query is kept as it is too, so different queries never share a key.
+ *
+ * @param query Query text
+ * @param out Buffer for the normalized text
+ * @param size Size of the buffer
+ * @return Length of the normalized text, or -1 if it does not fit
+ */
+static int pg_cache_normalize(const char *query, char *out, size_t size) {
+    size_t n = 0;
+    bool space = false;
+    const char *p = query;
+
+    while (*p) {
+        size_t len = 1;
+        bool verbatim = false;
+
+        if (isspace((unsigned char)*p)) {
+            space = true;
+            p++;
+            continue;
+        }
+
+        if (space && n > 0) {
+            if (n + 1 >= size) return -1;
+            out[n++] = ' ';
+        }
+        space = false;
+
+        if (*p == '\'' || *p == '"') {
+            const char *end = strchr(p + 1, *p);
+            len = end ? (size_t)(end - p + 1) : strlen(p);
+            verbatim = memchr(p, '\\', len) != NULL;
+        } else if ((p[0] == '-' && p[1] == '-') || (p[0] == '/' && p[1] == '*') ||
+                   (p[0] == '$' && !isdigit((unsigned char)p[1]))) {
+            verbatim = true;
+        }
+
+        if (verbatim) {
+            len = strlen(p);
+        }
+        if (n + len >= size) return -1;
+
+        if (len == 1) {
+            out[n++] = (char)tolower((unsigned char)*p);
+        } else {
+            memcpy(out + n, p, len);
+            n += len;
+        }
+        p += len;
+        if (verbatim) break;
+    }
+
+    while (n > 0 && (out[n - 1] == ';' || out[n - 1] == ' ')) {
+        n--;
+    }
+    out[n] = '\0';
+    return (int)n;
+}
+
+/**
+ * FNV-1a hash of normalized query text
+ *
+ * @param query Normalized query
+ * @return Hash value
+ */
+static uint32_t pg_cache_hash(const char *query) {
+    uint32_t hash = 2166136261u;
+
+    while (*query) {
+        hash ^= (unsigned char)*query++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static PGCacheShard *pg_cache_shard(PGCache *cache, uint32_t hash) {
+    // The bucket index uses the low bits, the shard the high ones
+    return &cache->shards[hash >> 28 & (CACHE_SHARDS - 1)];
+}
+
+static bool pg_cache_entry_matches(const PGCacheEntry *entry, uint32_t hash, char kind,
+                                   const char *query, int num_params, const uint32_t *param_types) {
+    return entry->hash == hash && entry->kind == kind && entry->num_params == num_params &&
+           (num_params == 0 || memcmp(entry->param_types, param_types, num_params * sizeof(uint32_t)) == 0) &&
+           strcmp(entry->query, query) == 0;
+}
+
+// Find the entry for a key; the shard must be locked
+static PGCacheEntry *pg_cache_find(PGCacheShard *shard, uint32_t hash, char kind,
+                                   const char *query, int num_params, const uint32_t *param_types) {
+    if (!shard->buckets) {
+        return NULL;
+    }
+
+    for (PGCacheEntry *entry = shard->buckets[hash & (shard->num_buckets - 1)]; entry; entry = entry->next) {
+        if (pg_cache_entry_matches(entry, hash, kind, query, num_params, param_types)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Unlink an entry from its clock position; the shard must be write locked
+static void pg_cache_clock_unlink(PGCacheShard *shard, PGCacheEntry *entry) {
+    if (entry->clock_prev) entry->clock_prev->clock_next = entry->clock_next;
+    else shard->clock_head = entry->clock_next;
+    if (entry->clock_next) entry->clock_next->clock_prev = entry->clock_prev;
+    else shard->clock_tail = entry->clock_prev;
+    entry->clock_prev = entry->clock_next = NULL;
+}
+
+// Put an entry behind the clock hand; the shard must be write locked
+static void pg_cache_clock_append(PGCacheShard *shard, PGCacheEntry *entry) {
+    entry->clock_prev = shard->clock_tail;
+    entry->clock_next = NULL;
+    if (shard->clock_tail) shard->clock_tail->clock_next = entry;
+    else shard->clock_head = entry;
+    shard->clock_tail = entry;
+}
+
+// Drop an entry from the shard; the shard must be write locked
+static void pg_cache_remove(PGCacheShard *shard, PGCacheEntry *entry) {
+    PGCacheEntry **link = &shard->buckets[entry->hash & (shard->num_buckets - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    pg_cache_clock_unlink(shard, entry);
+    shard->count--;
+    shard->bytes -= entry->size;
+    pg_cache_release(entry);
+}
+
+// Evict entries until `needed` more bytes fit; the shard must be write locked
+static void pg_cache_evict(PGCacheShard *shard, size_t needed) {
+    while (shard->clock_head && shard->bytes + needed > shard->max_bytes) {
+        PGCacheEntry *entry = shard->clock_head;
+
+        // A hit since the last pass earns one more turn
+        if (atomic_exchange_explicit(&entry->referenced, false, memory_order_relaxed)) {
+            pg_cache_clock_unlink(shard, entry);
+            pg_cache_clock_append(shard, entry);
+            continue;
+        }
+        pg_cache_remove(shard, entry);
+    }
+}
+
+// Double the bucket array; the shard must be write locked
+static int pg_cache_grow(PGCacheShard *shard) {
+    size_t num_buckets = shard->num_buckets ? shard->num_buckets * 2 : INITIAL_BUCKETS;
+    PGCacheEntry **buckets = (PGCacheEntry **)calloc(num_buckets, sizeof(PGCacheEntry *));
+    if (!buckets) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        PGCacheEntry *entry = shard->buckets[i];
+        while (entry) {
+            PGCacheEntry *next = entry->next;
+            size_t index = entry->hash & (num_buckets - 1);
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+    return 0;
+}
+
+/**
+ * Create a cache
+ *
+ * @param max_bytes Limit on the memory held by cached entries
+ * @return New cache, or NULL on error
+ */
+PGCache *pg_cache_create(size_t max_bytes) {
+    PGCache *cache = (PGCache *)calloc(1, sizeof(PGCache));
+    if (!cache) {
+        return NULL;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].max_bytes = max_bytes / CACHE_SHARDS;
+    }
+    return cache;
+}
+
+/**
+ * Destroy a cache
+ *
+ * Entries still held by readers are freed when they are released.
+ *
+ * @param cache Cache
+ */
+void pg_cache_destroy(PGCache *cache) {
+    if (!cache) {
+        return;
+    }
+
+    pg_cache_invalidate_all(cache);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].buckets);
+    }
+    free(cache);
+}
+
+/**
+ * Look up a cached reply
+ *
+ * @param cache Cache
+ * @param kind Kind of reply
+ * @param query Query text (normalized here)
+ * @param num_params Number of parameter types
+ * @param param_types Parameter type OIDs
+ * @return Entry, which must be released with pg_cache_release, or NULL
+ */
+PGCacheEntry *pg_cache_lookup(PGCache *cache, char kind, const char *query,
+                              int num_params, const uint32_t *param_types) {
+    char key[MAX_QUERY_LENGTH + 1];
+
+    if (pg_cache_normalize(query, key, sizeof(key)) < 0) {
+        return NULL;
+    }
+
+    uint32_t hash = pg_cache_hash(key);
+    PGCacheShard *shard = pg_cache_shard(cache, hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    PGCacheEntry *entry = pg_cache_find(shard, hash, kind, key, num_params, param_types);
+    if (entry) {
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+        if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return entry;
+}
+
+/**
+ * Get the wire bytes of an entry
+ *
+ * @param entry Entry
+ * @param length Set to the number of bytes
+ * @return Bytes
+ */
+const char *pg_cache_entry_data(const PGCacheEntry *entry, size_t *length) {
+    *length = entry->length;
+    return entry->data;
+}
+
+/**
+ * Release an entry returned by pg_cache_lookup
+ *
+ * @param entry Entry
+ */
+void pg_cache_release(PGCacheEntry *entry) {
+    if (entry && atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1) {
+        free(entry);
+    }
+}
+
+/**
+ * Store a reply, replacing any entry with the same key
+ *
+ * Replies larger than a shard's share of the limit are not stored.
+ *
+ * @param cache Cache
+ * @param kind Kind of reply
+ * @param query Query text (normalized here)
+ * @param num_params Number of parameter types
+ * @param param_types Parameter type OIDs
+ * @param data Wire bytes
+ * @param length Number of bytes
+ * @return 0 on success (including when not stored), -1 on error
+ */
+int pg_cache_insert(PGCache *cache, char kind, const char *query,
+                    int num_params, const uint32_t *param_types,
+                    const char *data, size_t length) {
+    char key[MAX_QUERY_LENGTH + 1];
+    int key_len = pg_cache_normalize(query, key, sizeof(key));
+
+    if (key_len < 0 || num_params < 0) {
+        return 0;
+    }
+
+    size_t params_size = num_params * sizeof(uint32_t);
+    size_t size = sizeof(PGCacheEntry) + params_size + key_len + 1 + length;
+    uint32_t hash = pg_cache_hash(key);
+    PGCacheShard *shard = pg_cache_shard(cache, hash);
+
+    if (size > shard->max_bytes) {
+        return 0;
+    }
+
+    PGCacheEntry *entry = (PGCacheEntry *)malloc(size);
+    if (!entry) {
+        return -1;
+    }
+
+    atomic_init(&entry->refs, 1);
+    atomic_init(&entry->referenced, false);
+    entry->hash = hash;
+    entry->kind = kind;
+    entry->num_params = num_params;
+    entry->param_types = (uint32_t *)(entry + 1);
+    entry->query = (char *)entry->param_types + params_size;
+    entry->data = entry->query + key_len + 1;
+    entry->length = length;
+    entry->size = size;
+    if (params_size > 0) {
+        memcpy(entry->param_types, param_types, params_size);
+    }
+    memcpy(entry->query, key, key_len + 1);
+    if (length > 0) {
+        memcpy(entry->data, data, length);
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    PGCacheEntry *old = pg_cache_find(shard, hash, kind, key, num_params, param_types);
+    if (old) {
+        pg_cache_remove(shard, old);
+    }
+
+    if (shard->count >= shard->num_buckets && pg_cache_grow(shard) < 0) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(entry);
+        return -1;
+    }
+
+    pg_cache_evict(shard, size);
+
+    size_t index = hash & (shard->num_buckets - 1);
+    entry->next = shard->buckets[index];
+    shard->buckets[index] = entry;
+    pg_cache_clock_append(shard, entry);
+    shard->count++;
+    shard->bytes += size;
+
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+/**
+ * Drop every cached reply for a query, whatever its kind and parameter types
+ *
+ * @param cache Cache
+ * @param query Query text (normalized here)
+ */
+void pg_cache_invalidate(PGCache *cache, const char *query) {
+    char key[MAX_QUERY_LENGTH + 1];
+
+    if (pg_cache_normalize(query, key, sizeof(key)) < 0) {
+        return;
+    }
+
+    uint32_t hash = pg_cache_hash(key);
+    PGCacheShard *shard = pg_cache_shard(cache, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    if (shard->buckets) {
+        PGCacheEntry *entry = shard->buckets[hash & (shard->num_buckets - 1)];
+        while (entry) {
+            PGCacheEntry *next = entry->next;
+            if (entry->hash == hash && strcmp(entry->query, key) == 0) {
+                pg_cache_remove(shard, entry);
+            }
+            entry = next;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * Drop every cached reply
+ *
+ * @param cache Cache
+ */
+void pg_cache_invalidate_all(PGCache *cache) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        PGCacheShard *shard = &cache->shards[i];
+
+        pthread_rwlock_wrlock(&shard->lock);
+        while (shard->clock_head) {
+            pg_cache_remove(shard, shard->clock_head);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,39 @@
+/**
+ * pg_cache.h
+ * Shared Query Response Cache
+ *
+ * This file contains declarations for the server-wide cache of serialized
+ * replies, shared by all connections and worker threads. Entries are keyed
+ * by normalized query text, the kind of reply and the parameter types, and
+ * hold wire bytes that are sent to the client as they are.
+ */
+
+#ifndef PG_CACHE_H
+#define PG_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Kinds of cached reply */
+#define PG_CACHE_DESCRIBE  'T'   /* RowDescription payload of a statement (empty: NoData) */
+#define PG_CACHE_RESULT    'R'   /* Full reply to a simple Query, without ReadyForQuery */
+
+typedef struct PGCache PGCache;
+typedef struct PGCacheEntry PGCacheEntry;
+
+/* Function declarations */
+PGCache *pg_cache_create(size_t max_bytes);
+void pg_cache_destroy(PGCache *cache);
+
+PGCacheEntry *pg_cache_lookup(PGCache *cache, char kind, const char *query,
+                              int num_params, const uint32_t *param_types);
+const char *pg_cache_entry_data(const PGCacheEntry *entry, size_t *length);
+void pg_cache_release(PGCacheEntry *entry);
+
+int pg_cache_insert(PGCache *cache, char kind, const char *query,
+                    int num_params, const uint32_t *param_types,
+                    const char *data, size_t length);
+void pg_cache_invalidate(PGCache *cache, const char *query);
+void pg_cache_invalidate_all(PGCache *cache);
+
+#endif /* PG_CACHE_H */
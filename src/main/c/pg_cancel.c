@@ -0,0 +1,274 @@
+/**
+ * pg_cancel.c
+ * Backend Key Registry
+ *
+ * This file contains the implementation of the registry declared in
+ * pg_cancel.h. An entry holds the (process ID, key) pair of the
+ * connection in its slot as one 64-bit word, 0 while the slot is unused.
+ * A cancel stores the pair it matched in the entry's request word and
+ * pushes the entry on the owning worker's list, a lock-free stack linked
+ * by entry index, so the worker visits only the slots that were asked for.
+ * The worker only acts on a request whose pair is still the registered
+ * one, so a cancel that races with the connection closing can never hit
+ * the next connection in the slot.
+ */
+
+#include "pg_cancel.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <openssl/rand.h>
+
+#define CANCEL_MAX_INDEX_BITS 24   // leaves at least 7 bits of generation in a process ID
+
+/* Registry slot */
+typedef struct {
+    _Atomic uint64_t tag;        /* Registered (pid, key), or 0 */
+    _Atomic uint64_t requested;  /* Pair a cancel matched, or 0 */
+    uint32_t generation;         /* Bumped on each registration; only the owner touches it */
+    _Atomic uint32_t next;       /* Next entry on the worker's list, as index + 1 */
+    atomic_bool queued;          /* On the worker's list */
+} PGCancelEntry;
+
+/* Per-worker list head, on a cache line of its own */
+typedef struct {
+    alignas(64) _Atomic uint32_t head;  /* Entries with a request, as index + 1 (0: none) */
+} PGCancelWorker;
+
+struct PGCancelRegistry {
+    PGCancelEntry *entries;      /* num_workers * slots_per_worker, by worker */
+    PGCancelWorker *workers;
+    int num_workers;
+    int slots_per_worker;
+    int index_bits;              /* Low bits of a process ID giving the entry */
+};
+
+static uint64_t pg_cancel_tag(int32_t pid, int32_t key) {
+    return ((uint64_t)(uint32_t)pid << 32) | (uint32_t)key;
+}
+
+/**
+ * Create a registry with an entry for every connection slot
+ *
+ * @param num_workers Number of worker threads
+ * @param slots_per_worker Connection slots of each worker
+ * @return Registry, or NULL on error
+ */
+PGCancelRegistry *pg_cancel_registry_create(int num_workers, int slots_per_worker) {
+    size_t count = (size_t)num_workers * (size_t)slots_per_worker;
+    int bits = 1;
+    while (((size_t)1 << bits) < count) {
+        bits++;
+    }
+    if (count == 0 || bits > CANCEL_MAX_INDEX_BITS) {
+        return NULL;
+    }
+
+    PGCancelRegistry *registry = (PGCancelRegistry *)calloc(1, sizeof(PGCancelRegistry));
+    if (!registry) {
+        return NULL;
+    }
+    registry->entries = (PGCancelEntry *)calloc(count, sizeof(PGCancelEntry));
+    registry->workers = (PGCancelWorker *)aligned_alloc(alignof(PGCancelWorker),
+                                                        (size_t)num_workers * sizeof(PGCancelWorker));
+    if (!registry->entries || !registry->workers) {
+        pg_cancel_registry_destroy(registry);
+        return NULL;
+    }
+    registry->num_workers = num_workers;
+    registry->slots_per_worker = slots_per_worker;
+    registry->index_bits = bits;
+
+    // Random starting generations keep process IDs from repeating across restarts
+    for (size_t i = 0; i < count; i++) {
+        atomic_init(&registry->entries[i].tag, 0);
+        atomic_init(&registry->entries[i].requested, 0);
+        atomic_init(&registry->entries[i].next, 0);
+        atomic_init(&registry->entries[i].queued, false);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        atomic_init(&registry->workers[i].head, 0);
+    }
+    for (size_t i = 0; i < count; i += 256) {
+        uint32_t seeds[256];
+        size_t n = count - i < 256 ? count - i : 256;
+        if (RAND_bytes((unsigned char *)seeds, (int)(n * sizeof(uint32_t))) != 1) {
+            pg_cancel_registry_destroy(registry);
+            return NULL;
+        }
+        for (size_t j = 0; j < n; j++) {
+            registry->entries[i + j].generation = seeds[j];
+        }
+    }
+    return registry;
+}
+
+/**
+ * Free a registry
+ *
+ * @param registry Registry (may be NULL)
+ */
+void pg_cancel_registry_destroy(PGCancelRegistry *registry) {
+    if (registry) {
+        free(registry->entries);
+        free(registry->workers);
+        free(registry);
+    }
+}
+
+/**
+ * Give the connection in a slot a new process ID and random secret key,
+ * and make it reachable by cancel requests; called by the owning worker
+ *
+ * @param registry Registry
+ * @param worker Owning worker
+ * @param slot Connection slot
+ * @param pid Set to the process ID
+ * @param key Set to the secret key
+ * @return 0 on success, -1 if no random key could be generated
+ */
+int pg_cancel_register(PGCancelRegistry *registry, int worker, int slot,
+                       int32_t *pid, int32_t *key) {
+    size_t index = (size_t)worker * (size_t)registry->slots_per_worker + (size_t)slot;
+    PGCancelEntry *entry = &registry->entries[index];
+    uint32_t generation_mask = (1u << (31 - registry->index_bits)) - 1;
+
+    // Process IDs are positive, and never 0
+    do {
+        entry->generation++;
+    } while ((entry->generation & generation_mask) == 0);
+
+    uint32_t secret;
+    if (RAND_bytes((unsigned char *)&secret, sizeof(secret)) != 1) {
+        return -1;
+    }
+    *pid = (int32_t)(((entry->generation & generation_mask) << registry->index_bits) | (uint32_t)index);
+    *key = (int32_t)secret;
+
+    atomic_store(&entry->requested, 0);
+    atomic_store(&entry->tag, pg_cancel_tag(*pid, *key));
+    return 0;
+}
+
+/**
+ * Find the slot a process ID of this registry belongs to
+ *
+ * @param registry Registry
+ * @param pid Process ID
+ * @param worker Set to the owning worker
+ * @param slot Set to the connection slot
+ * @return 0 on success, -1 if the process ID is out of range
+ */
+int pg_cancel_slot(PGCancelRegistry *registry, int32_t pid, int *worker, int *slot) {
+    size_t index = (uint32_t)pid & ((1u << registry->index_bits) - 1);
+
+    if (pid <= 0 || index >= (size_t)registry->num_workers * (size_t)registry->slots_per_worker) {
+        return -1;
+    }
+    *worker = (int)(index / (size_t)registry->slots_per_worker);
+    *slot = (int)(index % (size_t)registry->slots_per_worker);
+    return 0;
+}
+
+/**
+ * Make the connection in a slot reachable under a process ID and key it
+ * already has, given out for the same slot by a registry of the same size
+ * in the process it was taken over from; called by the owning worker
+ *
+ * @param registry Registry
+ * @param worker Owning worker
+ * @param slot Connection slot, as found by pg_cancel_slot
+ * @param pid Process ID
+ * @param key Secret key
+ */
+void pg_cancel_restore(PGCancelRegistry *registry, int worker, int slot, int32_t pid, int32_t key) {
+    PGCancelEntry *entry = &registry->entries[(size_t)worker * (size_t)registry->slots_per_worker + (size_t)slot];
+
+    // The next registration moves on from this generation
+    entry->generation = (uint32_t)pid >> registry->index_bits;
+    atomic_store(&entry->requested, 0);
+    atomic_store(&entry->tag, pg_cancel_tag(pid, key));
+}
+
+/**
+ * Make the connection in a slot unreachable; called by the owning worker
+ * before the slot is reused
+ *
+ * @param registry Registry
+ * @param worker Owning worker
+ * @param slot Connection slot
+ */
+void pg_cancel_unregister(PGCancelRegistry *registry, int worker, int slot) {
+    PGCancelEntry *entry = &registry->entries[(size_t)worker * (size_t)registry->slots_per_worker + (size_t)slot];
+    atomic_store(&entry->tag, 0);
+    atomic_store(&entry->requested, 0);
+}
+
+/**
+ * Ask for the connection with a process ID and key to be cancelled; may
+ * be called from any thread
+ *
+ * @param registry Registry
+ * @param pid Process ID from the CancelRequest
+ * @param key Secret key from the CancelRequest
+ * @return Index of the worker to wake, or -1 if no connection matches
+ */
+int pg_cancel_request(PGCancelRegistry *registry, int32_t pid, int32_t key) {
+    size_t index = (uint32_t)pid & ((1u << registry->index_bits) - 1);
+    uint64_t tag = pg_cancel_tag(pid, key);
+
+    if (pid <= 0 || index >= (size_t)registry->num_workers * (size_t)registry->slots_per_worker) {
+        return -1;
+    }
+    PGCancelEntry *entry = &registry->entries[index];
+    if (atomic_load(&entry->tag) != tag) {
+        return -1;
+    }
+
+    int worker = (int)(index / (size_t)registry->slots_per_worker);
+    atomic_store(&entry->requested, tag);
+
+    // Queue the entry unless it already is; the worker clears the flag
+    // before reading the request, so this one is not missed either way
+    if (!atomic_exchange(&entry->queued, true)) {
+        _Atomic uint32_t *head = &registry->workers[worker].head;
+        uint32_t next = atomic_load(head);
+        do {
+            atomic_store_explicit(&entry->next, next, memory_order_relaxed);
+        } while (!atomic_compare_exchange_weak(head, &next, (uint32_t)index + 1));
+    }
+    return worker;
+}
+
+/**
+ * Consume the cancel requests posted for a worker's connections since the
+ * last call; called by the owning worker, which may close connections
+ * from the callback
+ *
+ * @param registry Registry
+ * @param worker Owning worker
+ * @param cancel Called with each slot whose current connection was cancelled
+ * @param arg Passed to cancel
+ */
+void pg_cancel_take(PGCancelRegistry *registry, int worker,
+                    void (*cancel)(int slot, void *arg), void *arg) {
+    _Atomic uint32_t *head = &registry->workers[worker].head;
+    if (atomic_load_explicit(head, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    uint32_t link = atomic_exchange(head, 0);
+    while (link != 0) {
+        size_t index = link - 1;
+        PGCancelEntry *entry = &registry->entries[index];
+
+        // Once the flag is clear a new request may queue the entry again
+        link = atomic_load_explicit(&entry->next, memory_order_relaxed);
+        atomic_store(&entry->queued, false);
+
+        uint64_t requested = atomic_exchange(&entry->requested, 0);
+        if (requested != 0 && requested == atomic_load(&entry->tag)) {
+            cancel((int)(index % (size_t)registry->slots_per_worker), arg);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+/**
+ * pg_cancel.h
+ * Backend Key Registry
+ *
+ * This file contains declarations for the server-wide registry that maps
+ * the (process ID, secret key) pair sent in BackendKeyData to the
+ * connection it belongs to, so that a CancelRequest arriving on any
+ * worker thread can reach the worker that owns the connection. Every
+ * connection slot of every worker has a fixed entry, and the process ID
+ * encodes the entry's index, so registration, lookup and cancellation are
+ * a few atomic operations without locks.
+ */
+
+#ifndef PG_CANCEL_H
+#define PG_CANCEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct PGCancelRegistry PGCancelRegistry;
+
+/* Function declarations */
+PGCancelRegistry *pg_cancel_registry_create(int num_workers, int slots_per_worker);
+void pg_cancel_registry_destroy(PGCancelRegistry *registry);
+
+int pg_cancel_register(PGCancelRegistry *registry, int worker, int slot,
+                       int32_t *pid, int32_t *key);
+void pg_cancel_unregister(PGCancelRegistry *registry, int worker, int slot);
+int pg_cancel_slot(PGCancelRegistry *registry, int32_t pid, int *worker, int *slot);
+void pg_cancel_restore(PGCancelRegistry *registry, int worker, int slot, int32_t pid, int32_t key);
+
+int pg_cancel_request(PGCancelRegistry *registry, int32_t pid, int32_t key);
+void pg_cancel_take(PGCancelRegistry *registry, int worker,
+                    void (*cancel)(int slot, void *arg), void *arg);
+
+#endif /* PG_CANCEL_H */
@@ -0,0 +1,456 @@
+/**
+ * pg_capture.c
+ * Wire Traffic Capture
+ *
+ * This file contains the implementation of the capture file declared in
+ * pg_capture.h. A writer maps one segment at a time and publishes the
+ * bytes it has filled in the segment's header after every record, so a
+ * file that is still being written, or whose writer crashed, reads back
+ * up to its last complete record. A record too large for the space left
+ * in a segment is split in pieces of the same kind, which is harmless
+ * because payloads are byte streams.
+ */
+
+#include "pg_capture.h"
+#include "pg_metrics.h"
+#include "pg_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define CAPTURE_HEADER_SIZE 4096
+#define CAPTURE_SEGMENT_SIZE (4 * 1024 * 1024)
+#define CAPTURE_SEGMENT_MAGIC 0x4d474553u   // "SEGM"
+#define CAPTURE_PAD(n) (((n) + 7) & ~(size_t)7)
+
+/* Start of the file */
+typedef struct {
+    char magic[8];           /* PG_CAPTURE_MAGIC */
+    uint32_t version;        /* PG_CAPTURE_VERSION */
+    uint32_t segment_size;   /* Bytes per segment, header included */
+    uint64_t started;        /* Wall clock at creation, microseconds since the epoch */
+} PGCaptureFileHeader;
+
+/* Start of every segment, followed by its records */
+typedef struct {
+    _Atomic uint32_t magic;  /* CAPTURE_SEGMENT_MAGIC once the segment is in use */
+    uint32_t thread;         /* Thread that owns the segment */
+    uint64_t sequence;       /* Segment number within the thread, from 0 */
+    _Atomic uint64_t used;   /* Record bytes written after this header */
+    char reserved[40];
+} PGCaptureSegment;
+
+struct PGCapture {
+    int fd;
+    uint64_t start;          /* Monotonic clock at creation; records are relative to it */
+    atomic_uint_fast64_t next_segment;
+};
+
+/* One thread's view of the file; only that thread touches it */
+struct PGCaptureWriter {
+    PGCapture *capture;
+    int thread;
+    uint64_t sequence;       /* Segments claimed so far */
+    PGCaptureSegment *segment; /* Mapped segment being filled, or NULL */
+    size_t used;             /* Record bytes in it */
+    uint64_t next_conn;      /* Connections recorded so far */
+    bool failed;             /* Recording stopped after an error */
+};
+
+/* Segments of one thread, in sequence order */
+typedef struct {
+    const PGCaptureSegment **segments;
+    int num_segments;
+    int current;             /* Segment being read */
+    size_t offset;           /* Next record in it */
+} PGCaptureStream;
+
+struct PGCaptureReader {
+    char *map;
+    size_t size;
+    PGCaptureStream *streams; /* By thread */
+    int num_streams;
+};
+
+/**
+ * Create a capture file, replacing any file at the path
+ *
+ * @param path File path
+ * @return Capture, or NULL on error
+ */
+PGCapture *pg_capture_create(const char *path) {
+    PGCapture *capture = (PGCapture *)calloc(1, sizeof(PGCapture));
+    if (!capture) {
+        return NULL;
+    }
+
+    capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture->fd < 0) {
+        pg_log_error("Cannot create capture file %s: %s", path, strerror(errno));
+        free(capture);
+        return NULL;
+    }
+
+    char block[CAPTURE_HEADER_SIZE];
+    PGCaptureFileHeader *header = (PGCaptureFileHeader *)block;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    memset(block, 0, sizeof(block));
+    memcpy(header->magic, PG_CAPTURE_MAGIC, sizeof(header->magic));
+    header->version = PG_CAPTURE_VERSION;
+    header->segment_size = CAPTURE_SEGMENT_SIZE;
+    header->started = (uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_usec;
+
+    if (pwrite(capture->fd, block, sizeof(block), 0) != (ssize_t)sizeof(block)) {
+        pg_log_error("Cannot write capture file %s: %s", path, strerror(errno));
+        close(capture->fd);
+        free(capture);
+        return NULL;
+    }
+
+    capture->start = pg_metrics_now();
+    atomic_init(&capture->next_segment, 0);
+    return capture;
+}
+
+/**
+ * Close a capture file; its writers must have been destroyed
+ *
+ * @param capture Capture
+ */
+void pg_capture_destroy(PGCapture *capture) {
+    if (capture) {
+        close(capture->fd);
+        free(capture);
+    }
+}
+
+/**
+ * Create the writer of one thread
+ *
+ * @param capture Capture
+ * @param thread Thread number, unique among the writers
+ * @return Writer, or NULL on error
+ */
+PGCaptureWriter *pg_capture_writer_create(PGCapture *capture, int thread) {
+    PGCaptureWriter *writer = (PGCaptureWriter *)calloc(1, sizeof(PGCaptureWriter));
+    if (!writer) {
+        return NULL;
+    }
+    writer->capture = capture;
+    writer->thread = thread;
+    return writer;
+}
+
+/**
+ * Destroy a writer; what it recorded stays in the file
+ *
+ * @param writer Writer
+ */
+void pg_capture_writer_destroy(PGCaptureWriter *writer) {
+    if (writer) {
+        if (writer->segment) {
+            munmap(writer->segment, CAPTURE_SEGMENT_SIZE);
+        }
+        free(writer);
+    }
+}
+
+// Claim and map the next free segment of the file for the writer
+static int pg_capture_next_segment(PGCaptureWriter *writer) {
+    PGCapture *capture = writer->capture;
+
+    if (writer->segment) {
+        munmap(writer->segment, CAPTURE_SEGMENT_SIZE);
+        writer->segment = NULL;
+    }
+
+    uint64_t index = atomic_fetch_add(&capture->next_segment, 1);
+    off_t offset = CAPTURE_HEADER_SIZE + (off_t)index * CAPTURE_SEGMENT_SIZE;
+
+    // Unlike ftruncate, this never shrinks the file under another writer
+    int rc = posix_fallocate(capture->fd, offset, CAPTURE_SEGMENT_SIZE);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    void *map = mmap(NULL, CAPTURE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, offset);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    writer->segment = (PGCaptureSegment *)map;
+    writer->segment->thread = (uint32_t)writer->thread;
+    writer->segment->sequence = writer->sequence++;
+    atomic_store_explicit(&writer->segment->used, 0, memory_order_relaxed);
+    atomic_store_explicit(&writer->segment->magic, CAPTURE_SEGMENT_MAGIC, memory_order_release);
+    writer->used = 0;
+    return 0;
+}
+
+/**
+ * Record bytes gathered from several pieces
+ *
+ * A writer that fails (the disk is full) logs it once and records nothing
+ * more; the server keeps running.
+ *
+ * @param writer Writer of the calling thread
+ * @param conn Connection id from pg_capture_connect
+ * @param kind PG_CAPTURE_*
+ * @param iov Pieces
+ * @param iovcnt Number of pieces
+ * @param length Bytes to take from the pieces, at most their total
+ */
+void pg_capture_writev(PGCaptureWriter *writer, uint64_t conn, int kind,
+                       const struct iovec *iov, int iovcnt, size_t length) {
+    const size_t capacity = CAPTURE_SEGMENT_SIZE - sizeof(PGCaptureSegment);
+    int index = 0;
+    size_t consumed = 0;   // bytes of iov[index] already recorded
+
+    if (writer->failed) {
+        return;
+    }
+
+    PGCaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = (uint8_t)kind;
+    record.conn = conn;
+    record.time = pg_metrics_now() - writer->capture->start;
+
+    do {
+        size_t space = writer->segment ? capacity - writer->used : 0;
+        if (space < sizeof(record) + (length > 0 ? 8 : 0)) {
+            if (pg_capture_next_segment(writer) < 0) {
+                pg_log_warning("Capture stopped: %s", strerror(errno));
+                writer->failed = true;
+                return;
+            }
+            space = capacity;
+        }
+
+        size_t piece = length < space - sizeof(record) ? length : space - sizeof(record);
+        char *dst = (char *)(writer->segment + 1) + writer->used;
+
+        record.length = (uint32_t)piece;
+        memcpy(dst, &record, sizeof(record));
+        dst += sizeof(record);
+
+        for (size_t left = piece; left > 0 && index < iovcnt;) {
+            size_t take = iov[index].iov_len - consumed;
+            if (take > left) take = left;
+            memcpy(dst, (const char *)iov[index].iov_base + consumed, take);
+            dst += take;
+            left -= take;
+            consumed += take;
+            if (consumed == iov[index].iov_len) {
+                index++;
+                consumed = 0;
+            }
+        }
+        memset(dst, 0, CAPTURE_PAD(piece) - piece);
+
+        writer->used += sizeof(record) + CAPTURE_PAD(piece);
+        atomic_store_explicit(&writer->segment->used, writer->used, memory_order_release);
+        length -= piece;
+    } while (length > 0);
+}
+
+/**
+ * Record bytes
+ *
+ * @param writer Writer of the calling thread
+ * @param conn Connection id from pg_capture_connect
+ * @param kind PG_CAPTURE_*
+ * @param data Bytes
+ * @param length Number of bytes
+ */
+void pg_capture_write(PGCaptureWriter *writer, uint64_t conn, int kind, const void *data, size_t length) {
+    struct iovec iov = {(void *)data, length};
+    pg_capture_writev(writer, conn, kind, &iov, 1, length);
+}
+
+/**
+ * Record a new connection
+ *
+ * @param writer Writer of the calling thread
+ * @return Id to record the connection's traffic under
+ */
+uint64_t pg_capture_connect(PGCaptureWriter *writer) {
+    uint64_t conn = ((uint64_t)(writer->thread + 1) << 40) | ++writer->next_conn;
+    pg_capture_writev(writer, conn, PG_CAPTURE_CONNECT, NULL, 0, 0);
+    return conn;
+}
+
+/**
+ * Record the end of a connection
+ *
+ * @param writer Writer of the calling thread
+ * @param conn Connection id from pg_capture_connect
+ */
+void pg_capture_close(PGCaptureWriter *writer, uint64_t conn) {
+    pg_capture_writev(writer, conn, PG_CAPTURE_CLOSE, NULL, 0, 0);
+}
+
+static int pg_capture_compare_segments(const void *a, const void *b) {
+    const PGCaptureSegment *x = *(const PGCaptureSegment *const *)a;
+    const PGCaptureSegment *y = *(const PGCaptureSegment *const *)b;
+    return x->sequence < y->sequence ? -1 : x->sequence > y->sequence;
+}
+
+/**
+ * Open a capture file for reading
+ *
+ * @param path File path
+ * @return Reader, or NULL if the file cannot be read or is not a capture
+ */
+PGCaptureReader *pg_capture_reader_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < CAPTURE_HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    char *map = (char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const PGCaptureFileHeader *header = (const PGCaptureFileHeader *)map;
+    if (memcmp(header->magic, PG_CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PG_CAPTURE_VERSION ||
+        header->segment_size <= sizeof(PGCaptureSegment) || header->segment_size % 8 != 0) {
+        munmap(map, (size_t)st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    PGCaptureReader *reader = (PGCaptureReader *)calloc(1, sizeof(PGCaptureReader));
+    if (!reader) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    reader->map = map;
+    reader->size = (size_t)st.st_size;
+
+    // Segments claimed but never written are left out
+    size_t segment_size = header->segment_size;
+    size_t num_segments = (reader->size - CAPTURE_HEADER_SIZE) / segment_size;
+    for (size_t i = 0; i < num_segments; i++) {
+        const PGCaptureSegment *segment = (const PGCaptureSegment *)(map + CAPTURE_HEADER_SIZE + i * segment_size);
+        if (atomic_load_explicit(&segment->magic, memory_order_acquire) != CAPTURE_SEGMENT_MAGIC) {
+            continue;
+        }
+        if ((int)segment->thread >= reader->num_streams) {
+            int count = (int)segment->thread + 1;
+            PGCaptureStream *streams = (PGCaptureStream *)realloc(reader->streams, count * sizeof(PGCaptureStream));
+            if (!streams) {
+                pg_capture_reader_close(reader);
+                return NULL;
+            }
+            memset(streams + reader->num_streams, 0, (count - reader->num_streams) * sizeof(PGCaptureStream));
+            reader->streams = streams;
+            reader->num_streams = count;
+        }
+
+        PGCaptureStream *stream = &reader->streams[segment->thread];
+        const PGCaptureSegment **segments = (const PGCaptureSegment **)realloc(
+            (void *)stream->segments, (stream->num_segments + 1) * sizeof(PGCaptureSegment *));
+        if (!segments) {
+            pg_capture_reader_close(reader);
+            return NULL;
+        }
+        segments[stream->num_segments++] = segment;
+        stream->segments = segments;
+    }
+
+    for (int i = 0; i < reader->num_streams; i++) {
+        qsort((void *)reader->streams[i].segments, reader->streams[i].num_segments,
+              sizeof(PGCaptureSegment *), pg_capture_compare_segments);
+    }
+    return reader;
+}
+
+// Next record of a thread, or NULL at its end
+static const PGCaptureRecord *pg_capture_peek(PGCaptureStream *stream) {
+    while (stream->current < stream->num_segments) {
+        const PGCaptureSegment *segment = stream->segments[stream->current];
+        if (stream->offset < atomic_load_explicit(&segment->used, memory_order_acquire)) {
+            return (const PGCaptureRecord *)((const char *)(segment + 1) + stream->offset);
+        }
+        stream->current++;
+        stream->offset = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Read the next record in time order
+ *
+ * @param reader Reader
+ * @param record Receives the record header
+ * @param payload Receives a pointer to the payload, valid until the reader is closed
+ * @return 1 if a record was read, 0 at the end, -1 if the file is damaged
+ */
+int pg_capture_reader_next(PGCaptureReader *reader, PGCaptureRecord *record, const char **payload) {
+    const PGCaptureRecord *best = NULL;
+    PGCaptureStream *from = NULL;
+
+    // Each thread's records are in time order; take the earliest among them
+    for (int i = 0; i < reader->num_streams; i++) {
+        const PGCaptureRecord *next = pg_capture_peek(&reader->streams[i]);
+        if (next && (!best || next->time < best->time)) {
+            best = next;
+            from = &reader->streams[i];
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+
+    const PGCaptureSegment *segment = from->segments[from->current];
+    size_t used = atomic_load_explicit(&segment->used, memory_order_acquire);
+    size_t size = sizeof(PGCaptureRecord) + CAPTURE_PAD((size_t)best->length);
+    if (from->offset + size > used ||
+        (const char *)(segment + 1) + used > reader->map + reader->size) {
+        return -1;
+    }
+
+    memcpy(record, best, sizeof(*record));
+    *payload = (const char *)(best + 1);
+    from->offset += size;
+    return 1;
+}
+
+/**
+ * Close a reader
+ *
+ * @param reader Reader
+ */
+void pg_capture_reader_close(PGCaptureReader *reader) {
+    if (reader) {
+        for (int i = 0; i < reader->num_streams; i++) {
+            free((void *)reader->streams[i].segments);
+        }
+        free(reader->streams);
+        munmap(reader->map, reader->size);
+        free(reader);
+    }
+}
@@ -0,0 +1,61 @@
+/**
+ * pg_capture.h
+ * Wire Traffic Capture
+ *
+ * This file contains declarations for recording the bytes exchanged with
+ * clients into a memory-mapped binary file, and for reading them back.
+ * The file is a header followed by fixed-size segments; each worker thread
+ * claims whole segments with one atomic increment and appends
+ * length-prefixed records to its own, so recording takes no locks and no
+ * system calls except when a segment fills up. Records carry the
+ * connection id and a monotonic timestamp; the reader merges the segments
+ * of all threads back into time order.
+ */
+
+#ifndef PG_CAPTURE_H
+#define PG_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define PG_CAPTURE_MAGIC "PGCAPT01"
+#define PG_CAPTURE_VERSION 1
+
+/* Record kinds */
+#define PG_CAPTURE_CONNECT 'C'   /* A connection was accepted (no payload) */
+#define PG_CAPTURE_CLIENT  'F'   /* Bytes received from the client (after TLS decryption) */
+#define PG_CAPTURE_SERVER  'B'   /* Bytes written to the client (before TLS encryption) */
+#define PG_CAPTURE_CLOSE   'X'   /* The connection was closed (no payload) */
+
+/* Header of every record, followed by length payload bytes and padding to
+   a multiple of 8. Integers are in host byte order. */
+typedef struct {
+    uint32_t length;         /* Payload bytes */
+    uint8_t kind;            /* PG_CAPTURE_* */
+    uint8_t reserved[3];
+    uint64_t conn;           /* Connection id, unique within the file */
+    uint64_t time;           /* Nanoseconds since the capture was started */
+} PGCaptureRecord;
+
+typedef struct PGCapture PGCapture;
+typedef struct PGCaptureWriter PGCaptureWriter;
+typedef struct PGCaptureReader PGCaptureReader;
+
+/* Function declarations */
+PGCapture *pg_capture_create(const char *path);
+void pg_capture_destroy(PGCapture *capture);
+
+PGCaptureWriter *pg_capture_writer_create(PGCapture *capture, int thread);
+void pg_capture_writer_destroy(PGCaptureWriter *writer);
+uint64_t pg_capture_connect(PGCaptureWriter *writer);
+void pg_capture_close(PGCaptureWriter *writer, uint64_t conn);
+void pg_capture_write(PGCaptureWriter *writer, uint64_t conn, int kind, const void *data, size_t length);
+void pg_capture_writev(PGCaptureWriter *writer, uint64_t conn, int kind,
+                       const struct iovec *iov, int iovcnt, size_t length);
+
+PGCaptureReader *pg_capture_reader_open(const char *path);
+int pg_capture_reader_next(PGCaptureReader *reader, PGCaptureRecord *record, const char **payload);
+void pg_capture_reader_close(PGCaptureReader *reader);
+
+#endif /* PG_CAPTURE_H */
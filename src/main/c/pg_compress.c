@@ -0,0 +1,382 @@
+/**
+ * pg_compress.c
+ * Result Stream Compression
+ *
+ * This file contains the implementation of the compressed streams declared
+ * in pg_compress.h. LZ4 uses the frame format with linked blocks, so each
+ * flush can refer back to data compressed before it; zstd uses a streaming
+ * context at a fast level with a window sized for result batches. Both
+ * flush at the end of every call, which ends the CompressedData message.
+ */
+
+#include "pg_compress.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef PG_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef PG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZSTD_LEVEL 1
+#define ZSTD_WINDOW_LOG 17          // 128 kB of history
+#define DECOMPRESS_CHUNK 65536      // output reserved per decompression step
+
+struct PGCompressor {
+    PGCompressAlgorithm algorithm;
+#ifdef PG_HAVE_LZ4
+    LZ4F_cctx *lz4;
+    LZ4F_preferences_t lz4_prefs;
+    bool lz4_started;               // The frame header went out
+#endif
+#ifdef PG_HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+struct PGDecompressor {
+    PGCompressAlgorithm algorithm;
+#ifdef PG_HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+#ifdef PG_HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+};
+
+static const struct {
+    const char *name;
+    PGCompressAlgorithm algorithm;
+} pg_compress_algorithms[] = {
+#ifdef PG_HAVE_ZSTD
+    {"zstd", PG_COMPRESS_ZSTD},
+#endif
+#ifdef PG_HAVE_LZ4
+    {"lz4", PG_COMPRESS_LZ4},
+#endif
+    {"none", PG_COMPRESS_NONE}
+};
+
+#define NUM_ALGORITHMS (sizeof(pg_compress_algorithms) / sizeof(pg_compress_algorithms[0]))
+
+/**
+ * Look up an algorithm this build supports by name
+ *
+ * @param name Algorithm name (lz4, zstd or none)
+ * @param algorithm Set to the algorithm
+ * @return 0 on success, -1 if it is unknown or not compiled in
+ */
+int pg_compress_parse(const char *name, PGCompressAlgorithm *algorithm) {
+    for (size_t i = 0; i < NUM_ALGORITHMS; i++) {
+        if (strcmp(name, pg_compress_algorithms[i].name) == 0) {
+            *algorithm = pg_compress_algorithms[i].algorithm;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Pick the algorithm for a connection from the client's list
+ *
+ * @param requested Comma-separated algorithm names, most preferred first
+ * @return First one this build supports, or PG_COMPRESS_NONE
+ */
+PGCompressAlgorithm pg_compress_choose(const char *requested) {
+    const char *p = requested;
+
+    while (*p) {
+        size_t n = strcspn(p, ",");
+        char name[16];
+        PGCompressAlgorithm algorithm;
+
+        while (n > 0 && *p == ' ') {
+            p++;
+            n--;
+        }
+        if (n < sizeof(name)) {
+            memcpy(name, p, n);
+            name[n] = '\0';
+            if (pg_compress_parse(name, &algorithm) == 0) {
+                return algorithm;
+            }
+        }
+        p += n;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return PG_COMPRESS_NONE;
+}
+
+/**
+ * Get the name of an algorithm
+ *
+ * @param algorithm Algorithm
+ * @return Name as used in _pq_.compression
+ */
+const char *pg_compress_name(PGCompressAlgorithm algorithm) {
+    switch (algorithm) {
+        case PG_COMPRESS_LZ4: return "lz4";
+        case PG_COMPRESS_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+/**
+ * List the algorithms this build supports, for logs and usage text
+ *
+ * @return Comma-separated names
+ */
+const char *pg_compress_supported(void) {
+#if defined(PG_HAVE_ZSTD) && defined(PG_HAVE_LZ4)
+    return "zstd,lz4";
+#elif defined(PG_HAVE_ZSTD)
+    return "zstd";
+#elif defined(PG_HAVE_LZ4)
+    return "lz4";
+#else
+    return "none";
+#endif
+}
+
+/**
+ * Start the sending side of a compressed stream
+ *
+ * @param algorithm Algorithm
+ * @return Compressor, or NULL on error or for PG_COMPRESS_NONE
+ */
+PGCompressor *pg_compressor_create(PGCompressAlgorithm algorithm) {
+    PGCompressor *compressor = (PGCompressor *)calloc(1, sizeof(PGCompressor));
+    if (!compressor) {
+        return NULL;
+    }
+    compressor->algorithm = algorithm;
+
+    switch (algorithm) {
+#ifdef PG_HAVE_LZ4
+        case PG_COMPRESS_LZ4:
+            if (LZ4F_isError(LZ4F_createCompressionContext(&compressor->lz4, LZ4F_VERSION))) {
+                break;
+            }
+            compressor->lz4_prefs.frameInfo.blockMode = LZ4F_blockLinked;
+            compressor->lz4_prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+            compressor->lz4_prefs.autoFlush = 1;
+            return compressor;
+#endif
+#ifdef PG_HAVE_ZSTD
+        case PG_COMPRESS_ZSTD:
+            compressor->zstd = ZSTD_createCCtx();
+            if (!compressor->zstd ||
+                ZSTD_isError(ZSTD_CCtx_setParameter(compressor->zstd, ZSTD_c_compressionLevel, ZSTD_LEVEL)) ||
+                ZSTD_isError(ZSTD_CCtx_setParameter(compressor->zstd, ZSTD_c_windowLog, ZSTD_WINDOW_LOG))) {
+                break;
+            }
+            return compressor;
+#endif
+        default:
+            break;
+    }
+    pg_compressor_destroy(compressor);
+    return NULL;
+}
+
+/**
+ * Release a compressor
+ *
+ * @param compressor Compressor (may be NULL)
+ */
+void pg_compressor_destroy(PGCompressor *compressor) {
+    if (!compressor) {
+        return;
+    }
+#ifdef PG_HAVE_LZ4
+    if (compressor->lz4) {
+        LZ4F_freeCompressionContext(compressor->lz4);
+    }
+#endif
+#ifdef PG_HAVE_ZSTD
+    ZSTD_freeCCtx(compressor->zstd);
+#endif
+    free(compressor);
+}
+
+/**
+ * Compress bytes and flush, appending the output to a buffer
+ *
+ * @param compressor Compressor
+ * @param data Bytes to compress
+ * @param length Number of bytes
+ * @param out Buffer the compressed bytes are appended to
+ * @return 0 on success, -1 on error
+ */
+int pg_compressor_compress(PGCompressor *compressor, const char *data, size_t length, PGBuffer *out) {
+    switch (compressor->algorithm) {
+#ifdef PG_HAVE_LZ4
+        case PG_COMPRESS_LZ4: {
+            size_t bound = LZ4F_compressBound(length, &compressor->lz4_prefs) + LZ4F_HEADER_SIZE_MAX;
+            if (pg_buffer_reserve(out, bound) < 0) {
+                return -1;
+            }
+            char *dst = pg_buffer_write_ptr(out);
+            size_t written = 0;
+            size_t n;
+
+            if (!compressor->lz4_started) {
+                n = LZ4F_compressBegin(compressor->lz4, dst, bound, &compressor->lz4_prefs);
+                if (LZ4F_isError(n)) return -1;
+                written += n;
+                compressor->lz4_started = true;
+            }
+            n = LZ4F_compressUpdate(compressor->lz4, dst + written, bound - written, data, length, NULL);
+            if (LZ4F_isError(n)) return -1;
+            written += n;
+            n = LZ4F_flush(compressor->lz4, dst + written, bound - written, NULL);
+            if (LZ4F_isError(n)) return -1;
+            written += n;
+            pg_buffer_commit(out, written);
+            return 0;
+        }
+#endif
+#ifdef PG_HAVE_ZSTD
+        case PG_COMPRESS_ZSTD: {
+            ZSTD_inBuffer input = {data, length, 0};
+            size_t remaining;
+
+            do {
+                if (pg_buffer_reserve(out, ZSTD_compressBound(length - input.pos) + 64) < 0) {
+                    return -1;
+                }
+                ZSTD_outBuffer output = {pg_buffer_write_ptr(out), pg_buffer_writable(out), 0};
+                remaining = ZSTD_compressStream2(compressor->zstd, &output, &input, ZSTD_e_flush);
+                if (ZSTD_isError(remaining)) return -1;
+                pg_buffer_commit(out, output.pos);
+            } while (remaining > 0);
+            return 0;
+        }
+#endif
+        default:
+            (void)data;
+            (void)length;
+            (void)out;
+            return -1;
+    }
+}
+
+/**
+ * Start the receiving side of a compressed stream
+ *
+ * @param algorithm Algorithm
+ * @return Decompressor, or NULL on error or for PG_COMPRESS_NONE
+ */
+PGDecompressor *pg_decompressor_create(PGCompressAlgorithm algorithm) {
+    PGDecompressor *decompressor = (PGDecompressor *)calloc(1, sizeof(PGDecompressor));
+    if (!decompressor) {
+        return NULL;
+    }
+    decompressor->algorithm = algorithm;
+
+    switch (algorithm) {
+#ifdef PG_HAVE_LZ4
+        case PG_COMPRESS_LZ4:
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&decompressor->lz4, LZ4F_VERSION))) {
+                break;
+            }
+            return decompressor;
+#endif
+#ifdef PG_HAVE_ZSTD
+        case PG_COMPRESS_ZSTD:
+            decompressor->zstd = ZSTD_createDCtx();
+            if (!decompressor->zstd) {
+                break;
+            }
+            return decompressor;
+#endif
+        default:
+            break;
+    }
+    pg_decompressor_destroy(decompressor);
+    return NULL;
+}
+
+/**
+ * Release a decompressor
+ *
+ * @param decompressor Decompressor (may be NULL)
+ */
+void pg_decompressor_destroy(PGDecompressor *decompressor) {
+    if (!decompressor) {
+        return;
+    }
+#ifdef PG_HAVE_LZ4
+    if (decompressor->lz4) {
+        LZ4F_freeDecompressionContext(decompressor->lz4);
+    }
+#endif
+#ifdef PG_HAVE_ZSTD
+    ZSTD_freeDCtx(decompressor->zstd);
+#endif
+    free(decompressor);
+}
+
+/**
+ * Decompress the payload of one CompressedData message, appending the
+ * messages it held to a buffer
+ *
+ * @param decompressor Decompressor
+ * @param data Compressed bytes
+ * @param length Number of bytes
+ * @param out Buffer the decompressed bytes are appended to
+ * @return 0 on success, -1 on error
+ */
+int pg_decompressor_decompress(PGDecompressor *decompressor, const char *data, size_t length, PGBuffer *out) {
+    switch (decompressor->algorithm) {
+#ifdef PG_HAVE_LZ4
+        case PG_COMPRESS_LZ4: {
+            size_t offset = 0;
+
+            // Ends when the input is used up and nothing more is produced
+            for (;;) {
+                if (pg_buffer_reserve(out, DECOMPRESS_CHUNK) < 0) {
+                    return -1;
+                }
+                size_t produced = pg_buffer_writable(out);
+                size_t consumed = length - offset;
+                size_t hint = LZ4F_decompress(decompressor->lz4, pg_buffer_write_ptr(out), &produced,
+                                              data + offset, &consumed, NULL);
+                if (LZ4F_isError(hint)) return -1;
+                pg_buffer_commit(out, produced);
+                offset += consumed;
+                if (offset == length && produced == 0) {
+                    return 0;
+                }
+            }
+        }
+#endif
+#ifdef PG_HAVE_ZSTD
+        case PG_COMPRESS_ZSTD: {
+            ZSTD_inBuffer input = {data, length, 0};
+
+            // A full output may hide more flushed data, so go on until it is not
+            for (;;) {
+                if (pg_buffer_reserve(out, DECOMPRESS_CHUNK) < 0) {
+                    return -1;
+                }
+                ZSTD_outBuffer output = {pg_buffer_write_ptr(out), pg_buffer_writable(out), 0};
+                size_t result = ZSTD_decompressStream(decompressor->zstd, &output, &input);
+                if (ZSTD_isError(result)) return -1;
+                pg_buffer_commit(out, output.pos);
+                if (input.pos == input.size && output.pos < output.size) {
+                    return 0;
+                }
+            }
+        }
+#endif
+        default:
+            (void)data;
+            (void)length;
+            (void)out;
+            return -1;
+    }
+}
@@ -0,0 +1,56 @@
+/**
+ * pg_compress.h
+ * Result Stream Compression
+ *
+ * This file contains declarations for the _pq_.compression protocol
+ * extension. A client lists the algorithms it accepts in the
+ * _pq_.compression startup parameter; the server picks the first one it
+ * was built with and reports it in a ParameterStatus of the same name.
+ * From then on it may replace runs of DataRow and CopyData messages with
+ * CompressedData ('z') messages, whose payload decompresses to the
+ * original messages. All CompressedData messages of a connection form one
+ * continuous stream, each ending at a flush point, so a message can be
+ * decompressed as soon as it arrives and later ones reuse the history of
+ * earlier ones. Every other message is sent as it is.
+ *
+ * Algorithms are compiled in with the Makefile's LZ4=1 and ZSTD=1.
+ */
+
+#ifndef PG_COMPRESS_H
+#define PG_COMPRESS_H
+
+#include "pg_buffer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Name of the startup parameter and ParameterStatus */
+#define PG_COMPRESSION_OPTION "_pq_.compression"
+
+/* Compression algorithms */
+typedef enum {
+    PG_COMPRESS_NONE = 0,
+    PG_COMPRESS_LZ4,
+    PG_COMPRESS_ZSTD
+} PGCompressAlgorithm;
+
+/* Sending side of a compressed stream */
+typedef struct PGCompressor PGCompressor;
+
+/* Receiving side of a compressed stream */
+typedef struct PGDecompressor PGDecompressor;
+
+/* Function declarations */
+PGCompressAlgorithm pg_compress_choose(const char *requested);
+const char *pg_compress_name(PGCompressAlgorithm algorithm);
+int pg_compress_parse(const char *name, PGCompressAlgorithm *algorithm);
+const char *pg_compress_supported(void);
+
+PGCompressor *pg_compressor_create(PGCompressAlgorithm algorithm);
+void pg_compressor_destroy(PGCompressor *compressor);
+int pg_compressor_compress(PGCompressor *compressor, const char *data, size_t length, PGBuffer *out);
+
+PGDecompressor *pg_decompressor_create(PGCompressAlgorithm algorithm);
+void pg_decompressor_destroy(PGDecompressor *decompressor);
+int pg_decompressor_decompress(PGDecompressor *decompressor, const char *data, size_t length, PGBuffer *out);
+
+#endif /* PG_COMPRESS_H */
@@ -0,0 +1,1429 @@
+/**
+ * pg_event.c
+ * Event Loop Backends
+ *
+ * This file contains the epoll, kqueue, io_uring and select()
+ * implementations of the readiness notification layer declared in
+ * pg_event.h. The io_uring backend also receives into a ring of buffers
+ * registered with the kernel (multishot receives) and sends from
+ * per-descriptor queues, one send in flight per descriptor.
+ */
+
+#include "pg_event.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#define PG_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+#if defined(PG_HAVE_EPOLL) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(IORING_ENTER_EXT_ARG) && defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define PG_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#define PG_HAVE_KQUEUE 1
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#define PG_EVENT_NATIVE_BATCH 256
+
+#ifdef PG_HAVE_IO_URING
+#define PG_URING_SQ_ENTRIES 256
+#define PG_URING_CQ_ENTRIES 4096
+#define PG_URING_CANCEL_TAG (~(uint64_t)0)   /* user_data of POLL_REMOVE and ASYNC_CANCEL requests */
+
+/* Receives fill buffers the kernel takes from a ring registered with it */
+#define PG_URING_RECV_BUFFERS 256            /* Must be a power of two */
+#define PG_URING_RECV_BUFFER_SIZE 8192
+#define PG_URING_RECV_GROUP 0
+
+/* Bytes pg_event_send holds for a descriptor before it reports EAGAIN; the
+ * descriptor is writable again once half of that has been sent */
+#define PG_URING_SEND_LIMIT (256 * 1024)
+#define PG_URING_SEND_MIN 16384              /* Smallest send buffer allocated */
+
+/* The top two bits of user_data tell requests apart. A send carries the
+ * address of its buffer, which leaves them clear */
+#define PG_URING_KIND_SHIFT 62
+#define PG_URING_KIND_SEND 0
+#define PG_URING_KIND_POLL 1
+#define PG_URING_KIND_RECV 2
+#define PG_URING_SERIAL_MASK 0x3fffffffu
+
+/* Receive request states */
+#define PG_URING_RECV_IDLE 0        /* None outstanding */
+#define PG_URING_RECV_ARMED 1       /* Multishot receive running */
+#define PG_URING_RECV_CANCELLED 2   /* Cancelled, last completion not reaped yet */
+
+/* Data queued for sending on a descriptor */
+typedef struct {
+    int fd;
+    size_t length;           /* Bytes in data */
+    size_t offset;           /* Bytes the kernel has sent */
+    size_t capacity;
+    char data[];
+} PGUringSend;
+
+/* Per-descriptor io_uring state */
+typedef struct {
+    int interest;            /* PG_EVENT_* the descriptor is watched for */
+    uint32_t gen;            /* Bumped whenever an armed poll is cancelled */
+    uint32_t reg;            /* Bumped on removal; stale receives are dropped */
+    uint8_t armed;           /* A poll request is outstanding in the kernel */
+    uint8_t queued;          /* On the re-arm list */
+    uint8_t recv;            /* PG_URING_RECV_* */
+    uint8_t completes;       /* Receives and sends go through the ring */
+    uint8_t send_armed;      /* The send request for sending is outstanding */
+    uint8_t writable;        /* On the writable list */
+    int send_error;          /* errno of a failed send, returned by pg_event_send */
+    PGUringSend *sending;    /* Buffer the kernel is sending from */
+    PGUringSend *unsent;     /* Data queued behind it */
+} PGUringFd;
+
+/* Submission and completion rings shared with the kernel */
+typedef struct {
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;              /* SQ and CQ rings (single mapping) */
+    size_t ring_size;
+    size_t sqes_size;
+
+    /* Receive buffers, handed to the kernel through buf_ring */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+    int completes;           /* Buffer ring registered: receives and sends available */
+    int recv_single;         /* The kernel rejected multishot receives */
+
+    /* Buffers reported by the last wait, given back by the next one */
+    unsigned short lent[PG_EVENT_NATIVE_BATCH];
+    int num_lent;
+
+    /* Poll state, indexed by descriptor */
+    PGUringFd *fds;
+    int fds_size;
+
+    /* Descriptors whose requests must be armed before the next wait */
+    int *rearm;
+    int num_rearm;
+
+    /* Sending descriptors watched for PG_EVENT_WRITE whose queue has room */
+    int *writable;
+    int num_writable;
+} PGUring;
+#endif
+
+/* Event loop state */
+struct PGEventLoop {
+    PGEventBackend backend;  /* Backend in use */
+    int fd;                  /* epoll/kqueue descriptor, -1 for select */
+
+    /* Events returned by the last wait; cleared on removal so that a
+     * descriptor closed while a batch is dispatched is not reported again */
+    PGEvent *pending;
+    int num_pending;
+
+#ifdef PG_HAVE_EPOLL
+    struct epoll_event epoll_events[PG_EVENT_NATIVE_BATCH];
+#endif
+#ifdef PG_HAVE_KQUEUE
+    struct kevent kqueue_events[PG_EVENT_NATIVE_BATCH];
+#endif
+#ifdef PG_HAVE_IO_URING
+    PGUring uring;
+#endif
+
+    /* Registered data pointers, indexed by descriptor */
+    void **data;
+    int data_size;
+
+    /* select() backend */
+    fd_set read_set;
+    fd_set write_set;
+    int max_fd;
+};
+
+static PGEventBackend pg_event_default_backend(void) {
+#if defined(PG_HAVE_EPOLL)
+    return PG_EVENT_BACKEND_EPOLL;
+#elif defined(PG_HAVE_KQUEUE)
+    return PG_EVENT_BACKEND_KQUEUE;
+#else
+    return PG_EVENT_BACKEND_SELECT;
+#endif
+}
+
+#ifdef PG_HAVE_IO_URING
+// Queue a receive buffer for the kernel; pg_uring_publish_buffers makes it visible
+static void pg_uring_give_buffer(PGUring *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (PG_URING_RECV_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * PG_URING_RECV_BUFFER_SIZE);
+    buf->len = PG_URING_RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+static void pg_uring_publish_buffers(PGUring *ring) {
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Register the buffers receives are done into. Kernels before 5.19 have no
+// buffer rings; the loop then only polls and pg_event_loop_completes is false
+static void pg_uring_setup_buffers(PGEventLoop *loop) {
+    PGUring *ring = &loop->uring;
+    struct io_uring_buf_reg reg;
+
+    ring->buf_ring_size = PG_URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    void *map = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    ring->buf_ring = (struct io_uring_buf_ring *)map;
+
+    ring->buffers = (char *)malloc((size_t)PG_URING_RECV_BUFFERS * PG_URING_RECV_BUFFER_SIZE);
+    if (!ring->buffers) {
+        return;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = PG_URING_RECV_BUFFERS;
+    reg.bgid = PG_URING_RECV_GROUP;
+    if (syscall(__NR_io_uring_register, loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return;
+    }
+
+    for (unsigned bid = 0; bid < PG_URING_RECV_BUFFERS; bid++) {
+        pg_uring_give_buffer(ring, (unsigned short)bid);
+    }
+    pg_uring_publish_buffers(ring);
+    ring->completes = 1;
+}
+
+// Map the rings of a new io_uring instance. Polls are one-shot and re-armed
+// by pg_uring_wait, which keeps the level-triggered semantics of epoll
+static int pg_uring_setup(PGEventLoop *loop) {
+    PGUring *ring = &loop->uring;
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = PG_URING_CQ_ENTRIES;
+#ifdef IORING_SETUP_COOP_TASKRUN
+    params.flags |= IORING_SETUP_COOP_TASKRUN;
+#endif
+
+    loop->fd = (int)syscall(__NR_io_uring_setup, PG_URING_SQ_ENTRIES, &params);
+#ifdef IORING_SETUP_COOP_TASKRUN
+    if (loop->fd < 0 && errno == EINVAL) {
+        params.flags &= ~IORING_SETUP_COOP_TASKRUN;   // kernels before 5.19
+        loop->fd = (int)syscall(__NR_io_uring_setup, PG_URING_SQ_ENTRIES, &params);
+    }
+#endif
+    if (loop->fd < 0) {
+        return -1;
+    }
+
+    // One wait must submit, sleep with a timeout and reap in a single call
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED) {
+        ring->ring = NULL;
+        return -1;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char *base = (char *)ring->ring;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    pg_uring_setup_buffers(loop);
+    return 0;
+}
+
+static void pg_uring_teardown(PGEventLoop *loop) {
+    PGUring *ring = &loop->uring;
+
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring) munmap(ring->ring, ring->ring_size);
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buffers);
+
+    // Buffers still being sent belong to the kernel until the ring is gone
+    for (int fd = 0; fd < ring->fds_size; fd++) {
+        free(ring->fds[fd].unsent);
+    }
+    free(ring->fds);
+    free(ring->rearm);
+    free(ring->writable);
+}
+
+// Submit queued requests, optionally waiting for at least one completion
+static int pg_uring_enter(PGEventLoop *loop, int wait, int timeout_ms) {
+    PGUring *ring = &loop->uring;
+    unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    if (!to_submit && !wait) {
+        return 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+
+    int result = (int)syscall(__NR_io_uring_enter, loop->fd, to_submit, wait ? 1 : 0,
+                              flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (result < 0 && (errno == ETIME || errno == EINTR)) {
+        return 0;
+    }
+    return result < 0 ? -1 : 0;
+}
+
+// Get the next free submission entry, flushing the queue when it is full
+static struct io_uring_sqe *pg_uring_sqe(PGEventLoop *loop) {
+    PGUring *ring = &loop->uring;
+
+    if (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (pg_uring_enter(loop, 0, 0) < 0) {
+            return NULL;
+        }
+        if (*ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[*ring->sq_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish the entry returned by pg_uring_sqe; the kernel sees it on the next enter
+static void pg_uring_push(PGEventLoop *loop) {
+    PGUring *ring = &loop->uring;
+    unsigned tail = *ring->sq_tail;
+
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t pg_uring_tag(int kind, uint32_t serial, int fd) {
+    return ((uint64_t)kind << PG_URING_KIND_SHIFT) |
+           ((uint64_t)(serial & PG_URING_SERIAL_MASK) << 32) | (uint32_t)fd;
+}
+
+static uint32_t pg_uring_tag_serial(uint64_t tag) {
+    return (uint32_t)(tag >> 32) & PG_URING_SERIAL_MASK;
+}
+
+// Grow the descriptor state and its lists to cover a descriptor
+static int pg_uring_reserve(PGEventLoop *loop, int fd) {
+    PGUring *ring = &loop->uring;
+
+    if (fd < ring->fds_size) {
+        return 0;
+    }
+
+    int new_size = ring->fds_size ? ring->fds_size : 64;
+    while (new_size <= fd) {
+        new_size *= 2;
+    }
+
+    PGUringFd *new_fds = (PGUringFd *)realloc(ring->fds, new_size * sizeof(PGUringFd));
+    if (!new_fds) {
+        return -1;
+    }
+    memset(new_fds + ring->fds_size, 0, (new_size - ring->fds_size) * sizeof(PGUringFd));
+    ring->fds = new_fds;
+
+    // Each descriptor is on a list at most once
+    int *new_rearm = (int *)realloc(ring->rearm, new_size * sizeof(int));
+    if (!new_rearm) {
+        return -1;
+    }
+    ring->rearm = new_rearm;
+
+    int *new_writable = (int *)realloc(ring->writable, new_size * sizeof(int));
+    if (!new_writable) {
+        return -1;
+    }
+    ring->writable = new_writable;
+    ring->fds_size = new_size;
+    return 0;
+}
+
+static void pg_uring_queue_rearm(PGUring *ring, int fd) {
+    if (!ring->fds[fd].queued) {
+        ring->fds[fd].queued = 1;
+        ring->rearm[ring->num_rearm++] = fd;
+    }
+}
+
+// Bytes accepted by pg_event_send that the kernel has not sent yet
+static size_t pg_uring_unsent(const PGUringFd *state) {
+    size_t length = 0;
+
+    if (state->sending) length += state->sending->length - state->sending->offset;
+    if (state->unsent) length += state->unsent->length;
+    return length;
+}
+
+static void pg_uring_queue_writable(PGUring *ring, int fd) {
+    PGUringFd *state = &ring->fds[fd];
+
+    if (!state->writable && pg_uring_unsent(state) <= PG_URING_SEND_LIMIT / 2) {
+        state->writable = 1;
+        ring->writable[ring->num_writable++] = fd;
+    }
+}
+
+// Readiness the kernel is polled for. A descriptor that sends through the
+// ring is writable while its queue has room, which the loop tracks itself
+static int pg_uring_polled(const PGUringFd *state, int events) {
+    int polled = events & (PG_EVENT_READ | PG_EVENT_WRITE);
+
+    if (state->completes) {
+        polled &= ~PG_EVENT_WRITE;
+    }
+    return polled;
+}
+
+// Cancel a request by its user_data; the cancel's own completion is ignored
+static int pg_uring_cancel(PGEventLoop *loop, int opcode, uint64_t tag) {
+    struct io_uring_sqe *sqe = pg_uring_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = tag;
+    sqe->user_data = PG_URING_CANCEL_TAG;
+    pg_uring_push(loop);
+    return 0;
+}
+
+// Change the interest of a descriptor. An armed poll with a different mask is
+// cancelled; the new one is armed by the next wait, so several changes to a
+// descriptor within one batch cost a single submission and no extra syscall.
+// A receive keeps running across changes that still ask for PG_EVENT_RECV
+static int pg_uring_set(PGEventLoop *loop, int fd, int events) {
+    PGUring *ring = &loop->uring;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if ((events & PG_EVENT_RECV) && !ring->completes) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (pg_uring_reserve(loop, fd) < 0) {
+        return -1;
+    }
+
+    PGUringFd *state = &ring->fds[fd];
+    if (events & PG_EVENT_RECV) {
+        state->completes = 1;
+    }
+
+    int polled = pg_uring_polled(state, events);
+    if (state->armed && pg_uring_polled(state, state->interest) != polled) {
+        if (pg_uring_cancel(loop, IORING_OP_POLL_REMOVE,
+                            pg_uring_tag(PG_URING_KIND_POLL, state->gen, fd)) < 0) {
+            return -1;
+        }
+        state->gen++;       // the cancelled poll's completion is now stale
+        state->armed = 0;
+    }
+
+    // The next receive is armed once the cancelled one has completed
+    if (state->recv == PG_URING_RECV_ARMED && !(events & PG_EVENT_RECV)) {
+        if (pg_uring_cancel(loop, IORING_OP_ASYNC_CANCEL,
+                            pg_uring_tag(PG_URING_KIND_RECV, state->reg, fd)) < 0) {
+            return -1;
+        }
+        state->recv = PG_URING_RECV_CANCELLED;
+    }
+
+    state->interest = events;
+    if ((polled && !state->armed) ||
+        ((events & PG_EVENT_RECV) && state->recv == PG_URING_RECV_IDLE)) {
+        pg_uring_queue_rearm(ring, fd);
+    }
+    if ((events & PG_EVENT_WRITE) && state->completes) {
+        pg_uring_queue_writable(ring, fd);
+    }
+    return 0;
+}
+
+// Submit what is left of the buffer being sent
+static int pg_uring_submit_send(PGEventLoop *loop, int fd, PGUringSend *send) {
+    struct io_uring_sqe *sqe = pg_uring_sqe(loop);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(send->data + send->offset);
+    sqe->len = (uint32_t)(send->length - send->offset);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)send;
+    pg_uring_push(loop);
+    return 0;
+}
+
+// Arm the poll, receive and send requests a descriptor is missing
+static int pg_uring_arm_fd(PGEventLoop *loop, int fd) {
+    PGUring *ring = &loop->uring;
+    PGUringFd *state = &ring->fds[fd];
+    int polled = pg_uring_polled(state, state->interest);
+
+    if (polled && !state->armed) {
+        struct io_uring_sqe *sqe = pg_uring_sqe(loop);
+        if (!sqe) {
+            return -1;
+        }
+
+        // poll32_events takes the epoll bit layout
+        uint32_t mask = 0;
+        if (polled & PG_EVENT_READ) mask |= EPOLLIN | EPOLLRDHUP;
+        if (polled & PG_EVENT_WRITE) mask |= EPOLLOUT;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        mask = (mask << 16) | (mask >> 16);
+#endif
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = mask;
+        sqe->user_data = pg_uring_tag(PG_URING_KIND_POLL, state->gen, fd);
+        pg_uring_push(loop);
+        state->armed = 1;
+    }
+
+    if ((state->interest & PG_EVENT_RECV) && state->recv == PG_URING_RECV_IDLE) {
+        struct io_uring_sqe *sqe = pg_uring_sqe(loop);
+        if (!sqe) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = PG_URING_RECV_GROUP;
+        sqe->ioprio = ring->recv_single ? 0 : IORING_RECV_MULTISHOT;
+        sqe->user_data = pg_uring_tag(PG_URING_KIND_RECV, state->reg, fd);
+        pg_uring_push(loop);
+        state->recv = PG_URING_RECV_ARMED;
+    }
+
+    // One send per descriptor is outstanding, which keeps the stream in order
+    if (!state->sending && state->unsent && state->unsent->length) {
+        state->sending = state->unsent;
+        state->unsent = NULL;
+    }
+    if (state->sending && !state->send_armed) {
+        if (pg_uring_submit_send(loop, fd, state->sending) < 0) {
+            return -1;
+        }
+        state->send_armed = 1;
+    }
+    return 0;
+}
+
+// Arm the missing requests of every descriptor on the re-arm list
+static int pg_uring_arm(PGEventLoop *loop) {
+    PGUring *ring = &loop->uring;
+
+    for (int i = 0; i < ring->num_rearm; i++) {
+        int fd = ring->rearm[i];
+
+        if (pg_uring_arm_fd(loop, fd) < 0) {
+            // Keep the rest queued for the next wait
+            memmove(ring->rearm, ring->rearm + i, (ring->num_rearm - i) * sizeof(int));
+            ring->num_rearm -= i;
+            return -1;
+        }
+        ring->fds[fd].queued = 0;
+    }
+
+    ring->num_rearm = 0;
+    return 0;
+}
+
+// A send completed. Its buffer is reused for the next one unless the
+// descriptor was removed, in which case nothing owns it any more
+static void pg_uring_sent(PGEventLoop *loop, PGUringSend *send, int res) {
+    PGUring *ring = &loop->uring;
+    int fd = send->fd;
+
+    if (fd >= ring->fds_size || ring->fds[fd].sending != send) {
+        free(send);
+        return;
+    }
+
+    PGUringFd *state = &ring->fds[fd];
+    state->send_armed = 0;
+
+    if (res > 0) {
+        send->offset += (size_t)res;
+    }
+
+    if (res <= 0 && res != -EAGAIN && res != -EINTR) {
+        // Everything queued is lost; the owner sees the error on its next send
+        state->send_error = res < 0 ? -res : EPIPE;
+        state->sending = NULL;
+        free(send);
+        free(state->unsent);
+        state->unsent = NULL;
+    } else if (send->offset < send->length) {
+        pg_uring_queue_rearm(ring, fd);
+        return;
+    } else {
+        state->sending = NULL;
+        if (!state->unsent) {
+            send->length = 0;
+            send->offset = 0;
+            state->unsent = send;
+        } else {
+            free(send);
+            pg_uring_queue_rearm(ring, fd);
+        }
+    }
+
+    if (state->interest & PG_EVENT_WRITE) {
+        pg_uring_queue_writable(ring, fd);
+    }
+}
+
+// Arm pending requests, submit them together with the wait, and reap
+// completions into events
+static int pg_uring_wait(PGEventLoop *loop, PGEvent *events, int max_events, int timeout_ms) {
+    PGUring *ring = &loop->uring;
+    int n = 0;
+
+    // Data reported by the previous wait has been consumed
+    if (ring->num_lent) {
+        for (int i = 0; i < ring->num_lent; i++) {
+            pg_uring_give_buffer(ring, ring->lent[i]);
+        }
+        ring->num_lent = 0;
+        pg_uring_publish_buffers(ring);
+    }
+
+    if (pg_uring_arm(loop) < 0) {
+        return -1;
+    }
+
+    // Sleep only if no completion is already waiting to be reaped
+    int idle = *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) &&
+               !ring->num_writable;
+    if (pg_uring_enter(loop, idle, timeout_ms) < 0) {
+        return -1;
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int returned = 0;
+
+    while (head != tail && n < max_events) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t tag = cqe->user_data;
+        head++;
+
+        if (tag == PG_URING_CANCEL_TAG) {
+            continue;
+        }
+
+        if ((tag >> PG_URING_KIND_SHIFT) == PG_URING_KIND_SEND) {
+            pg_uring_sent(loop, (PGUringSend *)(uintptr_t)tag, cqe->res);
+            continue;
+        }
+
+        int fd = (int)(uint32_t)tag;
+
+        if ((tag >> PG_URING_KIND_SHIFT) == PG_URING_KIND_RECV) {
+            int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+            if (fd >= ring->fds_size ||
+                (ring->fds[fd].reg & PG_URING_SERIAL_MASK) != pg_uring_tag_serial(tag)) {
+                if (bid >= 0) {
+                    pg_uring_give_buffer(ring, (unsigned short)bid);
+                    returned = 1;
+                }
+                continue;   // descriptor removed since the receive was armed
+            }
+
+            PGUringFd *state = &ring->fds[fd];
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                state->recv = PG_URING_RECV_IDLE;
+                if (state->interest & PG_EVENT_RECV) {
+                    pg_uring_queue_rearm(ring, fd);
+                }
+            }
+
+            // Out of buffers or cancelled: re-armed above if still wanted
+            if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+                continue;
+            }
+            if (cqe->res == -EINVAL && !ring->recv_single) {
+                ring->recv_single = 1;   // multishot receives need 6.0
+                continue;
+            }
+
+            events[n].fd = fd;
+            events[n].data = loop->data[fd];
+            events[n].events = PG_EVENT_RECV;
+            events[n].buffer = bid >= 0 ? ring->buffers + (size_t)bid * PG_URING_RECV_BUFFER_SIZE : NULL;
+            events[n].result = cqe->res;
+            if (bid >= 0) {
+                ring->lent[ring->num_lent++] = (unsigned short)bid;
+            }
+            n++;
+            continue;
+        }
+
+        if (fd >= ring->fds_size ||
+            (ring->fds[fd].gen & PG_URING_SERIAL_MASK) != pg_uring_tag_serial(tag)) {
+            continue;   // poll cancelled by a modify or remove
+        }
+
+        PGUringFd *state = &ring->fds[fd];
+        state->armed = 0;
+        pg_uring_queue_rearm(ring, fd);
+
+        events[n].fd = fd;
+        events[n].data = loop->data[fd];
+        events[n].events = 0;
+        if (cqe->res < 0) {
+            events[n].events = PG_EVENT_ERROR;
+        } else {
+            if (cqe->res & EPOLLIN) events[n].events |= PG_EVENT_READ;
+            if (cqe->res & EPOLLOUT) events[n].events |= PG_EVENT_WRITE;
+            if (cqe->res & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) events[n].events |= PG_EVENT_ERROR;
+        }
+        n++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if (returned) {
+        pg_uring_publish_buffers(ring);
+    }
+
+    // Descriptors that send through the ring are writable without asking the kernel
+    int kept = 0;
+    for (int i = 0; i < ring->num_writable; i++) {
+        int fd = ring->writable[i];
+        PGUringFd *state = &ring->fds[fd];
+
+        if (!(state->interest & PG_EVENT_WRITE) || !state->completes ||
+            pg_uring_unsent(state) > PG_URING_SEND_LIMIT / 2) {
+            state->writable = 0;
+        } else if (n < max_events) {
+            state->writable = 0;
+            events[n].fd = fd;
+            events[n].data = loop->data[fd];
+            events[n].events = PG_EVENT_WRITE;
+            n++;
+        } else {
+            ring->writable[kept++] = fd;
+        }
+    }
+    ring->num_writable = kept;
+    return n;
+}
+
+// Stop everything running for a descriptor about to be closed. Queued data
+// is still sent (the server closes connections right after an error
+// message), but only if no other send is in flight; the requests reach the
+// kernel here, while the descriptor is still open
+static int pg_uring_remove(PGEventLoop *loop, int fd) {
+    PGUring *ring = &loop->uring;
+
+    if (pg_uring_set(loop, fd, 0) < 0) {
+        return -1;
+    }
+
+    PGUringFd *state = &ring->fds[fd];
+    if (!state->completes) {
+        return 0;
+    }
+
+    if (!state->sending && state->unsent && state->unsent->length &&
+        pg_uring_submit_send(loop, fd, state->unsent) == 0) {
+        state->unsent = NULL;   // freed by its completion
+    }
+    free(state->unsent);
+    state->unsent = NULL;
+    state->sending = NULL;      // a send in flight is freed by its completion
+    state->send_armed = 0;
+    state->send_error = 0;
+    state->recv = PG_URING_RECV_IDLE;
+    state->completes = 0;
+    state->reg++;
+    return pg_uring_enter(loop, 0, 0);
+}
+
+static ssize_t pg_uring_send(PGEventLoop *loop, int fd, const struct iovec *iov, int iovcnt) {
+    PGUring *ring = &loop->uring;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (pg_uring_reserve(loop, fd) < 0) {
+        return -1;
+    }
+
+    PGUringFd *state = &ring->fds[fd];
+    if (state->send_error) {
+        errno = state->send_error;
+        return -1;
+    }
+
+    size_t queued = pg_uring_unsent(state);
+    if (queued >= PG_URING_SEND_LIMIT) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > PG_URING_SEND_LIMIT - queued) {
+        total = PG_URING_SEND_LIMIT - queued;
+    }
+
+    PGUringSend *send = state->unsent;
+    size_t used = send ? send->length : 0;
+    if (!send || send->capacity - used < total) {
+        size_t capacity = send ? send->capacity : 0;
+        if (capacity < PG_URING_SEND_MIN) {
+            capacity = PG_URING_SEND_MIN;
+        }
+        while (capacity < used + total) {
+            capacity *= 2;
+        }
+
+        send = (PGUringSend *)realloc(state->unsent, sizeof(PGUringSend) + capacity);
+        if (!send) {
+            return -1;
+        }
+        send->fd = fd;
+        send->length = used;
+        send->offset = 0;
+        send->capacity = capacity;
+        state->unsent = send;
+    }
+
+    size_t left = total;
+    for (int i = 0; i < iovcnt && left > 0; i++) {
+        size_t length = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(send->data + send->length, iov[i].iov_base, length);
+        send->length += length;
+        left -= length;
+    }
+
+    state->completes = 1;
+    if (!state->sending) {
+        pg_uring_queue_rearm(ring, fd);
+    }
+    return (ssize_t)total;
+}
+#endif
+
+/**
+ * Create an event loop
+ *
+ * @param backend Backend to use, PG_EVENT_BACKEND_AUTO picks the best one
+ * @return New event loop, or NULL if the backend is unavailable
+ */
+PGEventLoop *pg_event_loop_create(PGEventBackend backend) {
+    PGEventLoop *loop = (PGEventLoop *)calloc(1, sizeof(PGEventLoop));
+    if (!loop) {
+        return NULL;
+    }
+
+    if (backend == PG_EVENT_BACKEND_AUTO) {
+        backend = pg_event_default_backend();
+    }
+
+    loop->backend = backend;
+    loop->fd = -1;
+    loop->max_fd = -1;
+    FD_ZERO(&loop->read_set);
+    FD_ZERO(&loop->write_set);
+
+    switch (backend) {
+        case PG_EVENT_BACKEND_SELECT:
+            return loop;
+
+#ifdef PG_HAVE_EPOLL
+        case PG_EVENT_BACKEND_EPOLL:
+            loop->fd = epoll_create1(EPOLL_CLOEXEC);
+            break;
+#endif
+
+#ifdef PG_HAVE_KQUEUE
+        case PG_EVENT_BACKEND_KQUEUE:
+            loop->fd = kqueue();
+            break;
+#endif
+
+#ifdef PG_HAVE_IO_URING
+        case PG_EVENT_BACKEND_IO_URING:
+            if (pg_uring_setup(loop) < 0) {
+                int saved = errno;
+                pg_event_loop_destroy(loop);
+                errno = saved;
+                return NULL;
+            }
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    if (loop->fd < 0) {
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+/**
+ * Destroy an event loop
+ *
+ * Registered descriptors are not closed.
+ *
+ * @param loop Event loop
+ */
+void pg_event_loop_destroy(PGEventLoop *loop) {
+    if (loop) {
+#ifdef PG_HAVE_IO_URING
+        if (loop->backend == PG_EVENT_BACKEND_IO_URING) {
+            pg_uring_teardown(loop);
+        }
+#endif
+        if (loop->fd >= 0) {
+            close(loop->fd);
+        }
+        free(loop->data);
+        free(loop);
+    }
+}
+
+/**
+ * Get the backend an event loop is using
+ *
+ * @param loop Event loop
+ * @return Backend in use (never PG_EVENT_BACKEND_AUTO)
+ */
+PGEventBackend pg_event_loop_backend(const PGEventLoop *loop) {
+    return loop->backend;
+}
+
+/**
+ * Check whether an event loop can receive and send for its descriptors
+ *
+ * Only the io_uring backend can, and only on kernels with buffer rings
+ * (5.19 and later). Such a loop accepts PG_EVENT_RECV interest and
+ * pg_event_send.
+ *
+ * @param loop Event loop
+ * @return true if PG_EVENT_RECV and pg_event_send are available
+ */
+bool pg_event_loop_completes(const PGEventLoop *loop) {
+#ifdef PG_HAVE_IO_URING
+    if (loop->backend == PG_EVENT_BACKEND_IO_URING) {
+        return loop->uring.completes != 0;
+    }
+#endif
+    (void)loop;
+    return false;
+}
+
+// Remember the data pointer for a descriptor, growing the table as needed
+static int pg_event_set_data(PGEventLoop *loop, int fd, void *data) {
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (fd >= loop->data_size) {
+        int new_size = loop->data_size ? loop->data_size : 64;
+        while (new_size <= fd) {
+            new_size *= 2;
+        }
+
+        void **new_data = (void **)realloc(loop->data, new_size * sizeof(void *));
+        if (!new_data) {
+            return -1;
+        }
+        memset(new_data + loop->data_size, 0, (new_size - loop->data_size) * sizeof(void *));
+        loop->data = new_data;
+        loop->data_size = new_size;
+    }
+
+    loop->data[fd] = data;
+    return 0;
+}
+
+#ifdef PG_HAVE_EPOLL
+static int pg_epoll_ctl(PGEventLoop *loop, int op, int fd, int events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    if (events & PG_EVENT_READ) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (events & PG_EVENT_WRITE) ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+
+    return epoll_ctl(loop->fd, op, fd, &ev);
+}
+#endif
+
+#ifdef PG_HAVE_KQUEUE
+static int pg_kqueue_set(PGEventLoop *loop, int fd, int events) {
+    struct kevent changes[2];
+
+    EV_SET(&changes[0], fd, EVFILT_READ,
+           (events & PG_EVENT_READ) ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE, 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE,
+           (events & PG_EVENT_WRITE) ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE, 0, 0, NULL);
+
+    return kevent(loop->fd, changes, 2, NULL, 0, NULL);
+}
+#endif
+
+static int pg_select_set(PGEventLoop *loop, int fd, int events) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    FD_CLR(fd, &loop->read_set);
+    FD_CLR(fd, &loop->write_set);
+    if (events & PG_EVENT_READ) FD_SET(fd, &loop->read_set);
+    if (events & PG_EVENT_WRITE) FD_SET(fd, &loop->write_set);
+
+    if (fd > loop->max_fd) {
+        loop->max_fd = fd;
+    }
+    return 0;
+}
+
+/**
+ * Register a descriptor with an event loop
+ *
+ * @param loop Event loop
+ * @param fd File descriptor
+ * @param events PG_EVENT_READ and/or PG_EVENT_WRITE, or PG_EVENT_RECV in
+ *               place of PG_EVENT_READ (see pg_event_loop_completes)
+ * @param data Pointer reported back with ready events
+ * @return 0 on success, -1 on error
+ */
+int pg_event_add(PGEventLoop *loop, int fd, int events, void *data) {
+    int result;
+
+    if (pg_event_set_data(loop, fd, data) < 0) {
+        return -1;
+    }
+
+    switch (loop->backend) {
+#ifdef PG_HAVE_EPOLL
+        case PG_EVENT_BACKEND_EPOLL:
+            result = pg_epoll_ctl(loop, EPOLL_CTL_ADD, fd, events);
+            break;
+#endif
+#ifdef PG_HAVE_IO_URING
+        case PG_EVENT_BACKEND_IO_URING:
+            result = pg_uring_set(loop, fd, events);
+            break;
+#endif
+#ifdef PG_HAVE_KQUEUE
+        case PG_EVENT_BACKEND_KQUEUE:
+            result = pg_kqueue_set(loop, fd, events);
+            break;
+#endif
+        default:
+            result = pg_select_set(loop, fd, events);
+            break;
+    }
+
+    if (result < 0) {
+        loop->data[fd] = NULL;
+    }
+    return result;
+}
+
+/**
+ * Change the events a registered descriptor is watched for
+ *
+ * @param loop Event loop
+ * @param fd File descriptor
+ * @param events PG_EVENT_READ, PG_EVENT_RECV and/or PG_EVENT_WRITE, 0 to pause
+ * @param data Pointer reported back with ready events
+ * @return 0 on success, -1 on error
+ */
+int pg_event_modify(PGEventLoop *loop, int fd, int events, void *data) {
+    int result;
+
+    if (pg_event_set_data(loop, fd, data) < 0) {
+        return -1;
+    }
+
+    switch (loop->backend) {
+#ifdef PG_HAVE_EPOLL
+        case PG_EVENT_BACKEND_EPOLL:
+            result = pg_epoll_ctl(loop, EPOLL_CTL_MOD, fd, events);
+            break;
+#endif
+#ifdef PG_HAVE_IO_URING
+        case PG_EVENT_BACKEND_IO_URING:
+            result = pg_uring_set(loop, fd, events);
+            break;
+#endif
+#ifdef PG_HAVE_KQUEUE
+        case PG_EVENT_BACKEND_KQUEUE:
+            result = pg_kqueue_set(loop, fd, events);
+            break;
+#endif
+        default:
+            result = pg_select_set(loop, fd, events);
+            break;
+    }
+
+    if (result < 0) {
+        loop->data[fd] = NULL;
+    }
+    return result;
+}
+
+/**
+ * Unregister a descriptor from an event loop
+ *
+ * Must be called before the descriptor is closed. Any event for the
+ * descriptor still waiting to be dispatched from the current batch is
+ * cancelled (its events field is set to 0).
+ *
+ * @param loop Event loop
+ * @param fd File descriptor
+ * @return 0 on success, -1 on error
+ */
+int pg_event_remove(PGEventLoop *loop, int fd) {
+    int result = 0;
+
+    for (int i = 0; i < loop->num_pending; i++) {
+        if (loop->pending[i].fd == fd) {
+            loop->pending[i].events = 0;
+            loop->pending[i].data = NULL;
+        }
+    }
+
+    switch (loop->backend) {
+#ifdef PG_HAVE_EPOLL
+        case PG_EVENT_BACKEND_EPOLL: {
+            struct epoll_event ev;
+            result = epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, &ev);
+            break;
+        }
+#endif
+#ifdef PG_HAVE_IO_URING
+        case PG_EVENT_BACKEND_IO_URING:
+            result = pg_uring_remove(loop, fd);
+            break;
+#endif
+#ifdef PG_HAVE_KQUEUE
+        case PG_EVENT_BACKEND_KQUEUE: {
+            struct kevent changes[2];
+            EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+            EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+            result = kevent(loop->fd, changes, 2, NULL, 0, NULL);
+            break;
+        }
+#endif
+        default:
+            if (fd < 0 || fd >= FD_SETSIZE) {
+                errno = EINVAL;
+                return -1;
+            }
+            FD_CLR(fd, &loop->read_set);
+            FD_CLR(fd, &loop->write_set);
+            while (loop->max_fd >= 0 &&
+                   !FD_ISSET(loop->max_fd, &loop->read_set) &&
+                   !FD_ISSET(loop->max_fd, &loop->write_set)) {
+                loop->max_fd--;
+            }
+            break;
+    }
+
+    if (fd >= 0 && fd < loop->data_size) {
+        loop->data[fd] = NULL;
+    }
+    return result;
+}
+
+/**
+ * Wait for registered descriptors to become ready
+ *
+ * The cost of a wakeup is proportional to the number of ready descriptors
+ * for the epoll, kqueue and io_uring backends, and to the highest registered
+ * descriptor for the select() backend.
+ *
+ * @param loop Event loop
+ * @param events Array receiving ready descriptors
+ * @param max_events Size of the events array
+ * @param timeout_ms Timeout in milliseconds, -1 to wait forever
+ * @return Number of ready descriptors, 0 on timeout, -1 on error
+ */
+int pg_event_wait(PGEventLoop *loop, PGEvent *events, int max_events, int timeout_ms) {
+    int n = 0;
+
+    loop->pending = events;
+    loop->num_pending = 0;
+
+    if (max_events > PG_EVENT_NATIVE_BATCH) {
+        max_events = PG_EVENT_NATIVE_BATCH;
+    }
+
+    switch (loop->backend) {
+#ifdef PG_HAVE_EPOLL
+        case PG_EVENT_BACKEND_EPOLL:
+            n = epoll_wait(loop->fd, loop->epoll_events, max_events, timeout_ms);
+            for (int i = 0; i < n; i++) {
+                struct epoll_event *ev = &loop->epoll_events[i];
+                events[i].fd = ev->data.fd;
+                events[i].data = loop->data[ev->data.fd];
+                events[i].events = 0;
+                if (ev->events & EPOLLIN) events[i].events |= PG_EVENT_READ;
+                if (ev->events & EPOLLOUT) events[i].events |= PG_EVENT_WRITE;
+                if (ev->events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) events[i].events |= PG_EVENT_ERROR;
+            }
+            break;
+#endif
+
+#ifdef PG_HAVE_IO_URING
+        case PG_EVENT_BACKEND_IO_URING:
+            n = pg_uring_wait(loop, events, max_events, timeout_ms);
+            break;
+#endif
+
+#ifdef PG_HAVE_KQUEUE
+        case PG_EVENT_BACKEND_KQUEUE: {
+            struct timespec ts;
+            struct timespec *tsp = NULL;
+
+            if (timeout_ms >= 0) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+                tsp = &ts;
+            }
+
+            n = kevent(loop->fd, NULL, 0, loop->kqueue_events, max_events, tsp);
+            for (int i = 0; i < n; i++) {
+                struct kevent *kev = &loop->kqueue_events[i];
+                events[i].fd = (int)kev->ident;
+                events[i].data = loop->data[kev->ident];
+                events[i].events = (kev->filter == EVFILT_WRITE) ? PG_EVENT_WRITE : PG_EVENT_READ;
+                if (kev->flags & (EV_EOF | EV_ERROR)) {
+                    events[i].events |= PG_EVENT_ERROR;
+                }
+            }
+            break;
+        }
+#endif
+
+        default: {
+            fd_set read_fds = loop->read_set;
+            fd_set write_fds = loop->write_set;
+            struct timeval tv;
+            struct timeval *tvp = NULL;
+
+            if (timeout_ms >= 0) {
+                tv.tv_sec = timeout_ms / 1000;
+                tv.tv_usec = (timeout_ms % 1000) * 1000;
+                tvp = &tv;
+            }
+
+            int ready = select(loop->max_fd + 1, &read_fds, &write_fds, NULL, tvp);
+            if (ready <= 0) {
+                n = ready;
+                break;
+            }
+
+            for (int fd = 0; fd <= loop->max_fd && n < max_events; fd++) {
+                int mask = 0;
+                if (FD_ISSET(fd, &read_fds)) mask |= PG_EVENT_READ;
+                if (FD_ISSET(fd, &write_fds)) mask |= PG_EVENT_WRITE;
+                if (mask) {
+                    events[n].fd = fd;
+                    events[n].events = mask;
+                    events[n].data = loop->data[fd];
+                    n++;
+                }
+            }
+            break;
+        }
+    }
+
+    if (n > 0) {
+        loop->num_pending = n;
+    }
+    return n;
+}
+
+/**
+ * Queue data to be sent on a descriptor
+ *
+ * The data is copied and sent by the loop, in order, starting with the
+ * next wait. A descriptor watched for PG_EVENT_WRITE is reported writable
+ * once the queue has drained enough to take more. On removal, queued data
+ * is still sent unless an earlier send is in flight.
+ *
+ * @param loop Event loop (see pg_event_loop_completes)
+ * @param fd File descriptor
+ * @param iov Data to send
+ * @param iovcnt Number of entries in iov
+ * @return Bytes accepted, or -1 with errno set (EAGAIN if the queue is
+ *         full, or the error a previous send failed with)
+ */
+ssize_t pg_event_send(PGEventLoop *loop, int fd, const struct iovec *iov, int iovcnt) {
+#ifdef PG_HAVE_IO_URING
+    if (loop->backend == PG_EVENT_BACKEND_IO_URING && loop->uring.completes) {
+        return pg_uring_send(loop, fd, iov, iovcnt);
+    }
+#endif
+    (void)loop;
+    (void)fd;
+    (void)iov;
+    (void)iovcnt;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/**
+ * Check whether the loop still has requests running for a descriptor
+ *
+ * A descriptor that is not watched for PG_EVENT_RECV and has nothing left
+ * to send can be handed to another loop once this returns false.
+ *
+ * @param loop Event loop
+ * @param fd File descriptor
+ * @return true while a receive or send is outstanding or queued
+ */
+bool pg_event_busy(PGEventLoop *loop, int fd) {
+#ifdef PG_HAVE_IO_URING
+    if (loop->backend == PG_EVENT_BACKEND_IO_URING && fd >= 0 && fd < loop->uring.fds_size) {
+        const PGUringFd *state = &loop->uring.fds[fd];
+        return state->recv != PG_URING_RECV_IDLE || state->sending ||
+               (state->unsent && state->unsent->length);
+    }
+#endif
+    (void)loop;
+    (void)fd;
+    return false;
+}
+
+/**
+ * Get the name of an event loop backend
+ *
+ * @param backend Backend
+ * @return Backend name
+ */
+const char *pg_event_backend_name(PGEventBackend backend) {
+    switch (backend) {
+        case PG_EVENT_BACKEND_SELECT: return "select";
+        case PG_EVENT_BACKEND_EPOLL: return "epoll";
+        case PG_EVENT_BACKEND_KQUEUE: return "kqueue";
+        case PG_EVENT_BACKEND_IO_URING: return "io_uring";
+        default: return "auto";
+    }
+}
+
+/**
+ * Parse an event loop backend name
+ *
+ * @param name Backend name (auto, select, epoll, kqueue or io_uring)
+ * @param backend Output backend
+ * @return 0 on success, -1 if the name is unknown
+ */
+int pg_event_backend_parse(const char *name, PGEventBackend *backend) {
+    if (strcasecmp(name, "auto") == 0) {
+        *backend = PG_EVENT_BACKEND_AUTO;
+    } else if (strcasecmp(name, "select") == 0) {
+        *backend = PG_EVENT_BACKEND_SELECT;
+    } else if (strcasecmp(name, "epoll") == 0) {
+        *backend = PG_EVENT_BACKEND_EPOLL;
+    } else if (strcasecmp(name, "kqueue") == 0) {
+        *backend = PG_EVENT_BACKEND_KQUEUE;
+    } else if (strcasecmp(name, "io_uring") == 0) {
+        *backend = PG_EVENT_BACKEND_IO_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
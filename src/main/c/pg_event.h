@@ -0,0 +1,65 @@
+/**
+ * pg_event.h
+ * Event Loop Backends
+ *
+ * This file contains declarations for the readiness notification layer used
+ * by the server loop. Descriptors are registered once and only ready
+ * descriptors are reported back, using epoll on Linux, kqueue on BSD/macOS
+ * and select() as a portable fallback. On Linux, io_uring can be selected
+ * instead of epoll: interest changes are queued as poll requests and
+ * submitted with the wait, so one loop iteration is a single syscall.
+ * io_uring can also do the I/O itself: a descriptor watched for
+ * PG_EVENT_RECV gets the received data in its events, and
+ * pg_event_send queues data the ring sends with the next wait.
+ */
+
+#ifndef PG_EVENT_H
+#define PG_EVENT_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Event loop backends */
+typedef enum {
+    PG_EVENT_BACKEND_AUTO = 0,   /* Best backend available on this platform */
+    PG_EVENT_BACKEND_SELECT,     /* Portable select() fallback (FD_SETSIZE limited) */
+    PG_EVENT_BACKEND_EPOLL,      /* Linux epoll */
+    PG_EVENT_BACKEND_KQUEUE,     /* BSD/macOS kqueue */
+    PG_EVENT_BACKEND_IO_URING    /* Linux io_uring (never picked by AUTO) */
+} PGEventBackend;
+
+/* Interest and readiness flags */
+#define PG_EVENT_READ    0x01    /* Descriptor is readable */
+#define PG_EVENT_WRITE   0x02    /* Descriptor is writable */
+#define PG_EVENT_ERROR   0x04    /* Error or hangup (reported only) */
+#define PG_EVENT_RECV    0x08    /* Data received (see pg_event_loop_completes) */
+
+/* Ready descriptor reported by pg_event_wait */
+typedef struct {
+    int fd;                  /* Ready file descriptor */
+    int events;              /* PG_EVENT_* flags, 0 if cancelled */
+    void *data;              /* Pointer registered with the descriptor */
+    const char *buffer;      /* PG_EVENT_RECV: received data, valid until the next wait */
+    int result;              /* PG_EVENT_RECV: bytes received, 0 at end of stream, -errno on error */
+} PGEvent;
+
+typedef struct PGEventLoop PGEventLoop;
+
+/* Function declarations */
+PGEventLoop *pg_event_loop_create(PGEventBackend backend);
+void pg_event_loop_destroy(PGEventLoop *loop);
+PGEventBackend pg_event_loop_backend(const PGEventLoop *loop);
+bool pg_event_loop_completes(const PGEventLoop *loop);
+
+int pg_event_add(PGEventLoop *loop, int fd, int events, void *data);
+int pg_event_modify(PGEventLoop *loop, int fd, int events, void *data);
+int pg_event_remove(PGEventLoop *loop, int fd);
+int pg_event_wait(PGEventLoop *loop, PGEvent *events, int max_events, int timeout_ms);
+ssize_t pg_event_send(PGEventLoop *loop, int fd, const struct iovec *iov, int iovcnt);
+bool pg_event_busy(PGEventLoop *loop, int fd);
+
+const char *pg_event_backend_name(PGEventBackend backend);
+int pg_event_backend_parse(const char *name, PGEventBackend *backend);
+
+#endif /* PG_EVENT_H */
@@ -0,0 +1,303 @@
+/**
+ * pg_executor.c
+ * Work-Stealing Thread Pool
+ *
+ * This file contains the implementation of the thread pool declared in
+ * pg_executor.h. Tasks submitted from an executor thread go to the bottom
+ * of its own deque and are taken back LIFO for cache locality; tasks
+ * submitted from other threads are spread round-robin. An idle executor
+ * thread steals from the top of the other deques before going to sleep.
+ */
+
+#include "pg_executor.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define INITIAL_QUEUE_CAPACITY 64
+
+/* Queued task */
+typedef struct {
+    PGTaskFunc func;
+    void *arg;
+} PGTask;
+
+/* Per-thread task deque */
+typedef struct {
+    pthread_mutex_t lock;
+    PGTask *tasks;           /* Ring of queued tasks */
+    size_t capacity;         /* Size of the ring (power of two) */
+    size_t top;              /* Next task to steal */
+    size_t bottom;           /* Next free slot for the owner */
+} PGTaskQueue;
+
+/* Executor thread */
+typedef struct {
+    PGExecutor *executor;
+    int id;
+    pthread_t thread;
+    PGTaskQueue queue;
+} PGExecutorThread;
+
+/* Thread pool */
+struct PGExecutor {
+    PGExecutorThread *threads;
+    int num_threads;
+    atomic_uint next_queue;  /* Round-robin target for external submits */
+    atomic_int queued;       /* Tasks queued across all deques */
+    atomic_int idle;         /* Threads sleeping on idle_cond */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    bool stopping;           /* Protected by idle_lock */
+};
+
+static __thread PGExecutorThread *current_thread = NULL;
+
+// Push a task at the owner's end of a deque
+static int pg_task_queue_push(PGTaskQueue *queue, PGTaskFunc func, void *arg) {
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->bottom - queue->top == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : INITIAL_QUEUE_CAPACITY;
+        PGTask *tasks = (PGTask *)malloc(capacity * sizeof(PGTask));
+        if (!tasks) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        for (size_t i = queue->top; i != queue->bottom; i++) {
+            tasks[i & (capacity - 1)] = queue->tasks[i & (queue->capacity - 1)];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->capacity = capacity;
+    }
+
+    PGTask *task = &queue->tasks[queue->bottom & (queue->capacity - 1)];
+    task->func = func;
+    task->arg = arg;
+    queue->bottom++;
+
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+// Take a task from the owner's end (newest first)
+static bool pg_task_queue_pop(PGTaskQueue *queue, PGTask *task) {
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->bottom != queue->top) {
+        queue->bottom--;
+        *task = queue->tasks[queue->bottom & (queue->capacity - 1)];
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+// Take a task from the thieves' end (oldest first)
+static bool pg_task_queue_steal(PGTaskQueue *queue, PGTask *task) {
+    bool found = false;
+
+    // Don't wait behind the owner or another thief, try the next victim
+    if (pthread_mutex_trylock(&queue->lock) != 0) {
+        return false;
+    }
+    if (queue->bottom != queue->top) {
+        *task = queue->tasks[queue->top & (queue->capacity - 1)];
+        queue->top++;
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+// Find work: own deque first, then the other threads' deques
+static bool pg_executor_take(PGExecutorThread *self, PGTask *task) {
+    PGExecutor *executor = self->executor;
+
+    if (pg_task_queue_pop(&self->queue, task)) {
+        return true;
+    }
+
+    for (int i = 1; i < executor->num_threads; i++) {
+        PGExecutorThread *victim = &executor->threads[(self->id + i) % executor->num_threads];
+        if (pg_task_queue_steal(&victim->queue, task)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void *pg_executor_thread_main(void *arg) {
+    PGExecutorThread *self = (PGExecutorThread *)arg;
+    PGExecutor *executor = self->executor;
+    PGTask task;
+
+    current_thread = self;
+
+    for (;;) {
+        if (pg_executor_take(self, &task)) {
+            atomic_fetch_sub(&executor->queued, 1);
+            task.func(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&executor->idle_lock);
+        atomic_fetch_add(&executor->idle, 1);
+        while (atomic_load(&executor->queued) <= 0 && !executor->stopping) {
+            pthread_cond_wait(&executor->idle_cond, &executor->idle_lock);
+        }
+        atomic_fetch_sub(&executor->idle, 1);
+
+        // Queued tasks are drained before the pool shuts down
+        bool done = executor->stopping && atomic_load(&executor->queued) <= 0;
+        pthread_mutex_unlock(&executor->idle_lock);
+
+        if (done) {
+            break;
+        }
+    }
+
+    current_thread = NULL;
+    return NULL;
+}
+
+// Join the first `started` threads and free the pool
+static void pg_executor_stop(PGExecutor *executor, int started) {
+    pthread_mutex_lock(&executor->idle_lock);
+    executor->stopping = true;
+    pthread_cond_broadcast(&executor->idle_cond);
+    pthread_mutex_unlock(&executor->idle_lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(executor->threads[i].thread, NULL);
+    }
+
+    for (int i = 0; i < executor->num_threads; i++) {
+        pthread_mutex_destroy(&executor->threads[i].queue.lock);
+        free(executor->threads[i].queue.tasks);
+    }
+
+    pthread_mutex_destroy(&executor->idle_lock);
+    pthread_cond_destroy(&executor->idle_cond);
+    free(executor->threads);
+    free(executor);
+}
+
+/**
+ * Create a thread pool
+ *
+ * @param num_threads Number of threads, 0 for one per online CPU
+ * @return New thread pool, or NULL on error
+ */
+PGExecutor *pg_executor_create(int num_threads) {
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    PGExecutor *executor = (PGExecutor *)calloc(1, sizeof(PGExecutor));
+    if (!executor) {
+        return NULL;
+    }
+
+    executor->threads = (PGExecutorThread *)calloc(num_threads, sizeof(PGExecutorThread));
+    if (!executor->threads) {
+        free(executor);
+        return NULL;
+    }
+
+    atomic_init(&executor->next_queue, 0);
+    atomic_init(&executor->queued, 0);
+    atomic_init(&executor->idle, 0);
+    pthread_mutex_init(&executor->idle_lock, NULL);
+    pthread_cond_init(&executor->idle_cond, NULL);
+    executor->stopping = false;
+
+    for (int i = 0; i < num_threads; i++) {
+        PGExecutorThread *thread = &executor->threads[i];
+        thread->executor = executor;
+        thread->id = i;
+        pthread_mutex_init(&thread->queue.lock, NULL);
+    }
+
+    // num_threads counts started threads so a failed start can be unwound
+    executor->num_threads = 0;
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&executor->threads[i].thread, NULL,
+                           pg_executor_thread_main, &executor->threads[i]) != 0) {
+            int started = executor->num_threads;
+            executor->num_threads = num_threads;
+            pg_executor_stop(executor, started);
+            return NULL;
+        }
+        executor->num_threads++;
+    }
+
+    return executor;
+}
+
+/**
+ * Queue a task on a thread pool
+ *
+ * Safe to call from any thread, including from inside a running task.
+ *
+ * @param executor Thread pool
+ * @param func Task function
+ * @param arg Argument passed to the task function
+ * @return 0 on success, -1 on error
+ */
+int pg_executor_submit(PGExecutor *executor, PGTaskFunc func, void *arg) {
+    PGExecutorThread *target = current_thread;
+
+    if (!target || target->executor != executor) {
+        unsigned n = atomic_fetch_add(&executor->next_queue, 1);
+        target = &executor->threads[n % (unsigned)executor->num_threads];
+    }
+
+    if (pg_task_queue_push(&target->queue, func, arg) < 0) {
+        return -1;
+    }
+
+    // queued is raised before idle is read and a sleeper raises idle
+    // before reading queued, so at least one side sees the other
+    atomic_fetch_add(&executor->queued, 1);
+    if (atomic_load(&executor->idle) > 0) {
+        pthread_mutex_lock(&executor->idle_lock);
+        pthread_cond_signal(&executor->idle_cond);
+        pthread_mutex_unlock(&executor->idle_lock);
+    }
+
+    return 0;
+}
+
+/**
+ * Get the number of threads in a thread pool
+ *
+ * @param executor Thread pool
+ * @return Number of threads
+ */
+int pg_executor_num_threads(const PGExecutor *executor) {
+    return executor->num_threads;
+}
+
+/**
+ * Destroy a thread pool
+ *
+ * Tasks already queued are run before the threads exit.
+ *
+ * @param executor Thread pool
+ */
+void pg_executor_destroy(PGExecutor *executor) {
+    if (!executor) {
+        return;
+    }
+
+    pg_executor_stop(executor, executor->num_threads);
+}
@@ -0,0 +1,24 @@
+/**
+ * pg_executor.h
+ * Work-Stealing Thread Pool
+ *
+ * This file contains declarations for the thread pool that runs blocking
+ * work (async query callbacks) off the event loop threads. Each executor
+ * thread has its own task deque; idle threads steal from the others.
+ */
+
+#ifndef PG_EXECUTOR_H
+#define PG_EXECUTOR_H
+
+/* Task function */
+typedef void (*PGTaskFunc)(void *arg);
+
+typedef struct PGExecutor PGExecutor;
+
+/* Function declarations */
+PGExecutor *pg_executor_create(int num_threads);
+int pg_executor_submit(PGExecutor *executor, PGTaskFunc func, void *arg);
+int pg_executor_num_threads(const PGExecutor *executor);
+void pg_executor_destroy(PGExecutor *executor);
+
+#endif /* PG_EXECUTOR_H */
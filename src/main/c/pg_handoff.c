@@ -0,0 +1,464 @@
+/**
+ * pg_handoff.c
+ * Hot Restart Handoff
+ *
+ * This file contains the implementation of the handoff socket and the
+ * connection records declared in pg_handoff.h. A connection record holds
+ * what a session at ReadyForQuery outside a transaction is made of: its
+ * backend key, protocol version, session settings, user and database, and
+ * its prepared statements as the Parse messages that created them plus
+ * the RowDescription they were described with. Portals do not outlive the
+ * transaction, and the I/O buffers of an idle connection are empty, so
+ * nothing else is needed to carry on where the old process left off.
+ */
+
+// struct ucred is a GNU extension
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "pg_handoff.h"
+#include "pg_log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define HANDOFF_TIMEOUT_SECONDS 10   // a stalled peer aborts the handoff instead of the server
+
+/* Bounds-checked reader over a record */
+typedef struct {
+    const char *p;
+    const char *end;
+} PGHandoffReader;
+
+static int pg_handoff_address(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        pg_log_error("Handoff socket path too long: %s", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static void pg_handoff_set_timeout(int fd, int option) {
+    struct timeval timeout = {HANDOFF_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+/**
+ * Listen for the process that will take over, replacing any socket left
+ * at the path. Only processes of the same user may connect.
+ *
+ * @param path Socket path
+ * @return Non-blocking listening socket, or -1 on error
+ */
+int pg_handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (pg_handoff_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        pg_log_error("Cannot create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // What is there belongs to a process that is gone, or whose listeners
+    // this one has taken over
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 ||
+        listen(fd, 1) < 0) {
+        pg_log_error("Cannot listen on handoff socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Connect to the running process to take over from it
+ *
+ * @param path Socket path
+ * @return Socket, or -1 if no process listens there
+ */
+int pg_handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (pg_handoff_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    pg_handoff_set_timeout(fd, SO_RCVTIMEO);
+    pg_handoff_set_timeout(fd, SO_SNDTIMEO);
+    return fd;
+}
+
+/**
+ * Accept the process taking over, if it runs as the same user
+ *
+ * @param listen_fd Socket from pg_handoff_listen
+ * @return Blocking socket to send the records on, or -1
+ */
+int pg_handoff_accept(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uid_t uid = (uid_t)-1;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+        uid = cred.uid;
+    }
+#else
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        uid = (uid_t)-1;
+    }
+#endif
+    if (uid != geteuid()) {
+        pg_log_warning("Handoff refused to a process of another user");
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    pg_handoff_set_timeout(fd, SO_SNDTIMEO);
+    return fd;
+}
+
+/**
+ * Send one record, with sockets attached
+ *
+ * @param fd Handoff socket
+ * @param data Record
+ * @param length Record length, at most PG_HANDOFF_MAX_RECORD
+ * @param fds Sockets to pass (the caller still closes its own copies)
+ * @param num_fds Number of sockets, at most PG_HANDOFF_MAX_FDS
+ * @return 0 on success, -1 on error
+ */
+int pg_handoff_send(int fd, const void *data, size_t length, const int *fds, int num_fds) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * PG_HANDOFF_MAX_FDS)];
+    } control;
+    struct iovec iov = {(void *)data, length};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.space;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)num_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)num_fds);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)length ? 0 : -1;
+}
+
+/**
+ * Receive one record and the sockets attached to it
+ *
+ * @param fd Handoff socket
+ * @param data Buffer for the record, PG_HANDOFF_MAX_RECORD bytes
+ * @param size Buffer size
+ * @param fds Set to the received sockets (close-on-exec)
+ * @param max_fds Room in fds
+ * @param num_fds Set to the number of sockets received
+ * @return Record length, 0 once the peer has closed, or -1 on error
+ */
+ssize_t pg_handoff_recv(int fd, void *data, size_t size, int *fds, int max_fds, int *num_fds) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int) * PG_HANDOFF_MAX_FDS)];
+    } control;
+    struct iovec iov = {data, size};
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    *num_fds = 0;
+    for (struct cmsghdr *cmsg = n >= 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*num_fds < max_fds) {
+                fds[(*num_fds)++] = received;
+            } else {
+                close(received);
+            }
+        }
+    }
+
+    // A cut record would be misread; its sockets are of no use either
+    if (n > 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        while (*num_fds > 0) {
+            close(fds[--*num_fds]);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * Whether a connection's state can move to another process. TLS sessions
+ * and compressed streams live in library contexts that cannot be written
+ * out, and a pooler client holding an upstream connection is tied to it.
+ *
+ * @param client Connection
+ * @return Whether pg_handoff_encode can carry it
+ */
+bool pg_handoff_portable(const PGClientConn *client) {
+    return !client->ssl && !client->compressor && !client->backend;
+}
+
+static int pg_handoff_put(PGBuffer *out, const void *data, size_t length) {
+    return pg_buffer_append(out, data, length);
+}
+
+static int pg_handoff_put_int32(PGBuffer *out, int32_t value) {
+    return pg_buffer_append(out, &value, sizeof(value));
+}
+
+// Length-prefixed string; -1 for NULL
+static int pg_handoff_put_string(PGBuffer *out, const char *s) {
+    int32_t length = s ? (int32_t)strlen(s) : -1;
+    if (pg_handoff_put_int32(out, length) < 0) {
+        return -1;
+    }
+    return length > 0 ? pg_handoff_put(out, s, (size_t)length) : 0;
+}
+
+// Statement as the payload of the Parse that created it, then its
+// RowDescription: -2 if not described yet, -1 for NoData
+static int pg_handoff_put_statement(PGStatement *statement, void *arg) {
+    PGBuffer *out = (PGBuffer *)arg;
+    size_t name_length = strlen(statement->name) + 1;
+    size_t query_length = strlen(statement->query) + 1;
+    int32_t parse_length = (int32_t)(name_length + query_length + 2 + (size_t)statement->num_params * 4);
+    uint16_t count = htons((uint16_t)statement->num_params);
+
+    if (pg_handoff_put_int32(out, parse_length) < 0 ||
+        pg_handoff_put(out, statement->name, name_length) < 0 ||
+        pg_handoff_put(out, statement->query, query_length) < 0 ||
+        pg_handoff_put(out, &count, 2) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < statement->num_params; i++) {
+        uint32_t oid = htonl(statement->param_types[i]);
+        if (pg_handoff_put(out, &oid, 4) < 0) {
+            return -1;
+        }
+    }
+
+    int32_t description = !statement->described ? -2 :
+                          statement->row_description ? statement->row_description_len : -1;
+    if (pg_handoff_put_int32(out, description) < 0) {
+        return -1;
+    }
+    return description > 0 ? pg_handoff_put(out, statement->row_description, (size_t)description) : 0;
+}
+
+/**
+ * Write a connection record for an idle connection
+ *
+ * @param client Connection at ReadyForQuery, outside a transaction
+ * @param out Buffer the record is appended to
+ * @return 0 on success, -1 on allocation failure or if it would not fit
+ *         in PG_HANDOFF_MAX_RECORD
+ */
+int pg_handoff_encode(PGClientConn *client, PGBuffer *out) {
+    char type = PG_HANDOFF_CONNECTION;
+    uint8_t settings[2] = {(uint8_t)client->txn_status, client->protocol_minor};
+    int32_t timeouts[4] = {
+        client->idle_session_timeout,
+        client->idle_in_transaction_session_timeout,
+        client->statement_timeout,
+        client->client_connection_check_interval
+    };
+
+    if (pg_handoff_put(out, &type, 1) < 0 ||
+        pg_handoff_put_int32(out, client->backend_pid) < 0 ||
+        pg_handoff_put_int32(out, client->secret_key) < 0 ||
+        pg_handoff_put(out, settings, sizeof(settings)) < 0 ||
+        pg_handoff_put(out, timeouts, sizeof(timeouts)) < 0 ||
+        pg_handoff_put_string(out, client->user) < 0 ||
+        pg_handoff_put_string(out, client->database) < 0 ||
+        pg_handoff_put_int32(out, (int32_t)client->stmts.statements.count) < 0 ||
+        pg_stmt_each(&client->stmts, pg_handoff_put_statement, out) < 0) {
+        return -1;
+    }
+    return pg_buffer_length(out) <= PG_HANDOFF_MAX_RECORD ? 0 : -1;
+}
+
+/**
+ * Get the process ID a connection record was sent with
+ *
+ * @param record Connection record
+ * @param length Record length
+ * @return Process ID, or 0 if the record is too short
+ */
+int32_t pg_handoff_pid(const char *record, size_t length) {
+    int32_t pid = 0;
+    if (length >= 1 + sizeof(pid)) {
+        memcpy(&pid, record + 1, sizeof(pid));
+    }
+    return pid;
+}
+
+static const char *pg_handoff_take(PGHandoffReader *reader, size_t length) {
+    if ((size_t)(reader->end - reader->p) < length) {
+        return NULL;
+    }
+    const char *p = reader->p;
+    reader->p += length;
+    return p;
+}
+
+static bool pg_handoff_get_int32(PGHandoffReader *reader, int32_t *value) {
+    const char *p = pg_handoff_take(reader, sizeof(*value));
+    if (!p) {
+        return false;
+    }
+    memcpy(value, p, sizeof(*value));
+    return true;
+}
+
+// String copied into the connection's startup arena
+static bool pg_handoff_get_string(PGHandoffReader *reader, PGArena *arena, char **s) {
+    int32_t length;
+    if (!pg_handoff_get_int32(reader, &length) || length < -1) {
+        return false;
+    }
+    *s = NULL;
+    if (length < 0) {
+        return true;
+    }
+
+    const char *p = pg_handoff_take(reader, (size_t)length);
+    char *copy = p ? (char *)pg_arena_alloc(arena, (size_t)length + 1) : NULL;
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, p, (size_t)length);
+    copy[length] = '\0';
+    *s = copy;
+    return true;
+}
+
+static bool pg_handoff_get_statement(PGHandoffReader *reader, PGClientConn *client) {
+    int32_t parse_length;
+    int32_t description;
+    PGStatement *statement;
+
+    if (!pg_handoff_get_int32(reader, &parse_length) || parse_length < 0) {
+        return false;
+    }
+    const char *parse = pg_handoff_take(reader, (size_t)parse_length);
+    if (!parse || pg_stmt_parse(&client->stmts, parse, parse_length, &statement) != PG_STMT_OK ||
+        !pg_handoff_get_int32(reader, &description) || description < -2) {
+        return false;
+    }
+
+    // The pooler prepares it upstream under its own name when first used
+    if (client->worker->pool &&
+        pg_pool_restore_statement(client, statement, parse, (size_t)parse_length) < 0) {
+        return false;
+    }
+    if (description == -2) {
+        return true;
+    }
+    const char *data = description >= 0 ? pg_handoff_take(reader, (size_t)description) : NULL;
+    if (description >= 0 && !data) {
+        return false;
+    }
+    return pg_stmt_set_row_description(statement, data, description >= 0 ? description : 0) == 0;
+}
+
+/**
+ * Restore the session of a connection record into a new connection. The
+ * backend key is set as it was; the caller decides whether it can keep it.
+ *
+ * @param client Connection set up for the received socket
+ * @param record Connection record
+ * @param length Record length
+ * @return 0 on success, -1 if the record is malformed or memory ran out
+ */
+int pg_handoff_decode(PGClientConn *client, const char *record, size_t length) {
+    PGHandoffReader reader = {record, record + length};
+    const char *type = pg_handoff_take(&reader, 1);
+    const char *settings;
+    const char *timeouts;
+    int32_t count;
+    int32_t values[4];
+
+    if (!type || *type != PG_HANDOFF_CONNECTION ||
+        !pg_handoff_get_int32(&reader, &client->backend_pid) ||
+        !pg_handoff_get_int32(&reader, &client->secret_key) ||
+        !(settings = pg_handoff_take(&reader, 2)) ||
+        !(timeouts = pg_handoff_take(&reader, sizeof(values))) ||
+        !pg_handoff_get_string(&reader, &client->arena, &client->user) ||
+        !pg_handoff_get_string(&reader, &client->arena, &client->database) ||
+        !pg_handoff_get_int32(&reader, &count) || count < 0) {
+        return -1;
+    }
+
+    client->txn_status = settings[0];
+    client->protocol_minor = (uint8_t)settings[1];
+    memcpy(values, timeouts, sizeof(values));
+    client->idle_session_timeout = values[0];
+    client->idle_in_transaction_session_timeout = values[1];
+    client->statement_timeout = values[2];
+    client->client_connection_check_interval = values[3];
+
+    for (int32_t i = 0; i < count; i++) {
+        if (!pg_handoff_get_statement(&reader, client)) {
+            return -1;
+        }
+    }
+    return reader.p == reader.end ? 0 : -1;
+}
@@ -0,0 +1,48 @@
+/**
+ * pg_handoff.h
+ * Hot Restart Handoff
+ *
+ * This file contains declarations for passing the listening sockets and
+ * idle connections of a running server to a new process, so that an
+ * upgrade drops no sessions. The running process listens on a Unix socket;
+ * a new one started with the same path connects to it and receives one
+ * record per SOCK_SEQPACKET message: the process IDs of the connections
+ * that may follow, so their slots and cancel keys stay free; the listening
+ * sockets, after which the new process accepts and the old one no longer
+ * does; each connection as it reaches ReadyForQuery outside a transaction,
+ * its socket attached as SCM_RIGHTS and its session state serialized
+ * behind it; and an end record once the old process has none left.
+ * Integers are in host byte order, since both ends run on one machine.
+ */
+
+#ifndef PG_HANDOFF_H
+#define PG_HANDOFF_H
+
+#include "pg_server.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PG_HANDOFF_MAX_RECORD (128 * 1024)  /* Largest record; connections whose state does not fit are closed */
+#define PG_HANDOFF_MAX_FDS 64               /* Sockets attached to one record */
+
+/* Record types, the first byte of every record */
+#define PG_HANDOFF_RESERVE    'R'   /* int32 workers and max connections of the old process, then process IDs */
+#define PG_HANDOFF_LISTENERS  'L'   /* No payload; listening sockets attached */
+#define PG_HANDOFF_CONNECTION 'C'   /* Session state (pg_handoff_encode); the connection's socket attached */
+#define PG_HANDOFF_DONE       'D'   /* No more connections follow */
+
+/* Function declarations */
+int pg_handoff_listen(const char *path);
+int pg_handoff_connect(const char *path);
+int pg_handoff_accept(int listen_fd);
+int pg_handoff_send(int fd, const void *data, size_t length, const int *fds, int num_fds);
+ssize_t pg_handoff_recv(int fd, void *data, size_t size, int *fds, int max_fds, int *num_fds);
+
+bool pg_handoff_portable(const PGClientConn *client);
+int pg_handoff_encode(PGClientConn *client, PGBuffer *out);
+int32_t pg_handoff_pid(const char *record, size_t length);
+int pg_handoff_decode(PGClientConn *client, const char *record, size_t length);
+
+#endif /* PG_HANDOFF_H */
@@ -1,19 +1,49 @@
 /**
  * pg_log.c
  * Logging functionality for PostgreSQL Protocol Server Emulator
+ *
+ * Log calls do not write to the file themselves. Each thread formats its
+ * lines into its own ring buffer, which only that thread writes and only
+ * the background writer thread reads, so logging takes no locks; the
+ * writer drains all rings and writes what it finds in one batch. Until
+ * pg_log_init starts the writer (and after pg_log_close stops it), lines
+ * are written directly.
+ *
+ * The level macros in pg_log.h go further and leave the formatting to the
+ * writer as well: the caller stores the time, the format pointer (always a
+ * string literal) and the raw argument values, and the writer does the
+ * printf work.
  */
 
 #include "pg_log.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PG_LOG_RING_SIZE (256 * 1024)   /* Bytes per thread; a power of two */
+#define PG_LOG_LINE_MAX 4096            /* Longer lines are cut short */
+#define PG_LOG_BATCH_SIZE (64 * 1024)   /* Bytes handed to fwrite at a time */
+#define PG_LOG_BATCH_WAIT_US 1000       /* Writer pause between drains, so lines batch up */
+#define PG_LOG_IDLE_PASSES 100          /* Empty drains before the writer waits to be woken */
+
+/* Kinds of ring record; each is a 4-byte length, the kind, then the body */
+#define PG_LOG_RECORD_LINE 'L'          /* A formatted line */
+#define PG_LOG_RECORD_ARGS 'A'          /* Level, time, format and packed arguments */
 
 /* Global log configuration */
 PGLogConfig pg_log_config = {
     .log_file = NULL,
     .log_level = PG_LOG_INFO,
     .include_timestamp = 1,
-    .include_pid = 1
+    .include_pid = 1,
+    .block_when_full = 0
 };
 
 /* Log level strings */
@@ -24,230 +54,779 @@ static const char *log_level_strings[] = {
     "DEBUG"
 };
 
-/* Initialize logging */
-void pg_log_init(FILE *log_file, PGLogLevel level) {
-    pg_log_config.log_file = log_file ? log_file : stderr;
-    pg_log_config.log_level = level;
+/* Records logged by one thread. head and tail only grow; their difference
+   is the bytes in use. */
+typedef struct PGLogRing {
+    char *data;                  /* PG_LOG_RING_SIZE bytes */
+    _Atomic size_t head;         /* Written by the owning thread */
+    _Atomic size_t tail;         /* Consumed by the writer thread */
+    atomic_bool in_use;          /* Owned by a running thread */
+    struct PGLogRing *next;      /* Next ring in the registry */
+} PGLogRing;
+
+/* Header of a PG_LOG_RECORD_ARGS record */
+typedef struct {
+    char kind;
+    char level;
+    struct timespec time;        /* When the line was logged */
+    const char *format;          /* String literal */
+} PGLogArgsHeader;
+
+/* Timestamp of the last line formatted by a thread */
+typedef struct {
+    time_t second;               /* Second the date part was formatted for */
+    long millisecond;            /* Millisecond of the cached text */
+    char text[32];               /* "[YYYY-MM-DD HH:MM:SS.mmm] " */
+    int length;
+} PGLogClock;
+
+/* Rings of all threads that have logged; rings are reused, never freed */
+static _Atomic(PGLogRing *) log_rings = NULL;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local PGLogRing *log_ring = NULL;
+static _Thread_local PGLogClock log_clock;
+
+/* Background writer */
+static pthread_t log_writer;
+static atomic_bool log_writer_running = false;
+static atomic_bool log_writer_stop = false;
+static atomic_bool log_writer_sleeping = false;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+static uint64_t log_passes = 0;      /* Drain passes completed, under log_wake_lock */
+static pthread_mutex_t log_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_ullong log_dropped = 0;
+
+static char log_pid[24];             /* "[pid] " */
+static int log_pid_length = 0;
+static pthread_once_t log_pid_once = PTHREAD_ONCE_INIT;
+
+static FILE *pg_log_out(void) {
+    return pg_log_config.log_file ? pg_log_config.log_file : stderr;
 }
 
-/* Set log level */
-void pg_log_set_level(PGLogLevel level) {
-    pg_log_config.log_level = level;
+static void pg_log_format_pid(void) {
+    log_pid_length = snprintf(log_pid, sizeof(log_pid), "[%d] ", (int)getpid());
 }
 
-/* Set log file */
-void pg_log_set_file(FILE *log_file) {
-    if (pg_log_config.log_file != stderr && pg_log_config.log_file != stdout) {
-        fclose(pg_log_config.log_file);
+/* Hand a thread's ring back for reuse when the thread exits */
+static void pg_log_ring_release(void *ring) {
+    atomic_store(&((PGLogRing *)ring)->in_use, false);
+}
+
+static void pg_log_ring_key_create(void) {
+    pthread_key_create(&log_ring_key, pg_log_ring_release);
+}
+
+/* Ring of the calling thread, or NULL if none could be allocated */
+static PGLogRing *pg_log_thread_ring(void) {
+    if (log_ring) {
+        return log_ring;
     }
-    pg_log_config.log_file = log_file ? log_file : stderr;
+    pthread_once(&log_ring_key_once, pg_log_ring_key_create);
+
+    /* Take over the ring of a thread that has exited */
+    PGLogRing *ring;
+    for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        bool free_ring = false;
+        if (atomic_compare_exchange_strong(&ring->in_use, &free_ring, true)) {
+            break;
+        }
+    }
+
+    if (!ring) {
+        ring = (PGLogRing *)calloc(1, sizeof(PGLogRing));
+        if (!ring) {
+            return NULL;
+        }
+        ring->data = (char *)malloc(PG_LOG_RING_SIZE);
+        if (!ring->data) {
+            free(ring);
+            return NULL;
+        }
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->in_use, true);
+
+        ring->next = atomic_load(&log_rings);
+        while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {}
+    }
+
+    pthread_setspecific(log_ring_key, ring);
+    log_ring = ring;
+    return ring;
 }
 
-/* Close logging */
-void pg_log_close(void) {
-    if (pg_log_config.log_file != stderr && pg_log_config.log_file != stdout) {
-        fclose(pg_log_config.log_file);
-        pg_log_config.log_file = stderr;
+static void pg_log_ring_copy_in(PGLogRing *ring, size_t pos, const void *src, size_t length) {
+    size_t offset = pos & (PG_LOG_RING_SIZE - 1);
+    size_t first = PG_LOG_RING_SIZE - offset < length ? PG_LOG_RING_SIZE - offset : length;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char *)src + first, length - first);
+}
+
+static void pg_log_ring_copy_out(const PGLogRing *ring, size_t pos, void *dst, size_t length) {
+    size_t offset = pos & (PG_LOG_RING_SIZE - 1);
+    size_t first = PG_LOG_RING_SIZE - offset < length ? PG_LOG_RING_SIZE - offset : length;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char *)dst + first, ring->data, length - first);
+}
+
+/* Append a record to a ring; -1 if it does not have room */
+static int pg_log_ring_push(PGLogRing *ring, const char *record, uint32_t length) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (PG_LOG_RING_SIZE - (head - tail) < sizeof(length) + length) {
+        return -1;
     }
+    pg_log_ring_copy_in(ring, head, &length, sizeof(length));
+    pg_log_ring_copy_in(ring, head + sizeof(length), record, length);
+    atomic_store_explicit(&ring->head, head + sizeof(length) + length, memory_order_release);
+    return 0;
 }
 
-/* Generic log function */
-void pg_log(PGLogLevel level, const char *format, ...) {
-    if (level > pg_log_config.log_level) {
-        return;
+static int pg_log_format_line(char *line, PGLogLevel level, const struct timespec *time,
+                              const char *format, ...);
+static int pg_log_unpack_line(char *line, const char *record, size_t record_length);
+
+/* Wake the writer if it is waiting for lines. The fence orders the
+   release store of the ring head before the load of the flag; without
+   it the two can be reordered, and the writer could go to sleep on a
+   ring that just received a line while this thread sees it awake. */
+static void pg_log_wake_writer(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&log_writer_sleeping)) {
+        pthread_mutex_lock(&log_wake_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+}
+
+/* Write a batch of lines to the log file */
+static void pg_log_write_batch(const char *batch, size_t length) {
+    if (length > 0) {
+        pthread_mutex_lock(&log_file_lock);
+        fwrite(batch, 1, length, pg_log_out());
+        pthread_mutex_unlock(&log_file_lock);
+    }
+}
+
+/* Move every record in the rings to the log file, formatting the ones
+   that carry arguments; returns the bytes written */
+static size_t pg_log_drain(char *batch) {
+    char record[1 + PG_LOG_LINE_MAX];
+    size_t used = 0;
+    size_t total = 0;
+
+    unsigned long long dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped > 0) {
+        used = (size_t)pg_log_format_line(batch, PG_LOG_WARNING, NULL,
+                                          "%llu log messages dropped, the log ring was full",
+                                          dropped);
+    }
+
+    for (PGLogRing *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head) {
+            uint32_t length;
+            pg_log_ring_copy_out(ring, tail, &length, sizeof(length));
+            pg_log_ring_copy_out(ring, tail + sizeof(length), record, length);
+            tail += sizeof(length) + length;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+            if (used + PG_LOG_LINE_MAX > PG_LOG_BATCH_SIZE) {
+                pg_log_write_batch(batch, used);
+                total += used;
+                used = 0;
+            }
+            if (record[0] == PG_LOG_RECORD_LINE) {
+                memcpy(batch + used, record + 1, length - 1);
+                used += length - 1;
+            } else {
+                used += pg_log_unpack_line(batch + used, record, length);
+            }
+        }
     }
 
-    FILE *out = pg_log_config.log_file ? pg_log_config.log_file : stderr;
-    
-    /* Print timestamp if enabled */
+    pg_log_write_batch(batch, used);
+    total += used;
+    if (total > 0) {
+        pthread_mutex_lock(&log_file_lock);
+        fflush(pg_log_out());
+        pthread_mutex_unlock(&log_file_lock);
+    }
+    return total;
+}
+
+static bool pg_log_rings_empty(void) {
+    for (PGLogRing *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        if (atomic_load(&ring->head) != atomic_load(&ring->tail)) {
+            return false;
+        }
+    }
+    return atomic_load(&log_dropped) == 0;
+}
+
+/* Background writer: drains the rings until pg_log_close */
+static void *pg_log_writer_main(void *arg) {
+    char *batch = (char *)arg;
+    int idle_passes = 0;
+
+    for (;;) {
+        bool stopping = atomic_load(&log_writer_stop);
+        size_t written = pg_log_drain(batch);
+
+        pthread_mutex_lock(&log_wake_lock);
+        log_passes++;
+        pthread_cond_broadcast(&log_drained);
+        if (stopping) {
+            pthread_mutex_unlock(&log_wake_lock);
+            break;
+        }
+
+        idle_passes = written > 0 ? 0 : idle_passes + 1;
+        if (idle_passes >= PG_LOG_IDLE_PASSES) {
+            /* Idle: wait to be woken, unless a line arrived since the
+               drain. The flag is set before the rings are checked, and a
+               logging thread fences between publishing a line and
+               reading the flag, so one of the two sees the other; if it
+               is the logging thread, it takes the lock to signal. */
+            atomic_store(&log_writer_sleeping, true);
+            if (pg_log_rings_empty() && !atomic_load(&log_writer_stop)) {
+                pthread_cond_wait(&log_wake, &log_wake_lock);
+            }
+            atomic_store(&log_writer_sleeping, false);
+            idle_passes = 0;
+            pthread_mutex_unlock(&log_wake_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&log_wake_lock);
+
+        /* Busy: let lines collect so they are written in one batch,
+           without the logging threads having to signal each one */
+        usleep(PG_LOG_BATCH_WAIT_US);
+    }
+
+    free(batch);
+    return NULL;
+}
+
+/* Format the timestamp prefix, reusing the last one within the same
+   millisecond and the date part within the same second */
+static int pg_log_format_timestamp(char *out, const struct timespec *now) {
+    PGLogClock *clock = &log_clock;
+    long millisecond = now->tv_nsec / 1000000;
+
+    if (clock->length == 0 || now->tv_sec != clock->second) {
+        struct tm tm_info;
+        localtime_r(&now->tv_sec, &tm_info);
+        clock->text[0] = '[';
+        strftime(clock->text + 1, sizeof(clock->text) - 1, "%Y-%m-%d %H:%M:%S", &tm_info);
+        clock->length = (int)strlen(clock->text);
+        memcpy(clock->text + clock->length, ".000] ", 7);
+        clock->length += 6;
+        clock->second = now->tv_sec;
+        clock->millisecond = -1;
+    }
+    if (millisecond != clock->millisecond) {
+        char *digits = clock->text + clock->length - 5;
+        digits[0] = (char)('0' + millisecond / 100);
+        digits[1] = (char)('0' + millisecond / 10 % 10);
+        digits[2] = (char)('0' + millisecond % 10);
+        clock->millisecond = millisecond;
+    }
+
+    memcpy(out, clock->text, clock->length);
+    return clock->length;
+}
+
+/* Format the prefix of a line logged at a time (NULL: now) */
+static int pg_log_format_prefix(char *line, PGLogLevel level, const struct timespec *time) {
+    int length = 0;
+
+    /* Timestamp */
     if (pg_log_config.include_timestamp) {
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[20];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-        fprintf(out, "[%s] ", timestamp);
-    }
-    
-    /* Print log level */
-    fprintf(out, "[%s] ", log_level_strings[level]);
-    
-    /* Print PID if enabled */
+        struct timespec now;
+        if (!time) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            time = &now;
+        }
+        length += pg_log_format_timestamp(line, time);
+    }
+
+    /* Log level */
+    length += snprintf(line + length, PG_LOG_LINE_MAX - length, "[%s] ", log_level_strings[level]);
+
+    /* Process ID */
     if (pg_log_config.include_pid) {
-        fprintf(out, "[%d] ", getpid());
+        pthread_once(&log_pid_once, pg_log_format_pid);
+        memcpy(line + length, log_pid, log_pid_length);
+        length += log_pid_length;
+    }
+    return length;
+}
+
+/* End a line of which n message bytes were formatted after the prefix:
+   mark it when the message was cut short, and add the newline */
+static int pg_log_end_line(char *line, int length, int n) {
+    if (n < 0) {
+        n = 0;
     }
-    
-    /* Print the actual message */
+    if (n >= PG_LOG_LINE_MAX - 1 - length) {
+        length = PG_LOG_LINE_MAX - 1;
+        memcpy(line + length - 3, "...", 3);
+    } else {
+        length += n;
+    }
+
+    /* Add newline if not present */
+    if (length == 0 || line[length - 1] != '\n') {
+        line[length++] = '\n';
+    }
+    return length;
+}
+
+/* Format a complete log line of at most PG_LOG_LINE_MAX bytes, ending in a
+   newline; returns its length */
+static int pg_log_format_va(char *line, PGLogLevel level, const struct timespec *time,
+                            const char *format, va_list args) {
+    int length = pg_log_format_prefix(line, level, time);
+    int n = vsnprintf(line + length, PG_LOG_LINE_MAX - 1 - length, format, args);
+    return pg_log_end_line(line, length, n);
+}
+
+static int pg_log_format_line(char *line, PGLogLevel level, const struct timespec *time,
+                              const char *format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(out, format, args);
+    int length = pg_log_format_va(line, level, time, format, args);
     va_end(args);
-    
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n') {
-        fprintf(out, "\n");
+    return length;
+}
+
+/* A printf conversion, as far as packing its argument is concerned */
+typedef struct {
+    const char *start;           /* The '%' */
+    const char *end;             /* Just past the conversion character */
+    int stars;                   /* Width and precision given as int arguments */
+    bool star_precision;         /* The last star is the precision */
+    int precision;               /* Literal precision, or -1 */
+    char length;                 /* 'H' hh, 'h', 'l', 'q' ll, 'z', 'j', 't', or 0 */
+    char conversion;
+} PGLogSpec;
+
+/* Parse the next conversion of a format; NULL when there is none left */
+static const char *pg_log_next_spec(const char *p, PGLogSpec *spec) {
+    while (*p && !(p[0] == '%' && p[1] != '%')) {
+        p += (p[0] == '%') ? 2 : 1;
+    }
+    if (!*p) {
+        return NULL;
+    }
+
+    spec->start = p++;
+    spec->stars = 0;
+    spec->star_precision = false;
+    spec->precision = -1;
+    spec->length = 0;
+
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            spec->star_precision = true;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9') spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
+    }
+
+    switch (*p) {
+        case 'h': spec->length = (p[1] == 'h') ? 'H' : 'h'; p += (p[1] == 'h') ? 2 : 1; break;
+        case 'l': spec->length = (p[1] == 'l') ? 'q' : 'l'; p += (p[1] == 'l') ? 2 : 1; break;
+        case 'z': case 'j': case 't': spec->length = *p++; break;
+        default: break;
     }
-    
-    /* Flush output */
-    fflush(out);
+    spec->conversion = *p;
+    spec->end = *p ? p + 1 : p;
+    return spec->end;
 }
 
-/* Convenience functions for different log levels */
-void pg_log_error(const char *format, ...) {
-    if (PG_LOG_ERROR > pg_log_config.log_level) {
-        return;
+/* Store the arguments of a format in out; returns the bytes used, or -1
+   if they do not fit (the line will be cut short anyway) or the format
+   uses a conversion that cannot be deferred (%n, long double) */
+static int pg_log_pack(char *out, size_t size, const char *format, va_list args) {
+    PGLogSpec spec;
+    size_t used = 0;
+
+#define PG_LOG_PACK(type, value) do { \
+        type v_ = (value); \
+        if (used + sizeof(v_) > size) return -1; \
+        memcpy(out + used, &v_, sizeof(v_)); \
+        used += sizeof(v_); \
+    } while (0)
+
+    const char *p = format;
+    while ((p = pg_log_next_spec(p, &spec)) != NULL) {
+        int precision = spec.precision;
+        for (int i = 0; i < spec.stars; i++) {
+            int star = va_arg(args, int);
+            PG_LOG_PACK(int, star);
+            if (i == spec.stars - 1 && spec.star_precision) {
+                precision = star;
+            }
+        }
+
+        switch (spec.conversion) {
+            case 'd': case 'i':
+                switch (spec.length) {
+                    case 'l': PG_LOG_PACK(int64_t, va_arg(args, long)); break;
+                    case 'q': PG_LOG_PACK(int64_t, va_arg(args, long long)); break;
+                    case 'z': PG_LOG_PACK(int64_t, va_arg(args, ssize_t)); break;
+                    case 'j': PG_LOG_PACK(int64_t, va_arg(args, intmax_t)); break;
+                    case 't': PG_LOG_PACK(int64_t, va_arg(args, ptrdiff_t)); break;
+                    default: PG_LOG_PACK(int64_t, va_arg(args, int)); break;
+                }
+                break;
+
+            case 'u': case 'o': case 'x': case 'X':
+                switch (spec.length) {
+                    case 'l': PG_LOG_PACK(uint64_t, va_arg(args, unsigned long)); break;
+                    case 'q': PG_LOG_PACK(uint64_t, va_arg(args, unsigned long long)); break;
+                    case 'z': PG_LOG_PACK(uint64_t, va_arg(args, size_t)); break;
+                    case 'j': PG_LOG_PACK(uint64_t, va_arg(args, uintmax_t)); break;
+                    case 't': PG_LOG_PACK(uint64_t, va_arg(args, ptrdiff_t)); break;
+                    default: PG_LOG_PACK(uint64_t, va_arg(args, unsigned int)); break;
+                }
+                break;
+
+            case 'c':
+                PG_LOG_PACK(int64_t, va_arg(args, int));
+                break;
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                PG_LOG_PACK(double, va_arg(args, double));
+                break;
+
+            case 'p':
+                PG_LOG_PACK(void *, va_arg(args, void *));
+                break;
+
+            case 's': {
+                // The text is copied: the caller's buffer may not outlive the call
+                const char *str = va_arg(args, const char *);
+                if (!str) str = "(null)";
+                size_t length = precision >= 0 ? strnlen(str, (size_t)precision) : strlen(str);
+                if (used + length + 1 > size) return -1;
+                memcpy(out + used, str, length);
+                out[used + length] = '\0';
+                used += length + 1;
+                break;
+            }
+
+            default:
+                return -1;
+        }
     }
-    
-    va_list args;
-    va_start(args, format);
-    
-    FILE *out = pg_log_config.log_file ? pg_log_config.log_file : stderr;
-    
-    /* Print timestamp if enabled */
-    if (pg_log_config.include_timestamp) {
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[20];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-        fprintf(out, "[%s] ", timestamp);
-    }
-    
-    /* Print log level */
-    fprintf(out, "[%s] ", log_level_strings[PG_LOG_ERROR]);
-    
-    /* Print PID if enabled */
-    if (pg_log_config.include_pid) {
-        fprintf(out, "[%d] ", getpid());
+#undef PG_LOG_PACK
+
+    return (int)used;
+}
+
+/* Format a PG_LOG_RECORD_ARGS record into a complete line */
+static int pg_log_unpack_line(char *line, const char *record, size_t record_length) {
+    PGLogArgsHeader header;
+    char spec_text[32];
+    PGLogSpec spec;
+
+    memcpy(&header, record, sizeof(header));
+    const char *args = record + sizeof(header);
+    const char *args_end = record + record_length;
+
+    int length = pg_log_format_prefix(line, (PGLogLevel)header.level, &header.time);
+    int limit = PG_LOG_LINE_MAX - 1;   /* room for the newline */
+    int n = 0;                         /* message bytes, as snprintf counts them */
+
+#define PG_LOG_UNPACK(type, var) \
+    type var; \
+    if (args + sizeof(var) > args_end) goto done; \
+    memcpy(&var, args, sizeof(var)); \
+    args += sizeof(var)
+
+    const char *p = header.format;
+    const char *text = p;
+    while ((p = pg_log_next_spec(p, &spec)) != NULL) {
+        // Literal text before the conversion, with %% collapsed
+        for (const char *t = text; t < spec.start; t++) {
+            if (t[0] == '%' && t[1] == '%') t++;
+            if (length + n < limit) line[length + n] = *t;
+            n++;
+        }
+        text = spec.end;
+
+        size_t spec_length = (size_t)(spec.end - spec.start);
+        if (spec_length >= sizeof(spec_text)) goto done;
+        memcpy(spec_text, spec.start, spec_length);
+        spec_text[spec_length] = '\0';
+
+        int stars[2] = {0, 0};
+        for (int i = 0; i < spec.stars; i++) {
+            PG_LOG_UNPACK(int, star);
+            stars[i] = star;
+        }
+
+        char *out = line + (length + n < limit ? length + n : limit);
+        size_t room = length + n < limit ? (size_t)(limit - length - n) + 1 : 1;
+        int written;
+
+#define PG_LOG_PRINT(value) \
+        (spec.stars == 0 ? snprintf(out, room, spec_text, value) : \
+         spec.stars == 1 ? snprintf(out, room, spec_text, stars[0], value) : \
+                           snprintf(out, room, spec_text, stars[0], stars[1], value))
+
+        switch (spec.conversion) {
+            case 'd': case 'i': {
+                PG_LOG_UNPACK(int64_t, v);
+                switch (spec.length) {
+                    case 'l': written = PG_LOG_PRINT((long)v); break;
+                    case 'q': written = PG_LOG_PRINT((long long)v); break;
+                    case 'z': written = PG_LOG_PRINT((ssize_t)v); break;
+                    case 'j': written = PG_LOG_PRINT((intmax_t)v); break;
+                    case 't': written = PG_LOG_PRINT((ptrdiff_t)v); break;
+                    default: written = PG_LOG_PRINT((int)v); break;
+                }
+                break;
+            }
+            case 'u': case 'o': case 'x': case 'X': {
+                PG_LOG_UNPACK(uint64_t, v);
+                switch (spec.length) {
+                    case 'l': written = PG_LOG_PRINT((unsigned long)v); break;
+                    case 'q': written = PG_LOG_PRINT((unsigned long long)v); break;
+                    case 'z': written = PG_LOG_PRINT((size_t)v); break;
+                    case 'j': written = PG_LOG_PRINT((uintmax_t)v); break;
+                    case 't': written = PG_LOG_PRINT((ptrdiff_t)v); break;
+                    default: written = PG_LOG_PRINT((unsigned int)v); break;
+                }
+                break;
+            }
+            case 'c': {
+                PG_LOG_UNPACK(int64_t, v);
+                written = PG_LOG_PRINT((int)v);
+                break;
+            }
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+                PG_LOG_UNPACK(double, v);
+                written = PG_LOG_PRINT(v);
+                break;
+            }
+            case 'p': {
+                PG_LOG_UNPACK(void *, v);
+                written = PG_LOG_PRINT(v);
+                break;
+            }
+            case 's': {
+                const char *str = args;
+                size_t str_length = strnlen(str, (size_t)(args_end - args));
+                if (str + str_length >= args_end) goto done;
+                args += str_length + 1;
+                written = PG_LOG_PRINT(str);
+                break;
+            }
+            default:
+                goto done;
+        }
+#undef PG_LOG_PRINT
+
+        if (written > 0) n += written;
     }
-    
-    /* Print the actual message */
-    vfprintf(out, format, args);
-    va_end(args);
-    
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n') {
-        fprintf(out, "\n");
+
+    // Literal text after the last conversion
+    for (const char *t = text; *t; t++) {
+        if (t[0] == '%' && t[1] == '%') t++;
+        if (length + n < limit) line[length + n] = *t;
+        n++;
     }
-    
-    /* Flush output */
-    fflush(out);
+
+done:
+#undef PG_LOG_UNPACK
+    return pg_log_end_line(line, length, n);
 }
 
-void pg_log_warning(const char *format, ...) {
-    if (PG_LOG_WARNING > pg_log_config.log_level) {
+/* Initialize logging and start the writer thread */
+void pg_log_init(FILE *log_file, PGLogLevel level) {
+    pg_log_config.log_file = log_file ? log_file : stderr;
+    pg_log_config.log_level = level;
+
+    bool running = false;
+    if (!atomic_compare_exchange_strong(&log_writer_running, &running, true)) {
         return;
     }
-    
-    va_list args;
-    va_start(args, format);
-    
-    FILE *out = pg_log_config.log_file ? pg_log_config.log_file : stderr;
-    
-    /* Print timestamp if enabled */
-    if (pg_log_config.include_timestamp) {
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[20];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-        fprintf(out, "[%s] ", timestamp);
-    }
-    
-    /* Print log level */
-    fprintf(out, "[%s] ", log_level_strings[PG_LOG_WARNING]);
-    
-    /* Print PID if enabled */
-    if (pg_log_config.include_pid) {
-        fprintf(out, "[%d] ", getpid());
+
+    char *batch = (char *)malloc(PG_LOG_BATCH_SIZE);
+    atomic_store(&log_writer_stop, false);
+    if (!batch || pthread_create(&log_writer, NULL, pg_log_writer_main, batch) != 0) {
+        /* Lines are written directly instead */
+        free(batch);
+        atomic_store(&log_writer_running, false);
+        return;
     }
-    
-    /* Print the actual message */
-    vfprintf(out, format, args);
-    va_end(args);
-    
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n') {
-        fprintf(out, "\n");
+
+    /* Lines still queued at exit are written out */
+    static bool exit_hook = false;
+    if (!exit_hook) {
+        exit_hook = true;
+        atexit(pg_log_close);
     }
-    
-    /* Flush output */
-    fflush(out);
 }
 
-void pg_log_info(const char *format, ...) {
-    if (PG_LOG_INFO > pg_log_config.log_level) {
+/* Set log level */
+void pg_log_set_level(PGLogLevel level) {
+    pg_log_config.log_level = level;
+}
+
+/* Wait until every line logged so far is written to the file */
+void pg_log_flush(void) {
+    if (!atomic_load(&log_writer_running)) {
+        fflush(pg_log_out());
         return;
     }
-    
-    va_list args;
-    va_start(args, format);
-    
-    FILE *out = pg_log_config.log_file ? pg_log_config.log_file : stderr;
-    
-    /* Print timestamp if enabled */
-    if (pg_log_config.include_timestamp) {
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[20];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-        fprintf(out, "[%s] ", timestamp);
-    }
-    
-    /* Print log level */
-    fprintf(out, "[%s] ", log_level_strings[PG_LOG_INFO]);
-    
-    /* Print PID if enabled */
-    if (pg_log_config.include_pid) {
-        fprintf(out, "[%d] ", getpid());
+
+    pthread_mutex_lock(&log_wake_lock);
+    uint64_t target = log_passes + 2;   /* a full pass that started after this call */
+    pthread_cond_signal(&log_wake);
+    while (log_passes < target && atomic_load(&log_writer_running)) {
+        pthread_cond_wait(&log_drained, &log_wake_lock);
     }
-    
-    /* Print the actual message */
-    vfprintf(out, format, args);
-    va_end(args);
-    
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n') {
-        fprintf(out, "\n");
+    pthread_mutex_unlock(&log_wake_lock);
+}
+
+/* Set log file */
+void pg_log_set_file(FILE *log_file) {
+    pg_log_flush();
+
+    pthread_mutex_lock(&log_file_lock);
+    if (pg_log_config.log_file && pg_log_config.log_file != stderr && pg_log_config.log_file != stdout) {
+        fclose(pg_log_config.log_file);
+    }
+    pg_log_config.log_file = log_file ? log_file : stderr;
+    pthread_mutex_unlock(&log_file_lock);
+}
+
+/* Number of lines dropped because a ring was full, since the last report */
+unsigned long long pg_log_dropped(void) {
+    return atomic_load(&log_dropped);
+}
+
+/* Close logging: write out what is queued, stop the writer, close the file */
+void pg_log_close(void) {
+    bool running = true;
+    if (atomic_compare_exchange_strong(&log_writer_running, &running, false)) {
+        pthread_mutex_lock(&log_wake_lock);
+        atomic_store(&log_writer_stop, true);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_lock);
+        pthread_join(log_writer, NULL);
+    }
+
+    if (pg_log_config.log_file && pg_log_config.log_file != stderr && pg_log_config.log_file != stdout) {
+        fclose(pg_log_config.log_file);
+        pg_log_config.log_file = stderr;
+    }
+}
+
+/* Queue a record for the writer, or write a line directly when there is
+   no writer */
+static void pg_log_submit(const char *record, uint32_t length) {
+    PGLogRing *ring = atomic_load(&log_writer_running) ? pg_log_thread_ring() : NULL;
+
+    if (!ring) {
+        /* No writer thread: write the line directly */
+        char line[PG_LOG_LINE_MAX];
+        if (record[0] == PG_LOG_RECORD_LINE) {
+            memcpy(line, record + 1, length - 1);
+            length -= 1;
+        } else {
+            length = (uint32_t)pg_log_unpack_line(line, record, length);
+        }
+        pthread_mutex_lock(&log_file_lock);
+        fwrite(line, 1, length, pg_log_out());
+        fflush(pg_log_out());
+        pthread_mutex_unlock(&log_file_lock);
+        return;
+    }
+
+    while (pg_log_ring_push(ring, record, length) < 0) {
+        if (!pg_log_config.block_when_full || !atomic_load(&log_writer_running)) {
+            atomic_fetch_add(&log_dropped, 1);
+            return;
+        }
+        /* Wait for the writer to make room */
+        pg_log_wake_writer();
+        sched_yield();
     }
-    
-    /* Flush output */
-    fflush(out);
+    pg_log_wake_writer();
 }
 
-void pg_log_debug(const char *format, ...) {
-    if (PG_LOG_DEBUG > pg_log_config.log_level) {
+/* Log a message at a level with a va_list */
+void pg_log_va(PGLogLevel level, const char *format, va_list args) {
+    char record[1 + PG_LOG_LINE_MAX];
+
+    if (level > pg_log_config.log_level) {
         return;
     }
-    
+
+    record[0] = PG_LOG_RECORD_LINE;
+    int length = pg_log_format_va(record + 1, level, NULL, format, args);
+    pg_log_submit(record, (uint32_t)(1 + length));
+}
+
+/* Generic log function */
+void pg_log(PGLogLevel level, const char *format, ...) {
     va_list args;
     va_start(args, format);
-    
-    FILE *out = pg_log_config.log_file ? pg_log_config.log_file : stderr;
-    
-    /* Print timestamp if enabled */
-    if (pg_log_config.include_timestamp) {
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char timestamp[20];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-        fprintf(out, "[%s] ", timestamp);
-    }
-    
-    /* Print log level */
-    fprintf(out, "[%s] ", log_level_strings[PG_LOG_DEBUG]);
-    
-    /* Print PID if enabled */
-    if (pg_log_config.include_pid) {
-        fprintf(out, "[%d] ", getpid());
+    pg_log_va(level, format, args);
+    va_end(args);
+}
+
+/* Log a message whose format is a string literal, leaving the formatting
+   to the writer thread */
+void pg_log_deferred(PGLogLevel level, const char *format, ...) {
+    char record[PG_LOG_LINE_MAX];
+    PGLogArgsHeader header;
+    va_list args;
+
+    if (level > pg_log_config.log_level) {
+        return;
     }
-    
-    /* Print the actual message */
-    vfprintf(out, format, args);
+
+    header.kind = PG_LOG_RECORD_ARGS;
+    header.level = (char)level;
+    header.format = format;
+    clock_gettime(CLOCK_REALTIME, &header.time);
+    memcpy(record, &header, sizeof(header));
+
+    va_start(args, format);
+    int length = pg_log_pack(record + sizeof(header), sizeof(record) - sizeof(header),
+                             format, args);
     va_end(args);
-    
-    /* Add newline if not present */
-    if (format[strlen(format) - 1] != '\n') {
-        fprintf(out, "\n");
+
+    if (length < 0) {
+        /* Arguments that cannot be deferred: format them now */
+        va_start(args, format);
+        pg_log_va(level, format, args);
+        va_end(args);
+        return;
     }
-    
-    /* Flush output */
-    fflush(out);
+    pg_log_submit(record, (uint32_t)(sizeof(header) + length));
 }
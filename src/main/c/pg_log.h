@@ -1,6 +1,15 @@
 /**
  * pg_log.h
  * Logging functionality for PostgreSQL Protocol Server Emulator
+ *
+ * Once pg_log_init has been called, lines are queued per thread without
+ * locking and written to the log file by a background thread.
+ *
+ * The level macros below are the cheap way to log: below the runtime level
+ * they cost one comparison, below PG_LOG_COMPILE_LEVEL they are not
+ * compiled at all, and otherwise the arguments are queued as they are and
+ * formatted by the background thread. Their format must be a string
+ * literal, and %s arguments are copied when the line is logged.
  */
 
 #ifndef PG_LOG_H
@@ -24,6 +33,7 @@ typedef struct {
     PGLogLevel log_level;    /* Current log level */
     int include_timestamp;   /* Whether to include timestamp in log messages */
     int include_pid;         /* Whether to include process ID in log messages */
+    int block_when_full;     /* Wait for room when a thread's queue is full (default: drop the line) */
 } PGLogConfig;
 
 /* Global log configuration */
@@ -38,16 +48,63 @@ void pg_log_set_level(PGLogLevel level);
 /* Set log file */
 void pg_log_set_file(FILE *log_file);
 
-/* Close logging */
+/* Wait until all queued lines are written */
+void pg_log_flush(void);
+
+/* Close logging: write queued lines and stop the writer thread */
 void pg_log_close(void);
 
-/* Log functions */
-void pg_log_error(const char *format, ...);
-void pg_log_warning(const char *format, ...);
-void pg_log_info(const char *format, ...);
-void pg_log_debug(const char *format, ...);
+/* Number of lines dropped on full queues and not yet reported in the log */
+unsigned long long pg_log_dropped(void);
+
+/* Generic log functions, formatting on the calling thread */
+void pg_log(PGLogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void pg_log_va(PGLogLevel level, const char *format, va_list args)
+    __attribute__((format(printf, 2, 0)));
+
+/* Log with formatting left to the writer thread; use the macros below */
+void pg_log_deferred(PGLogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
 
-/* Generic log function */
-void pg_log(PGLogLevel level, const char *format, ...);
+/* Most verbose level compiled in, as a PGLogLevel number; build with
+   -DPG_LOG_COMPILE_LEVEL=1 to leave info and debug logging out */
+#ifndef PG_LOG_COMPILE_LEVEL
+#define PG_LOG_COMPILE_LEVEL 3
+#endif
+
+/* Type-checks the arguments of a compiled-out call without evaluating them */
+static inline __attribute__((format(printf, 1, 2))) void pg_log_unused(const char *format, ...) {
+    (void)format;
+}
+
+#define PG_LOG_AT(level, ...) \
+    do { \
+        if ((level) <= pg_log_config.log_level) \
+            pg_log_deferred((level), "" __VA_ARGS__); \
+    } while (0)
+#define PG_LOG_NONE(...) ((void)(0 && (pg_log_unused(__VA_ARGS__), 0)))
+
+/* Log functions */
+#if PG_LOG_COMPILE_LEVEL >= 0
+#define pg_log_error(...) PG_LOG_AT(PG_LOG_ERROR, __VA_ARGS__)
+#else
+#define pg_log_error(...) PG_LOG_NONE(__VA_ARGS__)
+#endif
+#if PG_LOG_COMPILE_LEVEL >= 1
+#define pg_log_warning(...) PG_LOG_AT(PG_LOG_WARNING, __VA_ARGS__)
+#else
+#define pg_log_warning(...) PG_LOG_NONE(__VA_ARGS__)
+#endif
+#if PG_LOG_COMPILE_LEVEL >= 2
+#define pg_log_info(...) PG_LOG_AT(PG_LOG_INFO, __VA_ARGS__)
+#else
+#define pg_log_info(...) PG_LOG_NONE(__VA_ARGS__)
+#endif
+#if PG_LOG_COMPILE_LEVEL >= 3
+#define pg_log_debug(...) PG_LOG_AT(PG_LOG_DEBUG, __VA_ARGS__)
+#else
+#define pg_log_debug(...) PG_LOG_NONE(__VA_ARGS__)
+#endif
 
 #endif /* PG_LOG_H */
@@ -0,0 +1,584 @@
+/**
+ * pg_metrics.c
+ * Server Metrics
+ *
+ * This file contains the implementation of the metrics declared in
+ * pg_metrics.h: the shards, their totals, the text formats they are
+ * reported in and the HTTP endpoint Prometheus scrapes. The endpoint runs
+ * on a thread of its own, so a scrape never touches an event loop.
+ */
+
+#include "pg_metrics.h"
+#include "pg_protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define HTTP_REQUEST_MAX 4096        // longer request heads are refused
+#define HTTP_TIMEOUT_MS 1000         // for a scraper to send its request
+#define HTTP_POLL_MS 250             // how often the endpoint checks for stop
+
+struct PGMetrics {
+    int num_shards;
+    PGMetricsShard *shards;
+};
+
+struct PGMetricsServer {
+    PGMetrics *metrics;
+    int fd;                  /* Listening socket */
+    pthread_t thread;
+    atomic_bool stop;
+};
+
+/* Names of the timers, in the order of the PG_TIMER constants */
+static const char *timer_names[PG_NUM_TIMERS] = {
+    "query", "parse", "bind", "execute", "sync", "first_byte", "tls_handshake"
+};
+
+/* Quantiles reported for each timer */
+static const double report_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define NUM_REPORT_QUANTILES (sizeof(report_quantiles) / sizeof(report_quantiles[0]))
+
+/**
+ * Create the metrics with one shard per writing thread
+ *
+ * @param num_shards Number of shards
+ * @return Metrics, or NULL on allocation failure
+ */
+PGMetrics *pg_metrics_create(int num_shards) {
+    PGMetrics *metrics = (PGMetrics *)malloc(sizeof(PGMetrics));
+    if (!metrics) {
+        return NULL;
+    }
+
+    // Shards are cache-line aligned so threads never write the same line
+    void *shards = NULL;
+    if (posix_memalign(&shards, 64, (size_t)num_shards * sizeof(PGMetricsShard)) != 0) {
+        free(metrics);
+        return NULL;
+    }
+    memset(shards, 0, (size_t)num_shards * sizeof(PGMetricsShard));
+
+    metrics->num_shards = num_shards;
+    metrics->shards = (PGMetricsShard *)shards;
+    return metrics;
+}
+
+/**
+ * Free the metrics
+ *
+ * @param metrics Metrics (may be NULL)
+ */
+void pg_metrics_destroy(PGMetrics *metrics) {
+    if (metrics) {
+        free(metrics->shards);
+        free(metrics);
+    }
+}
+
+/**
+ * Get a shard
+ *
+ * @param metrics Metrics
+ * @param index Shard index
+ * @return The shard
+ */
+PGMetricsShard *pg_metrics_shard(PGMetrics *metrics, int index) {
+    return &metrics->shards[index];
+}
+
+static uint64_t pg_counter_get(const PGCounter *counter) {
+    return atomic_load_explicit((PGCounter *)counter, memory_order_relaxed);
+}
+
+/**
+ * Sum all shards
+ *
+ * The shards keep changing while they are read, so the totals are not an
+ * exact snapshot, but every counter is at least what it was at the start.
+ *
+ * @param metrics Metrics
+ * @param totals Filled with the sums
+ */
+void pg_metrics_collect(const PGMetrics *metrics, PGMetricsTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+
+    for (int s = 0; s < metrics->num_shards; s++) {
+        const PGMetricsShard *shard = &metrics->shards[s];
+
+        for (int i = 0; i < 256; i++) {
+            totals->messages_in[i] += pg_counter_get(&shard->messages_in[i]);
+            totals->messages_out[i] += pg_counter_get(&shard->messages_out[i]);
+        }
+        totals->bytes_in += pg_counter_get(&shard->bytes_in);
+        totals->bytes_out += pg_counter_get(&shard->bytes_out);
+        totals->accepts += pg_counter_get(&shard->accepts);
+        totals->rejects += pg_counter_get(&shard->rejects);
+        totals->closes += pg_counter_get(&shard->closes);
+        totals->tls_handshakes += pg_counter_get(&shard->tls_handshakes);
+        totals->tls_resumed += pg_counter_get(&shard->tls_resumed);
+        totals->tls_kernel += pg_counter_get(&shard->tls_kernel);
+        totals->auth_ok += pg_counter_get(&shard->auth_ok);
+        totals->auth_failed += pg_counter_get(&shard->auth_failed);
+        totals->cancel_requests += pg_counter_get(&shard->cancel_requests);
+        totals->cancelled += pg_counter_get(&shard->cancelled);
+        totals->skipped += pg_counter_get(&shard->skipped);
+        totals->hibernations += pg_counter_get(&shard->hibernations);
+        totals->idle_timeouts += pg_counter_get(&shard->idle_timeouts);
+        totals->auth_timeouts += pg_counter_get(&shard->auth_timeouts);
+        totals->statement_timeouts += pg_counter_get(&shard->statement_timeouts);
+        totals->lost_clients += pg_counter_get(&shard->lost_clients);
+        totals->compressed_in += pg_counter_get(&shard->compressed_in);
+        totals->compressed_out += pg_counter_get(&shard->compressed_out);
+
+        for (int t = 0; t < PG_NUM_TIMERS; t++) {
+            const PGHistogram *histogram = &shard->timers[t];
+            PGHistogramTotals *total = &totals->timers[t];
+
+            for (int b = 0; b < PG_HISTOGRAM_BUCKETS; b++) {
+                total->buckets[b] += pg_counter_get(&histogram->buckets[b]);
+            }
+            total->count += pg_counter_get(&histogram->count);
+            total->sum += pg_counter_get(&histogram->sum);
+            uint64_t max = pg_counter_get(&histogram->max);
+            if (max > total->max) {
+                total->max = max;
+            }
+        }
+    }
+
+    // A connection is closed on the shard that accepted it, but closes may
+    // have been read later than accepts
+    totals->connections = totals->accepts > totals->closes ? totals->accepts - totals->closes : 0;
+}
+
+/* Smallest and one past the largest value of a bucket */
+static void pg_histogram_bucket_range(int bucket, uint64_t *low, uint64_t *high) {
+    if (bucket < (2 << PG_HISTOGRAM_SUB_BITS)) {
+        *low = (uint64_t)bucket;
+        *high = (uint64_t)bucket + 1;
+        return;
+    }
+    int shift = (bucket >> PG_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(bucket - (shift << PG_HISTOGRAM_SUB_BITS));
+    *low = sub << shift;
+    *high = (sub + 1) << shift;
+}
+
+/**
+ * Estimate a quantile of a histogram
+ *
+ * @param histogram Histogram totals
+ * @param quantile Quantile between 0 and 1
+ * @return Middle of the bucket holding the quantile, capped at the
+ *         largest value recorded; 0 for an empty histogram
+ */
+uint64_t pg_histogram_quantile(const PGHistogramTotals *histogram, double quantile) {
+    uint64_t count = 0;
+    for (int b = 0; b < PG_HISTOGRAM_BUCKETS; b++) {
+        count += histogram->buckets[b];
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // Rank of the value, 1-based
+    uint64_t rank = (uint64_t)(quantile * (double)count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < PG_HISTOGRAM_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank) {
+            uint64_t low, high;
+            pg_histogram_bucket_range(b, &low, &high);
+            uint64_t value = low + (high - low) / 2;
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Get the name of a timer
+ *
+ * @param timer PG_TIMER constant
+ * @return Timer name
+ */
+const char *pg_timer_name(int timer) {
+    return timer >= 0 && timer < PG_NUM_TIMERS ? timer_names[timer] : "unknown";
+}
+
+/* Name of a message type for reports; unknown types are shown by code */
+static const char *pg_metrics_message_label(int type, bool backend, char *buf, size_t size) {
+    const char *name = pg_message_name((char)type, backend);
+    if (name) {
+        return name;
+    }
+    snprintf(buf, size, "0x%02x", type);
+    return buf;
+}
+
+static int pg_metrics_printf(PGBuffer *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Append formatted text to a buffer */
+static int pg_metrics_printf(PGBuffer *out, const char *format, ...) {
+    va_list args;
+
+    for (size_t room = 256;; ) {
+        if (pg_buffer_reserve(out, room) < 0) {
+            return -1;
+        }
+        va_start(args, format);
+        int n = vsnprintf(pg_buffer_write_ptr(out), pg_buffer_writable(out), format, args);
+        va_end(args);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < pg_buffer_writable(out)) {
+            pg_buffer_commit(out, (size_t)n);
+            return 0;
+        }
+        room = (size_t)n + 1;
+    }
+}
+
+/**
+ * Format totals in the Prometheus text exposition format
+ *
+ * Latencies are reported as summaries in seconds: the quantiles come from
+ * the histogram buckets, so they are accurate to a few percent.
+ *
+ * @param totals Metrics totals
+ * @param out Buffer the text is appended to
+ * @return 0 on success, -1 on allocation failure
+ */
+int pg_metrics_format_prometheus(const PGMetricsTotals *totals, PGBuffer *out) {
+    static const struct {
+        const char *name;
+        const char *help;
+        const char *type;
+        size_t offset;
+    } scalars[] = {
+        {"pgprotocol_connections", "Open client connections", "gauge",
+         offsetof(PGMetricsTotals, connections)},
+        {"pgprotocol_connections_accepted_total", "Client connections accepted", "counter",
+         offsetof(PGMetricsTotals, accepts)},
+        {"pgprotocol_connections_rejected_total", "Client connections refused", "counter",
+         offsetof(PGMetricsTotals, rejects)},
+        {"pgprotocol_connections_closed_total", "Client connections closed", "counter",
+         offsetof(PGMetricsTotals, closes)},
+        {"pgprotocol_tls_handshakes_total", "TLS handshakes completed", "counter",
+         offsetof(PGMetricsTotals, tls_handshakes)},
+        {"pgprotocol_tls_resumed_total", "TLS handshakes that resumed a session", "counter",
+         offsetof(PGMetricsTotals, tls_resumed)},
+        {"pgprotocol_tls_kernel_total", "TLS connections with kernel encryption (kTLS)", "counter",
+         offsetof(PGMetricsTotals, tls_kernel)},
+        {"pgprotocol_auth_ok_total", "SCRAM-SHA-256 logins that succeeded", "counter",
+         offsetof(PGMetricsTotals, auth_ok)},
+        {"pgprotocol_auth_failed_total", "SCRAM-SHA-256 logins that failed", "counter",
+         offsetof(PGMetricsTotals, auth_failed)},
+        {"pgprotocol_cancel_requests_total", "CancelRequests that matched a connection", "counter",
+         offsetof(PGMetricsTotals, cancel_requests)},
+        {"pgprotocol_cancelled_total", "Statements interrupted by a CancelRequest", "counter",
+         offsetof(PGMetricsTotals, cancelled)},
+        {"pgprotocol_skipped_total", "Messages discarded up to Sync after an extended-protocol error", "counter",
+         offsetof(PGMetricsTotals, skipped)},
+        {"pgprotocol_hibernations_total", "Idle connections that gave their buffers back to the pool", "counter",
+         offsetof(PGMetricsTotals, hibernations)},
+        {"pgprotocol_idle_timeouts_total", "Sessions ended by idle_session_timeout or idle_in_transaction_session_timeout",
+         "counter", offsetof(PGMetricsTotals, idle_timeouts)},
+        {"pgprotocol_auth_timeouts_total", "Connections closed by authentication_timeout", "counter",
+         offsetof(PGMetricsTotals, auth_timeouts)},
+        {"pgprotocol_statement_timeouts_total", "Statements interrupted by statement_timeout", "counter",
+         offsetof(PGMetricsTotals, statement_timeouts)},
+        {"pgprotocol_lost_clients_total", "Clients found disconnected while a statement ran", "counter",
+         offsetof(PGMetricsTotals, lost_clients)},
+        {"pgprotocol_compressed_input_bytes_total", "DataRow and CopyData bytes sent as CompressedData", "counter",
+         offsetof(PGMetricsTotals, compressed_in)},
+        {"pgprotocol_compressed_output_bytes_total", "Bytes of the CompressedData messages replacing them", "counter",
+         offsetof(PGMetricsTotals, compressed_out)},
+        {"pgprotocol_received_bytes_total", "Bytes read from clients", "counter",
+         offsetof(PGMetricsTotals, bytes_in)},
+        {"pgprotocol_sent_bytes_total", "Bytes written to clients", "counter",
+         offsetof(PGMetricsTotals, bytes_out)},
+    };
+    char label[8];
+    int result = 0;
+
+    for (size_t i = 0; i < sizeof(scalars) / sizeof(scalars[0]); i++) {
+        uint64_t value;
+        memcpy(&value, (const char *)totals + scalars[i].offset, sizeof(value));
+        result |= pg_metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                                    scalars[i].name, scalars[i].help,
+                                    scalars[i].name, scalars[i].type,
+                                    scalars[i].name, (unsigned long long)value);
+    }
+
+    for (int backend = 0; backend <= 1; backend++) {
+        const char *name = backend ? "pgprotocol_messages_sent_total" : "pgprotocol_messages_received_total";
+        const uint64_t *counts = backend ? totals->messages_out : totals->messages_in;
+
+        result |= pg_metrics_printf(out, "# HELP %s Protocol messages %s by type\n# TYPE %s counter\n",
+                                    name, backend ? "sent" : "received", name);
+        for (int type = 0; type < 256; type++) {
+            if (counts[type] > 0) {
+                result |= pg_metrics_printf(out, "%s{type=\"%s\"} %llu\n", name,
+                                            pg_metrics_message_label(type, backend, label, sizeof(label)),
+                                            (unsigned long long)counts[type]);
+            }
+        }
+    }
+
+    result |= pg_metrics_printf(out, "# HELP pgprotocol_latency_seconds Time spent handling requests\n"
+                                     "# TYPE pgprotocol_latency_seconds summary\n");
+    for (int t = 0; t < PG_NUM_TIMERS; t++) {
+        const PGHistogramTotals *histogram = &totals->timers[t];
+
+        for (size_t q = 0; q < NUM_REPORT_QUANTILES; q++) {
+            result |= pg_metrics_printf(out, "pgprotocol_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n",
+                                        timer_names[t], report_quantiles[q],
+                                        pg_histogram_quantile(histogram, report_quantiles[q]) / 1e9);
+        }
+        result |= pg_metrics_printf(out, "pgprotocol_latency_seconds_sum{op=\"%s\"} %.9f\n"
+                                         "pgprotocol_latency_seconds_count{op=\"%s\"} %llu\n",
+                                    timer_names[t], histogram->sum / 1e9,
+                                    timer_names[t], (unsigned long long)histogram->count);
+    }
+
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * Produce the rows of SHOW pgprotocol_stats
+ *
+ * Message counts are listed only for the types seen; latencies are in
+ * microseconds.
+ *
+ * @param totals Metrics totals
+ * @param callback Called with each name and value; a negative return stops
+ * @param arg Passed to the callback
+ * @return 0 on success, or the callback's negative return
+ */
+int pg_metrics_rows(const PGMetricsTotals *totals, PGMetricsRowCallback callback, void *arg) {
+    char name[64];
+    char label[8];
+    int result;
+
+#define PG_METRICS_ROW(row_name, value) \
+    if ((result = callback(arg, (row_name), (int64_t)(value))) < 0) return result
+
+    PG_METRICS_ROW("connections", totals->connections);
+    PG_METRICS_ROW("connections_accepted", totals->accepts);
+    PG_METRICS_ROW("connections_rejected", totals->rejects);
+    PG_METRICS_ROW("connections_closed", totals->closes);
+    PG_METRICS_ROW("tls_handshakes", totals->tls_handshakes);
+    PG_METRICS_ROW("tls_resumed", totals->tls_resumed);
+    PG_METRICS_ROW("tls_kernel", totals->tls_kernel);
+    PG_METRICS_ROW("auth_ok", totals->auth_ok);
+    PG_METRICS_ROW("auth_failed", totals->auth_failed);
+    PG_METRICS_ROW("cancel_requests", totals->cancel_requests);
+    PG_METRICS_ROW("cancelled", totals->cancelled);
+    PG_METRICS_ROW("skipped", totals->skipped);
+    PG_METRICS_ROW("hibernations", totals->hibernations);
+    PG_METRICS_ROW("idle_timeouts", totals->idle_timeouts);
+    PG_METRICS_ROW("auth_timeouts", totals->auth_timeouts);
+    PG_METRICS_ROW("statement_timeouts", totals->statement_timeouts);
+    PG_METRICS_ROW("lost_clients", totals->lost_clients);
+    PG_METRICS_ROW("compressed_in", totals->compressed_in);
+    PG_METRICS_ROW("compressed_out", totals->compressed_out);
+    PG_METRICS_ROW("bytes_received", totals->bytes_in);
+    PG_METRICS_ROW("bytes_sent", totals->bytes_out);
+
+    for (int backend = 0; backend <= 1; backend++) {
+        const uint64_t *counts = backend ? totals->messages_out : totals->messages_in;
+        for (int type = 0; type < 256; type++) {
+            if (counts[type] > 0) {
+                snprintf(name, sizeof(name), "%s.%s", backend ? "sent" : "received",
+                         pg_metrics_message_label(type, backend, label, sizeof(label)));
+                PG_METRICS_ROW(name, counts[type]);
+            }
+        }
+    }
+
+    for (int t = 0; t < PG_NUM_TIMERS; t++) {
+        const PGHistogramTotals *histogram = &totals->timers[t];
+
+        snprintf(name, sizeof(name), "%s.count", timer_names[t]);
+        PG_METRICS_ROW(name, histogram->count);
+        snprintf(name, sizeof(name), "%s.p50_us", timer_names[t]);
+        PG_METRICS_ROW(name, pg_histogram_quantile(histogram, 0.5) / 1000);
+        snprintf(name, sizeof(name), "%s.p99_us", timer_names[t]);
+        PG_METRICS_ROW(name, pg_histogram_quantile(histogram, 0.99) / 1000);
+        snprintf(name, sizeof(name), "%s.max_us", timer_names[t]);
+        PG_METRICS_ROW(name, histogram->max / 1000);
+    }
+#undef PG_METRICS_ROW
+
+    return 0;
+}
+
+/* Write all of a buffer to a blocking socket */
+static int pg_metrics_write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Answer one HTTP request: GET /metrics (or /) returns the metrics */
+static void pg_metrics_handle_http(PGMetricsServer *server, int fd) {
+    char request[HTTP_REQUEST_MAX];
+    size_t length = 0;
+    PGBuffer body;
+    PGBuffer reply;
+
+    // Read the request head; the body, if any, is ignored
+    while (length < sizeof(request) - 1) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, HTTP_TIMEOUT_MS) <= 0) {
+            return;
+        }
+        ssize_t n = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return;
+        }
+        length += (size_t)n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    pg_buffer_init(&body);
+    pg_buffer_init(&reply);
+
+    const char *status = "200 OK";
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        PGMetricsTotals *totals = (PGMetricsTotals *)malloc(sizeof(PGMetricsTotals));
+        if (totals) {
+            pg_metrics_collect(server->metrics, totals);
+        }
+        if (!totals || pg_metrics_format_prometheus(totals, &body) < 0) {
+            status = "500 Internal Server Error";
+            pg_buffer_truncate(&body, 0);
+        }
+        free(totals);
+    } else if (strncmp(request, "GET ", 4) == 0) {
+        status = "404 Not Found";
+    } else {
+        status = "405 Method Not Allowed";
+    }
+
+    if (pg_metrics_printf(&reply, "HTTP/1.0 %s\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n"
+                                  "Connection: close\r\n\r\n",
+                          status, pg_buffer_length(&body)) == 0 &&
+        pg_metrics_write_all(fd, pg_buffer_read_ptr(&reply), pg_buffer_length(&reply)) == 0 &&
+        pg_buffer_length(&body) > 0) {
+        pg_metrics_write_all(fd, pg_buffer_read_ptr(&body), pg_buffer_length(&body));
+    }
+
+    pg_buffer_free(&body);
+    pg_buffer_free(&reply);
+}
+
+/* Endpoint thread: serves one scrape at a time until stopped */
+static void *pg_metrics_server_main(void *arg) {
+    PGMetricsServer *server = (PGMetricsServer *)arg;
+
+    while (!atomic_load(&server->stop)) {
+        struct pollfd pfd = {server->fd, POLLIN, 0};
+        if (poll(&pfd, 1, HTTP_POLL_MS) <= 0) {
+            continue;
+        }
+
+        int fd = accept(server->fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        // The listener is non-blocking; the connection is served blocking
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        pg_metrics_handle_http(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Serve the metrics over HTTP for Prometheus
+ *
+ * @param metrics Metrics
+ * @param port TCP port to listen on
+ * @return Endpoint, or NULL if the port cannot be opened
+ */
+PGMetricsServer *pg_metrics_serve(PGMetrics *metrics, int port) {
+    struct sockaddr_in addr;
+    int opt = 1;
+
+    PGMetricsServer *server = (PGMetricsServer *)calloc(1, sizeof(PGMetricsServer));
+    if (!server) {
+        return NULL;
+    }
+    server->metrics = metrics;
+    atomic_init(&server->stop, false);
+
+    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->fd < 0) {
+        free(server);
+        return NULL;
+    }
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    fcntl(server->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(server->fd, F_SETFL, fcntl(server->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(server->fd, 16) < 0 ||
+        pthread_create(&server->thread, NULL, pg_metrics_server_main, server) != 0) {
+        close(server->fd);
+        free(server);
+        return NULL;
+    }
+    return server;
+}
+
+/**
+ * Stop the HTTP endpoint and free it
+ *
+ * @param server Endpoint (may be NULL)
+ */
+void pg_metrics_server_stop(PGMetricsServer *server) {
+    if (server) {
+        atomic_store(&server->stop, true);
+        pthread_join(server->thread, NULL);
+        close(server->fd);
+        free(server);
+    }
+}
@@ -0,0 +1,164 @@
+/**
+ * pg_metrics.h
+ * Server Metrics
+ *
+ * This file contains declarations for the server's counters and latency
+ * histograms. Each event loop thread updates a shard of its own, so
+ * recording is a plain load and store with no locking or atomic
+ * read-modify-write; readers sum the shards. The totals are exported as
+ * Prometheus text over HTTP and as rows of SHOW pgprotocol_stats.
+ */
+
+#ifndef PG_METRICS_H
+#define PG_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "pg_buffer.h"
+
+/* Timed operations */
+#define PG_TIMER_QUERY       0   /* Query callback */
+#define PG_TIMER_PARSE       1   /* Parse, including the callback */
+#define PG_TIMER_BIND        2   /* Bind, including the callback */
+#define PG_TIMER_EXECUTE     3   /* Execute callback */
+#define PG_TIMER_SYNC        4   /* Sync callback */
+#define PG_TIMER_FIRST_BYTE  5   /* From reading a request to writing the first byte of its reply */
+#define PG_TIMER_TLS         6   /* TLS handshake, from the SSLRequest or ClientHello to its end */
+#define PG_NUM_TIMERS        7
+
+/* Histogram buckets: values below 32 ns are exact, then each power of two
+   is split into 16 buckets (at most 6% apart), up to 2^40 ns (18 minutes) */
+#define PG_HISTOGRAM_SUB_BITS 4
+#define PG_HISTOGRAM_MAX_BITS 40
+#define PG_HISTOGRAM_BUCKETS  ((PG_HISTOGRAM_MAX_BITS - PG_HISTOGRAM_SUB_BITS + 1) << PG_HISTOGRAM_SUB_BITS)
+
+typedef _Atomic uint64_t PGCounter;
+
+/* Latency histogram in nanoseconds */
+typedef struct {
+    PGCounter buckets[PG_HISTOGRAM_BUCKETS];
+    PGCounter count;
+    PGCounter sum;
+    PGCounter max;
+} PGHistogram;
+
+/* Metrics written by one thread, on cache lines of its own */
+typedef struct {
+    _Alignas(64) PGCounter messages_in[256];  /* Frontend messages by type byte (0: startup packets) */
+    PGCounter messages_out[256];              /* Backend messages by type byte */
+    PGCounter bytes_in;
+    PGCounter bytes_out;
+    PGCounter accepts;                        /* Connections accepted */
+    PGCounter rejects;                        /* Connections refused (limit reached, no memory or no descriptors) */
+    PGCounter closes;                         /* Accepted connections closed */
+    PGCounter tls_handshakes;                 /* TLS handshakes completed */
+    PGCounter tls_resumed;                    /* Of those, resumed sessions */
+    PGCounter tls_kernel;                     /* Of those, with kernel TLS encrypting writes */
+    PGCounter auth_ok;                        /* SCRAM logins that succeeded */
+    PGCounter auth_failed;                    /* SCRAM logins that failed */
+    PGCounter cancel_requests;                /* CancelRequests matching a connection */
+    PGCounter cancelled;                      /* Statements interrupted by one */
+    PGCounter skipped;                        /* Messages discarded up to Sync after an error */
+    PGCounter hibernations;                   /* Idle connections that gave their buffers back */
+    PGCounter idle_timeouts;                  /* Sessions ended by an idle timeout */
+    PGCounter auth_timeouts;                  /* Connections closed before finishing authentication */
+    PGCounter statement_timeouts;             /* Statements interrupted by statement_timeout */
+    PGCounter lost_clients;                   /* Clients found gone while a statement ran */
+    PGCounter compressed_in;                  /* Message bytes replaced by CompressedData */
+    PGCounter compressed_out;                 /* Bytes of the CompressedData replacing them */
+    PGHistogram timers[PG_NUM_TIMERS];
+} PGMetricsShard;
+
+typedef struct PGMetrics PGMetrics;
+typedef struct PGMetricsServer PGMetricsServer;
+
+/* Totals of all shards; same layout, read once */
+typedef struct {
+    uint64_t buckets[PG_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} PGHistogramTotals;
+
+typedef struct {
+    uint64_t messages_in[256];
+    uint64_t messages_out[256];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t accepts;
+    uint64_t rejects;
+    uint64_t closes;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_kernel;
+    uint64_t auth_ok;
+    uint64_t auth_failed;
+    uint64_t cancel_requests;
+    uint64_t cancelled;
+    uint64_t skipped;
+    uint64_t hibernations;
+    uint64_t idle_timeouts;
+    uint64_t auth_timeouts;
+    uint64_t statement_timeouts;
+    uint64_t lost_clients;
+    uint64_t compressed_in;
+    uint64_t compressed_out;
+    uint64_t connections;    /* Open connections: accepts minus closes */
+    PGHistogramTotals timers[PG_NUM_TIMERS];
+} PGMetricsTotals;
+
+/* Called for each row of SHOW pgprotocol_stats */
+typedef int (*PGMetricsRowCallback)(void *arg, const char *name, int64_t value);
+
+/* Function declarations */
+PGMetrics *pg_metrics_create(int num_shards);
+void pg_metrics_destroy(PGMetrics *metrics);
+PGMetricsShard *pg_metrics_shard(PGMetrics *metrics, int index);
+
+void pg_metrics_collect(const PGMetrics *metrics, PGMetricsTotals *totals);
+uint64_t pg_histogram_quantile(const PGHistogramTotals *histogram, double quantile);
+const char *pg_timer_name(int timer);
+int pg_metrics_format_prometheus(const PGMetricsTotals *totals, PGBuffer *out);
+int pg_metrics_rows(const PGMetricsTotals *totals, PGMetricsRowCallback callback, void *arg);
+
+PGMetricsServer *pg_metrics_serve(PGMetrics *metrics, int port);
+void pg_metrics_server_stop(PGMetricsServer *server);
+
+/* Add to a counter. Only the shard's own thread writes it, so a relaxed
+   load and store is enough; readers may see a slightly stale value. */
+static inline void pg_counter_add(PGCounter *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+/* Monotonic clock in nanoseconds */
+static inline uint64_t pg_metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* Bucket of a value */
+static inline int pg_histogram_bucket(uint64_t value) {
+    if (value < (2u << PG_HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    if (value >> PG_HISTOGRAM_MAX_BITS) {
+        return PG_HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = 63 - __builtin_clzll(value) - PG_HISTOGRAM_SUB_BITS;
+    return (shift << PG_HISTOGRAM_SUB_BITS) + (int)(value >> shift);
+}
+
+/* Record a latency in nanoseconds */
+static inline void pg_histogram_record(PGHistogram *histogram, uint64_t value) {
+    pg_counter_add(&histogram->buckets[pg_histogram_bucket(value)], 1);
+    pg_counter_add(&histogram->count, 1);
+    pg_counter_add(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+#endif /* PG_METRICS_H */
@@ -0,0 +1,1560 @@
+/**
+ * pg_pool.c
+ * Upstream Connection Pooler
+ *
+ * This file contains the implementation of the pooler declared in
+ * pg_pool.h. Every request forwarded upstream leaves an entry in its
+ * connection's queue of pending replies, saying which message ends the
+ * reply and whether the reply goes to the client; replies of statements the
+ * pooler prepares on its own are dropped, and replies it makes up (for a
+ * statement already prepared on the connection) wait in the queue so that
+ * the client gets everything in order. After an ErrorResponse the server
+ * skips messages up to Sync, and so does the queue.
+ */
+
+#include "pg_pool.h"
+#include "pg_server.h"
+#include "pg_protocol.h"
+#include "pg_auth.h"
+#include "pg_log.h"
+#include "pg_simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include "/usr/local/pgsql/18/include/server/libpq/protocol.h"
+
+#define POOL_READ_SIZE (64 * 1024)          // read size for upstream replies
+#define POOL_HIGH_WATER (256 * 1024)        // client input pauses while this much waits to go upstream
+#define POOL_STATEMENT_PREFIX "pgpool_"     // names of the statements prepared upstream
+#define POOL_MESSAGE_MAX 1024               // longest authentication message built here
+
+/* What ends the reply to a request sent upstream */
+typedef enum {
+    PENDING_PARSE,           /* ParseComplete */
+    PENDING_BIND,            /* BindComplete */
+    PENDING_CLOSE,           /* CloseComplete */
+    PENDING_DESCRIBE,        /* RowDescription or NoData */
+    PENDING_EXECUTE,         /* CommandComplete, EmptyQueryResponse or PortalSuspended */
+    PENDING_SYNC,            /* ReadyForQuery after Sync */
+    PENDING_QUERY,           /* ReadyForQuery after Query or FunctionCall */
+    PENDING_REPLY            /* Nothing was sent: the reply made up here waits its turn */
+} PGPendingKind;
+
+/* Request awaiting its reply */
+typedef struct {
+    PGPendingKind kind;
+    bool swallow;            /* Sent by the pooler: the reply is not forwarded */
+    uint32_t statement;      /* Statement a Parse prepares (0: none) */
+    char *reply;             /* PENDING_REPLY: whole message for the client */
+    int reply_length;
+} PGPending;
+
+typedef enum {
+    BACKEND_UNUSED,          /* No connection */
+    BACKEND_CONNECTING,      /* TCP connect in progress */
+    BACKEND_STARTUP,         /* Logging in */
+    BACKEND_IDLE,            /* In the pool */
+    BACKEND_ACTIVE           /* Serving a client */
+} PGBackendState;
+
+/* Upstream connection */
+struct PGBackend {
+    int fd;                  /* Socket, -1 when unused */
+    PGBackendState state;
+    PGPool *pool;            /* Pool the connection belongs to */
+    PGClientConn *client;    /* Client being served (BACKEND_ACTIVE) */
+    PGBuffer in;             /* Replies not yet framed */
+    PGBuffer out;            /* Requests not yet written */
+    int watch_events;        /* Events the loop watches the socket for */
+    bool read_paused;        /* The client is not reading; replies wait in the socket */
+    bool synced;             /* No request was sent since the last ReadyForQuery */
+    PGPending *pending;      /* Ring of requests awaiting replies */
+    size_t pending_head;     /* Index of the oldest */
+    size_t pending_count;    /* Number of entries */
+    size_t pending_capacity; /* Size of the ring (power of two) */
+    size_t pending_syncs;    /* Entries ended by ReadyForQuery */
+    uint32_t *prepared;      /* Statements prepared on this connection (open addressing, 0: empty) */
+    size_t prepared_mask;    /* Size of the set - 1 (0: not allocated) */
+    size_t prepared_count;
+    int32_t pid;             /* BackendKeyData, for forwarding cancel requests */
+    int32_t key;
+    PGScramClient *scram;    /* SCRAM exchange while logging in */
+    bool capture;            /* Records the server's ParameterStatus messages for the pool */
+    PGBackend *next_idle;    /* Link in the pool's idle stack */
+};
+
+/* Statement prepared upstream for the clients of a pool, keyed by the Parse
+   message after the name: query text and parameter types */
+typedef struct PGPoolStatement {
+    struct PGPoolStatement *next;
+    uint64_t hash;
+    uint32_t id;             /* Upstream name is POOL_STATEMENT_PREFIX<id> */
+    size_t key_length;
+    char key[];
+} PGPoolStatement;
+
+struct PGPool {
+    PGWorker *worker;        /* Worker whose loop runs the pool */
+    PGPoolConfig config;
+    struct sockaddr_storage addr; /* Upstream address, resolved once */
+    socklen_t addr_len;
+    PGBackend *backends;     /* config.size connections */
+    int open;                /* Connections not BACKEND_UNUSED */
+    int connecting;          /* Of those, not yet logged in */
+    PGBackend *idle;         /* Logged in and free */
+    PGClientConn *wait_head; /* Clients waiting for a connection, oldest first */
+    PGClientConn *wait_tail;
+    PGPoolStatement **statements; /* Hash table of statements (chained) */
+    size_t statements_mask;
+    size_t statements_count;
+    uint32_t next_statement; /* Id of the next statement */
+    PGBuffer parameters;     /* ParameterStatus messages of the first login */
+    bool have_parameters;    /* parameters is complete */
+    PGBackend *capturing;    /* Login recording the parameters, or NULL */
+};
+
+/* CancelRequest forwarded upstream from an executor thread */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int32_t pid;
+    int32_t key;
+} PGPoolCancel;
+
+static void pg_backend_close(PGBackend *backend, const char *code, const char *message);
+static int pg_backend_flush(PGBackend *backend);
+static void pg_pool_hand_over(PGPool *pool, PGBackend *backend);
+static int pg_pool_finish_reply(PGBackend *backend);
+
+static PGServer *pg_pool_server(PGPool *pool) {
+    return pool->worker->server;
+}
+
+/* Messages */
+
+static void pg_put_int32(char *p, int32_t value) {
+    uint32_t n = htonl((uint32_t)value);
+    memcpy(p, &n, 4);
+}
+
+static int32_t pg_get_int32(const char *p) {
+    uint32_t n;
+    memcpy(&n, p, 4);
+    return (int32_t)ntohl(n);
+}
+
+// Append a message built from pieces to an upstream connection's output
+static int pg_backend_put(PGBackend *backend, char type, const void *a, size_t a_length,
+                          const void *b, size_t b_length) {
+    char header[5];
+    header[0] = type;
+    pg_put_int32(header + 1, (int32_t)(4 + a_length + b_length));
+    if (pg_buffer_reserve(&backend->out, 5 + a_length + b_length) < 0) {
+        return -1;
+    }
+    pg_buffer_append(&backend->out, header, 5);
+    if (a_length > 0) pg_buffer_append(&backend->out, a, a_length);
+    if (b_length > 0) pg_buffer_append(&backend->out, b, b_length);
+    return 0;
+}
+
+// ErrorResponse message as bytes, for replies that wait in the queue
+static char *pg_pool_error_message(const char *code, const char *message, int *length) {
+    size_t n = 1 + 4 + 1 + sizeof("ERROR") + 1 + strlen(code) + 1 + 1 + strlen(message) + 1 + 1;
+    char *data = (char *)malloc(n);
+    if (!data) {
+        return NULL;
+    }
+    data[0] = PqMsg_ErrorResponse;
+    pg_put_int32(data + 1, (int32_t)(n - 1));
+    char *p = data + 5;
+    *p++ = PG_ERR_SEVERITY;
+    memcpy(p, "ERROR", sizeof("ERROR"));
+    p += sizeof("ERROR");
+    *p++ = PG_ERR_CODE;
+    memcpy(p, code, strlen(code) + 1);
+    p += strlen(code) + 1;
+    *p++ = PG_ERR_MESSAGE;
+    memcpy(p, message, strlen(message) + 1);
+    p += strlen(message) + 1;
+    *p = '\0';
+    *length = (int)n;
+    return data;
+}
+
+/* Pending replies */
+
+static PGPending *pg_backend_push(PGBackend *backend, PGPendingKind kind) {
+    if (backend->pending_count == backend->pending_capacity) {
+        size_t capacity = backend->pending_capacity ? backend->pending_capacity * 2 : 16;
+        PGPending *ring = (PGPending *)malloc(capacity * sizeof(PGPending));
+        if (!ring) {
+            return NULL;
+        }
+        for (size_t i = 0; i < backend->pending_count; i++) {
+            ring[i] = backend->pending[(backend->pending_head + i) & (backend->pending_capacity - 1)];
+        }
+        free(backend->pending);
+        backend->pending = ring;
+        backend->pending_head = 0;
+        backend->pending_capacity = capacity;
+    }
+
+    PGPending *entry = &backend->pending[(backend->pending_head + backend->pending_count) &
+                                         (backend->pending_capacity - 1)];
+    memset(entry, 0, sizeof(*entry));
+    entry->kind = kind;
+    backend->pending_count++;
+    if (kind != PENDING_REPLY) {
+        backend->synced = false;
+    }
+    if (kind == PENDING_SYNC || kind == PENDING_QUERY) {
+        backend->pending_syncs++;
+    }
+    return entry;
+}
+
+static PGPending *pg_backend_head(PGBackend *backend) {
+    return backend->pending_count ? &backend->pending[backend->pending_head] : NULL;
+}
+
+static void pg_backend_pop(PGBackend *backend) {
+    PGPending *entry = &backend->pending[backend->pending_head];
+    if (entry->kind == PENDING_SYNC || entry->kind == PENDING_QUERY) {
+        backend->pending_syncs--;
+    }
+    free(entry->reply);
+    backend->pending_head = (backend->pending_head + 1) & (backend->pending_capacity - 1);
+    backend->pending_count--;
+}
+
+// Queue a reply made up here; with nothing ahead of it, it goes out at once
+static int pg_backend_reply(PGBackend *backend, char *reply, int length) {
+    if (!reply) {
+        return -1;
+    }
+    if (backend->pending_count == 0) {
+        int result = pg_server_send(backend->client, reply, (size_t)length);
+        pg_server_end_message(backend->client, reply[0]);
+        free(reply);
+        return result;
+    }
+    PGPending *entry = pg_backend_push(backend, PENDING_REPLY);
+    if (!entry) {
+        free(reply);
+        return -1;
+    }
+    entry->reply = reply;
+    entry->reply_length = length;
+    return 0;
+}
+
+static int pg_backend_reply_complete(PGBackend *backend, char type) {
+    char *reply = (char *)malloc(5);
+    if (reply) {
+        reply[0] = type;
+        pg_put_int32(reply + 1, 4);
+    }
+    return pg_backend_reply(backend, reply, 5);
+}
+
+/* Statements */
+
+static uint64_t pg_pool_hash(const char *data, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Id of the upstream statement for a query and parameter types, adding it if new
+static uint32_t pg_pool_statement_id(PGPool *pool, const char *key, size_t key_length) {
+    uint64_t hash = pg_pool_hash(key, key_length);
+
+    if (pool->statements) {
+        for (PGPoolStatement *s = pool->statements[hash & pool->statements_mask]; s; s = s->next) {
+            if (s->hash == hash && s->key_length == key_length && memcmp(s->key, key, key_length) == 0) {
+                return s->id;
+            }
+        }
+    }
+
+    if (!pool->statements || pool->statements_count >= pool->statements_mask + 1) {
+        size_t size = pool->statements ? (pool->statements_mask + 1) * 2 : 64;
+        PGPoolStatement **table = (PGPoolStatement **)calloc(size, sizeof(PGPoolStatement *));
+        if (!table) {
+            return 0;
+        }
+        for (size_t i = 0; pool->statements && i <= pool->statements_mask; i++) {
+            PGPoolStatement *s = pool->statements[i];
+            while (s) {
+                PGPoolStatement *next = s->next;
+                s->next = table[s->hash & (size - 1)];
+                table[s->hash & (size - 1)] = s;
+                s = next;
+            }
+        }
+        free(pool->statements);
+        pool->statements = table;
+        pool->statements_mask = size - 1;
+    }
+
+    PGPoolStatement *statement = (PGPoolStatement *)malloc(sizeof(PGPoolStatement) + key_length);
+    if (!statement) {
+        return 0;
+    }
+    statement->hash = hash;
+    statement->id = ++pool->next_statement;
+    statement->key_length = key_length;
+    memcpy(statement->key, key, key_length);
+    statement->next = pool->statements[hash & pool->statements_mask];
+    pool->statements[hash & pool->statements_mask] = statement;
+    pool->statements_count++;
+    return statement->id;
+}
+
+static bool pg_backend_has_statement(const PGBackend *backend, uint32_t id) {
+    if (!backend->prepared) {
+        return false;
+    }
+    for (size_t i = id & backend->prepared_mask;; i = (i + 1) & backend->prepared_mask) {
+        if (backend->prepared[i] == id) return true;
+        if (backend->prepared[i] == 0) return false;
+    }
+}
+
+static int pg_backend_add_statement(PGBackend *backend, uint32_t id) {
+    if (!backend->prepared || (backend->prepared_count + 1) * 2 > backend->prepared_mask + 1) {
+        size_t size = backend->prepared ? (backend->prepared_mask + 1) * 2 : 64;
+        uint32_t *set = (uint32_t *)calloc(size, sizeof(uint32_t));
+        if (!set) {
+            return -1;
+        }
+        for (size_t i = 0; backend->prepared && i <= backend->prepared_mask; i++) {
+            if (backend->prepared[i]) {
+                size_t j = backend->prepared[i] & (size - 1);
+                while (set[j]) j = (j + 1) & (size - 1);
+                set[j] = backend->prepared[i];
+            }
+        }
+        free(backend->prepared);
+        backend->prepared = set;
+        backend->prepared_mask = size - 1;
+    }
+
+    size_t i = id & backend->prepared_mask;
+    while (backend->prepared[i] && backend->prepared[i] != id) {
+        i = (i + 1) & backend->prepared_mask;
+    }
+    if (!backend->prepared[i]) {
+        backend->prepared[i] = id;
+        backend->prepared_count++;
+    }
+    return 0;
+}
+
+// Forget a statement whose Parse failed, by rebuilding the set without it
+static void pg_backend_remove_statement(PGBackend *backend, uint32_t id) {
+    if (!pg_backend_has_statement(backend, id)) {
+        return;
+    }
+    uint32_t *old = backend->prepared;
+    size_t size = backend->prepared_mask + 1;
+    backend->prepared = NULL;
+    backend->prepared_mask = 0;
+    backend->prepared_count = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (old[i] && old[i] != id) {
+            pg_backend_add_statement(backend, old[i]);
+        }
+    }
+    free(old);
+}
+
+// Send Parse for a client's statement under its upstream name, unless the
+// connection already has it. The reply is dropped.
+static int pg_backend_prepare(PGBackend *backend, const PGStatement *statement) {
+    if (pg_backend_has_statement(backend, statement->upstream)) {
+        return 0;
+    }
+
+    char name[32];
+    int name_length = snprintf(name, sizeof(name), POOL_STATEMENT_PREFIX "%u", statement->upstream) + 1;
+    size_t query_length = strlen(statement->query) + 1;
+    size_t length = (size_t)name_length + query_length + 2 + 4 * (size_t)statement->num_params;
+    char *payload = (char *)malloc(length);
+    if (!payload) {
+        return -1;
+    }
+    char *p = payload;
+    memcpy(p, name, (size_t)name_length);
+    p += name_length;
+    memcpy(p, statement->query, query_length);
+    p += query_length;
+    uint16_t count = htons((uint16_t)statement->num_params);
+    memcpy(p, &count, 2);
+    p += 2;
+    for (int i = 0; i < statement->num_params; i++) {
+        pg_put_int32(p, (int32_t)statement->param_types[i]);
+        p += 4;
+    }
+
+    int result = pg_backend_put(backend, PqMsg_Parse, payload, length, NULL, 0);
+    free(payload);
+    PGPending *entry = result == 0 ? pg_backend_push(backend, PENDING_PARSE) : NULL;
+    if (!entry || pg_backend_add_statement(backend, statement->upstream) < 0) {
+        return -1;
+    }
+    entry->swallow = true;
+    entry->statement = statement->upstream;
+    return 0;
+}
+
+// Forward a message that names a client statement at offset name, with the
+// upstream name in its place
+static int pg_backend_put_renamed(PGBackend *backend, char type, const char *payload, size_t length,
+                                  size_t name, const PGStatement *statement) {
+    char renamed[32];
+    size_t end = name + strlen(payload + name) + 1;
+    int n = snprintf(renamed, sizeof(renamed), POOL_STATEMENT_PREFIX "%u", statement->upstream) + 1;
+
+    if (pg_buffer_reserve(&backend->out, 5 + name + (size_t)n + length - end) < 0) {
+        return -1;
+    }
+    char header[5];
+    header[0] = type;
+    pg_put_int32(header + 1, (int32_t)(4 + name + (size_t)n + length - end));
+    pg_buffer_append(&backend->out, header, 5);
+    pg_buffer_append(&backend->out, payload, name);
+    pg_buffer_append(&backend->out, renamed, (size_t)n);
+    pg_buffer_append(&backend->out, payload + end, length - end);
+    return 0;
+}
+
+// Parse of a named statement: remembered for the client, and prepared
+// upstream under a name shared by all clients with the same statement
+static int pg_pool_parse(PGClientConn *client, PGBackend *backend, const char *payload, size_t length) {
+    PGStatement *statement;
+    int result = pg_stmt_parse(&client->stmts, payload, (int)length, &statement);
+
+    if (result == PG_STMT_DUPLICATE) {
+        // Like the server would: an error, then nothing until Sync
+        char message[256];
+        int reply_length = 0;
+        snprintf(message, sizeof(message), "prepared statement \"%s\" already exists", payload);
+        client->backend_skip = true;
+        char *reply = pg_pool_error_message("42P05", message, &reply_length);
+        return pg_backend_reply(backend, reply, reply_length);
+    }
+    if (result != PG_STMT_OK) {
+        return -1;
+    }
+
+    size_t key = strlen(payload) + 1;
+    statement->upstream = pg_pool_statement_id(backend->pool, payload + key, length - key);
+    if (!statement->upstream) {
+        return -1;
+    }
+    if (pg_backend_has_statement(backend, statement->upstream)) {
+        return pg_backend_reply_complete(backend, PqMsg_ParseComplete);
+    }
+    if (pg_backend_put_renamed(backend, PqMsg_Parse, payload, length, 0, statement) < 0 ||
+        pg_backend_add_statement(backend, statement->upstream) < 0) {
+        return -1;
+    }
+    PGPending *entry = pg_backend_push(backend, PENDING_PARSE);
+    if (!entry) {
+        return -1;
+    }
+    entry->statement = statement->upstream;
+    return 0;
+}
+
+// Bind or Describe of a statement: renamed, after preparing it on this
+// connection if needed. Unknown names go through as they are, so the
+// server reports them.
+static int pg_pool_use_statement(PGClientConn *client, PGBackend *backend, char type,
+                                 const char *payload, size_t length, size_t name, PGPendingKind kind) {
+    PGStatement *statement = payload[name] ? pg_stmt_lookup(&client->stmts, payload + name) : NULL;
+    int result;
+
+    if (statement && statement->upstream) {
+        result = pg_backend_prepare(backend, statement);
+        if (result == 0) {
+            result = pg_backend_put_renamed(backend, type, payload, length, name, statement);
+        }
+    } else {
+        result = pg_backend_put(backend, type, payload, length, NULL, 0);
+    }
+    return result < 0 || !pg_backend_push(backend, kind) ? -1 : 0;
+}
+
+/* Connections */
+
+static int pg_backend_watch(PGBackend *backend, int events) {
+    PGEventLoop *loop = backend->pool->worker->loop;
+    int result = 0;
+
+    if (backend->watch_events == events) {
+        return 0;
+    }
+    if (!events) {
+        result = pg_event_remove(loop, backend->fd);
+    } else if (!backend->watch_events) {
+        result = pg_event_add(loop, backend->fd, events, backend);
+    } else {
+        result = pg_event_modify(loop, backend->fd, events, backend);
+    }
+    if (result == 0) {
+        backend->watch_events = events;
+    }
+    return result;
+}
+
+// Events the connection needs: replies unless the client is not reading,
+// and writability while requests are queued
+static int pg_backend_update_watch(PGBackend *backend) {
+    int events = backend->read_paused ? 0 : PG_EVENT_READ;
+    if (pg_buffer_length(&backend->out) > 0 || backend->state == BACKEND_CONNECTING) {
+        events |= PG_EVENT_WRITE;
+    }
+    return pg_backend_watch(backend, events);
+}
+
+// Let a client waiting for its connection to drain send again
+static void pg_pool_wake_client(PGClientConn *client) {
+    if (client->backend_wait) {
+        client->backend_wait = false;
+        if (pg_server_resume_input(client) < 0) {
+            pg_server_remove_client(client->server, client);
+        }
+    }
+}
+
+static int pg_backend_flush(PGBackend *backend) {
+    PGBuffer *out = &backend->out;
+
+    while (pg_buffer_length(out) > 0) {
+        ssize_t sent = send(backend->fd, pg_buffer_read_ptr(out), pg_buffer_length(out), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        pg_buffer_consume(out, (size_t)sent);
+    }
+    if (pg_buffer_length(out) == 0) {
+        pg_buffer_shrink(out, POOL_READ_SIZE);
+    }
+    return pg_backend_update_watch(backend);
+}
+
+// Send the startup packet; the login continues as replies arrive
+static int pg_backend_start(PGBackend *backend) {
+    const PGPoolConfig *config = &backend->pool->config;
+    char packet[512];
+    int n = snprintf(packet + 8, sizeof(packet) - 9, "user%c%s%cdatabase%c%s%c%c",
+                     0, config->user, 0, 0, config->database ? config->database : config->user, 0, 0);
+    if (n < 0 || (size_t)n >= sizeof(packet) - 9) {
+        return -1;
+    }
+    pg_put_int32(packet, n + 8);
+    pg_put_int32(packet + 4, (PG_PROTOCOL_MAJOR << 16) | PG_PROTOCOL_MINOR);
+
+    backend->state = BACKEND_STARTUP;
+    if (pg_buffer_append(&backend->out, packet, (size_t)n + 8) < 0) {
+        return -1;
+    }
+    return pg_backend_flush(backend);
+}
+
+// Open another upstream connection
+static int pg_pool_open(PGPool *pool) {
+    PGBackend *backend = NULL;
+    for (int i = 0; i < pool->config.size && !backend; i++) {
+        if (pool->backends[i].state == BACKEND_UNUSED) {
+            backend = &pool->backends[i];
+        }
+    }
+    if (!backend) {
+        return -1;
+    }
+
+    int fd = socket(pool->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    backend->fd = fd;
+    backend->state = BACKEND_CONNECTING;
+    backend->watch_events = 0;
+    backend->read_paused = false;
+    backend->client = NULL;
+    backend->pid = 0;
+    backend->key = 0;
+    pool->open++;
+    pool->connecting++;
+
+    int result = connect(fd, (const struct sockaddr *)&pool->addr, pool->addr_len);
+    if (result < 0 && errno != EINPROGRESS) {
+        pg_log_error("Cannot connect to upstream server %s:%d: %s", pool->config.host,
+                     pool->config.port, strerror(errno));
+        pg_backend_close(backend, NULL, NULL);
+        return -1;
+    }
+    if ((result == 0 ? pg_backend_start(backend) : pg_backend_update_watch(backend)) < 0) {
+        pg_backend_close(backend, NULL, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+// Fail every waiting client; used when no connection can be made
+static void pg_pool_fail_waiting(PGPool *pool, const char *error, size_t length) {
+    while (pool->wait_head) {
+        PGClientConn *client = pool->wait_head;
+        pool->wait_head = client->next_waiting;
+        if (pool->wait_head) {
+            pool->wait_head->prev_waiting = NULL;
+        } else {
+            pool->wait_tail = NULL;
+        }
+        client->next_waiting = client->prev_waiting = NULL;
+        client->backend_wait = false;
+
+        if (error) {
+            pg_server_send(client, error, length);
+        } else {
+            pg_send_error(client, "08006", "could not connect to the upstream server");
+        }
+        pg_server_flush(client);
+        pg_server_remove_client(client->server, client);
+    }
+}
+
+// Close a connection. A client it served gets the error (if any) and is
+// closed too, since its session state is gone.
+static void pg_backend_close(PGBackend *backend, const char *code, const char *message) {
+    PGPool *pool = backend->pool;
+    PGClientConn *client = backend->client;
+    bool logging_in = backend->state == BACKEND_CONNECTING || backend->state == BACKEND_STARTUP;
+
+    if (backend->state == BACKEND_UNUSED) {
+        return;
+    }
+    if (backend->state == BACKEND_IDLE) {
+        PGBackend **p = &pool->idle;
+        while (*p && *p != backend) p = &(*p)->next_idle;
+        if (*p) *p = backend->next_idle;
+    }
+
+    pg_backend_watch(backend, 0);
+    close(backend->fd);
+    backend->fd = -1;
+    backend->state = BACKEND_UNUSED;
+    backend->client = NULL;
+    pg_buffer_free(&backend->in);
+    pg_buffer_free(&backend->out);
+    while (backend->pending_count) {
+        pg_backend_pop(backend);
+    }
+    free(backend->pending);
+    backend->pending = NULL;
+    backend->pending_capacity = 0;
+    free(backend->prepared);
+    backend->prepared = NULL;
+    backend->prepared_mask = 0;
+    backend->prepared_count = 0;
+    pg_scram_client_free(backend->scram);
+    backend->scram = NULL;
+    if (pool->capturing == backend) {
+        pool->capturing = NULL;
+        pg_buffer_truncate(&pool->parameters, 0);
+    }
+    pool->open--;
+    if (logging_in) {
+        pool->connecting--;
+    }
+
+    if (client) {
+        client->backend = NULL;
+        if (message) {
+            pg_send_error(client, code, message);
+            pg_server_flush(client);
+        }
+        pg_server_remove_client(client->server, client);
+    }
+
+    // Nothing else will serve the waiting clients
+    if (pool->open == 0 && logging_in) {
+        pg_pool_fail_waiting(pool, NULL, 0);
+    }
+}
+
+/* Login */
+
+static int pg_backend_send_password(PGBackend *backend, const char *password) {
+    return pg_backend_put(backend, PqMsg_PasswordMessage, password, strlen(password) + 1, NULL, 0);
+}
+
+// "md5" followed by md5(md5(password || user) || salt) in hex
+static int pg_backend_send_md5(PGBackend *backend, const char *salt) {
+    const PGPoolConfig *config = &backend->pool->config;
+    const char *password = config->password ? config->password : "";
+    unsigned char digest[16];
+    char text[POOL_MESSAGE_MAX];
+    char hex[3 + 32 + 1] = "md5";
+
+    int n = snprintf(text, sizeof(text), "%s%s", password, config->user);
+    if (n < 0 || (size_t)n >= sizeof(text) ||
+        !EVP_Digest(text, (size_t)n, digest, NULL, EVP_md5(), NULL)) {
+        return -1;
+    }
+    pg_simd_hex_encode(digest, 16, text);
+    memcpy(text + 32, salt, 4);
+    if (!EVP_Digest(text, 36, digest, NULL, EVP_md5(), NULL)) {
+        return -1;
+    }
+    pg_simd_hex_encode(digest, 16, hex + 3);
+    hex[35] = '\0';
+    return pg_backend_send_password(backend, hex);
+}
+
+// Answer an authentication request of the upstream server
+static int pg_backend_authenticate(PGBackend *backend, const char *payload, int length) {
+    const PGPoolConfig *config = &backend->pool->config;
+    char message[POOL_MESSAGE_MAX];
+    int n;
+
+    if (length < 4) {
+        return -1;
+    }
+    switch (pg_get_int32(payload)) {
+        case PG_AUTH_OK:
+            pg_scram_client_free(backend->scram);
+            backend->scram = NULL;
+            return 0;
+
+        case PG_AUTH_CLEARTEXT:
+            return pg_backend_send_password(backend, config->password ? config->password : "");
+
+        case PG_AUTH_MD5:
+            return length == 8 ? pg_backend_send_md5(backend, payload + 4) : -1;
+
+        case PG_AUTH_SASL:
+            // A list of mechanism names, ending with an empty one
+            for (const char *p = payload + 4; p < payload + length && *p; p += strlen(p) + 1) {
+                if (strcmp(p, "SCRAM-SHA-256") == 0) {
+                    backend->scram = pg_scram_client_create(config->password);
+                    n = backend->scram ? pg_scram_client_first(backend->scram, message + 18, sizeof(message) - 18) : -1;
+                    if (n < 0) return -1;
+                    memcpy(message, "SCRAM-SHA-256", 14);
+                    pg_put_int32(message + 14, n);
+                    return pg_backend_put(backend, PqMsg_SASLInitialResponse, message, (size_t)n + 18, NULL, 0);
+                }
+            }
+            pg_log_error("Upstream server offers no SASL mechanism this pooler supports");
+            return -1;
+
+        case PG_AUTH_SASL_CONTINUE:
+            n = backend->scram ? pg_scram_client_final(backend->scram, payload + 4, length - 4,
+                                                       message, sizeof(message)) : -1;
+            return n < 0 ? -1 : pg_backend_put(backend, PqMsg_SASLResponse, message, (size_t)n, NULL, 0);
+
+        case PG_AUTH_SASL_FINAL:
+            if (!backend->scram || pg_scram_client_verify(backend->scram, payload + 4, length - 4) < 0) {
+                pg_log_error("Upstream server failed to prove it knows the password");
+                return -1;
+            }
+            return 0;
+
+        default:
+            pg_log_error("Upstream server asks for unsupported authentication method %d",
+                         pg_get_int32(payload));
+            return -1;
+    }
+}
+
+// Handle a message received while logging in
+static int pg_backend_login_message(PGBackend *backend, const char *message, size_t total) {
+    PGPool *pool = backend->pool;
+    const char *payload = message + 5;
+    int length = (int)total - 5;
+
+    switch (message[0]) {
+        case PqMsg_AuthenticationRequest:
+            return pg_backend_authenticate(backend, payload, length);
+
+        case PqMsg_ParameterStatus:
+            if (!pool->have_parameters && !pool->capturing) {
+                pool->capturing = backend;
+            }
+            return pool->capturing == backend ? pg_buffer_append(&pool->parameters, message, total) : 0;
+
+        case PqMsg_BackendKeyData:
+            if (length >= 8) {
+                backend->pid = pg_get_int32(payload);
+                backend->key = pg_get_int32(payload + 4);
+            }
+            return 0;
+
+        case PqMsg_NoticeResponse:
+            return 0;
+
+        case PqMsg_ErrorResponse: {
+            // Shown to the waiting clients if no other connection is left
+            const char *text = "";
+            for (const char *p = payload; p < payload + length && *p; p += strlen(p + 1) + 2) {
+                if (*p == PG_ERR_MESSAGE) text = p + 1;
+            }
+            pg_log_error("Upstream login failed: %s", text);
+            if (pool->open == 1) {
+                pg_pool_fail_waiting(pool, message, total);
+            }
+            return -1;
+        }
+
+        case PqMsg_ReadyForQuery:
+            backend->state = BACKEND_IDLE;
+            backend->synced = true;
+            pool->connecting--;
+            if (pool->capturing == backend) {
+                pool->capturing = NULL;
+                pool->have_parameters = true;
+            }
+            pg_pool_hand_over(pool, backend);
+            return 1;
+
+        default:
+            return -1;
+    }
+}
+
+/* Replies */
+
+// Does a reply message end the request at the head of the queue?
+static bool pg_pending_done(PGPendingKind kind, char type) {
+    switch (kind) {
+        case PENDING_PARSE: return type == PqMsg_ParseComplete;
+        case PENDING_BIND: return type == PqMsg_BindComplete;
+        case PENDING_CLOSE: return type == PqMsg_CloseComplete;
+        case PENDING_DESCRIBE: return type == PqMsg_RowDescription || type == PqMsg_NoData;
+        case PENDING_EXECUTE:
+            return type == PqMsg_CommandComplete || type == PqMsg_EmptyQueryResponse ||
+                   type == PqMsg_PortalSuspended;
+        case PENDING_SYNC:
+        case PENDING_QUERY: return type == PqMsg_ReadyForQuery;
+        default: return false;
+    }
+}
+
+// After an error in an extended query, the server skips up to Sync, and
+// sends no replies for what it skipped
+static void pg_backend_skip_to_sync(PGBackend *backend) {
+    PGPending *entry;
+    while ((entry = pg_backend_head(backend)) && entry->kind != PENDING_SYNC && entry->kind != PENDING_QUERY) {
+        if (entry->kind == PENDING_PARSE && entry->statement) {
+            pg_backend_remove_statement(backend, entry->statement);
+        }
+        pg_backend_pop(backend);
+    }
+}
+
+// Send the replies made up here that have reached the front of the queue
+static int pg_backend_send_queued(PGBackend *backend) {
+    PGPending *entry;
+    while ((entry = pg_backend_head(backend)) && entry->kind == PENDING_REPLY) {
+        int result = pg_server_send(backend->client, entry->reply, (size_t)entry->reply_length);
+        pg_server_end_message(backend->client, entry->reply[0]);
+        pg_backend_pop(backend);
+        if (result < 0) return -1;
+    }
+    return 0;
+}
+
+// Forward complete replies to the client. Runs of messages go out in one
+// piece; only the headers are looked at.
+static int pg_backend_forward_replies(PGBackend *backend) {
+    PGClientConn *client = backend->client;
+    PGMetricsShard *metrics = client->worker->metrics;
+    PGBuffer *in = &backend->in;
+    const char *data = pg_buffer_read_ptr(in);
+    size_t available = pg_buffer_length(in);
+    size_t offset = 0;
+    size_t run = 0;          // start of the bytes not yet forwarded
+    size_t partial = 0;      // bytes missing from a trailing partial message
+    int result = 0;
+
+    while (result == 0 && available - offset >= 5) {
+        const char *message = data + offset;
+        int32_t length = pg_get_int32(message + 1);
+        if (length < 4) return -1;
+        size_t total = (size_t)length + 1;
+        if (available - offset < total) {
+            partial = total - (available - offset);
+            break;
+        }
+        char type = message[0];
+        offset += total;
+        pg_counter_add(&metrics->messages_out[(unsigned char)type], 1);
+
+        // Notices, notifications and parameter changes may come at any time
+        if (type == PqMsg_NoticeResponse || type == PqMsg_NotificationResponse ||
+            type == PqMsg_ParameterStatus) {
+            continue;
+        }
+
+        PGPending *entry = pg_backend_head(backend);
+        if (!entry) {
+            pg_log_error("Unexpected message '%c' from the upstream server", type);
+            return -1;
+        }
+        if (entry->swallow && type != PqMsg_ErrorResponse) {
+            // Send what came before, and drop the reply the client did not ask for
+            if (offset - total > run) {
+                result = pg_server_send(client, data + run, offset - total - run);
+            }
+            run = offset;
+        }
+
+        if (type == PqMsg_ReadyForQuery) {
+            client->txn_status = length >= 5 ? message[5] : PG_TXN_IDLE;
+            backend->synced = backend->pending_count == 1;
+            pg_server_note_ready(client);
+        }
+        if (type == PqMsg_ErrorResponse && entry->kind != PENDING_SYNC && entry->kind != PENDING_QUERY) {
+            pg_backend_skip_to_sync(backend);
+        } else if (pg_pending_done(entry->kind, type)) {
+            pg_backend_pop(backend);
+        } else {
+            continue;
+        }
+
+        if (pg_backend_head(backend) && pg_backend_head(backend)->kind == PENDING_REPLY) {
+            if (offset > run && result == 0) {
+                result = pg_server_send(client, data + run, offset - run);
+            }
+            run = offset;
+            if (result == 0) result = pg_backend_send_queued(backend);
+        }
+    }
+
+    if (result == 0 && offset > run) {
+        result = pg_server_send(client, data + run, offset - run);
+    }
+    pg_buffer_consume(in, offset);
+    if (result < 0 || (partial > 0 && pg_buffer_reserve(in, partial) < 0)) return -1;
+    return pg_pool_finish_reply(backend);
+}
+
+// After replies were forwarded: give the connection back once the client
+// is idle outside a transaction, and stop reading while the client is not
+static int pg_pool_finish_reply(PGBackend *backend) {
+    PGClientConn *client = backend->client;
+    PGPool *pool = backend->pool;
+
+    if (pg_server_flush(client) < 0) {
+        return -1;
+    }
+    if (backend->synced && pg_buffer_length(&backend->out) == 0) {
+        if (client->txn_status == PG_TXN_IDLE) {
+            client->backend = NULL;
+            backend->client = NULL;
+            backend->state = BACKEND_IDLE;
+            backend->read_paused = false;
+            pg_pool_hand_over(pool, backend);
+            return 0;
+        }
+        if (pool->config.mode == PG_POOL_STATEMENT) {
+            pg_backend_close(backend, "08P01", "transaction blocks are not allowed in statement pooling mode");
+            return 1;
+        }
+    }
+
+    if (client->write_blocked && !backend->read_paused) {
+        backend->read_paused = true;
+        return pg_backend_update_watch(backend);
+    }
+    return 0;
+}
+
+/* Events */
+
+static int pg_backend_read(PGBackend *backend) {
+    PGBuffer *in = &backend->in;
+
+    if (pg_buffer_reserve(in, POOL_READ_SIZE) < 0) {
+        return -1;
+    }
+    ssize_t n = recv(backend->fd, pg_buffer_write_ptr(in), pg_buffer_writable(in), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    pg_buffer_commit(in, (size_t)n);
+
+    if (backend->state == BACKEND_ACTIVE) {
+        return pg_backend_forward_replies(backend);
+    }
+
+    // Logging in, or idle in the pool, where only asynchronous messages may come
+    while (pg_buffer_length(in) >= 5) {
+        const char *message = pg_buffer_read_ptr(in);
+        int32_t length = pg_get_int32(message + 1);
+        if (length < 4 || length > PG_MAX_MESSAGE_LENGTH) return -1;
+        size_t total = (size_t)length + 1;
+        if (pg_buffer_length(in) < total) {
+            return pg_buffer_reserve(in, total - pg_buffer_length(in));
+        }
+
+        int result;
+        if (backend->state == BACKEND_STARTUP) {
+            result = pg_backend_login_message(backend, message, total);
+        } else {
+            result = message[0] == PqMsg_NoticeResponse || message[0] == PqMsg_ParameterStatus ? 0 : -1;
+        }
+        if (result < 0) return -1;
+        if (backend->state == BACKEND_UNUSED) return 0;
+        pg_buffer_consume(in, total);
+        if (result > 0) {
+            // Logged in and handed over: what follows belongs to its client
+            if (backend->state == BACKEND_ACTIVE && pg_buffer_length(in) > 0) {
+                return pg_backend_forward_replies(backend);
+            }
+            return pg_backend_flush(backend);
+        }
+    }
+    return pg_backend_flush(backend);
+}
+
+/**
+ * Handle readiness of an upstream connection, reported by the worker loop
+ *
+ * @param pool Pool of the worker
+ * @param data Pointer the connection was registered with
+ * @param events PG_EVENT_* flags
+ * @return 0 (failures close the connection and its client)
+ */
+int pg_pool_handle_event(PGPool *pool, void *data, int events) {
+    PGBackend *backend = (PGBackend *)data;
+    (void)pool;
+
+    if (backend->state == BACKEND_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(backend->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            pg_log_error("Cannot connect to upstream server %s:%d: %s", backend->pool->config.host,
+                         backend->pool->config.port, strerror(error ? error : errno));
+            pg_backend_close(backend, NULL, NULL);
+        } else if (pg_backend_start(backend) < 0) {
+            pg_backend_close(backend, NULL, NULL);
+        }
+        return 0;
+    }
+
+    if (events & PG_EVENT_WRITE) {
+        if (pg_backend_flush(backend) < 0) {
+            pg_backend_close(backend, "08006", "lost connection to the upstream server");
+            return 0;
+        }
+        // Requests drained: the client may send more
+        if (backend->client && pg_buffer_length(&backend->out) < POOL_HIGH_WATER) {
+            pg_pool_wake_client(backend->client);
+            if (backend->state == BACKEND_UNUSED) return 0;
+        }
+    }
+    if ((events & (PG_EVENT_READ | PG_EVENT_ERROR)) && !backend->read_paused &&
+        pg_backend_read(backend) < 0) {
+        pg_backend_close(backend, "08006", "lost connection to the upstream server");
+    }
+    return 0;
+}
+
+/* Clients */
+
+// Give a free connection to the oldest waiting client, or to the pool
+static void pg_pool_hand_over(PGPool *pool, PGBackend *backend) {
+    PGClientConn *client = pool->wait_head;
+
+    if (!client) {
+        backend->next_idle = pool->idle;
+        pool->idle = backend;
+        pg_backend_update_watch(backend);
+        return;
+    }
+
+    pool->wait_head = client->next_waiting;
+    if (pool->wait_head) {
+        pool->wait_head->prev_waiting = NULL;
+    } else {
+        pool->wait_tail = NULL;
+    }
+    client->next_waiting = client->prev_waiting = NULL;
+
+    backend->state = BACKEND_ACTIVE;
+    backend->client = client;
+    client->backend = backend;
+    pg_backend_update_watch(backend);
+    pg_pool_wake_client(client);
+}
+
+// Connection for a client: a free one, or none yet, in which case the
+// client waits in line (and another connection is opened if allowed).
+// Without either, backend_wait stays clear.
+static PGBackend *pg_pool_acquire(PGPool *pool, PGClientConn *client) {
+    PGBackend *backend = pool->idle;
+
+    if (backend) {
+        pool->idle = backend->next_idle;
+        backend->next_idle = NULL;
+        backend->state = BACKEND_ACTIVE;
+        backend->client = client;
+        client->backend = backend;
+        return backend;
+    }
+
+    // One connection is opened per waiting client not already covered
+    // by a connection logging in
+    int waiting = 1;
+    for (PGClientConn *c = pool->wait_head; c && waiting <= pool->connecting; c = c->next_waiting) {
+        waiting++;
+    }
+    if (pool->open < pool->config.size && pool->connecting < waiting &&
+        pg_pool_open(pool) < 0 && pool->open == 0) {
+        return NULL;
+    }
+
+    client->backend_wait = true;
+    client->prev_waiting = pool->wait_tail;
+    client->next_waiting = NULL;
+    if (pool->wait_tail) {
+        pool->wait_tail->next_waiting = client;
+    } else {
+        pool->wait_head = client;
+    }
+    pool->wait_tail = client;
+    return NULL;
+}
+
+/**
+ * Forward a message of a client upstream, taking a connection for it
+ * first if the client has none
+ *
+ * @param client Client connection
+ * @param message Whole message: type, length and contents
+ * @param length Length of the message
+ * @return 0 if it was handled, 1 if it must wait (input pauses until a
+ *         connection is free), -1 to close the client
+ */
+int pg_pool_forward(PGClientConn *client, const char *message, size_t length) {
+    PGPool *pool = client->worker->pool;
+    char type = message[0];
+    const char *payload = message + 5;
+    size_t payload_length = length - 5;
+
+    if (type == PqMsg_Terminate) {
+        return -1;
+    }
+    if (client->backend_wait) {
+        return 1;
+    }
+
+    PGBackend *backend = client->backend;
+    if (!backend) {
+        backend = pg_pool_acquire(pool, client);
+        if (!backend) {
+            if (client->backend_wait) {
+                return 1;
+            }
+            pg_send_error(client, "08006", "could not connect to the upstream server");
+            return -1;
+        }
+    }
+
+    // An error was made up here: like the server, drop everything up to Sync
+    if (client->backend_skip && type != PqMsg_Sync) {
+        return 0;
+    }
+    client->backend_skip = false;
+
+    // Statement and portal names must end inside the message
+    size_t first = pg_simd_find_nul(payload, payload_length);
+    int result;
+    switch (type) {
+        case PqMsg_Parse:
+            if (first == payload_length) return -1;
+            if (payload[0]) {
+                result = pg_pool_parse(client, backend, payload, payload_length);
+                break;
+            }
+            result = pg_backend_put(backend, type, payload, payload_length, NULL, 0) == 0 &&
+                     pg_backend_push(backend, PENDING_PARSE) ? 0 : -1;
+            break;
+
+        case PqMsg_Bind:
+            if (first == payload_length || pg_simd_find_nul(payload + first + 1, payload_length - first - 1) ==
+                                           payload_length - first - 1) {
+                return -1;
+            }
+            result = pg_pool_use_statement(client, backend, type, payload, payload_length, first + 1, PENDING_BIND);
+            break;
+
+        case PqMsg_Describe:
+            if (payload_length < 2 || first == payload_length) return -1;
+            if (payload[0] == 'S') {
+                result = pg_pool_use_statement(client, backend, type, payload, payload_length, 1, PENDING_DESCRIBE);
+                break;
+            }
+            result = pg_backend_put(backend, type, payload, payload_length, NULL, 0) == 0 &&
+                     pg_backend_push(backend, PENDING_DESCRIBE) ? 0 : -1;
+            break;
+
+        case PqMsg_Close:
+            if (payload_length < 2 || first == payload_length) return -1;
+            if (payload[0] == 'S' && payload[1]) {
+                // The statement stays prepared upstream for other clients
+                pg_stmt_close(&client->stmts, payload + 1);
+                result = pg_backend_reply_complete(backend, PqMsg_CloseComplete);
+                break;
+            }
+            result = pg_backend_put(backend, type, payload, payload_length, NULL, 0) == 0 &&
+                     pg_backend_push(backend, PENDING_CLOSE) ? 0 : -1;
+            break;
+
+        case PqMsg_Execute:
+        case PqMsg_Sync:
+        case PqMsg_Query:
+        case PqMsg_FunctionCall:
+            result = pg_backend_put(backend, type, payload, payload_length, NULL, 0);
+            if (result == 0 && !pg_backend_push(backend, type == PqMsg_Execute ? PENDING_EXECUTE :
+                                                         type == PqMsg_Sync ? PENDING_SYNC : PENDING_QUERY)) {
+                result = -1;
+            }
+            break;
+
+        default:
+            // Flush, CopyData, CopyDone and CopyFail have no reply of their own
+            result = pg_backend_put(backend, type, payload, payload_length, NULL, 0);
+            break;
+    }
+    if (result < 0) {
+        return -1;
+    }
+
+    // Too much waiting to go upstream: stop reading from the client until it drains
+    if (pg_buffer_length(&backend->out) >= POOL_HIGH_WATER) {
+        if (pg_backend_flush(backend) < 0) return -1;
+        if (pg_buffer_length(&backend->out) >= POOL_HIGH_WATER) {
+            client->backend_wait = true;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the requests a client's batch of input produced upstream in one go
+ *
+ * @param client Client connection
+ * @return 0 on success, -1 if the upstream connection failed
+ */
+int pg_pool_flush(PGClientConn *client) {
+    return client->backend ? pg_backend_flush(client->backend) : 0;
+}
+
+/**
+ * The client's socket drained: read replies from its connection again
+ *
+ * @param client Client connection
+ * @return 0 on success, -1 on error
+ */
+int pg_pool_resume(PGClientConn *client) {
+    PGBackend *backend = client->backend;
+
+    if (!backend || !backend->read_paused) {
+        return 0;
+    }
+    backend->read_paused = false;
+    return pg_backend_update_watch(backend);
+}
+
+/**
+ * Let go of a client's upstream connection as the client closes. A
+ * connection in the middle of a request or transaction is closed rather
+ * than pooled, which makes the server roll it back.
+ *
+ * @param client Client connection
+ */
+void pg_pool_detach(PGClientConn *client) {
+    PGPool *pool = client->worker->pool;
+    PGBackend *backend = client->backend;
+
+    if (client->next_waiting || client->prev_waiting || pool->wait_head == client) {
+        if (client->prev_waiting) {
+            client->prev_waiting->next_waiting = client->next_waiting;
+        } else {
+            pool->wait_head = client->next_waiting;
+        }
+        if (client->next_waiting) {
+            client->next_waiting->prev_waiting = client->prev_waiting;
+        } else {
+            pool->wait_tail = client->prev_waiting;
+        }
+        client->next_waiting = client->prev_waiting = NULL;
+    }
+    client->backend_wait = false;
+    client->backend_skip = false;
+
+    if (!backend) {
+        return;
+    }
+    client->backend = NULL;
+    backend->client = NULL;
+    if (!backend->synced || pg_buffer_length(&backend->out) ||
+        client->txn_status != PG_TXN_IDLE) {
+        pg_backend_close(backend, NULL, NULL);
+        return;
+    }
+    backend->state = BACKEND_IDLE;
+    backend->read_paused = false;
+    pg_pool_hand_over(pool, backend);
+}
+
+/**
+ * Whether a client's upstream connection, if it still holds one, has
+ * answered everything it was sent
+ *
+ * @param client Client connection
+ * @return true if nothing is outstanding upstream
+ */
+bool pg_pool_idle(const PGClientConn *client) {
+    const PGBackend *backend = client->backend;
+
+    return !backend || (backend->synced && backend->pending_count == 0 &&
+                        pg_buffer_length(&backend->out) == 0);
+}
+
+/**
+ * Link a statement a client brought along from another process to the
+ * upstream statement of this pool, as its Parse would have. It is
+ * prepared upstream when first used.
+ *
+ * @param client Client connection
+ * @param statement Statement restored from the Parse payload
+ * @param payload Parse message payload
+ * @param length Length of the payload
+ * @return 0 on success, -1 on allocation failure
+ */
+int pg_pool_restore_statement(PGClientConn *client, PGStatement *statement,
+                              const char *payload, size_t length) {
+    size_t key = strlen(payload) + 1;
+
+    statement->upstream = pg_pool_statement_id(client->worker->pool, payload + key, length - key);
+    return statement->upstream ? 0 : -1;
+}
+
+static void pg_pool_cancel_task(void *arg) {
+    PGPoolCancel *cancel = (PGPoolCancel *)arg;
+    int fd = socket(cancel->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd >= 0 && connect(fd, (const struct sockaddr *)&cancel->addr, cancel->addr_len) == 0) {
+        char packet[16];
+        pg_put_int32(packet, 16);
+        pg_put_int32(packet + 4, PG_CANCEL_REQUEST_CODE);
+        pg_put_int32(packet + 8, cancel->pid);
+        pg_put_int32(packet + 12, cancel->key);
+        ssize_t n = send(fd, packet, sizeof(packet), MSG_NOSIGNAL);
+        (void)n;  // the server answers nothing either way
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(cancel);
+}
+
+/**
+ * Pass a client's cancel request on to the upstream connection running
+ * its request; the connect happens on an executor thread
+ *
+ * @param client Client connection
+ * @return 0 on success (or nothing to cancel), -1 on error
+ */
+int pg_pool_cancel(PGClientConn *client) {
+    PGBackend *backend = client->backend;
+    PGPool *pool = client->worker->pool;
+    PGExecutor *executor = pg_pool_server(pool)->executor;
+
+    if (!backend || backend->pending_syncs == 0 || !executor) {
+        return 0;
+    }
+    PGPoolCancel *cancel = (PGPoolCancel *)malloc(sizeof(PGPoolCancel));
+    if (!cancel) {
+        return -1;
+    }
+    cancel->addr = pool->addr;
+    cancel->addr_len = pool->addr_len;
+    cancel->pid = backend->pid;
+    cancel->key = backend->key;
+    if (pg_executor_submit(executor, pg_pool_cancel_task, cancel) < 0) {
+        free(cancel);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send a new client the ParameterStatus messages of the upstream server
+ *
+ * @param client Client connection
+ * @return Number of bytes sent (0 until a connection has logged in), or -1 on error
+ */
+int pg_pool_send_parameters(PGClientConn *client) {
+    PGPool *pool = client->worker->pool;
+    size_t length = pg_buffer_length(&pool->parameters);
+
+    if (!pool->have_parameters || length == 0) {
+        return 0;
+    }
+    const char *data = pg_buffer_read_ptr(&pool->parameters);
+    if (pg_server_send(client, data, length) < 0) {
+        return -1;
+    }
+    for (size_t offset = 0; offset + 5 <= length; offset += 1 + (size_t)pg_get_int32(data + offset + 1)) {
+        pg_counter_add(&client->worker->metrics->messages_out[PqMsg_ParameterStatus], 1);
+    }
+    return (int)length;
+}
+
+/* Pool */
+
+/**
+ * Create the pool of a worker; the first connection opens right away, so
+ * that clients see the upstream server's parameters
+ *
+ * @param worker Worker whose loop runs the pool
+ * @param config Upstream server and pool settings
+ * @return Pool, or NULL on error (logged)
+ */
+PGPool *pg_pool_create(PGWorker *worker, const PGPoolConfig *config) {
+    struct addrinfo hints, *result;
+    char port[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", config->port);
+    int error = getaddrinfo(config->host, port, &hints, &result);
+    if (error != 0) {
+        pg_log_error("Cannot resolve upstream server %s: %s", config->host, gai_strerror(error));
+        return NULL;
+    }
+
+    PGPool *pool = (PGPool *)calloc(1, sizeof(PGPool));
+    if (pool) {
+        pool->backends = (PGBackend *)calloc((size_t)config->size, sizeof(PGBackend));
+    }
+    if (!pool || !pool->backends) {
+        free(pool);
+        freeaddrinfo(result);
+        return NULL;
+    }
+    memcpy(&pool->addr, result->ai_addr, result->ai_addrlen);
+    pool->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    pool->worker = worker;
+    pool->config = *config;
+    pg_buffer_init(&pool->parameters);
+    for (int i = 0; i < config->size; i++) {
+        PGBackend *backend = &pool->backends[i];
+        backend->fd = -1;
+        backend->state = BACKEND_UNUSED;
+        backend->pool = pool;
+        pg_buffer_init(&backend->in);
+        pg_buffer_init(&backend->out);
+    }
+
+    pg_pool_open(pool);
+    return pool;
+}
+
+/**
+ * Close the connections of a pool and free it; its clients must be gone
+ *
+ * @param pool Pool (may be NULL)
+ */
+void pg_pool_destroy(PGPool *pool) {
+    if (!pool) {
+        return;
+    }
+    for (int i = 0; i < pool->config.size; i++) {
+        pg_backend_close(&pool->backends[i], NULL, NULL);
+    }
+    for (size_t i = 0; pool->statements && i <= pool->statements_mask; i++) {
+        PGPoolStatement *s = pool->statements[i];
+        while (s) {
+            PGPoolStatement *next = s->next;
+            free(s);
+            s = next;
+        }
+    }
+    free(pool->statements);
+    pg_buffer_free(&pool->parameters);
+    free(pool->backends);
+    free(pool);
+}
+
+/**
+ * Whether a pointer registered with the worker loop is one of the pool's
+ * upstream connections
+ *
+ * @param pool Pool (may be NULL)
+ * @param data Pointer from the event
+ * @return true for an upstream connection
+ */
+bool pg_pool_owns(const PGPool *pool, const void *data) {
+    return pool && (const char *)data >= (const char *)pool->backends &&
+           (const char *)data < (const char *)(pool->backends + pool->config.size);
+}
+
+/**
+ * Name of a pooling mode
+ *
+ * @param mode Mode
+ * @return "transaction" or "statement"
+ */
+const char *pg_pool_mode_name(PGPoolMode mode) {
+    return mode == PG_POOL_STATEMENT ? "statement" : "transaction";
+}
+
+/**
+ * Parse the name of a pooling mode
+ *
+ * @param name "transaction" or "statement"
+ * @param mode Set to the mode
+ * @return 0 on success, -1 for an unknown name
+ */
+int pg_pool_mode_parse(const char *name, PGPoolMode *mode) {
+    if (strcmp(name, "transaction") == 0) {
+        *mode = PG_POOL_TRANSACTION;
+    } else if (strcmp(name, "statement") == 0) {
+        *mode = PG_POOL_STATEMENT;
+    } else {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * pg_pool.h
+ * Upstream Connection Pooler
+ *
+ * This file contains declarations for the pooler backend, which answers
+ * clients by forwarding their messages to a real PostgreSQL server over a
+ * small pool of upstream connections. Each worker thread has a pool of its
+ * own, so clients and upstream connections of a worker are only touched by
+ * its loop. A client holds an upstream connection from its first message
+ * until the server reports it idle outside a transaction (transaction mode)
+ * or after every statement (statement mode); replies are forwarded as
+ * whole runs of messages, looking only at their headers. Named prepared
+ * statements are prepared upstream under names shared by all clients with
+ * the same statement, and prepared again on whichever connection a client
+ * gets next.
+ */
+
+#ifndef PG_POOL_H
+#define PG_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pg_stmt.h"
+
+typedef struct PGClientConn PGClientConn;
+typedef struct PGWorker PGWorker;
+typedef struct PGPool PGPool;
+typedef struct PGBackend PGBackend;
+
+/* When an upstream connection goes back to the pool */
+typedef enum {
+    PG_POOL_TRANSACTION = 0,     /* At the end of each transaction */
+    PG_POOL_STATEMENT            /* After each statement; transaction blocks are refused */
+} PGPoolMode;
+
+/* Upstream server and pool settings */
+typedef struct {
+    const char *host;        /* Upstream host name or address */
+    int port;                /* Upstream port */
+    const char *user;        /* User the pool logs in as */
+    const char *password;    /* Password for cleartext, MD5 or SCRAM-SHA-256 (NULL: none) */
+    const char *database;    /* Database (NULL: same as user) */
+    int size;                /* Upstream connections of this pool */
+    PGPoolMode mode;
+} PGPoolConfig;
+
+/* Function declarations */
+PGPool *pg_pool_create(PGWorker *worker, const PGPoolConfig *config);
+void pg_pool_destroy(PGPool *pool);
+bool pg_pool_owns(const PGPool *pool, const void *data);
+int pg_pool_handle_event(PGPool *pool, void *data, int events);
+
+int pg_pool_forward(PGClientConn *client, const char *message, size_t length);
+int pg_pool_flush(PGClientConn *client);
+int pg_pool_resume(PGClientConn *client);
+void pg_pool_detach(PGClientConn *client);
+bool pg_pool_idle(const PGClientConn *client);
+int pg_pool_cancel(PGClientConn *client);
+int pg_pool_send_parameters(PGClientConn *client);
+int pg_pool_restore_statement(PGClientConn *client, PGStatement *statement,
+                              const char *payload, size_t length);
+
+const char *pg_pool_mode_name(PGPoolMode mode);
+int pg_pool_mode_parse(const char *name, PGPoolMode *mode);
+
+#endif /* PG_POOL_H */
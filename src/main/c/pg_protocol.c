@@ -6,12 +6,15 @@
  */
 
 #include "pg_protocol.h"
+#include "pg_server.h"
+#include "pg_types.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include "/usr/local/pgsql/18/include/server/libpq/protocol.h"
 
 /**
  * Read a message from a client
@@ -62,276 +65,580 @@ int pg_read_message(int client_fd, char *buffer, int buffer_size) {
 }
 
 /**
- * Send a message to a client
+ * Start building a message in the client's output buffer
  * 
- * @param client_fd The client socket file descriptor
+ * The fields are appended with the pg_msg_put_* functions and the message
+ * is finished with pg_msg_end, which fills in the length. Nothing else may
+ * be sent on the connection while a message is being built.
+ * 
+ * @param client Client connection
  * @param type Message type
- * @param buffer Message content
- * @param length Length of the message content
  * @return 0 on success, -1 on error
  */
-int pg_send_message(int client_fd, char type, const char *buffer, int length) {
-    char *message;
-    int32_t total_length;
-    int result;
+int pg_msg_begin(PGClientConn *client, char type) {
+    PGBuffer *out = &client->out;
+    char header[5] = {type, 0, 0, 0, 0};
     
-    // Calculate the total message length
-    total_length = length + 4;
+    // Remember the start relative to the unsent data, which compaction keeps
+    client->msg_start = pg_buffer_length(out);
+    client->msg_failed = pg_buffer_append(out, header, sizeof(header)) < 0;
     
-    // Allocate memory for the message
-    message = malloc(total_length + 1);
-    if (!message) {
+    return client->msg_failed ? -1 : 0;
+}
+
+/**
+ * Append raw bytes to the message being built
+ * 
+ * A failure is remembered and reported again by pg_msg_end, so a sequence
+ * of puts only needs to be checked once at the end.
+ * 
+ * @param client Client connection
+ * @param data Bytes to append
+ * @param length Number of bytes
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_put_bytes(PGClientConn *client, const void *data, size_t length) {
+    if (client->msg_failed) {
         return -1;
     }
+    if (length > 0 && pg_buffer_append(&client->out, data, length) < 0) {
+        client->msg_failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append a single byte to the message being built
+ * 
+ * @param client Client connection
+ * @param value Value
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_put_byte(PGClientConn *client, char value) {
+    return pg_msg_put_bytes(client, &value, 1);
+}
+
+/**
+ * Append a 16-bit integer in network byte order to the message being built
+ * 
+ * @param client Client connection
+ * @param value Value
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_put_int16(PGClientConn *client, int16_t value) {
+    uint16_t n = htons((uint16_t)value);
+    return pg_msg_put_bytes(client, &n, sizeof(n));
+}
+
+/**
+ * Append a 32-bit integer in network byte order to the message being built
+ * 
+ * @param client Client connection
+ * @param value Value
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_put_int32(PGClientConn *client, int32_t value) {
+    uint32_t n = htonl((uint32_t)value);
+    return pg_msg_put_bytes(client, &n, sizeof(n));
+}
+
+/**
+ * Append a null-terminated string to the message being built
+ * 
+ * @param client Client connection
+ * @param str String
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_put_cstring(PGClientConn *client, const char *str) {
+    return pg_msg_put_bytes(client, str, strlen(str) + 1);
+}
+
+/**
+ * Append a column value (length and bytes) to the message being built
+ * 
+ * @param client Client connection
+ * @param value Value
+ * @param format PG_FORMAT_TEXT or PG_FORMAT_BINARY
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_put_value(PGClientConn *client, const PGValue *value, int16_t format) {
+    PGBuffer *out = &client->out;
     
-    // Set the message type
-    message[0] = type;
-    
-    // Set the message length
-    *((int32_t *)(message + 1)) = htonl(total_length);
+    if (value->isnull) {
+        return pg_msg_put_int32(client, -1);
+    }
+    if (pg_msg_put_int32(client, 0) < 0) {
+        return -1;
+    }
     
-    // Copy the message content
-    if (buffer && length > 0) {
-        memcpy(message + 5, buffer, length);
+    // Encode straight into the buffer, growing it once if the guess was short
+    size_t guess = 64;
+    if (value->type != PG_TYPE_BOOL && pg_type_length(value->type) < 0) {
+        guess += (size_t)value->v.str.length * 2;
     }
+    for (;;) {
+        if (pg_buffer_reserve(out, guess) < 0) {
+            client->msg_failed = true;
+            return -1;
+        }
+        int n = pg_value_encode(value, format, pg_buffer_write_ptr(out), guess);
+        if (n < 0) {
+            client->msg_failed = true;
+            return -1;
+        }
+        if ((size_t)n <= guess) {
+            uint32_t length = htonl((uint32_t)n);
+            memcpy(pg_buffer_write_ptr(out) - 4, &length, 4);
+            pg_buffer_commit(out, n);
+            return 0;
+        }
+        guess = n;
+    }
+}
+
+/**
+ * Finish the message being built
+ * 
+ * Patches the length field. If any put failed, the partial message is
+ * dropped from the output buffer so the stream stays well formed.
+ * 
+ * @param client Client connection
+ * @return 0 on success, -1 on error
+ */
+int pg_msg_end(PGClientConn *client) {
+    PGBuffer *out = &client->out;
     
-    // Send the message
-    result = write(client_fd, message, total_length + 1);
+    if (client->msg_failed) {
+        pg_buffer_truncate(out, client->msg_start);
+        client->msg_failed = false;
+        return -1;
+    }
     
-    // Free the message buffer
-    free(message);
+    char *msg = pg_buffer_read_ptr(out) + client->msg_start;
+    uint32_t length = htonl((uint32_t)(pg_buffer_length(out) - client->msg_start - 1));
+    memcpy(msg + 1, &length, 4);
     
-    return (result == total_length + 1) ? 0 : -1;
+    return pg_server_end_message(client, msg[0]);
 }
 
 /**
- * Send an error response to a client
+ * Send a message to a client
  * 
- * @param client_fd The client socket file descriptor
- * @param code Error code
- * @param message Error message
+ * The message is queued on the connection's output buffer; a large payload
+ * is written directly from the caller's memory when the socket allows.
+ * 
+ * @param client Client connection
+ * @param type Message type
+ * @param buffer Message content
+ * @param length Length of the message content
  * @return 0 on success, -1 on error
  */
-int pg_send_error(int client_fd, const char *code, const char *message) {
-    char buffer[1024];
-    int pos = 0;
+int pg_send_message(PGClientConn *client, char type, const char *buffer, int length) {
+    char header[5];
+    struct iovec iov[2];
+    uint32_t total_length = htonl(length + 4);
+    
+    // Set the message type and length
+    header[0] = type;
+    memcpy(header + 1, &total_length, 4);
+    
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)buffer;
+    iov[1].iov_len = (buffer && length > 0) ? length : 0;
+    
+    // Queue the message
+    if (pg_server_sendv(client, iov, iov[1].iov_len > 0 ? 2 : 1) < 0) {
+        return -1;
+    }
+    
+    return pg_server_end_message(client, type);
+}
+
+// Send an ErrorResponse with the given severity
+static int pg_send_error_severity(PGClientConn *client, const char *severity,
+                                  const char *code, const char *message) {
+    pg_msg_begin(client, PG_MSG_ERROR_RESPONSE);
     
     // Severity field
-    buffer[pos++] = PG_ERR_SEVERITY;
-    strcpy(buffer + pos, "ERROR");
-    pos += strlen("ERROR") + 1;
+    pg_msg_put_byte(client, PG_ERR_SEVERITY);
+    pg_msg_put_cstring(client, severity);
     
     // Code field
-    buffer[pos++] = PG_ERR_CODE;
-    strcpy(buffer + pos, code);
-    pos += strlen(code) + 1;
+    pg_msg_put_byte(client, PG_ERR_CODE);
+    pg_msg_put_cstring(client, code);
     
     // Message field
-    buffer[pos++] = PG_ERR_MESSAGE;
-    strcpy(buffer + pos, message);
-    pos += strlen(message) + 1;
+    pg_msg_put_byte(client, PG_ERR_MESSAGE);
+    pg_msg_put_cstring(client, message);
     
     // Terminator
-    buffer[pos++] = 0;
+    pg_msg_put_byte(client, 0);
     
-    return pg_send_message(client_fd, PG_MSG_ERROR_RESPONSE, buffer, pos);
+    return pg_msg_end(client);
+}
+
+/**
+ * Send an error response to a client
+ * 
+ * @param client Client connection
+ * @param code Error code
+ * @param message Error message
+ * @return 0 on success, -1 on error
+ */
+int pg_send_error(PGClientConn *client, const char *code, const char *message) {
+    return pg_send_error_severity(client, "ERROR", code, message);
+}
+
+/**
+ * Send an error response that ends the session; the caller closes the
+ * connection once it is flushed
+ * 
+ * @param client Client connection
+ * @param code Error code
+ * @param message Error message
+ * @return 0 on success, -1 on error
+ */
+int pg_send_fatal(PGClientConn *client, const char *code, const char *message) {
+    return pg_send_error_severity(client, "FATAL", code, message);
 }
 
 /**
  * Send a notice response to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param message Notice message
  * @return 0 on success, -1 on error
  */
-int pg_send_notice(int client_fd, const char *message) {
-    char buffer[1024];
-    int pos = 0;
+int pg_send_notice(PGClientConn *client, const char *message) {
+    pg_msg_begin(client, PG_MSG_NOTICE_RESPONSE);
     
     // Severity field
-    buffer[pos++] = PG_ERR_SEVERITY;
-    strcpy(buffer + pos, "NOTICE");
-    pos += strlen("NOTICE") + 1;
+    pg_msg_put_byte(client, PG_ERR_SEVERITY);
+    pg_msg_put_cstring(client, "NOTICE");
     
     // Message field
-    buffer[pos++] = PG_ERR_MESSAGE;
-    strcpy(buffer + pos, message);
-    pos += strlen(message) + 1;
+    pg_msg_put_byte(client, PG_ERR_MESSAGE);
+    pg_msg_put_cstring(client, message);
     
     // Terminator
-    buffer[pos++] = 0;
+    pg_msg_put_byte(client, 0);
     
-    return pg_send_message(client_fd, PG_MSG_NOTICE_RESPONSE, buffer, pos);
+    return pg_msg_end(client);
 }
 
 /**
  * Send an authentication request to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param auth_type Authentication type
  * @return 0 on success, -1 on error
  */
-int pg_send_auth_request(int client_fd, int auth_type) {
-    int32_t type = htonl(auth_type);
-    return pg_send_message(client_fd, PG_MSG_AUTHENTICATION, (char *)&type, sizeof(type));
+int pg_send_auth_request(PGClientConn *client, int auth_type) {
+    pg_msg_begin(client, PG_MSG_AUTHENTICATION);
+    pg_msg_put_int32(client, auth_type);
+    return pg_msg_end(client);
 }
 
 /**
  * Send an authentication OK message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @return 0 on success, -1 on error
  */
-int pg_send_auth_ok(int client_fd) {
-    return pg_send_auth_request(client_fd, PG_AUTH_OK);
+int pg_send_auth_ok(PGClientConn *client) {
+    return pg_send_auth_request(client, PG_AUTH_OK);
 }
 
 /**
  * Send a ready for query message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param status Transaction status
  * @return 0 on success, -1 on error
  */
-int pg_send_ready_for_query(int client_fd, char status) {
-    return pg_send_message(client_fd, PG_MSG_READY_FOR_QUERY, &status, 1);
+int pg_send_ready_for_query(PGClientConn *client, char status) {
+    pg_msg_begin(client, PG_MSG_READY_FOR_QUERY);
+    pg_msg_put_byte(client, status);
+    return pg_msg_end(client);
 }
 
 /**
  * Send a row description message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
+ * @param num_fields Number of fields
+ * @param field_names Array of field names
+ * @param field_types Array of field types
+ * @return 0 on success, -1 on error
+ */
+int pg_send_row_description(PGClientConn *client, int num_fields, const char **field_names, int *field_types) {
+    return pg_send_row_description_formats(client, num_fields, field_names, field_types, NULL);
+}
+
+/**
+ * Send a row description message with the format code of each column
+ * 
+ * @param client Client connection
  * @param num_fields Number of fields
  * @param field_names Array of field names
  * @param field_types Array of field types
+ * @param formats Array of format codes, or NULL for all text
  * @return 0 on success, -1 on error
  */
-int pg_send_row_description(int client_fd, int num_fields, const char **field_names, int *field_types) {
-    char buffer[4096];
-    int pos = 0;
-    int16_t num_fields_n = htons(num_fields);
+int pg_send_row_description_formats(PGClientConn *client, int num_fields, const char **field_names,
+                                    int *field_types, const int16_t *formats) {
+    pg_msg_begin(client, PG_MSG_ROW_DESCRIPTION);
     
     // Number of fields
-    memcpy(buffer, &num_fields_n, 2);
-    pos += 2;
+    pg_msg_put_int16(client, num_fields);
     
     // Field descriptions
     for (int i = 0; i < num_fields; i++) {
-        // Field name
-        strcpy(buffer + pos, field_names[i]);
-        pos += strlen(field_names[i]) + 1;
-        
-        // Table OID (0 for now)
-        *((int32_t *)(buffer + pos)) = 0;
-        pos += 4;
-        
-        // Column attribute number (0 for now)
-        *((int16_t *)(buffer + pos)) = 0;
-        pos += 2;
-        
-        // Data type OID
-        *((int32_t *)(buffer + pos)) = htonl(field_types[i]);
-        pos += 4;
-        
-        // Data type size (0 for now)
-        *((int16_t *)(buffer + pos)) = 0;
-        pos += 2;
-        
-        // Type modifier (0 for now)
-        *((int32_t *)(buffer + pos)) = 0;
-        pos += 4;
-        
-        // Format code (0 = text, 1 = binary)
-        *((int16_t *)(buffer + pos)) = 0;
-        pos += 2;
+        pg_msg_put_cstring(client, field_names[i]);  // Field name
+        pg_msg_put_int32(client, 0);                 // Table OID (0 for now)
+        pg_msg_put_int16(client, 0);                 // Column attribute number (0 for now)
+        pg_msg_put_int32(client, field_types[i]);    // Data type OID
+        pg_msg_put_int16(client, pg_type_length(field_types[i])); // Data type size
+        pg_msg_put_int32(client, -1);                // Type modifier (none)
+        pg_msg_put_int16(client, formats ? formats[i] : PG_FORMAT_TEXT); // Format code
     }
     
-    return pg_send_message(client_fd, PG_MSG_ROW_DESCRIPTION, buffer, pos);
+    return pg_msg_end(client);
 }
 
 /**
  * Send a data row message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param num_fields Number of fields
  * @param values Array of field values
  * @param lengths Array of field lengths
  * @return 0 on success, -1 on error
  */
-int pg_send_data_row(int client_fd, int num_fields, const char **values, int *lengths) {
-    char buffer[4096];
-    int pos = 0;
-    int16_t num_fields_n = htons(num_fields);
+int pg_send_data_row(PGClientConn *client, int num_fields, const char **values, int *lengths) {
+    pg_msg_begin(client, PG_MSG_DATA_ROW);
     
     // Number of fields
-    memcpy(buffer, &num_fields_n, 2);
-    pos += 2;
+    pg_msg_put_int16(client, num_fields);
     
     // Field values
     for (int i = 0; i < num_fields; i++) {
         if (values[i] == NULL) {
             // NULL value
-            *((int32_t *)(buffer + pos)) = htonl(-1);
-            pos += 4;
+            pg_msg_put_int32(client, -1);
         } else {
-            // Value length
-            *((int32_t *)(buffer + pos)) = htonl(lengths[i]);
-            pos += 4;
-            
-            // Value data
-            memcpy(buffer + pos, values[i], lengths[i]);
-            pos += lengths[i];
+            pg_msg_put_int32(client, lengths[i]);
+            pg_msg_put_bytes(client, values[i], lengths[i]);
+        }
+    }
+    
+    return pg_msg_end(client);
+}
+
+/**
+ * Send a data row message from typed values
+ * 
+ * @param client Client connection
+ * @param num_fields Number of fields
+ * @param values Array of field values
+ * @param formats Array of format codes, or NULL for all text
+ * @return 0 on success, -1 on error
+ */
+int pg_send_data_row_values(PGClientConn *client, int num_fields, const PGValue *values,
+                            const int16_t *formats) {
+    pg_msg_begin(client, PG_MSG_DATA_ROW);
+    
+    // Number of fields
+    pg_msg_put_int16(client, num_fields);
+    
+    // Field values
+    for (int i = 0; i < num_fields; i++) {
+        pg_msg_put_value(client, &values[i], formats ? formats[i] : PG_FORMAT_TEXT);
+    }
+    
+    return pg_msg_end(client);
+}
+
+/**
+ * Send a batch of data rows from typed columns
+ * 
+ * Each row's worst case is reserved once and its values are encoded in
+ * place, so the cells are never formatted into a separate buffer or
+ * passed as PGValues. Like the other senders, this must not be called
+ * while a message is being built.
+ * 
+ * @param client Client connection
+ * @param num_columns Number of columns
+ * @param columns Columns, all of supported types (pg_column_type_supported)
+ * @param first_row Index of the first row to send
+ * @param num_rows Number of rows to send
+ * @param formats Array of format codes, or NULL for all text
+ * @return 0 on success, -1 on error
+ */
+int pg_send_data_rows(PGClientConn *client, int num_columns, const PGColumn *columns,
+                      int first_row, int num_rows, const int16_t *formats) {
+    PGBuffer *out = &client->out;
+    size_t row_max = 7 + (size_t)num_columns * (4 + PG_COLUMN_ENCODED_MAX);
+    
+    for (int i = 0; i < num_columns; i++) {
+        if (!pg_column_type_supported(columns[i].type)) {
+            return -1;
+        }
+    }
+    
+    for (int row = first_row; row < first_row + num_rows; row++) {
+        if (pg_buffer_reserve(out, row_max) < 0) {
+            return -1;
+        }
+        char *msg = pg_buffer_write_ptr(out);
+        char *p = msg + 7;
+        uint16_t count = htons((uint16_t)num_columns);
+        
+        msg[0] = PG_MSG_DATA_ROW;
+        memcpy(msg + 5, &count, 2);
+        for (int i = 0; i < num_columns; i++) {
+            int n = pg_column_encode(&columns[i], row, formats ? formats[i] : PG_FORMAT_TEXT, p + 4);
+            uint32_t length = htonl((uint32_t)n);
+            memcpy(p, &length, 4);
+            p += 4 + (n > 0 ? n : 0);
+        }
+        uint32_t length = htonl((uint32_t)(p - msg - 1));
+        memcpy(msg + 1, &length, 4);
+        pg_buffer_commit(out, (size_t)(p - msg));
+        
+        if (pg_server_end_message(client, PG_MSG_DATA_ROW) < 0) {
+            return -1;
         }
     }
     
-    return pg_send_message(client_fd, PG_MSG_DATA_ROW, buffer, pos);
+    return 0;
 }
 
 /**
  * Send a command complete message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param tag Command tag
  * @return 0 on success, -1 on error
  */
-int pg_send_command_complete(int client_fd, const char *tag) {
-    char buffer[64];
-    strcpy(buffer, tag);
-    return pg_send_message(client_fd, PG_MSG_COMMAND_COMPLETE, buffer, strlen(buffer) + 1);
+int pg_send_command_complete(PGClientConn *client, const char *tag) {
+    pg_msg_begin(client, PG_MSG_COMMAND_COMPLETE);
+    pg_msg_put_cstring(client, tag);
+    return pg_msg_end(client);
 }
 
 /**
  * Send a parameter status message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param name Parameter name
  * @param value Parameter value
  * @return 0 on success, -1 on error
  */
-int pg_send_parameter_status(int client_fd, const char *name, const char *value) {
-    char buffer[1024];
-    int name_len = strlen(name) + 1;
-    int value_len = strlen(value) + 1;
-    
-    strcpy(buffer, name);
-    strcpy(buffer + name_len, value);
-    
-    return pg_send_message(client_fd, PG_MSG_PARAMETER_STATUS, buffer, name_len + value_len);
+int pg_send_parameter_status(PGClientConn *client, const char *name, const char *value) {
+    pg_msg_begin(client, PG_MSG_PARAMETER_STATUS);
+    pg_msg_put_cstring(client, name);
+    pg_msg_put_cstring(client, value);
+    return pg_msg_end(client);
 }
 
 /**
  * Send a backend key data message to a client
  * 
- * @param client_fd The client socket file descriptor
+ * @param client Client connection
  * @param pid Process ID
  * @param key Secret key
  * @return 0 on success, -1 on error
  */
-int pg_send_backend_key_data(int client_fd, int32_t pid, int32_t key) {
-    char buffer[8];
-    
-    *((int32_t *)buffer) = htonl(pid);
-    *((int32_t *)(buffer + 4)) = htonl(key);
+int pg_send_backend_key_data(PGClientConn *client, int32_t pid, int32_t key) {
+    pg_msg_begin(client, PG_MSG_BACKEND_KEY_DATA);
+    pg_msg_put_int32(client, pid);
+    pg_msg_put_int32(client, key);
+    return pg_msg_end(client);
+}
+
+/**
+ * Send a NegotiateProtocolVersion message to a client
+ * 
+ * Sent before authentication when the startup packet asked for a newer
+ * minor version or for protocol options the server does not know.
+ * 
+ * @param client Client connection
+ * @param minor Newest minor version the server supports for the major requested
+ * @param num_options Number of unrecognized options
+ * @param options Their names, as in the startup packet
+ * @return 0 on success, -1 on error
+ */
+int pg_send_negotiate_protocol_version(PGClientConn *client, int minor, int num_options,
+                                       const char **options) {
+    pg_msg_begin(client, PG_MSG_NEGOTIATE_PROTOCOL_VERSION);
+    pg_msg_put_int32(client, (PG_PROTOCOL_MAJOR << 16) | minor);
+    pg_msg_put_int32(client, num_options);
+    for (int i = 0; i < num_options; i++) {
+        pg_msg_put_cstring(client, options[i]);
+    }
+    return pg_msg_end(client);
+}
+
+/**
+ * Get the name of a message type
+ * 
+ * Frontend and backend messages share type bytes, so the direction is needed.
+ * 
+ * @param msg_type Message type byte (0 for a startup packet)
+ * @param backend Whether the message is sent by the server
+ * @return Message name, or NULL if the type is not known
+ */
+const char *pg_message_name(char msg_type, bool backend) {
+    if (backend) {
+        switch (msg_type) {
+            case PqMsg_AuthenticationRequest: return "Authentication";
+            case PqMsg_BackendKeyData: return "BackendKeyData";
+            case PqMsg_ParameterStatus: return "ParameterStatus";
+            case PqMsg_ReadyForQuery: return "ReadyForQuery";
+            case PqMsg_RowDescription: return "RowDescription";
+            case PqMsg_DataRow: return "DataRow";
+            case PqMsg_CommandComplete: return "CommandComplete";
+            case PqMsg_ErrorResponse: return "ErrorResponse";
+            case PqMsg_NoticeResponse: return "NoticeResponse";
+            case PqMsg_EmptyQueryResponse: return "EmptyQueryResponse";
+            case PqMsg_ParseComplete: return "ParseComplete";
+            case PqMsg_BindComplete: return "BindComplete";
+            case PqMsg_CloseComplete: return "CloseComplete";
+            case PqMsg_NoData: return "NoData";
+            case PqMsg_PortalSuspended: return "PortalSuspended";
+            case PqMsg_NotificationResponse: return "NotificationResponse";
+            case PqMsg_ParameterDescription: return "ParameterDescription";
+            case PqMsg_CopyInResponse: return "CopyInResponse";
+            case PqMsg_CopyOutResponse: return "CopyOutResponse";
+            case PqMsg_CopyBothResponse: return "CopyBothResponse";
+            case PqMsg_CopyData: return "CopyData";
+            case PqMsg_CopyDone: return "CopyDone";
+            case PqMsg_FunctionCallResponse: return "FunctionCallResponse";
+            case PqMsg_NegotiateProtocolVersion: return "NegotiateProtocolVersion";
+            case PG_MSG_COMPRESSED_DATA: return "CompressedData";
+            default: return NULL;
+        }
+    }
     
-    return pg_send_message(client_fd, PG_MSG_BACKEND_KEY_DATA, buffer, 8);
+    switch (msg_type) {
+        case 0: return "Startup";
+        case PqMsg_Bind: return "Bind";
+        case PqMsg_Close: return "Close";
+        case PqMsg_Describe: return "Describe";
+        case PqMsg_Execute: return "Execute";
+        case PqMsg_FunctionCall: return "FunctionCall";
+        case PqMsg_Flush: return "Flush";
+        case PqMsg_Parse: return "Parse";
+        case PqMsg_Query: return "Query";
+        case PqMsg_Sync: return "Sync";
+        case PqMsg_Terminate: return "Terminate";
+        case PqMsg_PasswordMessage: return "PasswordMessage";
+        case PqMsg_CopyData: return "CopyData";
+        case PqMsg_CopyDone: return "CopyDone";
+        case PqMsg_CopyFail: return "CopyFail";
+        default: return NULL;
+    }
 }
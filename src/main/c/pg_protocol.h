@@ -10,10 +10,26 @@
 #define PG_PROTOCOL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct PGClientConn PGClientConn;
+typedef struct PGValue PGValue;
+typedef struct PGColumn PGColumn;
 
 /* PostgreSQL protocol version */
 #define PG_PROTOCOL_MAJOR 3
 #define PG_PROTOCOL_MINOR 0
+#define PG_PROTOCOL_LATEST_MINOR 2  /* Newest minor version clients are answered in */
+
+/* Special request codes sent in place of a protocol version */
+#define PG_CANCEL_REQUEST_CODE   80877102    /* (1234 << 16) | 5678 */
+#define PG_SSL_REQUEST_CODE      80877103    /* (1234 << 16) | 5679 */
+#define PG_GSSENC_REQUEST_CODE   80877104    /* (1234 << 16) | 5680 */
+
+/* Message size limits */
+#define PG_MAX_STARTUP_PACKET_LENGTH 10000
+#define PG_MAX_MESSAGE_LENGTH        0x3fffffff
 
 /* Message types (first byte of message) */
 /* Frontend message types */
@@ -40,6 +56,8 @@
 #define PG_MSG_PARAMETER_STATUS 'S'
 #define PG_MSG_BACKEND_KEY_DATA 'K'
 #define PG_MSG_EMPTY_QUERY_RESPONSE 'I'
+#define PG_MSG_NEGOTIATE_PROTOCOL_VERSION 'v'
+#define PG_MSG_COMPRESSED_DATA 'z'    /* _pq_.compression extension (pg_compress.h) */
 
 /* Authentication types */
 #define PG_AUTH_OK               0
@@ -50,6 +68,9 @@
 #define PG_AUTH_GSS              7
 #define PG_AUTH_GSS_CONTINUE     8
 #define PG_AUTH_SSPI             9
+#define PG_AUTH_SASL             10
+#define PG_AUTH_SASL_CONTINUE    11
+#define PG_AUTH_SASL_FINAL       12
 
 /* Transaction status indicators */
 #define PG_TXN_IDLE              'I'
@@ -88,16 +109,34 @@ typedef struct {
 
 /* Function declarations */
 int pg_read_message(int client_fd, char *buffer, int buffer_size);
-int pg_send_message(int client_fd, char type, const char *buffer, int length);
-int pg_send_error(int client_fd, const char *code, const char *message);
-int pg_send_notice(int client_fd, const char *message);
-int pg_send_auth_request(int client_fd, int auth_type);
-int pg_send_auth_ok(int client_fd);
-int pg_send_ready_for_query(int client_fd, char status);
-int pg_send_row_description(int client_fd, int num_fields, const char **field_names, int *field_types);
-int pg_send_data_row(int client_fd, int num_fields, const char **values, int *lengths);
-int pg_send_command_complete(int client_fd, const char *tag);
-int pg_send_parameter_status(int client_fd, const char *name, const char *value);
-int pg_send_backend_key_data(int client_fd, int32_t pid, int32_t key);
+int pg_msg_begin(PGClientConn *client, char type);
+int pg_msg_put_bytes(PGClientConn *client, const void *data, size_t length);
+int pg_msg_put_byte(PGClientConn *client, char value);
+int pg_msg_put_int16(PGClientConn *client, int16_t value);
+int pg_msg_put_int32(PGClientConn *client, int32_t value);
+int pg_msg_put_cstring(PGClientConn *client, const char *str);
+int pg_msg_put_value(PGClientConn *client, const PGValue *value, int16_t format);
+int pg_msg_end(PGClientConn *client);
+int pg_send_message(PGClientConn *client, char type, const char *buffer, int length);
+int pg_send_error(PGClientConn *client, const char *code, const char *message);
+int pg_send_fatal(PGClientConn *client, const char *code, const char *message);
+int pg_send_notice(PGClientConn *client, const char *message);
+int pg_send_auth_request(PGClientConn *client, int auth_type);
+int pg_send_auth_ok(PGClientConn *client);
+int pg_send_ready_for_query(PGClientConn *client, char status);
+int pg_send_row_description(PGClientConn *client, int num_fields, const char **field_names, int *field_types);
+int pg_send_row_description_formats(PGClientConn *client, int num_fields, const char **field_names,
+                                    int *field_types, const int16_t *formats);
+int pg_send_data_row(PGClientConn *client, int num_fields, const char **values, int *lengths);
+int pg_send_data_row_values(PGClientConn *client, int num_fields, const PGValue *values,
+                            const int16_t *formats);
+int pg_send_data_rows(PGClientConn *client, int num_columns, const PGColumn *columns,
+                      int first_row, int num_rows, const int16_t *formats);
+int pg_send_command_complete(PGClientConn *client, const char *tag);
+int pg_send_parameter_status(PGClientConn *client, const char *name, const char *value);
+int pg_send_backend_key_data(PGClientConn *client, int32_t pid, int32_t key);
+int pg_send_negotiate_protocol_version(PGClientConn *client, int minor, int num_options,
+                                       const char **options);
+const char *pg_message_name(char msg_type, bool backend);
 
 #endif /* PG_PROTOCOL_H */
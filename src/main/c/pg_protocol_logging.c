@@ -4,6 +4,7 @@
  */
 
 #include "pg_server.h"
+#include "pg_protocol.h"
 #include "pg_log.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -281,33 +282,9 @@ void pg_server_set_logging_callbacks(PGServer *server) {
 
 // Helper function to log outgoing messages
 void pg_log_outgoing_message(PGClientConn *client, char msg_type, int length) {
-    const char *msg_name = "Unknown";
-    
-    switch (msg_type) {
-        case PqMsg_AuthenticationRequest: msg_name = "Authentication"; break;
-        case PqMsg_BackendKeyData: msg_name = "BackendKeyData"; break;
-        case PqMsg_ParameterStatus: msg_name = "ParameterStatus"; break;
-        case PqMsg_ReadyForQuery: msg_name = "ReadyForQuery"; break;
-        case PqMsg_RowDescription: msg_name = "RowDescription"; break;
-        case PqMsg_DataRow: msg_name = "DataRow"; break;
-        case PqMsg_CommandComplete: msg_name = "CommandComplete"; break;
-        case PqMsg_ErrorResponse: msg_name = "ErrorResponse"; break;
-        case PqMsg_NoticeResponse: msg_name = "NoticeResponse"; break;
-        case PqMsg_EmptyQueryResponse: msg_name = "EmptyQueryResponse"; break;
-        case PqMsg_ParseComplete: msg_name = "ParseComplete"; break;
-        case PqMsg_BindComplete: msg_name = "BindComplete"; break;
-        case PqMsg_CloseComplete: msg_name = "CloseComplete"; break;
-        case PqMsg_NoData: msg_name = "NoData"; break;
-        case PqMsg_NotificationResponse: msg_name = "NotificationResponse"; break;
-        case PqMsg_ParameterDescription: msg_name = "ParameterDescription"; break;
-        case PqMsg_CopyInResponse: msg_name = "CopyInResponse"; break;
-        case PqMsg_CopyOutResponse: msg_name = "CopyOutResponse"; break;
-        case PqMsg_CopyBothResponse: msg_name = "CopyBothResponse"; break;
-        case PqMsg_CopyData: msg_name = "CopyData"; break;
-        case PqMsg_CopyDone: msg_name = "CopyDone"; break;
-        case PqMsg_CopyFail: msg_name = "CopyFail"; break;
-        case PqMsg_FunctionCallResponse: msg_name = "FunctionCallResponse"; break;
-        case PqMsg_NegotiateProtocolVersion: msg_name = "NegotiateProtocolVersion"; break;
+    const char *msg_name = pg_message_name(msg_type, true);
+    if (!msg_name) {
+        msg_name = "Unknown";
     }
     
     pg_log_debug("Protocol: Sending %s message to client %d (%d bytes)", 
@@ -321,7 +298,7 @@ int pg_send_with_logging(PGClientConn *client, const void *buffer, size_t length
         pg_log_outgoing_message(client, msg_type, length);
     }
     
-    int result = send(client->fd, buffer, length, 0);
+    int result = pg_server_send(client, buffer, length);
     
     if (result < 0) {
         pg_log_error("Protocol: Failed to send message to client %d: %s", 
@@ -3,14 +3,21 @@
  * PostgreSQL Query Handler
  * 
  * This file contains implementations for handling PostgreSQL queries.
+ * The same handlers serve the simple Query message and the Execute of a
+ * portal; with a portal, RowDescription and ReadyForQuery are left to
+ * Describe and Sync, and columns use the portal's result formats.
  */
 
 #include "pg_server.h"
 #include "pg_protocol.h"
+#include "pg_types.h"
+#include "pg_metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include "/usr/local/pgsql/18/include/server/libpq/protocol.h"
 
 /* Query types */
 typedef enum {
@@ -24,16 +31,72 @@ typedef enum {
     QUERY_CREATE,
     QUERY_DROP,
     QUERY_ALTER,
+    QUERY_COPY,
+    QUERY_SHOW,
+    QUERY_EMPTY,
     QUERY_UNKNOWN
 } QueryType;
 
+/* Leading keyword of a query type */
+typedef struct {
+    const char *word;        /* Lower case */
+    size_t length;
+    QueryType type;
+} PGKeyword;
+
+#define QUERY_KEYWORD_MIN 4
+#define QUERY_KEYWORD_MAX 8
+#define QUERY_KEYWORD_SLOTS 16
+
+/* Keywords placed by pg_keyword_hash; empty slots have length 0 */
+static const PGKeyword query_keywords[QUERY_KEYWORD_SLOTS] = {
+    [0]  = {"alter", 5, QUERY_ALTER},
+    [1]  = {"insert", 6, QUERY_INSERT},
+    [2]  = {"rollback", 8, QUERY_ROLLBACK},
+    [3]  = {"select", 6, QUERY_SELECT},
+    [5]  = {"show", 4, QUERY_SHOW},
+    [7]  = {"begin", 5, QUERY_BEGIN},
+    [8]  = {"drop", 4, QUERY_DROP},
+    [9]  = {"copy", 4, QUERY_COPY},
+    [11] = {"commit", 6, QUERY_COMMIT},
+    [13] = {"update", 6, QUERY_UPDATE},
+    [14] = {"delete", 6, QUERY_DELETE},
+    [15] = {"create", 6, QUERY_CREATE},
+};
+
+/* Rows of SHOW pgprotocol_stats being sent */
+typedef struct {
+    PGClientConn *client;
+    int16_t formats[2];      /* Result formats of the columns */
+} PGStatsRows;
+
+/* State of a streamed generate_series(start, stop) */
+typedef struct {
+    long long next;
+    long long stop;
+    int16_t format;          /* Result format of the column */
+} PGSeries;
+
 /* Forward declarations */
 static QueryType pg_get_query_type(const char *query);
-static int pg_handle_select(PGClientConn *client, const char *query);
-static int pg_handle_insert(PGClientConn *client, const char *query);
-static int pg_handle_update(PGClientConn *client, const char *query);
-static int pg_handle_delete(PGClientConn *client, const char *query);
-static int pg_handle_transaction(PGClientConn *client, const char *query, QueryType type);
+static int pg_run_query(PGClientConn *client, const char *query, PGPortal *portal);
+static int pg_handle_select(PGClientConn *client, const char *query, PGPortal *portal);
+static int pg_handle_generate_series(PGClientConn *client, const char *args, PGPortal *portal);
+static int pg_handle_insert(PGClientConn *client, const char *query, PGPortal *portal);
+static int pg_handle_update(PGClientConn *client, const char *query, PGPortal *portal);
+static int pg_handle_delete(PGClientConn *client, const char *query, PGPortal *portal);
+static int pg_handle_transaction(PGClientConn *client, const char *query, QueryType type, PGPortal *portal);
+static int pg_handle_copy(PGClientConn *client, const char *query, PGPortal *portal);
+static int pg_handle_show(PGClientConn *client, const char *query, PGPortal *portal);
+static bool pg_query_has_word(const char *query, const char *word);
+
+/* Columns of the demonstration result sets */
+static const char *demo_field_names[] = {"id", "name", "value"};
+static int demo_field_types[] = {PG_TYPE_INT4, PG_TYPE_TEXT, PG_TYPE_TEXT};
+static const char *series_field_names[] = {"generate_series"};
+static int series_field_types[] = {PG_TYPE_INT8};
+static const char *stats_field_names[] = {"name", "value"};
+static int stats_field_types[] = {PG_TYPE_TEXT, PG_TYPE_INT8};
 
 /**
  * Default query callback
@@ -43,114 +106,353 @@ static int pg_handle_transaction(PGClientConn *client, const char *query, QueryT
  * @return 0 on success, -1 on error
  */
 int pg_default_query_callback(PGClientConn *client, const char *query) {
+    return pg_run_query(client, query, NULL);
+}
+
+/**
+ * Default execute callback: runs the query of the portal's statement
+ * 
+ * @param client Client connection
+ * @param portal_name Portal name
+ * @param max_rows Maximum number of rows (applied by the server to streamed results)
+ * @return 0 on success, -1 on error
+ */
+int pg_default_execute_callback(PGClientConn *client, const char *portal_name, int max_rows) {
+    PGPortal *portal = pg_portal_lookup(&client->stmts, portal_name);
+    (void)max_rows;
+    
+    if (!portal) {
+        return pg_send_error(client, "34000", "portal does not exist");
+    }
+    return pg_run_query(client, portal->statement->query, portal);
+}
+
+/**
+ * Default describe callback: describes the result of the demonstration queries
+ * 
+ * @param client Client connection
+ * @param describe_type 'S' for a statement, 'P' for a portal
+ * @param name Statement or portal name
+ * @return 0 on success, -1 on error
+ */
+int pg_default_describe_callback(PGClientConn *client, char describe_type, const char *name) {
+    PGPortal *portal = NULL;
+    const char *query;
+    
+    if (describe_type == 'P') {
+        portal = pg_portal_lookup(&client->stmts, name);
+        query = portal ? portal->statement->query : NULL;
+    } else {
+        PGStatement *stmt = pg_stmt_lookup(&client->stmts, name);
+        query = stmt ? stmt->query : NULL;
+    }
+    
+    QueryType type = query ? pg_get_query_type(query) : QUERY_UNKNOWN;
+    bool stats = type == QUERY_SHOW && pg_query_has_word(query, "pgprotocol_stats");
+    if (type != QUERY_SELECT && !stats) {
+        return pg_send_message(client, PqMsg_NoData, NULL, 0);
+    }
+    
+    int16_t formats[3];
+    for (int i = 0; i < 3; i++) {
+        formats[i] = pg_portal_result_format(portal, i);
+    }
+    if (stats) {
+        return pg_send_row_description_formats(client, 2, stats_field_names, stats_field_types, formats);
+    }
+    if (strstr(query, "generate_series(")) {
+        return pg_send_row_description_formats(client, 1, series_field_names, series_field_types, formats);
+    }
+    return pg_send_row_description_formats(client, 3, demo_field_names, demo_field_types, formats);
+}
+
+/**
+ * Run a query for a simple Query (portal NULL) or an Execute
+ * 
+ * @param client Client connection
+ * @param query Query string
+ * @param portal Portal being executed, or NULL
+ * @return 0 on success, -1 on error
+ */
+static int pg_run_query(PGClientConn *client, const char *query, PGPortal *portal) {
     QueryType type;
     
     // Get query type
     type = pg_get_query_type(query);
     
+    // A failed transaction block ignores everything until it ends
+    if (client->txn_status == PG_TXN_FAILED && type != QUERY_COMMIT && type != QUERY_ROLLBACK) {
+        pg_send_error(client, "25P02", "current transaction is aborted, commands ignored until end of transaction block");
+        return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
+    }
+    
     // Handle query based on type
     switch (type) {
         case QUERY_SELECT:
-            return pg_handle_select(client, query);
+            return pg_handle_select(client, query, portal);
         
         case QUERY_INSERT:
-            return pg_handle_insert(client, query);
+            return pg_handle_insert(client, query, portal);
         
         case QUERY_UPDATE:
-            return pg_handle_update(client, query);
+            return pg_handle_update(client, query, portal);
         
         case QUERY_DELETE:
-            return pg_handle_delete(client, query);
+            return pg_handle_delete(client, query, portal);
         
         case QUERY_BEGIN:
         case QUERY_COMMIT:
         case QUERY_ROLLBACK:
-            return pg_handle_transaction(client, query, type);
+            return pg_handle_transaction(client, query, type, portal);
+        
+        case QUERY_COPY:
+            return pg_handle_copy(client, query, portal);
+        
+        case QUERY_SHOW:
+            return pg_handle_show(client, query, portal);
+        
+        case QUERY_EMPTY:
+            if (pg_send_message(client, PqMsg_EmptyQueryResponse, NULL, 0) < 0) return -1;
+            return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
         
         default:
             // Send error for unsupported query types
-            pg_send_error(client->fd, "42601", "Unsupported query type");
-            pg_send_ready_for_query(client->fd, client->txn_status);
-            return -1;
+            pg_send_error(client, "42601", "Unsupported query type");
+            if (!portal) {
+                pg_send_ready_for_query(client, client->txn_status);
+            }
+            return 0;  // the error is reported, the connection stays usable
     }
 }
 
+/**
+ * Finish a command: ReadyForQuery follows a simple Query, while after an
+ * Execute it waits for Sync
+ * 
+ * @param client Client connection
+ * @param tag Command tag
+ * @param portal Portal being executed, or NULL
+ * @return 0 on success, -1 on error
+ */
+static int pg_complete(PGClientConn *client, const char *tag, PGPortal *portal) {
+    if (pg_send_command_complete(client, tag) < 0) {
+        return -1;
+    }
+    return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
+}
+
+/**
+ * Hash of a case-folded leading keyword: perfect over the keywords below
+ * 
+ * @param word First word, folded with pg_get_query_type's `| 0x20`
+ * @param length Length of the word (at least 2)
+ * @return Slot in query_keywords
+ */
+static inline unsigned pg_keyword_hash(const unsigned char *word, size_t length) {
+    return (word[0] * 11u + word[1] * 12u + (unsigned)length) & (QUERY_KEYWORD_SLOTS - 1);
+}
+
 /**
  * Get the type of a query
  * 
+ * The first word is folded to lower case with a single OR per byte (only
+ * upper-case letters can fold onto lower-case ones) and looked up with one
+ * hash probe and one comparison.
+ * 
  * @param query Query string
  * @return Query type
  */
 static QueryType pg_get_query_type(const char *query) {
-    char first_word[16] = {0};
-    int i = 0;
+    unsigned char word[QUERY_KEYWORD_MAX];
+    size_t length = 0;
     
     // Skip leading whitespace
-    while (isspace(*query)) {
+    while (isspace((unsigned char)*query)) {
         query++;
     }
     
-    // Get first word
-    while (*query && !isspace(*query) && i < 15) {
-        first_word[i++] = toupper(*query++);
-    }
-    first_word[i] = '\0';
-    
-    // Determine query type based on first word
-    if (strcmp(first_word, "SELECT") == 0) {
-        return QUERY_SELECT;
-    } else if (strcmp(first_word, "INSERT") == 0) {
-        return QUERY_INSERT;
-    } else if (strcmp(first_word, "UPDATE") == 0) {
-        return QUERY_UPDATE;
-    } else if (strcmp(first_word, "DELETE") == 0) {
-        return QUERY_DELETE;
-    } else if (strcmp(first_word, "BEGIN") == 0) {
-        return QUERY_BEGIN;
-    } else if (strcmp(first_word, "COMMIT") == 0) {
-        return QUERY_COMMIT;
-    } else if (strcmp(first_word, "ROLLBACK") == 0) {
-        return QUERY_ROLLBACK;
-    } else if (strcmp(first_word, "CREATE") == 0) {
-        return QUERY_CREATE;
-    } else if (strcmp(first_word, "DROP") == 0) {
-        return QUERY_DROP;
-    } else if (strcmp(first_word, "ALTER") == 0) {
-        return QUERY_ALTER;
+    // Get first word; one longer than every keyword cannot match
+    while (*query && !isspace((unsigned char)*query) && *query != ';') {
+        if (length == sizeof(word)) {
+            return QUERY_UNKNOWN;
+        }
+        word[length++] = (unsigned char)*query++ | 0x20;
+    }
+    
+    if (length == 0) {
+        return QUERY_EMPTY;
+    }
+    if (length < QUERY_KEYWORD_MIN) {
+        return QUERY_UNKNOWN;
     }
     
+    const PGKeyword *keyword = &query_keywords[pg_keyword_hash(word, length)];
+    if (keyword->length == length && memcmp(keyword->word, word, length) == 0) {
+        return keyword->type;
+    }
     return QUERY_UNKNOWN;
 }
 
+/**
+ * Send the next rows of a generate_series
+ * 
+ * @param client Client connection
+ * @param state Series state
+ * @param max_rows Maximum number of rows to send
+ * @return Number of rows sent, 0 when exhausted, or -1 on error
+ */
+static int pg_series_produce(PGClientConn *client, void *state, int max_rows) {
+    PGSeries *series = (PGSeries *)state;
+    int64_t values[256];
+    PGColumn column = {.type = PG_TYPE_INT8, .values = values};
+    int rows = 0;
+    
+    // Columnar batches: the values are formatted straight into the output
+    while (rows < max_rows && series->next <= series->stop) {
+        int n = 0;
+        while (n < 256 && rows + n < max_rows && series->next <= series->stop) {
+            values[n++] = series->next++;
+        }
+        if (pg_send_data_rows(client, 1, &column, 0, n, &series->format) < 0) {
+            return -1;
+        }
+        rows += n;
+    }
+    
+    return rows;
+}
+
+/**
+ * Read one generate_series argument: an integer, or $n for a Bind parameter
+ * 
+ * @param p Position in the argument text, advanced past the argument
+ * @param portal Portal supplying parameters, or NULL
+ * @param value Set to the argument
+ * @return 0 on success, -1 on error
+ */
+static int pg_series_arg(const char **p, PGPortal *portal, long long *value) {
+    char *end;
+    
+    while (isspace((unsigned char)**p)) {
+        (*p)++;
+    }
+    
+    if (**p == '$') {
+        PGValue param;
+        long index = strtol(*p + 1, &end, 10);
+        if (!portal || end == *p + 1 || pg_portal_param(portal, (int)index - 1, &param, NULL, 0) < 0) {
+            return -1;
+        }
+        if (param.isnull) {
+            return -1;
+        }
+        if (param.type == PG_TYPE_INT2 || param.type == PG_TYPE_INT4 || param.type == PG_TYPE_INT8) {
+            *value = param.v.i;
+        } else {
+            // Untyped or text parameter
+            char text[32];
+            if (param.v.str.length <= 0 || param.v.str.length >= (int)sizeof(text)) return -1;
+            memcpy(text, param.v.str.data, param.v.str.length);
+            text[param.v.str.length] = '\0';
+            char *text_end;
+            *value = strtoll(text, &text_end, 10);
+            if (*text_end) return -1;
+        }
+    } else {
+        *value = strtoll(*p, &end, 10);
+        if (end == *p) {
+            return -1;
+        }
+    }
+    
+    *p = end;
+    return 0;
+}
+
+/**
+ * Handle SELECT ... generate_series(start, stop)
+ * 
+ * The rows are streamed, so arbitrarily long series use constant memory.
+ * 
+ * @param client Client connection
+ * @param args Text following "generate_series("
+ * @param portal Portal being executed, or NULL
+ * @return 0 on success, -1 on error
+ */
+static int pg_handle_generate_series(PGClientConn *client, const char *args, PGPortal *portal) {
+    PGSeries *series;
+    
+    // A portal's stream may be suspended past Sync, so it cannot use
+    // per-query memory
+    series = portal ? malloc(sizeof(PGSeries)) : pg_client_alloc(client, sizeof(PGSeries));
+    if (!series) {
+        return -1;
+    }
+    series->format = pg_portal_result_format(portal, 0);
+    
+    const char *p = args;
+    if (pg_series_arg(&p, portal, &series->next) < 0 || *p++ != ',' ||
+        pg_series_arg(&p, portal, &series->stop) < 0) {
+        if (portal) {
+            free(series);
+        }
+        pg_send_error(client, "42883", "generate_series expects two integer arguments");
+        return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
+    }
+    
+    if (!portal) {
+        pg_send_row_description(client, 1, series_field_names, series_field_types);
+    }
+    return pg_server_stream_rows(client, "SELECT", pg_series_produce, portal ? free : NULL, series);
+}
+
 /**
  * Handle a SELECT query
  * 
  * @param client Client connection
  * @param query Query string
+ * @param portal Portal being executed, or NULL
  * @return 0 on success, -1 on error
  */
-static int pg_handle_select(PGClientConn *client, const char *query) {
+static int pg_handle_select(PGClientConn *client, const char *query, PGPortal *portal) {
+    const char *series = strstr(query, "generate_series(");
+    if (series) {
+        return pg_handle_generate_series(client, series + strlen("generate_series("), portal);
+    }
+    
     // For demonstration, we'll just return a simple result set
-    const char *field_names[] = {"id", "name", "value"};
-    int field_types[] = {23, 25, 25}; // int4, text, text
+    int16_t formats[3];
+    for (int i = 0; i < 3; i++) {
+        formats[i] = pg_portal_result_format(portal, i);
+    }
     
     // Send row description
-    pg_send_row_description(client->fd, 3, field_names, field_types);
+    if (!portal) {
+        pg_send_row_description(client, 3, demo_field_names, demo_field_types);
+    }
     
     // Send data rows
-    const char *values1[] = {"1", "Row 1", "Value 1"};
-    int lengths1[] = {1, 5, 7};
-    pg_send_data_row(client->fd, 3, values1, lengths1);
+    PGValue values1[] = {
+        {.type = PG_TYPE_INT4, .v.i = 1},
+        {.type = PG_TYPE_TEXT, .v.str = {"Row 1", 5}},
+        {.type = PG_TYPE_TEXT, .v.str = {"Value 1", 7}},
+    };
+    pg_send_data_row_values(client, 3, values1, formats);
     
-    const char *values2[] = {"2", "Row 2", "Value 2"};
-    int lengths2[] = {1, 5, 7};
-    pg_send_data_row(client->fd, 3, values2, lengths2);
+    PGValue values2[] = {
+        {.type = PG_TYPE_INT4, .v.i = 2},
+        {.type = PG_TYPE_TEXT, .v.str = {"Row 2", 5}},
+        {.type = PG_TYPE_TEXT, .v.str = {"Value 2", 7}},
+    };
+    pg_send_data_row_values(client, 3, values2, formats);
     
-    // Send command complete
-    pg_send_command_complete(client->fd, "SELECT 2");
+    // Send command complete, and ready for query after a simple Query
+    if (pg_complete(client, "SELECT 2", portal) < 0) {
+        return -1;
+    }
     
-    // Send ready for query
-    pg_send_ready_for_query(client->fd, client->txn_status);
+    // The rows are the same for everyone, so the reply can be shared
+    pg_server_cache_response(client);
     
     return 0;
 }
@@ -160,14 +462,15 @@ static int pg_handle_select(PGClientConn *client, const char *query) {
  * 
  * @param client Client connection
  * @param query Query string
+ * @param portal Portal being executed, or NULL
  * @return 0 on success, -1 on error
  */
-static int pg_handle_insert(PGClientConn *client, const char *query) {
+static int pg_handle_insert(PGClientConn *client, const char *query, PGPortal *portal) {
+    (void)query;
+
     // For demonstration, we'll just return a success message
-    pg_send_command_complete(client->fd, "INSERT 0 1");
-    pg_send_ready_for_query(client->fd, client->txn_status);
-    
-    return 0;
+    pg_server_invalidate_cache(client->server, NULL);
+    return pg_complete(client, "INSERT 0 1", portal);
 }
 
 /**
@@ -175,14 +478,15 @@ static int pg_handle_insert(PGClientConn *client, const char *query) {
  * 
  * @param client Client connection
  * @param query Query string
+ * @param portal Portal being executed, or NULL
  * @return 0 on success, -1 on error
  */
-static int pg_handle_update(PGClientConn *client, const char *query) {
+static int pg_handle_update(PGClientConn *client, const char *query, PGPortal *portal) {
+    (void)query;
+
     // For demonstration, we'll just return a success message
-    pg_send_command_complete(client->fd, "UPDATE 1");
-    pg_send_ready_for_query(client->fd, client->txn_status);
-    
-    return 0;
+    pg_server_invalidate_cache(client->server, NULL);
+    return pg_complete(client, "UPDATE 1", portal);
 }
 
 /**
@@ -190,14 +494,15 @@ static int pg_handle_update(PGClientConn *client, const char *query) {
  * 
  * @param client Client connection
  * @param query Query string
+ * @param portal Portal being executed, or NULL
  * @return 0 on success, -1 on error
  */
-static int pg_handle_delete(PGClientConn *client, const char *query) {
+static int pg_handle_delete(PGClientConn *client, const char *query, PGPortal *portal) {
+    (void)query;
+
     // For demonstration, we'll just return a success message
-    pg_send_command_complete(client->fd, "DELETE 1");
-    pg_send_ready_for_query(client->fd, client->txn_status);
-    
-    return 0;
+    pg_server_invalidate_cache(client->server, NULL);
+    return pg_complete(client, "DELETE 1", portal);
 }
 
 /**
@@ -206,30 +511,252 @@ static int pg_handle_delete(PGClientConn *client, const char *query) {
  * @param client Client connection
  * @param query Query string
  * @param type Query type
+ * @param portal Portal being executed, or NULL
  * @return 0 on success, -1 on error
  */
-static int pg_handle_transaction(PGClientConn *client, const char *query, QueryType type) {
+static int pg_handle_transaction(PGClientConn *client, const char *query, QueryType type, PGPortal *portal) {
+    (void)query;
+
     switch (type) {
         case QUERY_BEGIN:
             client->txn_status = PG_TXN_TRANSACTION;
-            pg_send_command_complete(client->fd, "BEGIN");
-            break;
+            return pg_complete(client, "BEGIN", portal);
         
         case QUERY_COMMIT:
+            // Committing a failed transaction rolls it back
+            if (client->txn_status == PG_TXN_FAILED) {
+                client->txn_status = PG_TXN_IDLE;
+                return pg_complete(client, "ROLLBACK", portal);
+            }
             client->txn_status = PG_TXN_IDLE;
-            pg_send_command_complete(client->fd, "COMMIT");
-            break;
+            return pg_complete(client, "COMMIT", portal);
         
         case QUERY_ROLLBACK:
             client->txn_status = PG_TXN_IDLE;
-            pg_send_command_complete(client->fd, "ROLLBACK");
-            break;
+            return pg_complete(client, "ROLLBACK", portal);
         
         default:
             return -1;
     }
+}
+
+/**
+ * Check whether a query contains a word, ignoring case
+ * 
+ * @param query Query string
+ * @param word Word to look for
+ * @return true if the word occurs on its own
+ */
+static bool pg_query_has_word(const char *query, const char *word) {
+    size_t length = strlen(word);
+    
+    for (const char *p = query; *p; p++) {
+        if (strncasecmp(p, word, length) == 0 &&
+            (p == query || !isalnum((unsigned char)p[-1])) &&
+            !isalnum((unsigned char)p[length])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Handle COPY ... FROM STDIN and COPY ... TO STDOUT through the copy callbacks
+ * 
+ * @param client Client connection
+ * @param query Query string
+ * @param portal Portal being executed, or NULL
+ * @return 0 on success, -1 on error
+ */
+static int pg_handle_copy(PGClientConn *client, const char *query, PGPortal *portal) {
+    PGServer *server = client->server;
     
-    pg_send_ready_for_query(client->fd, client->txn_status);
+    if (pg_query_has_word(query, "stdin")) {
+        return server->callbacks.copy_in_start(client, query);
+    }
+    if (pg_query_has_word(query, "stdout")) {
+        return server->callbacks.copy_out_start(client, query);
+    }
     
+    pg_send_error(client, "0A000", "COPY is only supported FROM STDIN or TO STDOUT");
+    return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
+}
+
+/**
+ * Default copy-in start callback: accepts text rows for any table
+ * 
+ * @param client Client connection
+ * @param query Query string
+ * @return 0 on success, -1 on error
+ */
+int pg_default_copy_in_start_callback(PGClientConn *client, const char *query) {
+    (void)query;
+    return pg_server_copy_in(client, PG_FORMAT_TEXT, 0, NULL);
+}
+
+/**
+ * Default copy data callback: counts the rows and drops them
+ * 
+ * @param client Client connection
+ * @param data Part of the COPY data stream
+ * @param length Length of data
+ * @return 0 on success, -1 on error
+ */
+int pg_default_copy_data_callback(PGClientConn *client, const char *data, int length) {
+    const char *end = data + length;
+    
+    while ((data = memchr(data, '\n', end - data)) != NULL) {
+        client->copy_rows++;
+        data++;
+    }
     return 0;
 }
+
+/**
+ * Default copy done callback: reports the rows received
+ * 
+ * @param client Client connection
+ * @return 0 on success, -1 on error
+ */
+int pg_default_copy_done_callback(PGClientConn *client) {
+    char tag[32];
+    snprintf(tag, sizeof(tag), "COPY %lld", (long long)client->copy_rows);
+    return pg_send_command_complete(client, tag);
+}
+
+/**
+ * Default copy fail callback: nothing to undo
+ * 
+ * @param client Client connection
+ * @param message Reason given by the client
+ * @return 0 on success, -1 on error
+ */
+int pg_default_copy_fail_callback(PGClientConn *client, const char *message) {
+    (void)client;
+    (void)message;
+    return 0;
+}
+
+/**
+ * Send the next rows of a generate_series as COPY text
+ * 
+ * @param client Client connection
+ * @param state Series state
+ * @param max_rows Maximum number of rows to send
+ * @return Number of rows sent, 0 when exhausted, or -1 on error
+ */
+static int pg_series_copy_produce(PGClientConn *client, void *state, int max_rows) {
+    PGSeries *series = (PGSeries *)state;
+    char line[32];
+    int rows = 0;
+    
+    while (rows < max_rows && series->next <= series->stop) {
+        int length = snprintf(line, sizeof(line), "%lld\n", series->next++);
+        if (pg_server_copy_data(client, line, length) < 0) {
+            return -1;
+        }
+        rows++;
+    }
+    
+    return rows;
+}
+
+/**
+ * Default copy-out start callback: COPY (SELECT ... generate_series(start,
+ * stop)) TO STDOUT streams the series, any other COPY the demonstration rows
+ * 
+ * @param client Client connection
+ * @param query Query string
+ * @return 0 on success, -1 on error
+ */
+int pg_default_copy_out_start_callback(PGClientConn *client, const char *query) {
+    PGPortal *portal = client->execute_portal ? pg_portal_lookup(&client->stmts, client->execute_portal) : NULL;
+    const char *args = strstr(query, "generate_series(");
+    
+    if (args) {
+        // COPY is never suspended, so it ends before the next ReadyForQuery
+        PGSeries *series = pg_client_alloc(client, sizeof(PGSeries));
+        if (!series) {
+            return -1;
+        }
+        series->format = PG_FORMAT_TEXT;
+        
+        const char *p = args + strlen("generate_series(");
+        if (pg_series_arg(&p, portal, &series->next) < 0 || *p++ != ',' ||
+            pg_series_arg(&p, portal, &series->stop) < 0) {
+            pg_send_error(client, "42883", "generate_series expects two integer arguments");
+            return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
+        }
+        
+        if (pg_server_copy_out(client, PG_FORMAT_TEXT, 1, NULL) < 0) {
+            return -1;
+        }
+        return pg_server_stream_copy(client, pg_series_copy_produce, NULL, series);
+    }
+    
+    static const char *rows[] = {"1\tRow 1\tValue 1\n", "2\tRow 2\tValue 2\n"};
+    if (pg_server_copy_out(client, PG_FORMAT_TEXT, 3, NULL) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pg_server_copy_data(client, rows[i], (int)strlen(rows[i])) < 0) {
+            return -1;
+        }
+    }
+    return pg_server_copy_out_done(client, 2);
+}
+
+/**
+ * Send one row of SHOW pgprotocol_stats
+ * 
+ * @param arg Rows being sent
+ * @param name Metric name
+ * @param value Metric value
+ * @return 0 on success, -1 on error
+ */
+static int pg_send_stats_row(void *arg, const char *name, int64_t value) {
+    PGStatsRows *rows = (PGStatsRows *)arg;
+    PGValue values[] = {
+        {.type = PG_TYPE_TEXT, .v.str = {name, (int)strlen(name)}},
+        {.type = PG_TYPE_INT8, .v.i = value},
+    };
+    return pg_send_data_row_values(rows->client, 2, values, rows->formats);
+}
+
+/**
+ * Handle SHOW; only pgprotocol_stats, the server's metrics, is known
+ * 
+ * @param client Client connection
+ * @param query Query string
+ * @param portal Portal being executed, or NULL
+ * @return 0 on success, -1 on error
+ */
+static int pg_handle_show(PGClientConn *client, const char *query, PGPortal *portal) {
+    PGStatsRows rows;
+    
+    if (!pg_query_has_word(query, "pgprotocol_stats")) {
+        pg_send_error(client, "42704", "unrecognized configuration parameter");
+        return portal ? 0 : pg_send_ready_for_query(client, client->txn_status);
+    }
+    
+    PGMetricsTotals *totals = pg_client_alloc(client, sizeof(PGMetricsTotals));
+    if (!totals) {
+        return -1;
+    }
+    pg_metrics_collect(client->server->metrics, totals);
+    
+    rows.client = client;
+    for (int i = 0; i < 2; i++) {
+        rows.formats[i] = pg_portal_result_format(portal, i);
+    }
+    
+    if (!portal) {
+        pg_send_row_description(client, 2, stats_field_names, stats_field_types);
+    }
+    int result = pg_metrics_rows(totals, pg_send_stats_row, &rows);
+    
+    if (result < 0) {
+        return -1;
+    }
+    return pg_complete(client, "SHOW", portal);
+}
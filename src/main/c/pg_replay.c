@@ -0,0 +1,990 @@
+/**
+ * pg_replay.c
+ * Capture Replay
+ *
+ * This file contains a client that replays traffic recorded with the
+ * server's --capture option. Every captured connection is opened again and
+ * sends what its client sent, at the captured pace (scaled by a speed
+ * factor) or as fast as the server answers. In both modes a request is
+ * held back until the server has sent as many ReadyForQuery messages as it
+ * had when the request was captured, so each connection sees its requests
+ * and replies in the captured order. SSL and GSS encryption requests and
+ * password messages are dropped: the target must trust the captured users.
+ */
+
+#include "pg_capture.h"
+#include "pg_event.h"
+#include "pg_buffer.h"
+#include "pg_metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "/usr/local/pgsql/18/include/server/libpq/protocol.h"
+
+#define REPLAY_MAX_EVENTS 256
+#define REPLAY_READ_SIZE (64 * 1024)
+#define REPLAY_CONNECT_BATCH 512      // connection attempts in progress per thread
+#define REPLAY_POLL_MS 100            // longest sleep, to notice the end of the run
+
+#define REPLAY_SSL_CODE 80877103
+#define REPLAY_GSSENC_CODE 80877104
+
+/* Run configuration */
+typedef struct {
+    const char *file;
+    const char *host;
+    int port;
+    double speed;            /* Pace relative to the capture, 0 for as fast as possible */
+    int threads;
+    bool json;
+    PGEventBackend event_backend;
+} ReplayOptions;
+
+/* Counts the messages in a stream of backend bytes without keeping them */
+typedef struct {
+    char header[5];          /* Type and length of the current message */
+    int header_len;
+    size_t skip;             /* Payload bytes of the current message not yet seen */
+    int answers;             /* Single-byte answers to SSL/GSS requests still to come */
+    uint64_t ready;          /* ReadyForQuery messages */
+    uint64_t errors;         /* ErrorResponse messages */
+} ReplayScanner;
+
+/* Client bytes to send once a connection reaches a point of its timeline */
+typedef struct {
+    uint64_t time;           /* Capture time of the read that received them */
+    uint64_t ready;          /* ReadyForQuery messages the server had sent by then */
+    size_t offset;           /* Slice of the connection's data */
+    size_t length;
+} ReplayStep;
+
+typedef enum {
+    REPLAY_WAITING,          /* Not connected yet */
+    REPLAY_CONNECTING,       /* Non-blocking connect in progress */
+    REPLAY_RUNNING,          /* Sending its steps */
+    REPLAY_DONE              /* Closed */
+} ReplayConnState;
+
+typedef struct ReplayThread ReplayThread;
+
+/* One captured connection */
+typedef struct {
+    uint64_t id;             /* Connection id in the capture */
+    uint64_t start;          /* Capture time of the connect */
+    uint64_t end;            /* Capture time of the close (0: still open at the end) */
+    PGBuffer data;           /* Everything the client sent that is replayed */
+    ReplayStep *steps;
+    int num_steps;
+    int steps_size;
+    ReplayScanner captured;  /* The server's side of the capture */
+
+    /* Framing of the captured client bytes while loading */
+    PGBuffer pending;
+    bool startup_done;
+
+    /* Replay */
+    int fd;
+    ReplayConnState state;
+    ReplayThread *thread;
+    int step;                /* Next step to send */
+    PGBuffer out;
+    bool watch_write;
+    ReplayScanner live;      /* What the server sends now */
+    uint64_t wait_start;     /* When the requests now waited on were sent (0: none) */
+    uint64_t wait_for;       /* ReadyForQuery count that answers them */
+    uint64_t due;            /* When the timer fires */
+    int heap_index;          /* Position in the thread's timer heap, -1 if not scheduled */
+} ReplayConn;
+
+/* Thread state; its counters are written by the thread only */
+struct ReplayThread {
+    pthread_t thread;
+    PGEventLoop *loop;
+    ReplayConn **conns;      /* In order of their captured connect times */
+    int num_conns;
+    int next_start;          /* First connection not yet started */
+    int connecting;
+    int active;              /* Connections not in REPLAY_DONE */
+    ReplayConn **heap;       /* Connections waiting for their time, earliest first */
+    int heap_size;
+    PGHistogram latency;     /* From sending requests to the ReadyForQuery they wait for */
+    uint64_t ready;
+    uint64_t errors;
+    uint64_t captured_errors;
+    uint64_t bytes_sent;
+    uint64_t connections;    /* Connections that replayed all their steps */
+    uint64_t connect_errors; /* Failed connects and connections dropped early */
+    char buffer[REPLAY_READ_SIZE];
+};
+
+static ReplayOptions options;
+static struct sockaddr_storage addr;
+static socklen_t addr_len;
+static atomic_bool running = true;
+
+static uint64_t capture_base;  /* Capture time of the first connect */
+static uint64_t replay_start;  /* Monotonic clock when the replay began */
+
+/**
+ * Signal handler: ends the run early
+ *
+ * @param sig Signal number
+ */
+static void replay_signal(int sig) {
+    (void)sig;
+    atomic_store(&running, false);
+}
+
+/**
+ * Print usage information
+ *
+ * @param program_name Program name
+ */
+static void print_usage(const char *program_name) {
+    printf("Usage: %s [options] FILE\n", program_name);
+    printf("Replays a capture recorded with pg_server --capture FILE\n");
+    printf("Options:\n");
+    printf("  -h, --host HOST         Server address (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT         Server port (default: 5432)\n");
+    printf("  -s, --speed X           Pace relative to the capture, or max (default: 1)\n");
+    printf("  -j, --threads NUM       Number of threads (default: 1)\n");
+    printf("  -e, --event-backend B   Event loop backend: auto, epoll, kqueue, io_uring, select (default: auto)\n");
+    printf("  -J, --json              Print the results as one JSON object\n");
+    printf("  -?, --help              Show this help message\n");
+}
+
+/**
+ * Parse command line arguments
+ *
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return 0 on success, 1 after --help, -1 on error
+ */
+static int parse_arguments(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 'h'},
+        {"port", required_argument, 0, 'p'},
+        {"speed", required_argument, 0, 's'},
+        {"threads", required_argument, 0, 'j'},
+        {"event-backend", required_argument, 0, 'e'},
+        {"json", no_argument, 0, 'J'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+    int option_index = 0;
+    int c;
+
+    options.host = "127.0.0.1";
+    options.port = 5432;
+    options.speed = 1;
+    options.threads = 1;
+    options.json = false;
+    options.event_backend = PG_EVENT_BACKEND_AUTO;
+
+    while ((c = getopt_long(argc, argv, "h:p:s:j:e:J?", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'h': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'j': options.threads = atoi(optarg); break;
+            case 'J': options.json = true; break;
+
+            case 's':
+                if (strcmp(optarg, "max") == 0) {
+                    options.speed = 0;
+                } else {
+                    options.speed = atof(optarg);
+                    if (options.speed <= 0) {
+                        fprintf(stderr, "Invalid speed: %s\n", optarg);
+                        return -1;
+                    }
+                }
+                break;
+
+            case 'e':
+                if (pg_event_backend_parse(optarg, &options.event_backend) != 0) {
+                    fprintf(stderr, "Unknown event backend: %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case '?':
+                print_usage(argv[0]);
+                return 1;
+
+            default:
+                return -1;
+        }
+    }
+
+    if (optind != argc - 1 || options.threads < 1 || options.port <= 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return -1;
+    }
+    options.file = argv[optind];
+    return 0;
+}
+
+/**
+ * Resolve the server address
+ *
+ * @return 0 on success, -1 if the host cannot be resolved
+ */
+static int replay_resolve(void) {
+    struct addrinfo hints, *result;
+    char port[16];
+
+    snprintf(port, sizeof(port), "%d", options.port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(options.host, port, &hints, &result);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", options.host, gai_strerror(rc));
+        return -1;
+    }
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+static uint32_t replay_get32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return ntohl(value);
+}
+
+/* Count the messages in the next bytes of a backend stream. Returns the
+   number of ReadyForQuery messages among them. */
+static uint64_t replay_scan(ReplayScanner *scan, const char *data, size_t length) {
+    uint64_t ready = scan->ready;
+
+    while (length > 0) {
+        if (scan->answers > 0) {
+            scan->answers--;
+            data++;
+            length--;
+            continue;
+        }
+        if (scan->skip > 0) {
+            size_t n = length < scan->skip ? length : scan->skip;
+            scan->skip -= n;
+            data += n;
+            length -= n;
+            continue;
+        }
+
+        size_t n = 5 - (size_t)scan->header_len;
+        if (n > length) n = length;
+        memcpy(scan->header + scan->header_len, data, n);
+        scan->header_len += (int)n;
+        data += n;
+        length -= n;
+        if (scan->header_len < 5) {
+            break;
+        }
+
+        uint32_t msg_len = replay_get32(scan->header + 1);
+        scan->skip = msg_len > 4 ? msg_len - 4 : 0;
+        scan->header_len = 0;
+        if (scan->header[0] == PqMsg_ReadyForQuery) {
+            scan->ready++;
+        } else if (scan->header[0] == PqMsg_ErrorResponse) {
+            scan->errors++;
+        }
+    }
+    return scan->ready - ready;
+}
+
+/* Add the complete client messages received so far to the data a
+   connection replays, dropping those that cannot be replayed */
+static int replay_frame_client(ReplayConn *conn) {
+    PGBuffer *pending = &conn->pending;
+
+    for (;;) {
+        const char *p = pg_buffer_read_ptr(pending);
+        size_t avail = pg_buffer_length(pending);
+        size_t total;
+        bool keep = true;
+
+        if (!conn->startup_done) {
+            // Untyped: length, then the protocol version or request code
+            if (avail < 8) break;
+            total = replay_get32(p);
+            if (total < 8) return -1;
+            if (avail < total) break;
+
+            uint32_t code = replay_get32(p + 4);
+            if (code == REPLAY_SSL_CODE || code == REPLAY_GSSENC_CODE) {
+                conn->captured.answers++;   // answered with a single byte
+                keep = false;
+            } else {
+                conn->startup_done = true;
+            }
+        } else {
+            if (avail < 5) break;
+            total = 1 + (size_t)replay_get32(p + 1);
+            if (total < 5) return -1;
+            if (avail < total) break;
+            keep = p[0] != PqMsg_PasswordMessage;  // also SASL responses
+        }
+
+        if (keep && pg_buffer_append(&conn->data, p, total) < 0) {
+            return -1;
+        }
+        pg_buffer_consume(pending, total);
+    }
+    return 0;
+}
+
+/**
+ * Add the bytes of a captured client read to its connection
+ *
+ * @param conn Connection
+ * @param time Capture time of the read
+ * @param data Bytes
+ * @param length Number of bytes
+ * @return 0 on success, -1 if the stream is not the protocol or memory ran out
+ */
+static int replay_add_client_bytes(ReplayConn *conn, uint64_t time, const char *data, size_t length) {
+    size_t before = pg_buffer_length(&conn->data);
+
+    if (pg_buffer_append(&conn->pending, data, length) < 0 || replay_frame_client(conn) < 0) {
+        return -1;
+    }
+    size_t added = pg_buffer_length(&conn->data) - before;
+    if (added == 0) {
+        return 0;
+    }
+
+    if (conn->num_steps == conn->steps_size) {
+        int size = conn->steps_size ? conn->steps_size * 2 : 8;
+        ReplayStep *steps = (ReplayStep *)realloc(conn->steps, size * sizeof(ReplayStep));
+        if (!steps) return -1;
+        conn->steps = steps;
+        conn->steps_size = size;
+    }
+    ReplayStep *step = &conn->steps[conn->num_steps++];
+    step->time = time;
+    step->ready = conn->captured.ready;
+    step->offset = before;
+    step->length = added;
+    return 0;
+}
+
+/* Connections by capture id, open addressing */
+typedef struct {
+    ReplayConn **slots;
+    size_t size;
+    size_t count;
+} ReplayIndex;
+
+static ReplayConn **replay_index_slot(ReplayIndex *index, uint64_t id) {
+    size_t i = (size_t)(id * 0x9e3779b97f4a7c15ull) & (index->size - 1);
+    while (index->slots[i] && index->slots[i]->id != id) {
+        i = (i + 1) & (index->size - 1);
+    }
+    return &index->slots[i];
+}
+
+static int replay_index_add(ReplayIndex *index, ReplayConn *conn) {
+    if ((index->count + 1) * 2 > index->size) {
+        ReplayIndex grown = {NULL, index->size ? index->size * 2 : 1024, 0};
+        grown.slots = (ReplayConn **)calloc(grown.size, sizeof(ReplayConn *));
+        if (!grown.slots) return -1;
+        for (size_t i = 0; i < index->size; i++) {
+            if (index->slots[i]) {
+                *replay_index_slot(&grown, index->slots[i]->id) = index->slots[i];
+                grown.count++;
+            }
+        }
+        free(index->slots);
+        *index = grown;
+    }
+    *replay_index_slot(index, conn->id) = conn;
+    index->count++;
+    return 0;
+}
+
+/**
+ * Load the connections of a capture
+ *
+ * @param conns Receives the connections, in order of their connect times
+ * @param num_conns Receives their number
+ * @return 0 on success, -1 if the file cannot be read
+ */
+static int replay_load(ReplayConn ***conns, int *num_conns) {
+    PGCaptureReader *reader = pg_capture_reader_open(options.file);
+    ReplayIndex index = {NULL, 0, 0};
+    ReplayConn **list = NULL;
+    int count = 0, size = 0;
+    PGCaptureRecord record;
+    const char *payload;
+    int rc;
+
+    if (!reader) {
+        fprintf(stderr, "Cannot read capture %s: %s\n", options.file, strerror(errno));
+        return -1;
+    }
+
+    while ((rc = pg_capture_reader_next(reader, &record, &payload)) > 0) {
+        if (record.kind == PG_CAPTURE_CONNECT) {
+            if (count == size) {
+                size = size ? size * 2 : 64;
+                list = (ReplayConn **)realloc(list, size * sizeof(ReplayConn *));
+            }
+            ReplayConn *conn = (ReplayConn *)calloc(1, sizeof(ReplayConn));
+            if (!list || !conn) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
+            }
+            conn->id = record.conn;
+            conn->start = record.time;
+            conn->fd = -1;
+            conn->heap_index = -1;
+            pg_buffer_init(&conn->data);
+            pg_buffer_init(&conn->pending);
+            pg_buffer_init(&conn->out);
+            if (count == 0) {
+                capture_base = record.time;
+            }
+            list[count++] = conn;
+            if (replay_index_add(&index, conn) < 0) {
+                fprintf(stderr, "Out of memory\n");
+                return -1;
+            }
+            continue;
+        }
+
+        // Connections open when the capture started are not replayed
+        ReplayConn *conn = index.size ? *replay_index_slot(&index, record.conn) : NULL;
+        if (!conn) {
+            continue;
+        }
+
+        switch (record.kind) {
+            case PG_CAPTURE_CLIENT:
+                if (replay_add_client_bytes(conn, record.time, payload, record.length) < 0) {
+                    fprintf(stderr, "Connection %llx does not speak the protocol; replaying what came before\n",
+                            (unsigned long long)conn->id);
+                    pg_buffer_truncate(&conn->pending, 0);
+                }
+                break;
+            case PG_CAPTURE_SERVER:
+                replay_scan(&conn->captured, payload, record.length);
+                break;
+            case PG_CAPTURE_CLOSE:
+                conn->end = record.time;
+                break;
+        }
+    }
+
+    if (rc < 0) {
+        fprintf(stderr, "Capture %s is damaged; replaying the records before it\n", options.file);
+    }
+    for (int i = 0; i < count; i++) {
+        pg_buffer_free(&list[i]->pending);
+    }
+    free(index.slots);
+    pg_capture_reader_close(reader);
+
+    *conns = list;
+    *num_conns = count;
+    return 0;
+}
+
+/* When a capture time comes in the replay */
+static uint64_t replay_due(uint64_t time) {
+    double offset = time > capture_base ? (double)(time - capture_base) : 0;
+    return replay_start + (uint64_t)(offset / options.speed);
+}
+
+static void replay_heap_swap(ReplayThread *thread, int a, int b) {
+    ReplayConn *conn = thread->heap[a];
+    thread->heap[a] = thread->heap[b];
+    thread->heap[b] = conn;
+    thread->heap[a]->heap_index = a;
+    thread->heap[b]->heap_index = b;
+}
+
+static void replay_heap_fix(ReplayThread *thread, int i) {
+    while (i > 0 && thread->heap[(i - 1) / 2]->due > thread->heap[i]->due) {
+        replay_heap_swap(thread, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < thread->heap_size && thread->heap[left]->due < thread->heap[least]->due) least = left;
+        if (right < thread->heap_size && thread->heap[right]->due < thread->heap[least]->due) least = right;
+        if (least == i) break;
+        replay_heap_swap(thread, i, least);
+        i = least;
+    }
+}
+
+/* Run replay_advance for the connection at the given time */
+static void replay_schedule(ReplayConn *conn, uint64_t due) {
+    ReplayThread *thread = conn->thread;
+
+    conn->due = due;
+    if (conn->heap_index < 0) {
+        conn->heap_index = thread->heap_size;
+        thread->heap[thread->heap_size++] = conn;
+    }
+    replay_heap_fix(thread, conn->heap_index);
+}
+
+static void replay_unschedule(ReplayConn *conn) {
+    ReplayThread *thread = conn->thread;
+    int i = conn->heap_index;
+
+    if (i < 0) {
+        return;
+    }
+    conn->heap_index = -1;
+    if (--thread->heap_size > i) {
+        thread->heap[i] = thread->heap[thread->heap_size];
+        thread->heap[i]->heap_index = i;
+        replay_heap_fix(thread, i);
+    }
+}
+
+/**
+ * Close a connection
+ *
+ * @param conn Connection
+ * @param failed Whether it ended before replaying all its steps
+ */
+static void replay_close(ReplayConn *conn, bool failed) {
+    ReplayThread *thread = conn->thread;
+
+    if (conn->fd >= 0) {
+        pg_event_remove(thread->loop, conn->fd);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if (conn->state == REPLAY_CONNECTING) {
+        thread->connecting--;
+    }
+    replay_unschedule(conn);
+    if (failed) {
+        thread->connect_errors++;
+    } else {
+        thread->connections++;
+    }
+    thread->errors += conn->live.errors;
+    thread->captured_errors += conn->captured.errors;
+    thread->ready += conn->live.ready;
+
+    pg_buffer_free(&conn->out);
+    conn->state = REPLAY_DONE;
+    thread->active--;
+}
+
+/* Watch a connection for reading, and for writing while output is queued */
+static void replay_watch(ReplayConn *conn, bool write) {
+    if (write != conn->watch_write) {
+        pg_event_modify(conn->thread->loop, conn->fd, PG_EVENT_READ | (write ? PG_EVENT_WRITE : 0), conn);
+        conn->watch_write = write;
+    }
+}
+
+/* Write queued output; -1 if the connection failed */
+static int replay_flush(ReplayConn *conn) {
+    PGBuffer *out = &conn->out;
+
+    while (pg_buffer_length(out) > 0) {
+        ssize_t sent = send(conn->fd, pg_buffer_read_ptr(out), pg_buffer_length(out), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        pg_buffer_consume(out, (size_t)sent);
+        conn->thread->bytes_sent += (uint64_t)sent;
+    }
+    replay_watch(conn, pg_buffer_length(out) > 0);
+    return 0;
+}
+
+/**
+ * Send the steps a connection has reached, then wait for the server, for
+ * the clock or, after the last one, for the captured close
+ *
+ * @param conn Connection
+ * @return 0 to go on, 1 if the connection was closed, -1 on error
+ */
+static int replay_advance(ReplayConn *conn) {
+    uint64_t now = pg_metrics_now();
+    uint64_t burst = 0;
+    bool waiting_clock = false;
+
+    while (conn->step < conn->num_steps) {
+        const ReplayStep *step = &conn->steps[conn->step];
+        if (conn->live.ready < step->ready) {
+            break;
+        }
+        if (options.speed > 0 && replay_due(step->time) > now) {
+            replay_schedule(conn, replay_due(step->time));
+            waiting_clock = true;
+            break;
+        }
+        if (pg_buffer_append(&conn->out, pg_buffer_read_ptr(&conn->data) + step->offset, step->length) < 0) {
+            return -1;
+        }
+        if (!burst) burst = now;
+        conn->step++;
+    }
+
+    // The requests just sent are answered once the server gets to the
+    // point where the captured client went on
+    uint64_t gate = conn->step < conn->num_steps ? conn->steps[conn->step].ready : conn->captured.ready;
+    if (burst && !conn->wait_start && gate > conn->live.ready) {
+        conn->wait_start = burst;
+        conn->wait_for = gate;
+    }
+
+    if (replay_flush(conn) < 0) {
+        return -1;
+    }
+
+    if (conn->step == conn->num_steps && conn->live.ready >= conn->captured.ready &&
+        pg_buffer_length(&conn->out) == 0 && !waiting_clock) {
+        // Idle connections are held open as long as they were captured
+        if (options.speed > 0 && conn->end && replay_due(conn->end) > now) {
+            replay_schedule(conn, replay_due(conn->end));
+            return 0;
+        }
+        replay_close(conn, false);
+        return 1;
+    }
+    return 0;
+}
+
+/* Read and count what the server sent; -1 if the connection failed */
+static int replay_read(ReplayConn *conn) {
+    ReplayThread *thread = conn->thread;
+    ssize_t n;
+
+    do {
+        n = recv(conn->fd, thread->buffer, sizeof(thread->buffer), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n <= 0) {
+        // After a Terminate the server hangs up; earlier, the replay is cut short
+        bool complete = conn->step == conn->num_steps && pg_buffer_length(&conn->out) == 0;
+        replay_close(conn, !complete);
+        return 1;
+    }
+
+    if (replay_scan(&conn->live, thread->buffer, (size_t)n) > 0 &&
+        conn->wait_start && conn->live.ready >= conn->wait_for) {
+        pg_histogram_record(&thread->latency, pg_metrics_now() - conn->wait_start);
+        conn->wait_start = 0;
+    }
+    return replay_advance(conn);
+}
+
+/**
+ * Open a connection; a failure is counted and the connection closed
+ *
+ * @param conn Connection
+ */
+static void replay_connect(ReplayConn *conn) {
+    ReplayThread *thread = conn->thread;
+    int one = 1;
+
+    conn->fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (conn->fd < 0) {
+        replay_close(conn, true);
+        return;
+    }
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn->state = REPLAY_CONNECTING;
+    conn->watch_write = true;
+    thread->connecting++;
+
+    int rc = connect(conn->fd, (const struct sockaddr *)&addr, addr_len);
+    if ((rc < 0 && errno != EINPROGRESS) ||
+        pg_event_add(thread->loop, conn->fd, PG_EVENT_READ | PG_EVENT_WRITE, conn) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        replay_close(conn, true);
+    }
+}
+
+/* The non-blocking connect finished */
+static int replay_connected(ReplayConn *conn) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+        return -1;
+    }
+    conn->state = REPLAY_RUNNING;
+    conn->thread->connecting--;
+    return replay_advance(conn);
+}
+
+/* Start the connections whose time has come, a batch at a time so the
+   server's listen backlog does not overflow */
+static void replay_start_connections(ReplayThread *thread, uint64_t now) {
+    while (thread->next_start < thread->num_conns && thread->connecting < REPLAY_CONNECT_BATCH) {
+        ReplayConn *conn = thread->conns[thread->next_start];
+        if (options.speed > 0 && replay_due(conn->start) > now) {
+            break;
+        }
+        thread->next_start++;
+        replay_connect(conn);
+    }
+}
+
+/* Milliseconds until the thread has something to do by the clock */
+static int replay_timeout(ReplayThread *thread, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+
+    if (thread->heap_size > 0) {
+        next = thread->heap[0]->due;
+    }
+    if (options.speed > 0 && thread->next_start < thread->num_conns &&
+        thread->connecting < REPLAY_CONNECT_BATCH) {
+        uint64_t start = replay_due(thread->conns[thread->next_start]->start);
+        if (start < next) next = start;
+    }
+    if (next == UINT64_MAX) {
+        return REPLAY_POLL_MS;
+    }
+    if (next <= now) {
+        return 0;
+    }
+    uint64_t ms = (next - now + 999999) / 1000000;
+    return ms < REPLAY_POLL_MS ? (int)ms : REPLAY_POLL_MS;
+}
+
+/* Thread body: replay the connections until they are all done */
+static void *replay_thread_main(void *arg) {
+    ReplayThread *thread = (ReplayThread *)arg;
+    PGEvent events[REPLAY_MAX_EVENTS];
+
+    while (thread->active > 0 && atomic_load(&running)) {
+        uint64_t now = pg_metrics_now();
+
+        replay_start_connections(thread, now);
+        while (thread->heap_size > 0 && thread->heap[0]->due <= now) {
+            ReplayConn *conn = thread->heap[0];
+            replay_unschedule(conn);
+            if (replay_advance(conn) < 0) {
+                replay_close(conn, true);
+            }
+        }
+
+        int n = pg_event_wait(thread->loop, events, REPLAY_MAX_EVENTS, replay_timeout(thread, now));
+        for (int i = 0; i < n; i++) {
+            ReplayConn *conn = (ReplayConn *)events[i].data;
+            if (!events[i].events || !conn || conn->state == REPLAY_DONE) continue;
+
+            int result = 0;
+            if (conn->state == REPLAY_CONNECTING) {
+                result = replay_connected(conn);
+            } else if (events[i].events & (PG_EVENT_READ | PG_EVENT_ERROR)) {
+                result = replay_read(conn);
+            } else if (events[i].events & PG_EVENT_WRITE) {
+                result = replay_flush(conn) < 0 ? -1 : replay_advance(conn);
+            }
+            if (result < 0) {
+                replay_close(conn, true);
+            }
+        }
+    }
+
+    // Connections still open when the run was interrupted
+    for (int i = 0; i < thread->num_conns; i++) {
+        if (thread->conns[i]->state != REPLAY_DONE) {
+            replay_close(thread->conns[i], true);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Print the results of the run
+ *
+ * @param threads Thread states
+ * @param num_conns Connections in the capture
+ * @param elapsed Seconds the run took
+ */
+static void replay_report(const ReplayThread *threads, int num_conns, double elapsed) {
+    uint64_t ready = 0, errors = 0, captured_errors = 0, bytes = 0, connections = 0, connect_errors = 0;
+    PGHistogramTotals latency;
+
+    memset(&latency, 0, sizeof(latency));
+    for (int t = 0; t < options.threads; t++) {
+        const ReplayThread *thread = &threads[t];
+        ready += thread->ready;
+        errors += thread->errors;
+        captured_errors += thread->captured_errors;
+        bytes += thread->bytes_sent;
+        connections += thread->connections;
+        connect_errors += thread->connect_errors;
+        for (int b = 0; b < PG_HISTOGRAM_BUCKETS; b++) {
+            latency.buckets[b] += thread->latency.buckets[b];
+        }
+        latency.count += thread->latency.count;
+        latency.sum += thread->latency.sum;
+        if (thread->latency.max > latency.max) {
+            latency.max = thread->latency.max;
+        }
+    }
+
+    double mean = latency.count ? latency.sum / 1e3 / latency.count : 0;
+    char speed[32];
+    if (options.speed > 0) {
+        snprintf(speed, sizeof(speed), "%gx", options.speed);
+    } else {
+        snprintf(speed, sizeof(speed), "max");
+    }
+
+    if (options.json) {
+        printf("{\"capture\":\"%s\",\"speed\":\"%s\",\"threads\":%d,\"elapsed_s\":%.3f,"
+               "\"connections\":%d,\"replayed\":%llu,\"connection_errors\":%llu,"
+               "\"ready\":%llu,\"ready_per_s\":%.1f,\"bytes_sent\":%llu,"
+               "\"errors\":%llu,\"captured_errors\":%llu,"
+               "\"latency_us\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+               options.file, speed, options.threads, elapsed, num_conns,
+               (unsigned long long)connections, (unsigned long long)connect_errors,
+               (unsigned long long)ready, ready / elapsed, (unsigned long long)bytes,
+               (unsigned long long)errors, (unsigned long long)captured_errors,
+               (unsigned long long)latency.count, mean,
+               pg_histogram_quantile(&latency, 0.5) / 1e3, pg_histogram_quantile(&latency, 0.99) / 1e3,
+               pg_histogram_quantile(&latency, 0.999) / 1e3, latency.max / 1e3);
+        return;
+    }
+
+    printf("capture: %s, speed: %s, threads: %d\n", options.file, speed, options.threads);
+    printf("connections: %d, replayed: %llu, connection errors: %llu\n", num_conns,
+           (unsigned long long)connections, (unsigned long long)connect_errors);
+    printf("ready for query: %llu in %.3f s, %.1f per second\n",
+           (unsigned long long)ready, elapsed, ready / elapsed);
+    printf("bytes sent: %llu\n", (unsigned long long)bytes);
+    printf("errors: %llu (captured: %llu)\n", (unsigned long long)errors, (unsigned long long)captured_errors);
+    printf("request latency (us): mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f (%llu samples)\n",
+           mean, pg_histogram_quantile(&latency, 0.5) / 1e3, pg_histogram_quantile(&latency, 0.99) / 1e3,
+           pg_histogram_quantile(&latency, 0.999) / 1e3, latency.max / 1e3, (unsigned long long)latency.count);
+}
+
+/* Allow as many descriptors as the hard limit permits */
+static void replay_raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Main entry point
+ *
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return Exit code
+ */
+int main(int argc, char **argv) {
+    ReplayConn **conns;
+    int num_conns;
+
+    int rc = parse_arguments(argc, argv);
+    if (rc != 0) {
+        return rc < 0 ? 1 : 0;
+    }
+    if (replay_resolve() < 0 || replay_load(&conns, &num_conns) < 0) {
+        return 1;
+    }
+    if (num_conns == 0) {
+        fprintf(stderr, "No connections in %s\n", options.file);
+        return 1;
+    }
+    replay_raise_fd_limit();
+
+    signal(SIGINT, replay_signal);
+    signal(SIGTERM, replay_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (options.threads > num_conns) {
+        options.threads = num_conns;
+    }
+    ReplayThread *threads = (ReplayThread *)calloc(options.threads, sizeof(ReplayThread));
+    ReplayConn **lists = (ReplayConn **)calloc((size_t)num_conns * 2, sizeof(ReplayConn *));
+    if (!threads || !lists) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Connections are dealt out in turn, keeping each thread's list in
+    // connect order
+    for (int t = 0, first = 0; t < options.threads; t++) {
+        ReplayThread *thread = &threads[t];
+        int count = num_conns / options.threads + (t < num_conns % options.threads);
+
+        thread->conns = lists + first;
+        thread->heap = lists + num_conns + first;
+        thread->loop = pg_event_loop_create(options.event_backend);
+        if (!thread->loop) {
+            fprintf(stderr, "Cannot create event loop\n");
+            return 1;
+        }
+        for (int i = t; i < num_conns; i += options.threads) {
+            conns[i]->thread = thread;
+            thread->conns[thread->num_conns++] = conns[i];
+        }
+        thread->active = thread->num_conns;
+        first += count;
+    }
+
+    replay_start = pg_metrics_now();
+    int started = 0;
+    for (; started < options.threads; started++) {
+        if (pthread_create(&threads[started].thread, NULL, replay_thread_main, &threads[started]) != 0) {
+            atomic_store(&running, false);
+            break;
+        }
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t].thread, NULL);
+    }
+    double elapsed = (pg_metrics_now() - replay_start) / 1e9;
+
+    replay_report(threads, num_conns, elapsed);
+
+    for (int t = 0; t < options.threads; t++) {
+        pg_event_loop_destroy(threads[t].loop);
+    }
+    for (int i = 0; i < num_conns; i++) {
+        pg_buffer_free(&conns[i]->data);
+        free(conns[i]->steps);
+        free(conns[i]);
+    }
+    free(conns);
+    free(lists);
+    free(threads);
+    return started == options.threads ? 0 : 1;
+}
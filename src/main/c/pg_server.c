@@ -3,21 +3,182 @@
  * PostgreSQL Protocol Server Emulator Implementation
  */
 
+ // splice() is a GNU extension
+ #if defined(__linux__) && !defined(_GNU_SOURCE)
+ #define _GNU_SOURCE
+ #endif
+
  #include "pg_server.h"
+ #include "pg_protocol.h"
  #include "pg_log.h"
+ #include "pg_stmt.h"
+ #include "pg_cache.h"
+ #include "pg_metrics.h"
+ #include "pg_tls.h"
+ #include "pg_auth.h"
+ #include "pg_cancel.h"
+ #include "pg_simd.h"
+ #include "pg_handoff.h"
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
+ #include <limits.h>
+ #include <stdarg.h>
  #include <unistd.h>
  #include <sys/socket.h>
  #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <arpa/inet.h>
  #include <errno.h>
  #include <fcntl.h>
- #include <sys/select.h>
+ #include <poll.h>
+ #include <sys/uio.h>
+ #include <sys/stat.h>
+ #include <sys/ioctl.h>
+ #ifdef __linux__
+ #include <sys/sendfile.h>
+ #endif
  #include "/usr/local/pgsql/18/include/server/libpq/protocol.h"
  
  #define BUFFER_SIZE 8192
+ #define MAX_EVENTS 256
+ #define ACCEPT_RETRY_INTERVAL 100          // ms the listener rests after running out of descriptors
+ #define MAX_IDLE_BUFFER_SIZE (64 * 1024)
+ #define OUTPUT_HIGH_WATER (64 * 1024)     // flush early once this much is queued
+ #define DIRECT_WRITE_THRESHOLD (16 * 1024) // write larger payloads without copying
+ #define MAX_SEND_IOV 8
+ #define STREAM_BATCH_ROWS 256              // rows asked of a producer per call
+ #define STREAM_BATCHES_PER_TURN 16         // batches before yielding to other clients
+ #define COPY_BUFFER_SIZE (256 * 1024)      // read size while receiving COPY data
+ #define COPY_CHUNK_SIZE (256 * 1024)       // largest CopyData sent from a descriptor
+ #define TLS_RECORD_TYPE_HANDSHAKE 0x16     // first byte of a ClientHello sent without an SSLRequest
+ #define CLIENT_SLAB_SIZE 64                // connection objects allocated at a time
+ #define BUFFER_POOL_BLOCKS 2048            // idle I/O buffer blocks kept per worker
+ #define QUERY_ARENA_BLOCK_SIZE 8192        // per-query memory allocated at a time
+ #define MAX_PROTOCOL_OPTIONS 64            // unrecognized _pq_. options reported back
+ #define HANDOFF_POLL_INTERVAL 100          // ms between looks for idle connections while handing off
+
+ // Closed peers must surface as EPIPE, not kill the process
+ #ifdef MSG_NOSIGNAL
+ #define SEND_FLAGS MSG_NOSIGNAL
+ #else
+ #define SEND_FLAGS 0
+ #endif
+
+ // Socket option that makes the kernel balance connections across listeners
+ #if defined(__linux__) && defined(SO_REUSEPORT)
+ #define PG_REUSEPORT_OPTION SO_REUSEPORT
+ #elif defined(SO_REUSEPORT_LB)
+ #define PG_REUSEPORT_OPTION SO_REUSEPORT_LB
+ #endif
+
+ // Async callback request; owned by the executor until it is finished,
+ // then by the client's worker
+ struct PGCompletion {
+     PGClientConn *client;    // Connection the request came from
+     char msg_type;           // PqMsg_Query or PqMsg_Execute
+     char *text;              // Copy of the query or portal name
+     int max_rows;            // Row limit for Execute
+     PGBuffer out;            // Reply messages, sent by the worker in order
+     int result;              // Result passed to pg_completion_finish
+     uint64_t started;        // When it was submitted, for the latency metrics
+     atomic_bool cancelled;   // A CancelRequest arrived while it ran
+     bool timed_out;          // The cancel came from statement_timeout (worker only)
+     bool failed;             // The reply contains an ErrorResponse
+     PGCompletion *next;      // Link in the worker's completion stack
+ };
+
+ // Block of connection objects. Objects are never returned to malloc while
+ // the server runs: a worker recycles them through its free list, so
+ // connection churn costs no allocation once the pool has grown.
+ struct PGClientSlab {
+     PGClientSlab *next;      // Older slab
+     PGClientConn clients[CLIENT_SLAB_SIZE];
+ };
+
+ // Rows streamed from a producer as the socket drains
+ struct PGStream {
+     PGRowProducer produce;   // Sends the next batch of rows
+     PGRowProducerClose close; // Releases state (may be NULL)
+     void *state;             // Producer state
+     char *tag;               // CommandComplete tag prefix, e.g. "SELECT"
+     char *portal;            // Portal of the Execute that started it, NULL for a simple Query
+     int max_rows;            // Row limit of the current Execute (0: no limit)
+     int64_t execute_rows;    // Rows sent for the current Execute
+     bool copy;               // COPY OUT: ends with CopyDone, and no row limit applies
+     int64_t rows;            // Row count for the tag, or -1 to count the rows produced
+     bool waiting;            // The producer waits for its source to become readable
+ };
+
+ // COPY OUT data taken from a file or pipe. The payload of each CopyData
+ // goes from the descriptor to the socket with sendfile or splice, without
+ // passing through user space; only the 5-byte headers are buffered.
+ typedef struct {
+     int fd;                  // Source descriptor, closed with the stream
+     bool file;               // Regular file: the length is known up front
+     bool zero_copy;          // Written with sendfile or splice rather than read
+     off_t offset;            // Next file offset
+     int64_t remaining;       // File bytes not yet sent
+     size_t chunk_left;       // Payload bytes of the current CopyData not yet sent
+     PGEventLoop *loop;       // Loop the descriptor is registered with while waiting
+     bool registered;         // The loop watches the descriptor
+ } PGCopySource;
+
+ // Connection received from the previous process, on its way to the
+ // worker that adopts it
+ struct PGAdoption {
+     int fd;                  // Client socket, or -1 to free the slots still kept
+     size_t length;           // Length of record
+     PGAdoption *next;        // Link in the worker's adoption stack
+     char record[];           // Connection record
+ };
+
+ // Progress of handing off to a new process (server->handoff_state)
+ enum {
+     HANDOFF_NONE = 0,        // Not handing off
+     HANDOFF_RESERVING,       // Workers stop accepting and send the process IDs of their connections
+     HANDOFF_PASSING,         // The listeners went over; connections follow as they go idle
+     HANDOFF_FAILED           // The new process went away; workers accept again
+ };
+
+ // What a worker has done for the current handoff (worker->handoff_step)
+ enum {
+     HANDOFF_STEP_NONE = 0,
+     HANDOFF_STEP_RESERVED,   // Stopped accepting and reserved its slots
+     HANDOFF_STEP_DRAINED,    // Passed on or closed all of its connections
+     HANDOFF_STEP_RESUMED     // Accepting again after a failure
+ };
+
+ static int pg_server_process_input(PGServer *server, PGClientConn *client);
+ static int pg_server_handle_writable(PGServer *server, PGClientConn *client);
+ static int pg_server_resume_output(PGServer *server, PGClientConn *client);
+ static int pg_server_handle_source(PGServer *server, PGClientConn *client);
+ static int pg_server_handle_received(PGServer *server, PGClientConn *client,
+                                      const char *data, int length);
+ static int pg_server_tls_handshake(PGServer *server, PGClientConn *client);
+ static int pg_server_watch(PGClientConn *client, int events);
+ static void pg_server_close_stream(PGClientConn *client);
+ static void pg_server_block_writes(PGClientConn *client);
+ static PGStream *pg_server_start_stream(PGClientConn *client, const char *tag, bool copy,
+                                         PGRowProducer produce, PGRowProducerClose close,
+                                         void *state);
+ static int pg_server_finish_copy_out(PGClientConn *client, int64_t rows, bool simple_query);
+ static void pg_server_count_messages(PGClientConn *client, const char *data, size_t length);
+ static void pg_server_count_sent(PGClientConn *client, size_t sent);
+ static void pg_server_note_error(PGClientConn *client);
+ static ssize_t pg_server_write(PGClientConn *client, const struct iovec *iov, int iovcnt);
+ static void pg_server_timer(PGTimer *timer);
+ static bool pg_server_client_idle(PGClientConn *client);
+ static void pg_server_arm_idle(PGClientConn *client);
+ static void pg_server_start_statement(PGClientConn *client, char msg_type);
+ static void pg_server_end_statement(PGClientConn *client);
+ static int pg_server_cancel_client(PGServer *server, PGClientConn *client, bool timeout);
+ static void pg_server_accept_handoff(PGServer *server);
+ static void pg_server_receive_handoff(PGServer *server);
+ static void pg_worker_handoff(PGWorker *worker);
+ static void pg_worker_adopt_clients(PGWorker *worker);
+ static int pg_server_take_listeners(PGServer *server, int *listeners);
+ static void pg_worker_resume_accept(PGTimer *timer);
  
  // Create server instance
  PGServer *pg_server_create(const PGServerConfig *config) {
@@ -29,10 +190,84 @@
      
      // Initialize server state
      server->server_fd = -1;
-     server->clients = (PGClientConn **)calloc(config->max_connections, sizeof(PGClientConn *));
-     server->num_clients = 0;
-     server->running = false;
+     server->num_workers = config->worker_threads > 1 ? config->worker_threads : 1;
+     server->workers = (PGWorker *)calloc(server->num_workers, sizeof(PGWorker));
+     atomic_init(&server->num_clients, 0);
+     atomic_init(&server->active_workers, 0);
+     atomic_init(&server->running, false);
      server->user_data = NULL;
+     server->executor = NULL;
+     server->cache = NULL;
+     server->metrics = pg_metrics_create(server->num_workers);
+     server->metrics_server = NULL;
+     server->tls = NULL;
+     server->auth = NULL;
+     server->capture = NULL;
+     server->cancels = pg_cancel_registry_create(server->num_workers, config->max_connections);
+     server->handoff_fd = -1;
+     server->handoff_peer = -1;
+     atomic_init(&server->handoff_state, HANDOFF_NONE);
+     server->handoff_generation = 0;
+     server->handoff_pending = 0;
+     server->handoff_deadline = 0;
+     pthread_mutex_init(&server->handoff_lock, NULL);
+     server->handoff_same_layout = false;
+     server->handoff_next_worker = 0;
+     server->handoff_adopted = 0;
+     server->handoff_record = NULL;
+     if (!server->metrics || !server->cancels) {
+         pg_metrics_destroy(server->metrics);
+         pg_cancel_registry_destroy(server->cancels);
+         free(server->workers);
+         free(server);
+         return NULL;
+     }
+
+     for (int i = 0; server->workers && i < server->num_workers; i++) {
+         PGWorker *worker = &server->workers[i];
+         worker->id = i;
+         worker->server = server;
+         worker->loop = NULL;
+         worker->listen_fd = -1;
+         worker->wake_fds[0] = worker->wake_fds[1] = -1;
+         worker->clients = (PGClientConn **)calloc(config->max_connections, sizeof(PGClientConn *));
+         worker->num_clients = 0;
+         worker->free_slots = (int *)malloc(config->max_connections * sizeof(int));
+         worker->num_free_slots = 0;
+         worker->free_clients = NULL;
+         worker->num_free_clients = 0;
+         worker->slabs = NULL;
+         atomic_init(&worker->completions, NULL);
+         worker->metrics = pg_metrics_shard(server->metrics, i);
+         worker->capture = NULL;
+         atomic_init(&worker->adoptions, NULL);
+         worker->reserved = NULL;
+         worker->num_reserved = 0;
+         worker->handoff_generation = 0;
+         worker->handoff_step = HANDOFF_STEP_NONE;
+         pg_wheel_init(&worker->timers, pg_wheel_now());
+         pg_timer_init(&worker->accept_timer, pg_worker_resume_accept, worker);
+         if (!worker->clients || !worker->free_slots ||
+             pg_buffer_pool_init(&worker->buffers, BUFFER_POOL_BLOCKS) < 0) {
+             free(worker->clients);
+             free(worker->free_slots);
+             pg_buffer_pool_destroy(&worker->buffers);
+             server->num_workers = i;
+             pg_server_destroy(server);
+             return NULL;
+         }
+
+         // Lowest index on top, so the table stays densely used
+         for (int slot = config->max_connections - 1; slot >= 0; slot--) {
+             worker->free_slots[worker->num_free_slots++] = slot;
+         }
+     }
+     if (!server->workers) {
+         pg_metrics_destroy(server->metrics);
+         pg_cancel_registry_destroy(server->cancels);
+         free(server);
+         return NULL;
+     }
  
      // Set default callbacks
      server->callbacks.startup = pg_default_startup_callback;
@@ -47,211 +282,3452 @@
      server->callbacks.cancel = pg_default_cancel_callback;
      server->callbacks.ssl_request = pg_default_ssl_request_callback;
      server->callbacks.unknown = pg_default_unknown_callback;
+     server->callbacks.copy_in_start = pg_default_copy_in_start_callback;
+     server->callbacks.copy_data = pg_default_copy_data_callback;
+     server->callbacks.copy_done = pg_default_copy_done_callback;
+     server->callbacks.copy_fail = pg_default_copy_fail_callback;
+     server->callbacks.copy_out_start = pg_default_copy_out_start_callback;
+     server->callbacks.async_query = NULL;
+     server->callbacks.async_execute = NULL;
+
+     if (config->query_cache_size > 0) {
+         server->cache = pg_cache_create(config->query_cache_size);
+         if (!server->cache) {
+             pg_server_destroy(server);
+             return NULL;
+         }
+     }
  
      return server;
  }
- 
- // Start the server
- int pg_server_start(PGServer *server) {
+
+ // Create a bound, listening, non-blocking socket
+ static int pg_server_listen(PGServer *server, bool reuse_port) {
      struct sockaddr_in addr;
      int opt = 1;
- 
+
      // Create socket
-     server->server_fd = socket(AF_INET, SOCK_STREAM, 0);
-     if (server->server_fd < 0) {
+     int fd = socket(AF_INET, SOCK_STREAM, 0);
+     if (fd < 0) {
          return -1;
      }
- 
+
      // Set socket options
-     setsockopt(server->server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
- 
+     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+ #ifdef PG_REUSEPORT_OPTION
+     if (reuse_port && setsockopt(fd, SOL_SOCKET, PG_REUSEPORT_OPTION, &opt, sizeof(opt)) < 0) {
+         close(fd);
+         return -1;
+     }
+ #else
+     (void)reuse_port;
+ #endif
+
      // Configure address
+     memset(&addr, 0, sizeof(addr));
      addr.sin_family = AF_INET;
      addr.sin_addr.s_addr = INADDR_ANY;
      addr.sin_port = htons(server->config.port);
- 
+
      // Bind
-     if (bind(server->server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-         close(server->server_fd);
+     if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+         close(fd);
          return -1;
      }
- 
+
      // Listen
-     if (listen(server->server_fd, server->config.max_connections) < 0) {
-         close(server->server_fd);
+     if (listen(fd, server->config.max_connections) < 0) {
+         close(fd);
          return -1;
      }
- 
-     server->running = true;
+
+     // Accept in a loop until EAGAIN, so the listener must not block
+     fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+     return fd;
+ }
+
+ // Create a worker's event loop, wakeup pipe and listener registration
+ static int pg_worker_init(PGWorker *worker) {
+     PGServer *server = worker->server;
+
+     worker->loop = pg_event_loop_create(server->config.event_backend);
+     if (!worker->loop) {
+         return -1;
+     }
+
+     if (pipe(worker->wake_fds) < 0) {
+         worker->wake_fds[0] = worker->wake_fds[1] = -1;
+         return -1;
+     }
+     for (int i = 0; i < 2; i++) {
+         fcntl(worker->wake_fds[i], F_SETFL, fcntl(worker->wake_fds[i], F_GETFL, 0) | O_NONBLOCK);
+         fcntl(worker->wake_fds[i], F_SETFD, FD_CLOEXEC);
+     }
+
+     if (pg_event_add(worker->loop, worker->wake_fds[0], PG_EVENT_READ, NULL) < 0 ||
+         pg_event_add(worker->loop, worker->listen_fd, PG_EVENT_READ, NULL) < 0) {
+         return -1;
+     }
+
+     if (server->capture) {
+         worker->capture = pg_capture_writer_create(server->capture, worker->id);
+         if (!worker->capture) {
+             return -1;
+         }
+     }
+
+     // In pooler mode each worker gets its share of the upstream connections
+     if (server->config.upstream_host) {
+         PGPoolConfig pool = {
+             .host = server->config.upstream_host,
+             .port = server->config.upstream_port,
+             .user = server->config.upstream_user,
+             .password = server->config.upstream_password,
+             .database = server->config.upstream_database,
+             .size = server->config.pool_size / server->num_workers +
+                     (worker->id < server->config.pool_size % server->num_workers),
+             .mode = server->config.pool_mode
+         };
+         if (pool.size < 1) {
+             pool.size = 1;
+         }
+         worker->pool = pg_pool_create(worker, &pool);
+         if (!worker->pool) {
+             return -1;
+         }
+     }
      return 0;
  }
+
+ // Interrupt a worker blocked in pg_event_wait (async-signal-safe)
+ static void pg_worker_wake(PGWorker *worker) {
+     if (worker->wake_fds[1] >= 0) {
+         char c = 0;
+         ssize_t n = write(worker->wake_fds[1], &c, 1);
+         (void)n;  // a full pipe already guarantees a wakeup
+     }
+ }
  
- // Main server loop
- int pg_server_run(PGServer *server) {
-     fd_set read_fds;
-     int max_fd;
-     struct timeval tv;
- 
-     while (server->running) {
-         FD_ZERO(&read_fds);
-         FD_SET(server->server_fd, &read_fds);
-         max_fd = server->server_fd;
- 
-         // Add client sockets to fd_set
-         for (int i = 0; i < server->config.max_connections; i++) {
-             if (server->clients[i]) {
-                 FD_SET(server->clients[i]->fd, &read_fds);
-                 if (server->clients[i]->fd > max_fd) {
-                     max_fd = server->clients[i]->fd;
-                 }
-             }
+ // Credential file to use: the configured one, or pg_passwd in the data
+ // directory if there is one; NULL means trust
+ static const char *pg_server_auth_file(PGServer *server, char *path, size_t size) {
+     if (server->config.auth_file) {
+         return server->config.auth_file;
+     }
+     if (server->config.data_dir) {
+         snprintf(path, size, "%s/%s", server->config.data_dir, PG_AUTH_DEFAULT_FILE);
+         if (access(path, F_OK) == 0) {
+             return path;
          }
- 
-         tv.tv_sec = 1;
-         tv.tv_usec = 0;
- 
-         int activity = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
-         if (activity < 0) continue;
- 
-         // New connection
-         if (FD_ISSET(server->server_fd, &read_fds)) {
-             struct sockaddr_in client_addr;
-             socklen_t addr_len = sizeof(client_addr);
-             int client_fd = accept(server->server_fd, (struct sockaddr *)&client_addr, &addr_len);
-             
-             if (client_fd >= 0) {
-                 pg_server_add_client(server, client_fd);
-             }
+     }
+     return NULL;
+ }
+
+ // Start the server
+ int pg_server_start(PGServer *server) {
+     // With several loops, give each its own listener and let the kernel
+     // spread new connections across them; otherwise the loops share one
+     bool reuse_port = false;
+ #ifdef PG_REUSEPORT_OPTION
+     reuse_port = server->num_workers > 1;
+ #endif
+
+     // A server running behind the handoff socket passes its listeners
+     // over, instead of this one binding the port
+     int listeners[PG_HANDOFF_MAX_FDS];
+     int num_listeners = 0;
+     if (server->config.handoff_socket) {
+         server->handoff_peer = pg_handoff_connect(server->config.handoff_socket);
+     }
+     if (server->handoff_peer >= 0) {
+         num_listeners = pg_server_take_listeners(server, listeners);
+         if (num_listeners <= 0) {
+             pg_server_stop(server);
+             return -1;
          }
- 
-         // Handle client messages
-         for (int i = 0; i < server->config.max_connections; i++) {
-             PGClientConn *client = server->clients[i];
-             if (client && FD_ISSET(client->fd, &read_fds)) {
-                 if (pg_server_handle_client(server, client) < 0) {
-                     pg_server_remove_client(server, client);
-                 }
+         server->server_fd = listeners[0];
+     } else {
+         server->server_fd = pg_server_listen(server, reuse_port);
+     }
+     if (server->server_fd < 0) {
+         return -1;
+     }
+
+     // One TLS context for all workers, so any of them can resume a session
+     if (server->config.ssl_enabled) {
+         server->tls = pg_tls_create(server->config.ssl_cert, server->config.ssl_key);
+         if (!server->tls) {
+             pg_server_stop(server);
+             return -1;
+         }
+     }
+
+     if (server->config.metrics_port > 0) {
+         server->metrics_server = pg_metrics_serve(server->metrics, server->config.metrics_port);
+         if (!server->metrics_server) {
+             pg_server_stop(server);
+             return -1;
+         }
+     }
+
+     char auth_path[PATH_MAX];
+     const char *auth_file = pg_server_auth_file(server, auth_path, sizeof(auth_path));
+
+     // Blocking callbacks, credential reloads and forwarded cancel requests
+     // only get threads of their own when they are used
+     if (server->callbacks.async_query || server->callbacks.async_execute || auth_file ||
+         server->config.upstream_host) {
+         server->executor = pg_executor_create(server->config.executor_threads);
+         if (!server->executor) {
+             pg_server_stop(server);
+             return -1;
+         }
+     }
+
+     if (auth_file) {
+         server->auth = pg_auth_create(auth_file, server->executor);
+         if (!server->auth) {
+             pg_server_stop(server);
+             return -1;
+         }
+     }
+
+     // Every worker appends to segments of its own, so recording takes no lock
+     if (server->config.capture_file) {
+         server->capture = pg_capture_create(server->config.capture_file);
+         if (!server->capture) {
+             pg_server_stop(server);
+             return -1;
+         }
+     }
+
+     for (int i = 0; i < server->num_workers; i++) {
+         PGWorker *worker = &server->workers[i];
+
+         worker->listen_fd = server->server_fd;
+         if (num_listeners > 0) {
+             // Workers share the listeners passed over if there are fewer
+             worker->listen_fd = listeners[i % num_listeners];
+         } else if (reuse_port && i > 0) {
+             worker->listen_fd = pg_server_listen(server, true);
+         }
+
+         if (worker->listen_fd < 0 || pg_worker_init(worker) < 0) {
+             for (int j = server->num_workers; j < num_listeners; j++) {
+                 close(listeners[j]);
              }
+             pg_server_stop(server);
+             return -1;
+         }
+     }
+
+     // Listeners beyond this server's workers: take the connections queued
+     // on them, then close them
+     for (int i = server->num_workers; i < num_listeners; i++) {
+         int client_fd;
+         while ((client_fd = accept(listeners[i], NULL, NULL)) >= 0) {
+             pg_server_add_client(&server->workers[0], client_fd);
+         }
+         close(listeners[i]);
+     }
+
+     // Worker 0 receives the previous server's connections as it lets go
+     // of them; without one, it waits for the next server to take over
+     if (server->handoff_peer >= 0) {
+         fcntl(server->handoff_peer, F_SETFL, fcntl(server->handoff_peer, F_GETFL, 0) | O_NONBLOCK);
+         if (pg_event_add(server->workers[0].loop, server->handoff_peer, PG_EVENT_READ,
+                          &server->handoff_peer) < 0) {
+             pg_server_stop(server);
+             return -1;
+         }
+     } else if (server->config.handoff_socket) {
+         server->handoff_fd = pg_handoff_listen(server->config.handoff_socket);
+         if (server->handoff_fd < 0 ||
+             pg_event_add(server->workers[0].loop, server->handoff_fd, PG_EVENT_READ,
+                          &server->handoff_fd) < 0) {
+             pg_server_stop(server);
+             return -1;
          }
      }
  
+     atomic_store(&server->running, true);
      return 0;
  }
  
- // Handle client messages
- int pg_server_handle_client(PGServer *server, PGClientConn *client) {
-     char buffer[BUFFER_SIZE];
-     int bytes_read;
- 
-     bytes_read = recv(client->fd, buffer, sizeof(buffer), 0);
-     if (bytes_read <= 0) {
+ // Accept all pending connections on the worker's listening socket
+ static void pg_worker_accept_clients(PGWorker *worker) {
+     for (;;) {
+         struct sockaddr_in client_addr;
+         socklen_t addr_len = sizeof(client_addr);
+         int client_fd = accept(worker->listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+
+         if (client_fd < 0) {
+             if (errno == EINTR || errno == ECONNABORTED) continue;
+             if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                 // The connection stays queued and the listener readable, so
+                 // the loop would come straight back here: stop watching the
+                 // listener until closed connections may have freed descriptors
+                 pg_counter_add(&worker->metrics->rejects, 1);
+                 pg_event_remove(worker->loop, worker->listen_fd);
+                 pg_wheel_add(&worker->timers, &worker->accept_timer, pg_wheel_now() + ACCEPT_RETRY_INTERVAL);
+             }
+             return;  // EAGAIN, or another worker sharing the listener won the race
+         }
+
+         pg_server_add_client(worker, client_fd);
+     }
+ }
+
+ // Watch the listener again after a rest
+ static void pg_worker_resume_accept(PGTimer *timer) {
+     PGWorker *worker = (PGWorker *)timer->data;
+
+     if (worker->listen_fd >= 0) {
+         pg_event_add(worker->loop, worker->listen_fd, PG_EVENT_READ, NULL);
+     }
+ }
+
+ // Change what the loop watches the client's socket for. A socket the loop
+ // receives and sends for stays registered while paused: the sends it
+ // queued must still go out
+ static int pg_server_watch(PGClientConn *client, int events) {
+     PGEventLoop *loop = client->worker->loop;
+     int result = 0;
+
+     if (client->watch_events == events) {
+         return 0;
+     }
+
+     int interest = events;
+     if (client->completion_io && (events & PG_EVENT_READ)) {
+         interest = (events & ~PG_EVENT_READ) | PG_EVENT_RECV;
+     }
+     if (!events) {
+         result = client->completion_io ? pg_event_modify(loop, client->fd, 0, client)
+                                        : pg_event_remove(loop, client->fd);
+     } else if (!client->watch_events) {
+         result = pg_event_add(loop, client->fd, interest, client);
+     } else {
+         result = pg_event_modify(loop, client->fd, interest, client);
+     }
+     if (result == 0) {
+         client->watch_events = events;
+     }
+     return result;
+ }
+
+ // Take a connection object from the worker's pool, growing it by a slab
+ // when it is empty
+ static PGClientConn *pg_worker_alloc_client(PGWorker *worker) {
+     if (!worker->free_clients) {
+         PGClientSlab *slab = (PGClientSlab *)malloc(sizeof(PGClientSlab));
+         if (!slab) {
+             return NULL;
+         }
+         slab->next = worker->slabs;
+         worker->slabs = slab;
+         for (int i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+             PGClientConn *client = &slab->clients[i];
+             pg_buffer_init_pooled(&client->in, &worker->buffers);
+             pg_buffer_init_pooled(&client->out, &worker->buffers);
+             pg_arena_init(&client->arena, 0);
+             pg_arena_init(&client->query_arena, QUERY_ARENA_BLOCK_SIZE);
+             pg_timer_init(&client->timer, pg_server_timer, client);
+             client->next_free = worker->free_clients;
+             worker->free_clients = client;
+         }
+         worker->num_free_clients += CLIENT_SLAB_SIZE;
+     }
+
+     PGClientConn *client = worker->free_clients;
+     worker->free_clients = client->next_free;
+     worker->num_free_clients--;
+     client->next_free = NULL;
+     return client;
+ }
+
+ // Release what a connection holds and return its object to the pool. The
+ // I/O buffers go to the worker's buffer pool, so a pooled object holds no
+ // memory of its own and a new connection taking one allocates nothing
+ // until it is used.
+ static void pg_worker_release_client(PGClientConn *client) {
+     PGWorker *worker = client->worker;
+
+     pg_wheel_cancel(&client->timer);
+     pg_server_close_stream(client);
+     pg_stmt_cache_free(&client->stmts);
+     pg_tls_free(client->ssl);
+     client->ssl = NULL;
+     client->user = NULL;
+     client->database = NULL;
+     client->application_name = NULL;
+     pg_compressor_destroy(client->compressor);
+     client->compressor = NULL;
+
+     pg_arena_free(&client->arena);
+     pg_arena_free(&client->query_arena);
+     pg_buffer_truncate(&client->in, 0);
+     pg_buffer_truncate(&client->out, 0);
+     client->out_wire = 0;
+     pg_buffer_free(&client->in);
+     pg_buffer_free(&client->out);
+
+     client->next_free = worker->free_clients;
+     worker->free_clients = client;
+     worker->num_free_clients++;
+ }
+
+ // Free the worker's connection objects; all of them must be pooled
+ static void pg_worker_free_clients(PGWorker *worker) {
+     for (PGClientConn *client = worker->free_clients; client; client = client->next_free) {
+         pg_arena_free(&client->arena);
+         pg_arena_free(&client->query_arena);
+         pg_buffer_free(&client->in);
+         pg_buffer_free(&client->out);
+     }
+     while (worker->slabs) {
+         PGClientSlab *next = worker->slabs->next;
+         free(worker->slabs);
+         worker->slabs = next;
+     }
+     worker->free_clients = NULL;
+     worker->num_free_clients = 0;
+ }
+
+ static void pg_completion_free(PGCompletion *completion) {
+     free(completion->text);
+     pg_buffer_free(&completion->out);
+     free(completion);
+ }
+
+ // Deliver a finished async job on the worker that owns the connection
+ static void pg_worker_complete(PGWorker *worker, PGCompletion *completion) {
+     PGServer *server = worker->server;
+     PGClientConn *client = completion->client;
+     int result = completion->result;
+     bool query = completion->msg_type == PqMsg_Query;
+     bool timed_out = completion->timed_out;
+
+     client->job = NULL;
+     // The job's reply ends with ReadyForQuery, which skipped end_message
+     pg_arena_reset(&client->query_arena);
+     pg_histogram_record(&worker->metrics->timers[completion->msg_type == PqMsg_Query ?
+                                                  PG_TIMER_QUERY : PG_TIMER_EXECUTE],
+                         pg_metrics_now() - completion->started);
+     if (client->closing) {
+         // The connection went away while the job ran
+         pg_completion_free(completion);
+         pg_worker_release_client(client);
+         return;
+     }
+
+     if (result >= 0) {
+         result = pg_server_watch(client, PG_EVENT_READ);
+     }
+     if (result >= 0 && atomic_load(&completion->cancelled)) {
+         // Cancelled while it ran: the error takes the place of the reply
+         pg_buffer_truncate(&completion->out, 0);
+         if (!timed_out) {
+             pg_counter_add(&worker->metrics->cancelled, 1);
+         }
+         result = pg_send_error(client, "57014", timed_out ? "canceling statement due to statement timeout"
+                                                           : "canceling statement due to user request");
+         if (result >= 0 && completion->msg_type == PqMsg_Query) {
+             result = pg_send_ready_for_query(client, client->txn_status);
+         }
+     }
+     if (result >= 0 && completion->failed) {
+         pg_server_note_error(client);
+     }
+     if (result >= 0) {
+         pg_server_count_messages(client, pg_buffer_read_ptr(&completion->out),
+                                  pg_buffer_length(&completion->out));
+         if (pg_buffer_length(&client->out) == 0) {
+             // Take over the reply buffer instead of copying it
+             pg_buffer_swap(&client->out, &completion->out);
+         } else {
+             result = pg_server_send(client, pg_buffer_read_ptr(&completion->out),
+                                     pg_buffer_length(&completion->out));
+         }
+     }
+     pg_completion_free(completion);
+
+     // A Query's reply ended with ReadyForQuery; an Execute is complete
+     if (result >= 0 && query) {
+         pg_server_note_ready(client);
+     } else if (result >= 0) {
+         pg_server_end_statement(client);
+     }
+
+     // Resume with whatever the client pipelined behind the request; this
+     // also flushes the reply
+     if (result >= 0) {
+         result = pg_server_process_input(server, client);
+     }
+     if (result < 0) {
+         pg_server_remove_client(server, client);
+     }
+ }
+
+ // Deliver every async job posted to this worker since the last call
+ static void pg_worker_drain_completions(PGWorker *worker) {
+     PGCompletion *list = atomic_exchange(&worker->completions, NULL);
+     PGCompletion *ordered = NULL;
+
+     // The stack is newest first; deliver in the order the jobs finished
+     while (list) {
+         PGCompletion *next = list->next;
+         list->next = ordered;
+         ordered = list;
+         list = next;
+     }
+
+     while (ordered) {
+         PGCompletion *next = ordered->next;
+         pg_worker_complete(worker, ordered);
+         ordered = next;
+     }
+ }
+
+ // Interrupt what a connection is running on a CancelRequest, or when
+ // statement_timeout expires. Like PostgreSQL, a connection that is idle
+ // ignores it.
+ static int pg_server_cancel_client(PGServer *server, PGClientConn *client, bool timeout) {
+     // The pooler passes it on to the upstream server running the request
+     if (client->worker->pool) {
+         return pg_pool_cancel(client);
+     }
+     if (client->job) {
+         // The callback may poll pg_completion_cancelled; its reply is
+         // replaced by the error when the job completes
+         client->job->timed_out = timeout;
+         atomic_store(&client->job->cancelled, true);
+         return 0;
+     }
+     if (!client->stream) {
+         return 0;
+     }
+
+     bool simple_query = client->stream->portal == NULL;
+     pg_server_close_stream(client);
+     if (!timeout) {
+         pg_counter_add(&client->worker->metrics->cancelled, 1);
+     }
+     if (pg_send_error(client, "57014", timeout ? "canceling statement due to statement timeout"
+                                                : "canceling statement due to user request") < 0) {
          return -1;
      }
- 
-     // First byte is message type
-     char msg_type = buffer[0];
-     int32_t length;
-     memcpy(&length, buffer + 1, 4);
-     length = ntohl(length);
- 
-     // Handle different message types
-     switch (msg_type) {
-         case 0: // Startup message
-             return server->callbacks.startup(client, buffer, bytes_read);
-         
-         case PqMsg_Query: // Simple Query
-             return server->callbacks.query(client, buffer + 5);
-         
-         case PqMsg_Parse: // Parse
-             return server->callbacks.parse(client, buffer + 5, NULL, 0);
-         
-         case PqMsg_Bind: // Bind
-             return server->callbacks.bind(client, buffer + 5, length - 4);
-         
-         case PqMsg_Execute: // Execute
-             return server->callbacks.execute(client, buffer + 5, 0);
-         
-         case PqMsg_Describe: // Describe
-             return server->callbacks.describe(client, buffer[5], buffer + 6);
-         
-         case PqMsg_Sync: // Sync
-             return server->callbacks.sync(client);
-         
-         case PqMsg_Terminate: // Terminate
-             return server->callbacks.terminate(client);
-         
-         default:
-             return server->callbacks.unknown(client, msg_type, buffer + 5, length - 4);
+     if (simple_query && pg_send_ready_for_query(client, client->txn_status) < 0) return -1;
+
+     // A stream blocked on the socket resumes input once the socket drains
+     if (client->write_blocked) {
+         return 0;
      }
+     return pg_server_resume_output(server, client);
  }
- 
- // Add new client connection
- int pg_server_add_client(PGServer *server, int client_fd) {
-     if (server->num_clients >= server->config.max_connections) {
-         close(client_fd);
+
+ // Cancel the client in a slot a cancel request matched
+ static void pg_worker_cancel_slot(int slot, void *arg) {
+     PGWorker *worker = (PGWorker *)arg;
+     PGClientConn *client = worker->clients[slot];
+
+     if (client && pg_server_cancel_client(worker->server, client, false) < 0) {
+         pg_server_remove_client(worker->server, client);
+     }
+ }
+
+ // Act on the cancel requests other threads posted for this worker's
+ // clients; only the slots they name are visited
+ static void pg_worker_process_cancels(PGWorker *worker) {
+     pg_cancel_take(worker->server->cancels, worker->id, pg_worker_cancel_slot, worker);
+ }
+
+ // Executor task: run the async callback for one request
+ static void pg_completion_run(void *arg) {
+     PGCompletion *completion = (PGCompletion *)arg;
+     PGClientConn *client = completion->client;
+     PGCallbacks *callbacks = &client->server->callbacks;
+     int result;
+
+     if (completion->msg_type == PqMsg_Query) {
+         result = callbacks->async_query(client, completion->text, completion);
+     } else {
+         result = callbacks->async_execute(client, completion->text, completion->max_rows, completion);
+     }
+
+     // A failed callback did not take ownership of the completion
+     if (result < 0) {
+         pg_completion_finish(completion, -1);
+     }
+ }
+
+ // Hand a Query or Execute to the executor; the connection reads no further
+ // input until the job completes, so its requests run one at a time and in order
+ static int pg_server_submit_async(PGServer *server, PGClientConn *client,
+                                   char msg_type, const char *text, int max_rows) {
+     PGCompletion *completion = (PGCompletion *)calloc(1, sizeof(PGCompletion));
+     if (!completion) {
          return -1;
      }
- 
-     PGClientConn *client = (PGClientConn *)malloc(sizeof(PGClientConn));
-     if (!client) {
-         close(client_fd);
+
+     completion->client = client;
+     completion->msg_type = msg_type;
+     completion->text = strdup(text);
+     completion->max_rows = max_rows;
+     completion->started = pg_metrics_now();
+     atomic_init(&completion->cancelled, false);
+     completion->timed_out = false;
+     pg_buffer_init(&completion->out);
+     if (!completion->text) {
+         free(completion);
          return -1;
      }
- 
-     // Initialize client connection
-     client->fd = client_fd;
-     client->user = NULL;
-     client->database = NULL;
-     client->authenticated = false;
-     client->txn_status = 'I';
-     client->backend_pid = getpid() + client_fd;
-     client->secret_key = rand();
-     client->ssl = NULL;
-     client->user_data = NULL;
-     client->server = server;
- 
-     // Find empty slot
-     for (int i = 0; i < server->config.max_connections; i++) {
-         if (!server->clients[i]) {
-             server->clients[i] = client;
-             server->num_clients++;
-             return 0;
-             // Continuing from where we left off...
 
-            return 0;
+     pg_server_watch(client, 0);
+     client->job = completion;
+
+     if (pg_executor_submit(server->executor, pg_completion_run, completion) < 0) {
+         client->job = NULL;
+         pg_completion_free(completion);
+         return -1;  // the connection is closed, so read interest stays off
+     }
+     return 0;
+ }
+
+ // Event loop of one worker
+ static void pg_worker_run(PGWorker *worker) {
+     PGServer *server = worker->server;
+     PGEvent events[MAX_EVENTS];
+
+     atomic_fetch_add(&server->active_workers, 1);
+
+     while (atomic_load(&server->running)) {
+         // Sleep until the next timer is due; with none, until an event
+         int timeout = pg_wheel_timeout(&worker->timers, pg_wheel_now());
+         bool handing_off = atomic_load_explicit(&server->handoff_state, memory_order_relaxed) != HANDOFF_NONE;
+         if (handing_off && (timeout < 0 || timeout > HANDOFF_POLL_INTERVAL)) {
+             timeout = HANDOFF_POLL_INTERVAL;
+         }
+         int n = pg_event_wait(worker->loop, events, MAX_EVENTS, timeout);
+         if (n < 0) continue;
+
+         // Only ready descriptors are reported, so the cost of a wakeup
+         // does not depend on the number of idle connections
+         for (int i = 0; i < n; i++) {
+             if (!events[i].events) continue;   // cancelled by a removal in this batch
+
+             if (events[i].fd == worker->wake_fds[0]) {
+                 char drain[64];
+                 while (read(worker->wake_fds[0], drain, sizeof(drain)) > 0) {}
+                 pg_worker_drain_completions(worker);
+                 pg_worker_process_cancels(worker);
+                 pg_worker_adopt_clients(worker);
+                 continue;
+             }
+
+             if (events[i].fd == worker->listen_fd) {
+                 // New connection
+                 pg_worker_accept_clients(worker);
+                 continue;
+             }
+
+             // A new server taking over, or the one taken over from (worker 0 only)
+             if (events[i].data == &server->handoff_fd) {
+                 pg_server_accept_handoff(server);
+                 continue;
+             }
+             if (events[i].data == &server->handoff_peer) {
+                 pg_server_receive_handoff(server);
+                 continue;
+             }
+
+             // Replies from an upstream connection of the pooler
+             if (pg_pool_owns(worker->pool, events[i].data)) {
+                 pg_pool_handle_event(worker->pool, events[i].data, events[i].events);
+                 continue;
+             }
+
+             // Handle client messages, finish a flush that hit EAGAIN, or
+             // continue a COPY OUT waiting on its pipe
+             PGClientConn *client = (PGClientConn *)events[i].data;
+             if (!client) continue;
+
+             int result;
+             if (events[i].fd != client->fd) {
+                 result = pg_server_handle_source(server, client);
+             } else if (events[i].events & PG_EVENT_RECV) {
+                 result = pg_server_handle_received(server, client, events[i].buffer, events[i].result);
+             } else if (events[i].events & PG_EVENT_WRITE) {
+                 result = pg_server_handle_writable(server, client);
+             } else {
+                 result = pg_server_handle_client(server, client);
+             }
+             if (result < 0) {
+                 pg_server_remove_client(server, client);
+             }
+         }
+
+         if (atomic_load_explicit(&server->handoff_state, memory_order_relaxed) != HANDOFF_NONE) {
+             pg_worker_handoff(worker);
+         }
+         pg_wheel_advance(&worker->timers, pg_wheel_now());
+     }
+
+     // Clients never migrate between workers, so each one closes its own
+     for (int i = 0; i < server->config.max_connections && worker->num_clients > 0; i++) {
+         if (worker->clients[i]) {
+             pg_server_remove_client(server, worker->clients[i]);
+         }
+     }
+
+     atomic_fetch_sub(&server->active_workers, 1);
+ }
+
+ static void *pg_worker_thread_main(void *arg) {
+     pg_worker_run((PGWorker *)arg);
+     return NULL;
+ }
+
+ // Main server loop
+ int pg_server_run(PGServer *server) {
+     int started = 1;
+
+     // Worker 0 runs on the calling thread
+     for (; started < server->num_workers; started++) {
+         PGWorker *worker = &server->workers[started];
+         if (pthread_create(&worker->thread, NULL, pg_worker_thread_main, worker) != 0) {
+             pg_server_stop(server);
+             break;
+         }
+     }
+
+     pg_worker_run(&server->workers[0]);
+
+     for (int i = 1; i < started; i++) {
+         pthread_join(server->workers[i].thread, NULL);
+     }
+
+     return started == server->num_workers ? 0 : -1;
+ }
+ 
+ // Start streaming rows for the Query or Execute being dispatched. The
+ // producer is pulled from as the socket drains, after the callback returns.
+ int pg_server_stream_rows(PGClientConn *client, const char *tag,
+                           PGRowProducer produce, PGRowProducerClose close, void *state) {
+     return pg_server_start_stream(client, tag, false, produce, close, state) ? 0 : -1;
+ }
+
+ // Start streaming CopyData rows after pg_server_copy_out; the stream ends
+ // with CopyDone and "COPY n"
+ int pg_server_stream_copy(PGClientConn *client, PGRowProducer produce,
+                           PGRowProducerClose close, void *state) {
+     return pg_server_start_stream(client, "COPY", true, produce, close, state) ? 0 : -1;
+ }
+
+ static PGStream *pg_server_start_stream(PGClientConn *client, const char *tag, bool copy,
+                                         PGRowProducer produce, PGRowProducerClose close,
+                                         void *state) {
+     PGStream *stream = NULL;
+
+     if (!client->stream) {
+         stream = (PGStream *)calloc(1, sizeof(PGStream));
+     }
+     if (stream) {
+         stream->tag = strdup(tag);
+         stream->portal = client->execute_portal ? strdup(client->execute_portal) : NULL;
+     }
+     if (!stream || !stream->tag || (client->execute_portal && !stream->portal)) {
+         if (stream) {
+             free(stream->tag);
+             free(stream);
+         }
+         if (close) close(state);
+         return NULL;
+     }
+
+     stream->produce = produce;
+     stream->close = close;
+     stream->state = state;
+     stream->max_rows = copy ? 0 : client->execute_max_rows;
+     stream->copy = copy;
+     stream->rows = -1;
+     client->stream = stream;
+     return stream;
+ }
+
+ // Release a stream
+ void pg_server_free_stream(PGStream *stream) {
+     if (stream->close) stream->close(stream->state);
+     free(stream->tag);
+     free(stream->portal);
+     free(stream);
+ }
+
+ // Release the running stream, if any
+ static void pg_server_close_stream(PGClientConn *client) {
+     if (client->stream) {
+         pg_server_free_stream(client->stream);
+         client->stream = NULL;
+     }
+ }
+
+ // Pull rows from the stream until it ends, reaches the Execute row limit,
+ // fills the socket, or has used up its turn on this loop
+ static int pg_server_run_stream(PGClientConn *client) {
+     PGStream *stream = client->stream;
+
+     for (int batch = 0; batch < STREAM_BATCHES_PER_TURN; batch++) {
+         int limit = STREAM_BATCH_ROWS;
+         if (stream->max_rows > 0 && stream->max_rows - stream->execute_rows < limit) {
+             limit = (int)(stream->max_rows - stream->execute_rows);
+         }
+
+         int n = stream->produce(client, stream->state, limit);
+         if (n < 0) {
+             return -1;
+         }
+
+         if (n == 0) {
+             // Exhausted: complete the command; like PostgreSQL, the count
+             // covers the rows of this Execute only
+             char tag[128];
+             bool simple_query = stream->portal == NULL;
+             bool copy = stream->copy;
+             int64_t rows = stream->rows >= 0 ? stream->rows : stream->execute_rows;
+             snprintf(tag, sizeof(tag), "%s %lld", stream->tag, (long long)rows);
+             pg_server_close_stream(client);
+             pg_server_end_statement(client);
+
+             if (copy) {
+                 return pg_server_finish_copy_out(client, rows, simple_query);
+             }
+             if (pg_send_command_complete(client, tag) < 0) return -1;
+             if (simple_query) {
+                 return pg_send_ready_for_query(client, client->txn_status);
+             }
+             return 0;
+         }
+
+         stream->execute_rows += n;
+         if (stream->max_rows > 0 && stream->execute_rows >= stream->max_rows) {
+             // Row limit reached: park the rest on the portal for the next
+             // Execute, and let other portals run in the meantime
+             PGPortal *portal = pg_portal_lookup(&client->stmts, stream->portal);
+             client->stream = NULL;
+             pg_server_end_statement(client);
+             if (portal && !portal->stream) {
+                 portal->stream = stream;
+             } else {
+                 pg_server_free_stream(stream);
+             }
+             return pg_send_message(client, PqMsg_PortalSuspended, NULL, 0);
+         }
+
+         if (client->write_blocked || stream->waiting) {
+             return 0;  // continues when the socket drains or the source has data
+         }
+     }
+
+     // Turn used up: continue once the socket has room again, after the
+     // other ready clients on this loop
+     if (pg_server_flush(client) < 0) return -1;
+     pg_server_block_writes(client);
+     return 0;
+ }
+
+ // Send CopyInResponse or CopyOutResponse: the overall format, then the
+ // format of each column
+ static int pg_server_send_copy_response(PGClientConn *client, char msg_type, int16_t format,
+                                         int num_columns, const int16_t *formats) {
+     pg_msg_begin(client, msg_type);
+     pg_msg_put_byte(client, (char)format);
+     pg_msg_put_int16(client, (int16_t)num_columns);
+     for (int i = 0; i < num_columns; i++) {
+         pg_msg_put_int16(client, formats ? formats[i] : format);
+     }
+     return pg_msg_end(client);
+ }
+
+ // Accept COPY ... FROM STDIN for the Query or Execute being dispatched:
+ // the CopyData that follows goes to the copy_data callback until CopyDone
+ // or CopyFail. formats may be NULL for all columns in the overall format.
+ int pg_server_copy_in(PGClientConn *client, int16_t format, int num_columns, const int16_t *formats) {
+     if (pg_server_send_copy_response(client, PqMsg_CopyInResponse, format, num_columns, formats) < 0) {
+         return -1;
+     }
+     client->copy_in = true;
+     client->copy_discard = false;
+     client->copy_simple = client->execute_portal == NULL;
+     client->copy_remaining = 0;
+     client->copy_rows = 0;
+     return 0;
+ }
+
+ // Start COPY ... TO STDOUT; the rows follow with pg_server_copy_data and
+ // pg_server_copy_out_done, or from pg_server_stream_copy or
+ // pg_server_copy_out_fd
+ int pg_server_copy_out(PGClientConn *client, int16_t format, int num_columns, const int16_t *formats) {
+     return pg_server_send_copy_response(client, PqMsg_CopyOutResponse, format, num_columns, formats);
+ }
+
+ // Send one CopyData message of COPY OUT
+ int pg_server_copy_data(PGClientConn *client, const char *data, int length) {
+     return pg_send_message(client, PqMsg_CopyData, data, length);
+ }
+
+ static int pg_server_finish_copy_out(PGClientConn *client, int64_t rows, bool simple_query) {
+     char tag[32];
+     snprintf(tag, sizeof(tag), "COPY %lld", (long long)rows);
+
+     if (pg_send_message(client, PqMsg_CopyDone, NULL, 0) < 0 ||
+         pg_send_command_complete(client, tag) < 0) {
+         return -1;
+     }
+     return simple_query ? pg_send_ready_for_query(client, client->txn_status) : 0;
+ }
+
+ // End a COPY OUT whose rows were sent with pg_server_copy_data
+ int pg_server_copy_out_done(PGClientConn *client, int64_t rows) {
+     return pg_server_finish_copy_out(client, rows, client->execute_portal == NULL);
+ }
+
+ // End copy-in mode with an error. Like PostgreSQL, the CopyData, CopyDone
+ // and CopyFail the client has already sent are dropped; after a simple
+ // Query, ReadyForQuery follows the error.
+ int pg_server_copy_error(PGClientConn *client, const char *code, const char *message) {
+     client->copy_in = false;
+     client->copy_discard = true;
+
+     if (pg_send_error(client, code, message) < 0) {
+         return -1;
+     }
+     return client->copy_simple ? pg_send_ready_for_query(client, client->txn_status) : 0;
+ }
+
+ static void pg_copy_source_close(void *state) {
+     PGCopySource *source = (PGCopySource *)state;
+     if (source->registered) {
+         pg_event_remove(source->loop, source->fd);
+     }
+     close(source->fd);
+     free(source);
+ }
+
+ // Wait for a pipe to have data; the loop reports it with the client, and
+ // the socket is not watched meanwhile, so input stays paused
+ static int pg_copy_source_wait(PGClientConn *client, PGCopySource *source) {
+     if (!source->registered) {
+         if (pg_event_add(source->loop, source->fd, PG_EVENT_READ, client) < 0) {
+             return -1;
+         }
+         source->registered = true;
+     }
+     client->stream->waiting = true;
+     return pg_server_watch(client, 0) < 0 ? -1 : 1;
+ }
+
+ // Bytes that can be read from a pipe without blocking; 0 at end of data,
+ // -1 when it has none yet
+ static ssize_t pg_copy_source_available(PGCopySource *source) {
+     struct pollfd pfd = {.fd = source->fd, .events = POLLIN};
+     int avail = 0;
+
+     if (poll(&pfd, 1, 0) < 0) {
+         return errno == EINTR ? -1 : 0;
+     }
+     if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+         return -1;
+     }
+     if (ioctl(source->fd, FIONREAD, &avail) < 0 || avail <= 0) {
+         // Readable with nothing to read: the writer has closed it
+         return 0;
+     }
+     return avail;
+ }
+
+ // Send one CopyData read into the output buffer, for sources the kernel
+ // cannot send to the socket directly
+ static int pg_copy_source_read(PGClientConn *client, PGCopySource *source, size_t chunk) {
+     PGBuffer *out = &client->out;
+     ssize_t n;
+
+     if (pg_buffer_reserve(out, 5 + chunk) < 0) {
+         return -1;
+     }
+     char *header = pg_buffer_write_ptr(out);
+     do {
+         n = source->file ? pread(source->fd, header + 5, chunk, source->offset)
+                          : read(source->fd, header + 5, chunk);
+     } while (n < 0 && errno == EINTR);
+
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         return pg_copy_source_wait(client, source);
+     }
+     if (n <= 0) {
+         // A file that shrank mid-copy ends early; so does a failed read
+         return source->file || n < 0 ? -1 : 0;
+     }
+
+     uint32_t msg_len = htonl((uint32_t)n + 4);
+     header[0] = PqMsg_CopyData;
+     memcpy(header + 1, &msg_len, 4);
+     pg_buffer_commit(out, 5 + (size_t)n);
+     source->offset += n;
+     source->remaining -= n;
+
+     if (pg_server_end_message(client, PqMsg_CopyData) < 0) {
+         return -1;
+     }
+     return 1;
+ }
+
+ // Send the next CopyData of a descriptor. Returns 1 while there is more
+ // (possibly waiting for the socket or the pipe), 0 at the end, -1 on error.
+ static int pg_copy_source_produce(PGClientConn *client, void *state, int max_rows) {
+     PGCopySource *source = (PGCopySource *)state;
+     (void)max_rows;
+
+     if (source->registered) {
+         pg_event_remove(source->loop, source->fd);
+         source->registered = false;
+     }
+
+     if (source->chunk_left == 0) {
+         ssize_t avail;
+         if (source->file) {
+             avail = source->remaining > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (ssize_t)source->remaining;
+         } else {
+             avail = pg_copy_source_available(source);
+             if (avail < 0) return pg_copy_source_wait(client, source);
+         }
+         if (avail == 0) {
+             return 0;
+         }
+
+         size_t chunk = (size_t)avail < COPY_CHUNK_SIZE ? (size_t)avail : COPY_CHUNK_SIZE;
+         if (!source->zero_copy) {
+             return pg_copy_source_read(client, source, chunk);
+         }
+
+         // The header is queued; the payload follows it once out is empty
+         char header[5];
+         uint32_t msg_len = htonl((uint32_t)chunk + 4);
+         header[0] = PqMsg_CopyData;
+         memcpy(header + 1, &msg_len, 4);
+         if (pg_buffer_append(&client->out, header, sizeof(header)) < 0) {
+             return -1;
+         }
+         pg_counter_add(&client->worker->metrics->messages_out[PqMsg_CopyData], 1);
+         source->chunk_left = chunk;
+     }
+
+     // Queued replies and the header go first
+     if (pg_server_flush(client) < 0) {
+         return -1;
+     }
+     if (pg_buffer_length(&client->out) > 0) {
+         return 1;
+     }
+
+ #ifdef __linux__
+     ssize_t sent;
+     do {
+         if (source->file && client->ssl) {
+             sent = pg_tls_sendfile(client->ssl, source->fd, source->offset, source->chunk_left);
+             if (sent > 0) source->offset += sent;
+         } else if (source->file) {
+             sent = sendfile(client->fd, source->fd, &source->offset, source->chunk_left);
+         } else {
+             sent = splice(source->fd, NULL, client->fd, NULL, source->chunk_left,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+         }
+     } while (sent < 0 && errno == EINTR);
+
+     if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         // The data is known to be there, so it is the socket that is full
+         pg_server_block_writes(client);
+         return 1;
+     }
+     if (sent <= 0) {
+         // The CopyData length is already on the wire; it cannot be cut short
+         return -1;
+     }
+
+     pg_server_count_sent(client, (size_t)sent);
+     source->chunk_left -= (size_t)sent;
+     if (source->file) {
+         source->remaining -= sent;
+     }
+     return 1;
+ #else
+     return -1;
+ #endif
+ }
+
+ // Stream COPY OUT data from a file (from its current offset to the end) or
+ // a pipe (until the writer closes it) after pg_server_copy_out. On Linux
+ // the bytes go from the descriptor to the socket with sendfile or splice;
+ // elsewhere they are read into the output buffer. The descriptor is closed
+ // when the copy ends, also on failure. rows is reported in "COPY n".
+ int pg_server_copy_out_fd(PGClientConn *client, int fd, int64_t rows) {
+     PGCopySource *source = (PGCopySource *)calloc(1, sizeof(PGCopySource));
+     struct stat st;
+
+     if (!source || fstat(fd, &st) < 0) {
+         free(source);
+         close(fd);
+         return -1;
+     }
+
+     source->fd = fd;
+     source->file = S_ISREG(st.st_mode);
+     source->loop = client->worker->loop;
+     if (source->file) {
+         off_t offset = lseek(fd, 0, SEEK_CUR);
+         source->offset = offset > 0 ? offset : 0;
+         source->remaining = st.st_size > source->offset ? st.st_size - source->offset : 0;
+     } else {
+         // Pipe reads must not block the loop
+         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+     }
+ #ifdef __linux__
+     // Over TLS only once the kernel does the encryption, and not while the
+     // connection is captured or compressed, which needs the bytes, or while
+     // the loop sends for it, which would put the payload ahead of its queue
+     source->zero_copy = (source->file || S_ISFIFO(st.st_mode)) &&
+                         (!client->ssl || client->ssl_kernel_send) && !client->capture_id &&
+                         !client->compressor && !client->completion_io;
+ #endif
+
+     PGStream *stream = pg_server_start_stream(client, "COPY", true, pg_copy_source_produce,
+                                               pg_copy_source_close, source);
+     if (!stream) {
+         return -1;
+     }
+     stream->rows = rows;
+     return 0;
+ }
+
+ // A COPY OUT pipe has data: let the stream continue
+ static int pg_server_handle_source(PGServer *server, PGClientConn *client) {
+     if (client->stream) {
+         client->stream->waiting = false;
+     }
+     return pg_server_resume_output(server, client);
+ }
+
+ // Report an error to the client and keep the connection
+ static int pg_server_report_error(PGClientConn *client, const char *code,
+                                   const char *format, const char *name) {
+     char message[256];
+     snprintf(message, sizeof(message), format, name);
+     return pg_send_error(client, code, message);
+ }
+
+ // Store the statement, then let the callback acknowledge it
+ static int pg_server_handle_parse(PGServer *server, PGClientConn *client,
+                                   const char *payload, int length) {
+     PGStatement *stmt;
+
+     switch (pg_stmt_parse(&client->stmts, payload, length, &stmt)) {
+         case PG_STMT_OK:
+             return server->callbacks.parse(client, stmt->name, stmt->query, stmt->num_params);
+         case PG_STMT_DUPLICATE:
+             return pg_server_report_error(client, "42P05",
+                                           "prepared statement \"%s\" already exists", payload);
+         default:
+             return -1;
+     }
+ }
+
+ // Create the portal, then let the callback acknowledge it
+ static int pg_server_handle_bind(PGServer *server, PGClientConn *client,
+                                  const char *payload, int length) {
+     PGPortal *portal;
+
+     switch (pg_portal_bind(&client->stmts, payload, length, &portal)) {
+         case PG_STMT_OK:
+             return server->callbacks.bind(client, payload, length);
+         case PG_STMT_NOT_FOUND:
+             // Bind starts with the portal name, then the statement name
+             return pg_server_report_error(client, "26000",
+                                           "prepared statement \"%s\" does not exist",
+                                           payload + strlen(payload) + 1);
+         case PG_STMT_DUPLICATE:
+             return pg_server_report_error(client, "42P03",
+                                           "portal \"%s\" already exists", payload);
+         case PG_STMT_INVALID:
+             return pg_server_report_error(client, "08P01",
+                                           "bind message for portal \"%s\" has invalid format codes",
+                                           payload);
+         default:
+             return -1;
+     }
+ }
+
+ // Find the last of the whole messages in a run of wire bytes
+ static ssize_t pg_server_last_message(const char *data, size_t length) {
+     size_t offset = 0;
+     ssize_t last = -1;
+
+     while (offset + 5 <= length) {
+         uint32_t msg_len;
+         memcpy(&msg_len, data + offset + 1, 4);
+         msg_len = ntohl(msg_len);
+         if (msg_len < 4 || msg_len > length - offset - 1) {
+             return -1;
+         }
+         last = (ssize_t)offset;
+         offset += 1 + msg_len;
+     }
+     return offset == length ? last : -1;
+ }
+
+ // Take the RowDescription of a statement described on another connection
+ static void pg_server_describe_from_cache(PGServer *server, PGStatement *stmt) {
+     PGCacheEntry *entry = pg_cache_lookup(server->cache, PG_CACHE_DESCRIBE, stmt->query,
+                                           stmt->num_params, stmt->param_types);
+     if (!entry) {
+         return;
+     }
+
+     // The entry holds the RowDescription payload; an empty one means NoData
+     size_t length;
+     const char *data = pg_cache_entry_data(entry, &length);
+     pg_stmt_set_row_description(stmt, length > 0 ? data : NULL, (int)length);
+     pg_cache_release(entry);
+ }
+
+ // Send the cached RowDescription of a statement, with the result formats
+ // of the portal being described
+ static int pg_server_send_described(PGClientConn *client, const PGStatement *stmt,
+                                     const PGPortal *portal) {
+     if (!stmt->row_description) {
+         return pg_send_message(client, PqMsg_NoData, NULL, 0);
+     }
+     if (!portal || portal->num_result_formats == 0) {
+         return pg_send_message(client, PqMsg_RowDescription,
+                                stmt->row_description, stmt->row_description_len);
+     }
+
+     pg_msg_begin(client, PqMsg_RowDescription);
+     pg_msg_put_bytes(client, stmt->row_description, stmt->row_description_len);
+     if (!client->msg_failed) {
+         char *fields = pg_buffer_read_ptr(&client->out) + client->msg_start + 5;
+         pg_row_description_set_formats(fields, stmt->row_description_len, portal);
+     }
+     return pg_msg_end(client);
+ }
+
+ // Answer a simple Query from the shared cache; 1 on a hit, 0 on a miss
+ static int pg_server_query_from_cache(PGServer *server, PGClientConn *client, const char *query) {
+     PGCacheEntry *entry = pg_cache_lookup(server->cache, PG_CACHE_RESULT, query, 0, NULL);
+     if (!entry) {
+         return 0;
+     }
+
+     size_t length;
+     const char *data = pg_cache_entry_data(entry, &length);
+     pg_server_count_messages(client, data, length);
+     int result = pg_server_send(client, data, length);
+     pg_cache_release(entry);
+
+     if (result < 0 || pg_send_ready_for_query(client, client->txn_status) < 0) {
+         return -1;
+     }
+     return 1;
+ }
+
+ // Run the query callback; if it called pg_server_cache_response, keep its
+ // reply (minus the ReadyForQuery, which depends on the connection) in the
+ // shared cache
+ static int pg_server_run_query(PGServer *server, PGClientConn *client, const char *query) {
+     size_t start = pg_buffer_length(&client->out);
+     uint64_t sent = client->bytes_sent;
+
+     client->cache_response = false;
+     int result = server->callbacks.query(client, query);
+     bool cacheable = client->cache_response;
+     client->cache_response = false;
+
+     size_t end = pg_buffer_length(&client->out);
+     if (result < 0 || !cacheable || client->stream || client->bytes_sent != sent || end <= start) {
+         return result;
+     }
+
+     const char *reply = pg_buffer_read_ptr(&client->out) + start;
+     ssize_t last = pg_server_last_message(reply, end - start);
+     if (last >= 0 && reply[last] == PqMsg_ReadyForQuery) {
+         pg_cache_insert(server->cache, PG_CACHE_RESULT, query, 0, NULL, reply, (size_t)last);
+     }
+     return result;
+ }
+
+ // Describe a statement or portal. The callback runs only the first time;
+ // the RowDescription (or NoData) it sends is cached on the statement and
+ // replayed for every later Describe of the statement or its portals.
+ static int pg_server_handle_describe(PGServer *server, PGClientConn *client,
+                                      const char *payload, int length) {
+     PGStatement *stmt;
+     PGPortal *portal = NULL;
+     char describe_type = payload[0];
+     const char *name = payload + 1;
+
+     if (length < 2 || strnlen(payload, length) == (size_t)length) {
+         return -1;
+     }
+
+     if (describe_type == 'S') {
+         stmt = pg_stmt_lookup(&client->stmts, name);
+         if (!stmt) {
+             return pg_server_report_error(client, "26000",
+                                           "prepared statement \"%s\" does not exist", name);
+         }
+
+         // ParameterDescription
+         pg_msg_begin(client, PqMsg_ParameterDescription);
+         pg_msg_put_int16(client, stmt->num_params);
+         for (int i = 0; i < stmt->num_params; i++) {
+             pg_msg_put_int32(client, stmt->param_types[i]);
+         }
+         if (pg_msg_end(client) < 0) return -1;
+     } else if (describe_type == 'P') {
+         portal = pg_portal_lookup(&client->stmts, name);
+         if (!portal) {
+             return pg_server_report_error(client, "34000", "portal \"%s\" does not exist", name);
+         }
+         stmt = portal->statement;
+     } else {
+         return -1;
+     }
+
+     if (!stmt->described && server->cache) {
+         pg_server_describe_from_cache(server, stmt);
+     }
+
+     if (stmt->described) {
+         return pg_server_send_described(client, stmt, portal);
+     }
+
+     size_t start = pg_buffer_length(&client->out);
+     uint64_t sent = client->bytes_sent;
+     int result = server->callbacks.describe(client, describe_type, name);
+     size_t end = pg_buffer_length(&client->out);
+
+     // Cache the reply if it is exactly one RowDescription or NoData message
+     // and it is still whole in the output buffer
+     if (result >= 0 && client->bytes_sent == sent && end > start &&
+         pg_server_last_message(pg_buffer_read_ptr(&client->out) + start, end - start) == 0) {
+         const char *msg = pg_buffer_read_ptr(&client->out) + start;
+         int msg_len = (int)(end - start);
+
+         if (msg[0] == PqMsg_NoData) {
+             pg_stmt_set_row_description(stmt, NULL, 0);
+         } else if (msg[0] == PqMsg_RowDescription &&
+                    pg_stmt_set_row_description(stmt, msg + 5, msg_len - 5) == 0) {
+             // Kept in statement form (all text); portals get their formats on replay
+             pg_row_description_set_formats(stmt->row_description, stmt->row_description_len, NULL);
+         }
+         if (stmt->described && server->cache) {
+             pg_cache_insert(server->cache, PG_CACHE_DESCRIBE, stmt->query,
+                             stmt->num_params, stmt->param_types,
+                             stmt->row_description, stmt->row_description_len);
+         }
+     }
+     return result;
+ }
+
+ // Run a portal, or continue the rows it left when it was suspended
+ static int pg_server_handle_execute(PGServer *server, PGClientConn *client,
+                                     const char *payload, int length) {
+     size_t portal_len = strnlen(payload, length);
+     int32_t max_rows;
+     int result;
+
+     if (portal_len + 1 + 4 > (size_t)length) return -1;
+     memcpy(&max_rows, payload + portal_len + 1, 4);
+     max_rows = ntohl(max_rows);
+
+     PGPortal *portal = pg_portal_lookup(&client->stmts, payload);
+     if (!portal) {
+         return pg_server_report_error(client, "34000", "portal \"%s\" does not exist", payload);
+     }
+
+     if (portal->stream) {
+         // Picked up by pg_server_dispatch_input once this returns
+         client->stream = portal->stream;
+         portal->stream = NULL;
+         client->stream->max_rows = max_rows;
+         client->stream->execute_rows = 0;
+         return 0;
+     }
+
+     if (server->callbacks.async_execute && server->executor) {
+         return pg_server_submit_async(server, client, PqMsg_Execute, payload, max_rows);
+     }
+
+     client->execute_portal = payload;
+     client->execute_max_rows = max_rows;
+     result = server->callbacks.execute(client, payload, max_rows);
+     client->execute_portal = NULL;
+     client->execute_max_rows = 0;
+     return result;
+ }
+
+ // Close a statement or portal
+ static int pg_server_handle_close(PGClientConn *client, const char *payload, int length) {
+     if (length < 2 || strnlen(payload, length) == (size_t)length) {
+         return -1;
+     }
+
+     if (payload[0] == 'S') {
+         pg_stmt_close(&client->stmts, payload + 1);
+     } else if (payload[0] == 'P') {
+         pg_portal_close(&client->stmts, payload + 1);
+     } else {
+         return -1;
+     }
+     return pg_send_message(client, PqMsg_CloseComplete, NULL, 0);
+ }
+
+ // Dispatch one complete message to its callback
+ static int pg_server_dispatch_message(PGServer *server, PGClientConn *client,
+                                       char msg_type, const char *payload, int length) {
+     switch (msg_type) {
+         case PqMsg_Query: // Simple Query
+             // The text is used in place, so its terminator must be inside the message
+             if (strnlen(payload, length) == (size_t)length) return -1;
+             // Like PostgreSQL, a simple Query drops the unnamed statement and portal
+             client->extended = false;
+             pg_stmt_close(&client->stmts, "");
+             pg_portal_close(&client->stmts, "");
+             // A failed transaction block refuses everything but its end,
+             // which a shared reply must not answer
+             if (server->cache && client->txn_status != PG_TXN_FAILED) {
+                 int hit = pg_server_query_from_cache(server, client, payload);
+                 if (hit != 0) return hit < 0 ? -1 : 0;
+             }
+             if (server->callbacks.async_query && server->executor) {
+                 return pg_server_submit_async(server, client, msg_type, payload, 0);
+             }
+             if (server->cache) {
+                 return pg_server_run_query(server, client, payload);
+             }
+             return server->callbacks.query(client, payload);
+         
+         case PqMsg_Parse: // Parse
+             client->extended = true;
+             return pg_server_handle_parse(server, client, payload, length);
+         
+         case PqMsg_Bind: // Bind
+             client->extended = true;
+             return pg_server_handle_bind(server, client, payload, length);
+         
+         case PqMsg_Execute: // Execute
+             client->extended = true;
+             return pg_server_handle_execute(server, client, payload, length);
+         
+         case PqMsg_Describe: // Describe
+             client->extended = true;
+             return pg_server_handle_describe(server, client, payload, length);
+         
+         case PqMsg_Close: // Close
+             client->extended = true;
+             return pg_server_handle_close(client, payload, length);
+         
+         case PqMsg_Flush: // Flush
+             // Send what is queued now rather than at the end of the batch
+             client->extended = true;
+             return pg_server_flush(client);
+         
+         case PqMsg_Sync: // Sync
+             // Ends a pipeline segment, failed or not. Outside an explicit
+             // transaction, Sync ends the implicit one and with it every portal
+             client->extended = false;
+             client->skip_to_sync = false;
+             if (client->txn_status != 'T') {
+                 pg_portal_close_all(&client->stmts);
+             }
+             return server->callbacks.sync(client);
+         
+         case PqMsg_Terminate: // Terminate
+             server->callbacks.terminate(client);
+             return -1;  // nothing may follow Terminate, close the connection
+         
+         case PqMsg_PasswordMessage: // Password (outside a SCRAM exchange)
+             if (strnlen(payload, length) == (size_t)length) return -1;
+             return server->callbacks.password(client, payload);
+         
+         default:
+             return server->callbacks.unknown(client, msg_type, payload, length);
+     }
+ }
+
+ // Dispatch a message received during a SCRAM exchange, where only the
+ // client's SASL responses may come
+ static int pg_server_dispatch_auth(PGClientConn *client, char msg_type, const char *payload, int length) {
+     char message[64];
+
+     if (msg_type != PqMsg_SASLResponse) {
+         snprintf(message, sizeof(message), "expected SASL response, got message type %d",
+                  (unsigned char)msg_type);
+         pg_send_error(client, "08P01", message);
+         pg_server_flush(client);
+         return -1;
+     }
+     return pg_auth_continue(client, payload, length);
+ }
+
+ // Dispatch a message received in copy-in mode, or after copy-in ended in
+ // an error (CopyData is handled by pg_server_dispatch_input)
+ static int pg_server_dispatch_copy(PGServer *server, PGClientConn *client,
+                                    char msg_type, const char *payload, int length) {
+     char message[256];
+
+     if (client->copy_discard) {
+         if (msg_type == PqMsg_CopyDone || msg_type == PqMsg_CopyFail) {
+             return 0;
+         }
+         client->copy_discard = false;
+         return pg_server_dispatch_message(server, client, msg_type, payload, length);
+     }
+
+     switch (msg_type) {
+         case PqMsg_CopyDone: // CopyDone
+             client->copy_in = false;
+             if (server->callbacks.copy_done(client) < 0) return -1;
+             if (client->copy_discard) return 0;  // the callback reported an error
+             return client->copy_simple ? pg_send_ready_for_query(client, client->txn_status) : 0;
+
+         case PqMsg_CopyFail: // CopyFail
+             if (strnlen(payload, length) == (size_t)length) return -1;
+             client->copy_in = false;
+             if (server->callbacks.copy_fail(client, payload) < 0) return -1;
+             snprintf(message, sizeof(message), "COPY from stdin failed: %s", payload);
+             return pg_server_copy_error(client, "57014", message);
+
+         case PqMsg_Flush: // Flush
+         case PqMsg_Sync: // Sync
+             return 0;  // ignored in copy-in mode
+
+         default:
+             client->copy_in = false;
+             if (server->callbacks.copy_fail(client, "unexpected message") < 0) return -1;
+             snprintf(message, sizeof(message),
+                      "unexpected message type 0x%02X during COPY from stdin", (unsigned char)msg_type);
+             return pg_server_copy_error(client, "08P01", message);
+     }
+ }
+
+ // Settle the protocol version and options of a startup packet before the
+ // startup callback sees it. As in PostgreSQL, a newer minor version or
+ // _pq_. options the server does not know are answered with
+ // NegotiateProtocolVersion, and the connection goes on in the newest
+ // version the server speaks without those options; only another major
+ // version is refused.
+ static int pg_server_negotiate_protocol(PGServer *server, PGClientConn *client,
+                                         const char *packet, int length) {
+     const char *unknown[MAX_PROTOCOL_OPTIONS];
+     int num_unknown = 0;
+     uint32_t version;
+
+     memcpy(&version, packet + 4, 4);
+     version = ntohl(version);
+     unsigned major = version >> 16, minor = version & 0xffff;
+
+     if (major != PG_PROTOCOL_MAJOR) {
+         char message[128];
+         snprintf(message, sizeof(message),
+                  "unsupported frontend protocol %u.%u: server supports %d.0 to %d.%d",
+                  major, minor, PG_PROTOCOL_MAJOR, PG_PROTOCOL_MAJOR, PG_PROTOCOL_LATEST_MINOR);
+         pg_send_fatal(client, "0A000", message);
+         pg_server_flush(client);
+         return -1;
+     }
+     client->protocol_minor = minor < PG_PROTOCOL_LATEST_MINOR ? minor : PG_PROTOCOL_LATEST_MINOR;
+
+     const char *p = packet + 8;
+     const char *end = packet + length;
+     while (p < end) {
+         const char *param = p;
+         size_t n = pg_simd_find_nul(p, (size_t)(end - p));
+         if (n == (size_t)(end - p) || n == 0) break;
+         p += n + 1;
+         const char *value = p;
+         n = pg_simd_find_nul(p, (size_t)(end - p));
+         if (n == (size_t)(end - p)) break;
+         p += n + 1;
+
+         if (strncmp(param, "_pq_.", 5) != 0) {
+             continue;
+         }
+         if (strcmp(param, PG_COMPRESSION_OPTION) == 0) {
+             client->compression_requested = true;
+             client->compression = server->config.compression_threshold > 0 ? pg_compress_choose(value)
+                                                                             : PG_COMPRESS_NONE;
+         } else if (num_unknown == MAX_PROTOCOL_OPTIONS) {
+             return -1;
+         } else {
+             unknown[num_unknown++] = param;
+         }
+     }
+
+     if (client->compression != PG_COMPRESS_NONE) {
+         client->compressor = pg_compressor_create(client->compression);
+         if (!client->compressor) {
+             client->compression = PG_COMPRESS_NONE;
+         }
+     }
+
+     if (minor > PG_PROTOCOL_LATEST_MINOR || num_unknown > 0) {
+         return pg_send_negotiate_protocol_version(client, client->protocol_minor, num_unknown, unknown);
+     }
+     return 0;
+ }
+
+ // Dispatch a packet received before the startup message
+ static int pg_server_dispatch_startup_packet(PGServer *server, PGClientConn *client,
+                                              const char *packet, int length) {
+     int32_t code;
+     memcpy(&code, packet + 4, 4);
+     code = ntohl(code);
+
+     switch (code) {
+         case PG_SSL_REQUEST_CODE:
+             // The real startup packet follows the answer, encrypted if it was 'S'
+             if (length != 8 || client->ssl) return -1;
+             if (server->callbacks.ssl_request(client) < 0) return -1;
+
+             // Bytes sent after the request but before the handshake were not
+             // encrypted, and must not be taken as if they had been
+             if (client->ssl_handshake && pg_buffer_length(&client->in) > (size_t)length) return -1;
+             return 0;
+
+         case PG_CANCEL_REQUEST_CODE: {
+             int32_t pid, key;
+             if (length != 16) return -1;
+             memcpy(&pid, packet + 8, 4);
+             memcpy(&key, packet + 12, 4);
+             server->callbacks.cancel(client, ntohl(pid), ntohl(key));
+             return -1;  // cancel connections are closed without a reply
+         }
+
+         default:
+             client->startup_done = true;
+             if (pg_server_negotiate_protocol(server, client, packet, length) < 0) return -1;
+             return server->callbacks.startup(client, packet, length);
+     }
+ }
+
+ // Latency timer of a message type, or -1 if it is not timed
+ static int pg_server_message_timer(char msg_type) {
+     switch (msg_type) {
+         case PqMsg_Query: return PG_TIMER_QUERY;
+         case PqMsg_Parse: return PG_TIMER_PARSE;
+         case PqMsg_Bind: return PG_TIMER_BIND;
+         case PqMsg_Execute: return PG_TIMER_EXECUTE;
+         case PqMsg_Sync: return PG_TIMER_SYNC;
+         default: return -1;
+     }
+ }
+
+ // Frame and dispatch every complete message in the input buffer; a
+ // trailing partial message stays buffered for the next read
+ static int pg_server_dispatch_input(PGServer *server, PGClientConn *client) {
+     PGBuffer *in = &client->in;
+
+     while (pg_buffer_length(in) > 0) {
+         const char *p = pg_buffer_read_ptr(in);
+         size_t available = pg_buffer_length(in);
+         int32_t length;
+         size_t total;
+         int result;
+
+         if (client->copy_remaining > 0) {
+             // The rest of a CopyData, delivered as a slice of the input
+             // buffer; dropped once copy-in has ended in an error, and
+             // for a message skipped up to Sync
+             size_t chunk = available < client->copy_remaining ? available : client->copy_remaining;
+             result = client->copy_in ? server->callbacks.copy_data(client, p, (int)chunk) : 0;
+             pg_buffer_consume(in, chunk);
+             client->copy_remaining -= chunk;
+             if (result < 0) return -1;
+             continue;
+         }
+
+         if (!client->startup_done) {
+             // Startup packets have no type byte: length, then protocol or request code
+             if (available < 4) break;
+             memcpy(&length, p, 4);
+             length = ntohl(length);
+             if (length < 8 || length > PG_MAX_STARTUP_PACKET_LENGTH) return -1;
+             total = (size_t)length;
+         } else {
+             if (available < 5) break;
+             memcpy(&length, p + 1, 4);
+             length = ntohl(length);
+             if (length < 4 || length > PG_MAX_MESSAGE_LENGTH) return -1;
+             total = (size_t)length + 1;
+
+             // After an extended-protocol error everything up to Sync is
+             // dropped unread, the same way, without buffering it whole
+             if (client->skip_to_sync && p[0] != PqMsg_Sync && p[0] != PqMsg_Terminate &&
+                 !client->copy_in && !client->copy_discard) {
+                 pg_counter_add(&client->worker->metrics->messages_in[(unsigned char)p[0]], 1);
+                 pg_counter_add(&client->worker->metrics->skipped, 1);
+                 pg_buffer_consume(in, 5);
+                 client->copy_remaining = (size_t)length - 4;
+                 continue;
+             }
+
+             // CopyData is not buffered whole: its payload is passed on as
+             // it arrives
+             if (p[0] == PqMsg_CopyData && (client->copy_in || client->copy_discard)) {
+                 pg_counter_add(&client->worker->metrics->messages_in[PqMsg_CopyData], 1);
+                 pg_buffer_consume(in, 5);
+                 client->copy_remaining = (size_t)length - 4;
+                 continue;
+             }
+         }
+
+         if (available < total) {
+             // Make room for the rest so the next read can complete it
+             if (pg_buffer_reserve(in, total - available) < 0) return -1;
+             break;
+         }
+
+         PGMetricsShard *metrics = client->worker->metrics;
+         if (!client->startup_done) {
+             pg_counter_add(&metrics->messages_in[0], 1);
+             result = pg_server_dispatch_startup_packet(server, client, p, length);
+         } else if (client->scram) {
+             pg_counter_add(&metrics->messages_in[(unsigned char)p[0]], 1);
+             result = pg_server_dispatch_auth(client, p[0], p + 5, length - 4);
+         } else if (client->worker->pool) {
+             // Forwarded as it is; a message that must wait for an upstream
+             // connection stays buffered, and input pauses until one is free
+             result = pg_pool_forward(client, p, total);
+             if (result > 0) {
+                 pg_server_watch(client, 0);
+                 break;
+             }
+             pg_counter_add(&metrics->messages_in[(unsigned char)p[0]], 1);
+             pg_server_start_statement(client, p[0]);
+         } else if (client->copy_in || client->copy_discard) {
+             pg_counter_add(&metrics->messages_in[(unsigned char)p[0]], 1);
+             result = pg_server_dispatch_copy(server, client, p[0], p + 5, length - 4);
+         } else {
+             int timer = pg_server_message_timer(p[0]);
+             uint64_t started = timer >= 0 ? pg_metrics_now() : 0;
+
+             pg_counter_add(&metrics->messages_in[(unsigned char)p[0]], 1);
+             pg_server_start_statement(client, p[0]);
+             result = pg_server_dispatch_message(server, client, p[0], p + 5, length - 4);
+
+             // An async callback is timed when its job completes
+             if (timer >= 0 && !client->job) {
+                 pg_histogram_record(&metrics->timers[timer], pg_metrics_now() - started);
+             }
+             // A streamed Execute completes when its rows run out
+             if (p[0] == PqMsg_Execute && !client->job && !client->stream) {
+                 pg_server_end_statement(client);
+             }
+         }
+
+         pg_buffer_consume(in, total);
+         if (result < 0) return -1;
+
+         // Nothing more is read in the clear once an SSLRequest is accepted
+         if (client->ssl_handshake) break;
+
+         // The callback started (or an Execute resumed) a stream
+         if (client->stream) {
+             if (pg_server_run_stream(client) < 0) return -1;
+         }
+
+         // Later messages wait until the async job for this one completes,
+         // until a slow client has read the replies already queued, until
+         // a stream has sent its last row, or until the upstream
+         // connection has taken the requests already forwarded
+         if (client->job || client->write_blocked || client->stream) break;
+         if (client->backend_wait) {
+             pg_server_watch(client, 0);
+             break;
+         }
+     }
+
+     if (!client->copy_in) {
+         pg_buffer_shrink(in, MAX_IDLE_BUFFER_SIZE);
+     }
+     return 0;
+ }
+
+ // Dispatch buffered input, then write all replies it produced at once, so
+ // pipelined requests cost one write rather than one per message
+ static int pg_server_process_input(PGServer *server, PGClientConn *client) {
+     client->in_batch = true;
+     int result = pg_server_dispatch_input(server, client);
+     client->in_batch = false;
+
+     // Forwarded requests go upstream in one write too
+     if (result < 0 || (client->worker->pool && pg_pool_flush(client) < 0)) {
+         return -1;
+     }
+     return pg_server_flush(client);
+ }
+
+ // The socket drained after a flush hit EAGAIN (or a stream yielded): resume
+ // the stream, then reading and dispatching the input that was held back
+ static int pg_server_handle_writable(PGServer *server, PGClientConn *client) {
+     if (pg_server_flush(client) < 0) {
+         return -1;
+     }
+     if (pg_buffer_length(&client->out) > 0) {
+         return 0;
+     }
+
+     client->write_blocked = false;
+
+     // The answer to an SSLRequest went out, or the handshake waited for the socket
+     if (client->ssl_handshake) {
+         return pg_server_tls_handshake(server, client);
+     }
+     if (pg_server_resume_output(server, client) < 0) {
+         return -1;
+     }
+
+     // A slow reader has taken the rest of a reply ending at ReadyForQuery
+     if (client->idle_since && !pg_timer_pending(&client->timer) && pg_server_client_idle(client)) {
+         pg_server_arm_idle(client);
+     }
+     return 0;
+ }
+
+ // Output can proceed: continue the stream, then input
+ static int pg_server_resume_output(PGServer *server, PGClientConn *client) {
+     // A stream goes first; it keeps input paused until it ends or suspends
+     if (client->stream) {
+         if (pg_server_run_stream(client) < 0) return -1;
+         if (client->write_blocked || (client->stream && client->stream->waiting)) return 0;
+     }
+
+     // Replies held in the upstream socket can be forwarded again
+     if (client->worker->pool && pg_pool_resume(client) < 0) {
+         return -1;
+     }
+     if (client->backend_wait) {
+         return 0;
+     }
+
+     if (pg_server_watch(client, PG_EVENT_READ) < 0) {
+         return -1;
+     }
+     return pg_server_process_input(server, client);
+ }
+
+ // Begin a TLS handshake on the client's socket; the loop drives it from
+ // here, and the startup packet is read once it is done
+ static int pg_server_begin_tls(PGClientConn *client, bool direct) {
+     client->ssl = pg_tls_accept(client->server->tls, client->fd);
+     if (!client->ssl) {
+         return -1;
+     }
+     client->ssl_handshake = true;
+     client->ssl_direct = direct;
+     client->ssl_start = pg_metrics_now();
+     return 0;
+ }
+
+ // Advance the handshake as far as the socket allows
+ static int pg_server_tls_handshake(PGServer *server, PGClientConn *client) {
+     int result = pg_tls_handshake(client->ssl);
+     if (result < 0) {
+         return -1;
+     }
+     if (result > 0) {
+         return pg_server_watch(client, result == PG_TLS_WANT_WRITE ? PG_EVENT_WRITE : PG_EVENT_READ);
+     }
+
+     // Direct negotiation is only valid with the ALPN protocol of PostgreSQL,
+     // so a server of another protocol cannot be tricked into answering
+     if (client->ssl_direct && !pg_tls_alpn_selected(client->ssl)) {
+         return -1;
+     }
+
+     PGMetricsShard *metrics = client->worker->metrics;
+     client->ssl_handshake = false;
+     client->ssl_kernel_send = pg_tls_kernel_send(client->ssl);
+     pg_counter_add(&metrics->tls_handshakes, 1);
+     pg_counter_add(&metrics->tls_resumed, pg_tls_session_reused(client->ssl));
+     pg_counter_add(&metrics->tls_kernel, client->ssl_kernel_send);
+     pg_histogram_record(&metrics->timers[PG_TIMER_TLS], pg_metrics_now() - client->ssl_start);
+
+     if (pg_server_watch(client, PG_EVENT_READ) < 0) {
+         return -1;
+     }
+
+     // The startup packet may have arrived with the end of the handshake
+     return pg_server_handle_client(server, client);
+ }
+
+ // Whether a new connection starts with a TLS ClientHello instead of an
+ // SSLRequest (direct SSL negotiation, PostgreSQL 17); peeked so the bytes
+ // stay in the socket for OpenSSL. Returns 1 if so, 0 if not, -1 on error.
+ static int pg_server_detect_direct_tls(PGClientConn *client) {
+     unsigned char first;
+     ssize_t n;
+
+     do {
+         n = recv(client->fd, &first, 1, MSG_PEEK);
+     } while (n < 0 && errno == EINTR);
+
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         return 0;
+     }
+     if (n <= 0) {
+         return -1;
+     }
+     return first == TLS_RECORD_TYPE_HANDSHAKE;
+ }
+
+ // Read into the input buffer from the socket, or through OpenSSL once TLS
+ // is established. Returns the bytes added, 0 if the peer closed the
+ // connection, -1 on error (errno EAGAIN when there is nothing to read).
+ static ssize_t pg_server_read(PGClientConn *client, PGBuffer *in) {
+     ssize_t n;
+
+     do {
+         n = client->ssl ? pg_tls_read(client->ssl, pg_buffer_write_ptr(in), pg_buffer_writable(in))
+                         : recv(client->fd, pg_buffer_write_ptr(in), pg_buffer_writable(in), 0);
+     } while (n < 0 && errno == EINTR);
+
+     if (n <= 0) {
+         return n;
+     }
+     pg_buffer_commit(in, (size_t)n);
+     if (!client->ssl) {
+         return n;
+     }
+
+     // The socket will not wake the loop for bytes OpenSSL already decrypted
+     size_t pending;
+     while ((pending = pg_tls_pending(client->ssl)) > 0) {
+         if (pg_buffer_reserve(in, pending) < 0) {
+             return -1;
+         }
+         ssize_t more = pg_tls_read(client->ssl, pg_buffer_write_ptr(in), pending);
+         if (more <= 0) break;
+         pg_buffer_commit(in, (size_t)more);
+         n += more;
+     }
+     return n;
+ }
+
+ // Account for bytes just appended to the input buffer
+ static void pg_server_note_input(PGClientConn *client, size_t length) {
+     PGBuffer *in = &client->in;
+
+     pg_counter_add(&client->worker->metrics->bytes_in, (uint64_t)length);
+
+     // No longer idle; hibernated buffers were taken back by the reserve
+     // before the bytes were appended. The authentication deadline and a
+     // running statement's timer keep going.
+     if (client->idle_since) {
+         client->idle_since = 0;
+         if (client->authenticated && !client->statement_start) {
+             pg_wheel_cancel(&client->timer);
+         }
+     }
+     client->hibernating = false;
+     if (client->capture_id) {
+         pg_capture_write(client->worker->capture, client->capture_id, PG_CAPTURE_CLIENT,
+                          pg_buffer_read_ptr(in) + pg_buffer_length(in) - length, length);
+     }
+     if (!client->request_time) {
+         client->request_time = pg_metrics_now();
+     }
+ }
+
+ // Handle data the loop received for a client (io_uring). Receiving goes on
+ // while input is paused, so the bytes are always kept, but only dispatched
+ // once the connection reads again; a paused handoff is called off.
+ static int pg_server_handle_received(PGServer *server, PGClientConn *client,
+                                      const char *data, int length) {
+     PGBuffer *in = &client->in;
+
+     if (length <= 0) {
+         return -1;  // end of stream or an error
+     }
+     if (pg_buffer_append(in, data, (size_t)length) < 0) {
+         return -1;
+     }
+     pg_server_note_input(client, (size_t)length);
+
+     if (client->handoff_paused) {
+         client->handoff_paused = false;
+         if (pg_server_watch(client, PG_EVENT_READ) < 0) {
+             return -1;
+         }
+     }
+     if (!(client->watch_events & PG_EVENT_READ)) {
+         return 0;
+     }
+     return pg_server_process_input(server, client);
+ }
+
+ // Handle client messages
+ int pg_server_handle_client(PGServer *server, PGClientConn *client) {
+     PGBuffer *in = &client->in;
+     ssize_t bytes_read;
+
+     if (client->ssl_handshake) {
+         return pg_server_tls_handshake(server, client);
+     }
+     if (server->tls && !client->startup_done && !client->ssl && pg_buffer_length(in) == 0) {
+         int direct = pg_server_detect_direct_tls(client);
+         if (direct < 0) return -1;
+         if (direct) {
+             if (pg_server_begin_tls(client, true) < 0) return -1;
+             return pg_server_tls_handshake(server, client);
+         }
+     }
+
+     // COPY data is handed over in place as it arrives, so larger reads
+     // only mean fewer wakeups
+     if (pg_buffer_reserve(in, client->copy_in ? COPY_BUFFER_SIZE : BUFFER_SIZE) < 0) {
+         return -1;
+     }
+
+     // One read per readiness event; whatever does not fit is picked up on
+     // the next wakeup, so buffered input stays bounded
+     bytes_read = pg_server_read(client, in);
+
+     if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         return 0;
+     }
+     if (bytes_read <= 0) {
+         return -1;
+     }
+     pg_server_note_input(client, (size_t)bytes_read);
+
+     if (pg_server_process_input(server, client) < 0) {
+         return -1;
+     }
+
+     // An SSLRequest was accepted: the handshake starts once 'S' is out
+     if (client->ssl_handshake && pg_buffer_length(&client->out) == 0) {
+         return pg_server_tls_handshake(server, client);
+     }
+     return 0;
+ }
+ 
+ // Turn on TCP keepalives, so a client that vanished without closing its
+ // connection (a crash, a dropped network) is noticed while it sits idle
+ static void pg_server_set_keepalives(int fd, const PGServerConfig *config) {
+     int on = 1;
+
+     if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0) {
+         return;  // not a TCP socket
+     }
+ #if defined(TCP_KEEPIDLE)
+     if (config->tcp_keepalives_idle > 0) {
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &config->tcp_keepalives_idle, sizeof(int));
+     }
+ #elif defined(TCP_KEEPALIVE)
+     if (config->tcp_keepalives_idle > 0) {
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &config->tcp_keepalives_idle, sizeof(int));
+     }
+ #endif
+ #ifdef TCP_KEEPINTVL
+     if (config->tcp_keepalives_interval > 0) {
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &config->tcp_keepalives_interval, sizeof(int));
+     }
+ #endif
+ #ifdef TCP_KEEPCNT
+     if (config->tcp_keepalives_count > 0) {
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &config->tcp_keepalives_count, sizeof(int));
+     }
+ #endif
+ }
+
+ // Count a new socket against max_connections and set up a connection
+ // object for it; the caller gives it a slot in the worker's table. The
+ // socket is closed on failure.
+ static PGClientConn *pg_worker_open_client(PGWorker *worker, int client_fd) {
+     PGServer *server = worker->server;
+
+     // Reserve a connection slot without taking a lock
+     if (atomic_fetch_add(&server->num_clients, 1) >= server->config.max_connections) {
+         atomic_fetch_sub(&server->num_clients, 1);
+         pg_counter_add(&worker->metrics->rejects, 1);
+         close(client_fd);
+         return NULL;
+     }
+ 
+     PGClientConn *client = pg_worker_alloc_client(worker);
+     if (!client) {
+         atomic_fetch_sub(&server->num_clients, 1);
+         pg_counter_add(&worker->metrics->rejects, 1);
+         close(client_fd);
+         return NULL;
+     }
+
+     // Replies are buffered and flushed without blocking the loop
+     fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
+     pg_server_set_keepalives(client_fd, &server->config);
+ 
+     // Initialize client connection
+     client->fd = client_fd;
+     client->user = NULL;
+     client->database = NULL;
+     client->application_name = NULL;
+     client->arena_compacted = false;
+     client->hibernating = false;
+     client->protocol_minor = PG_PROTOCOL_MINOR;
+     client->compression_requested = false;
+     client->compression = PG_COMPRESS_NONE;
+     client->compressor = NULL;
+     client->idle_since = 0;
+     client->idle_session_timeout = server->config.idle_session_timeout;
+     client->idle_in_transaction_session_timeout = server->config.idle_in_transaction_session_timeout;
+     client->statement_timeout = server->config.statement_timeout;
+     client->client_connection_check_interval = server->config.client_connection_check_interval;
+     client->statement_start = 0;
+     client->statement_timed_out = false;
+     client->authenticated = false;
+     client->scram = NULL;
+     client->txn_status = 'I';
+     client->backend_pid = 0;
+     client->secret_key = 0;
+     client->ssl = NULL;
+     client->ssl_handshake = false;
+     client->ssl_direct = false;
+     client->ssl_kernel_send = false;
+     client->ssl_start = 0;
+     client->user_data = NULL;
+     client->server = server;
+     client->worker = worker;
+     client->startup_done = false;
+     client->in_batch = false;
+     client->write_blocked = false;
+     client->msg_start = 0;
+     client->msg_failed = false;
+     client->out_wire = 0;
+     client->bytes_sent = 0;
+     client->request_time = 0;
+     client->cache_response = false;
+     client->watch_events = 0;
+     client->completion_io = pg_event_loop_completes(worker->loop) && !server->tls && !worker->pool;
+     client->handoff_paused = false;
+     client->stream = NULL;
+     pg_stmt_cache_init(&client->stmts);
+     client->execute_portal = NULL;
+     client->execute_max_rows = 0;
+     client->copy_in = false;
+     client->copy_discard = false;
+     client->copy_simple = false;
+     client->copy_remaining = 0;
+     client->copy_rows = 0;
+     client->extended = false;
+     client->skip_to_sync = false;
+     client->job = NULL;
+     client->closing = false;
+     client->backend = NULL;
+     client->backend_wait = false;
+     client->backend_skip = false;
+     client->next_waiting = NULL;
+     client->prev_waiting = NULL;
+     client->capture_id = 0;
+     return client;
+ }
+
+ // Give back what pg_worker_open_client took, for a connection that did
+ // not get a slot
+ static void pg_worker_reject_client(PGClientConn *client) {
+     PGWorker *worker = client->worker;
+
+     atomic_fetch_sub(&worker->server->num_clients, 1);
+     pg_counter_add(&worker->metrics->rejects, 1);
+     pg_worker_release_client(client);
+     close(client->fd);
+ }
+
+ // Add new client connection
+ int pg_server_add_client(PGWorker *worker, int client_fd) {
+     PGServer *server = worker->server;
+     PGClientConn *client = pg_worker_open_client(worker, client_fd);
+     if (!client) {
+         return -1;
+     }
+
+     // Each worker has a slot for every connection the server allows, so
+     // one is free whenever the count allowed it, unless slots are kept for
+     // connections a previous process is still passing on. The slot taken
+     // below gets a new process ID and random secret key, which
+     // CancelRequests are matched against on any worker.
+     int slot = worker->num_free_slots > 0 ? worker->free_slots[worker->num_free_slots - 1] : -1;
+     if (slot < 0 ||
+         pg_cancel_register(server->cancels, worker->id, slot,
+                            &client->backend_pid, &client->secret_key) < 0 ||
+         // Register once; the loop reports the client only when it is ready
+         pg_server_watch(client, PG_EVENT_READ) < 0) {
+         if (slot >= 0) {
+             pg_cancel_unregister(server->cancels, worker->id, slot);
+         }
+         pg_worker_reject_client(client);
+         return -1;
+     }
+
+     // Take a slot in this worker's table; only this worker touches it
+     client->slot = worker->free_slots[--worker->num_free_slots];
+     worker->clients[client->slot] = client;
+     worker->num_clients++;
+     pg_counter_add(&worker->metrics->accepts, 1);
+     if (worker->capture) {
+         client->capture_id = pg_capture_connect(worker->capture);
+     }
+
+     // Half-open connections must not keep the slot
+     if (server->config.authentication_timeout > 0) {
+         pg_wheel_add(&worker->timers, &client->timer,
+                      pg_wheel_now() + (uint64_t)server->config.authentication_timeout);
+     }
+     return 0;
+}
+
+// Remove client connection
+int pg_server_remove_client(PGServer *server, PGClientConn *client) {
+    PGWorker *worker = client->worker;
+    int slot = client->slot;
+
+    if (slot < 0 || worker->clients[slot] != client) {
+        return -1;
+    }
+    if (worker->pool) {
+        pg_pool_detach(client);
+    }
+
+    pg_server_watch(client, 0);
+    if (client->completion_io) {
+        // Replies the loop still holds go out before the socket is closed
+        pg_event_remove(worker->loop, client->fd);
+    }
+    pg_wheel_cancel(&client->timer);
+    if (client->ssl) {
+        pg_tls_shutdown(client->ssl);
+    }
+    close(client->fd);
+    if (client->capture_id) {
+        pg_capture_close(worker->capture, client->capture_id);
+        client->capture_id = 0;
+    }
+    pg_cancel_unregister(server->cancels, worker->id, slot);
+    client->slot = -1;
+    if (client->job) {
+        // An executor thread still holds the client; the completion frees it
+        client->closing = true;
+    } else {
+        pg_worker_release_client(client);
+    }
+    worker->clients[slot] = NULL;
+    worker->free_slots[worker->num_free_slots++] = slot;
+    worker->num_clients--;
+    atomic_fetch_sub(&server->num_clients, 1);
+    pg_counter_add(&worker->metrics->closes, 1);
+    return 0;
+}
+
+// Account for bytes written to the socket; the first write after a
+// request was read ends its time to first byte
+static void pg_server_count_sent(PGClientConn *client, size_t sent) {
+    PGMetricsShard *metrics = client->worker->metrics;
+
+    client->bytes_sent += sent;
+    pg_counter_add(&metrics->bytes_out, sent);
+    if (client->request_time && sent > 0) {
+        pg_histogram_record(&metrics->timers[PG_TIMER_FIRST_BYTE], pg_metrics_now() - client->request_time);
+        client->request_time = 0;
+    }
+}
+
+// Count the messages in wire bytes queued without pg_server_end_message
+static void pg_server_count_messages(PGClientConn *client, const char *data, size_t length) {
+    PGMetricsShard *metrics = client->worker->metrics;
+    size_t offset = 0;
+
+    while (offset + 5 <= length) {
+        uint32_t msg_len;
+        memcpy(&msg_len, data + offset + 1, 4);
+        pg_counter_add(&metrics->messages_out[(unsigned char)data[offset]], 1);
+        offset += 1 + ntohl(msg_len);
+    }
+}
+
+// Wait for the socket to drain before writing or reading any further
+static void pg_server_block_writes(PGClientConn *client) {
+    client->write_blocked = true;
+    pg_server_watch(client, PG_EVENT_WRITE);
+}
+
+// Answer an SSLRequest: 'S' and a TLS handshake when SSL is enabled, else
+// 'N', after which the client sends its startup packet in the clear
+int pg_server_accept_ssl(PGClientConn *client) {
+    char answer = client->server->tls ? 'S' : 'N';
+
+    if (pg_server_send(client, &answer, 1) < 0) {
+        return -1;
+    }
+    return client->server->tls ? pg_server_begin_tls(client, false) : 0;
+}
+
+// Queue bytes for the client
+int pg_server_send(PGClientConn *client, const void *data, size_t length) {
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+    return pg_server_sendv(client, &iov, 1);
+}
+
+// Queue bytes for the client from several pieces (a header and its payload).
+// Small writes are copied into the output buffer; a large one is written
+// straight from the caller's memory together with whatever is already queued,
+// and only the part the socket did not take is copied.
+int pg_server_sendv(PGClientConn *client, const struct iovec *iov, int iovcnt) {
+    PGBuffer *out = &client->out;
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    if (length >= DIRECT_WRITE_THRESHOLD && !client->write_blocked && !client->compressor &&
+        iovcnt < MAX_SEND_IOV) {
+        struct iovec vec[MAX_SEND_IOV];
+        int n = 0;
+        ssize_t sent;
+
+        if (pg_buffer_length(out) > 0) {
+            vec[n].iov_base = pg_buffer_read_ptr(out);
+            vec[n].iov_len = pg_buffer_length(out);
+            n++;
+        }
+        for (int i = 0; i < iovcnt; i++) {
+            vec[n++] = iov[i];
+        }
+
+        do {
+            sent = pg_server_write(client, vec, n);
+        } while (sent < 0 && errno == EINTR);
+
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            sent = 0;
+        }
+        pg_server_count_sent(client, (size_t)sent);
+
+        // Drop what was written, then keep the rest for a later flush
+        size_t queued = pg_buffer_length(out);
+        size_t skip = (size_t)sent < queued ? (size_t)sent : queued;
+        pg_buffer_consume(out, skip);
+        sent -= skip;
+        for (int i = 0; i < iovcnt; i++) {
+            size_t part = iov[i].iov_len;
+            if ((size_t)sent >= part) {
+                sent -= part;
+                continue;
+            }
+            if (pg_buffer_append(out, (const char *)iov[i].iov_base + sent, part - sent) < 0) {
+                return -1;
+            }
+            sent = 0;
+        }
+
+        if (pg_buffer_length(out) > 0) {
+            pg_server_block_writes(client);
+        }
+        return 0;
+    }
+
+    if (pg_buffer_reserve(out, length) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        pg_buffer_append(out, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    if (pg_buffer_length(out) >= OUTPUT_HIGH_WATER) {
+        return pg_server_flush(client);
+    }
+    return 0;
+}
+
+// Write through OpenSSL, which takes one buffer at a time; what it refused
+// is offered again, from the output buffer, on the next write
+static ssize_t pg_server_write_tls(PGClientConn *client, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t done = 0;
+        while (done < iov[i].iov_len) {
+            ssize_t n = pg_tls_write(client->ssl, (const char *)iov[i].iov_base + done, iov[i].iov_len - done);
+            if (n < 0) {
+                return total > 0 ? total : -1;
+            }
+            done += (size_t)n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+// Write to the socket, through OpenSSL once a TLS handshake is done unless
+// the kernel encrypts for it. Returns the bytes taken, which may be fewer
+// than given, or -1 with errno set.
+static ssize_t pg_server_write(PGClientConn *client, const struct iovec *iov, int iovcnt) {
+    ssize_t sent;
+
+    if (client->ssl && !client->ssl_handshake && !client->ssl_kernel_send) {
+        sent = pg_server_write_tls(client, iov, iovcnt);
+    } else if (client->completion_io) {
+        sent = pg_event_send(client->worker->loop, client->fd, iov, iovcnt);
+    } else {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+        sent = sendmsg(client->fd, &msg, SEND_FLAGS);
+    }
+
+    // Only what the socket took is recorded, in plaintext also over TLS
+    if (sent > 0 && client->capture_id) {
+        pg_capture_writev(client->worker->capture, client->capture_id, PG_CAPTURE_SERVER,
+                          iov, iovcnt, (size_t)sent);
+    }
+    return sent;
+}
+
+// Append the bytes of out from copied to start as they are, then the
+// messages from start to end as one CompressedData message
+static int pg_server_compress_run(PGClientConn *client, PGBuffer *rebuilt, const char *data,
+                                  size_t copied, size_t start, size_t end) {
+    static const char header[5] = {PG_MSG_COMPRESSED_DATA, 0, 0, 0, 0};
+    PGMetricsShard *metrics = client->worker->metrics;
+
+    if (pg_buffer_append(rebuilt, data + copied, start - copied) < 0) {
+        return -1;
+    }
+    size_t offset = pg_buffer_length(rebuilt);
+    if (pg_buffer_append(rebuilt, header, sizeof(header)) < 0 ||
+        pg_compressor_compress(client->compressor, data + start, end - start, rebuilt) < 0) {
+        return -1;
+    }
+
+    size_t total = pg_buffer_length(rebuilt) - offset;
+    uint32_t msg_len = htonl((uint32_t)(total - 1));
+    memcpy(pg_buffer_read_ptr(rebuilt) + offset + 1, &msg_len, 4);
+
+    pg_counter_add(&metrics->messages_out[PG_MSG_COMPRESSED_DATA], 1);
+    pg_counter_add(&metrics->compressed_in, end - start);
+    pg_counter_add(&metrics->compressed_out, total);
+    return 0;
+}
+
+// Replace each run of DataRow and CopyData messages queued since the last
+// flush with one CompressedData message when the run reaches the
+// compression threshold; shorter runs and all other messages go out as
+// they are. out_wire moves to the end of the last whole message, so a
+// message is only looked at once it is complete.
+static int pg_server_compress_output(PGClientConn *client) {
+    PGBuffer *out = &client->out;
+    const char *data = pg_buffer_read_ptr(out);
+    size_t length = pg_buffer_length(out);
+    size_t threshold = (size_t)client->server->config.compression_threshold;
+    size_t offset = client->out_wire;
+    size_t run_start = offset;
+    size_t copied = 0;
+    PGBuffer rebuilt;
+    bool rebuilding = false;
+    int result = 0;
+
+    // The end of the whole messages closes the last run like any other
+    // message type
+    while (result == 0) {
+        char type = 0;
+        size_t total = 0;
+
+        if (offset + 5 <= length) {
+            uint32_t msg_len;
+            memcpy(&msg_len, data + offset + 1, 4);
+            msg_len = ntohl(msg_len);
+            if (msg_len >= 4 && offset + 1 + msg_len <= length) {
+                type = data[offset];
+                total = 1 + (size_t)msg_len;
+            }
+        }
+        if (type == PqMsg_DataRow || type == PqMsg_CopyData) {
+            offset += total;
+            continue;
+        }
+
+        if (offset - run_start >= threshold) {
+            if (!rebuilding) {
+                pg_buffer_init_pooled(&rebuilt, &client->worker->buffers);
+                rebuilding = true;
+            }
+            result = pg_server_compress_run(client, &rebuilt, data, copied, run_start, offset);
+            copied = offset;
+        }
+        if (total == 0) {
+            break;
+        }
+        offset += total;
+        run_start = offset;
+    }
+
+    if (!rebuilding) {
+        client->out_wire = offset;
+        return 0;
+    }
+    if (result == 0) {
+        result = pg_buffer_append(&rebuilt, data + copied, length - copied);
+    }
+    if (result == 0) {
+        // Offsets into out taken before the flush no longer hold
+        client->bytes_sent += offset - client->out_wire;
+        client->out_wire = pg_buffer_length(&rebuilt) - (length - offset);
+        pg_buffer_swap(out, &rebuilt);
+    }
+    pg_buffer_free(&rebuilt);
+    return result;
+}
+
+// Write queued bytes until the buffer is empty or the socket is full; in the
+// latter case the rest goes out when the socket becomes writable. With
+// compression only the part in wire form is written, which is everything
+// but a message still being built.
+int pg_server_flush(PGClientConn *client) {
+    PGBuffer *out = &client->out;
+
+    if (client->compressor && pg_server_compress_output(client) < 0) {
+        return -1;
+    }
+
+    while (pg_buffer_length(out) > 0) {
+        size_t ready = client->compressor ? client->out_wire : pg_buffer_length(out);
+        if (ready == 0) {
+            break;
+        }
+        struct iovec iov = {pg_buffer_read_ptr(out), ready};
+        ssize_t sent = pg_server_write(client, &iov, 1);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pg_server_block_writes(client);
+                return 0;
+            }
+            return -1;
+        }
+        pg_buffer_consume(out, sent);
+        if (client->compressor) {
+            client->out_wire -= (size_t)sent;
+        }
+        pg_server_count_sent(client, (size_t)sent);
+    }
+
+    pg_buffer_shrink(out, MAX_IDLE_BUFFER_SIZE);
+    return 0;
+}
+
+// An error aborts the transaction block it happened in, and in the
+// extended protocol the rest of the pipeline: like PostgreSQL, the server
+// discards messages up to the next Sync, which answers with one
+// ReadyForQuery, so only the failed segment of a batch is lost
+static void pg_server_note_error(PGClientConn *client) {
+    if (client->txn_status == PG_TXN_TRANSACTION) {
+        client->txn_status = PG_TXN_FAILED;
+    }
+    if (client->extended) {
+        client->skip_to_sync = true;
+    }
+}
+
+// Called once a whole message is queued. ReadyForQuery ends a protocol
+// cycle, releasing the per-query memory, and flushes, unless a batch of
+// input is being dispatched, which flushes once at its end.
+int pg_server_end_message(PGClientConn *client, char msg_type) {
+    pg_counter_add(&client->worker->metrics->messages_out[(unsigned char)msg_type], 1);
+    if (msg_type == PqMsg_ErrorResponse) {
+        pg_server_note_error(client);
+    }
+    if (msg_type == PqMsg_ReadyForQuery) {
+        pg_arena_reset(&client->query_arena);
+        pg_server_note_ready(client);
+    }
+    if (pg_buffer_length(&client->out) >= OUTPUT_HIGH_WATER ||
+        (msg_type == PqMsg_ReadyForQuery && !client->in_batch)) {
+        return pg_server_flush(client);
+    }
+    return 0;
+}
+
+// Whether the connection waits for the client at ReadyForQuery, with every
+// request answered and its replies written
+static bool pg_server_client_idle(PGClientConn *client) {
+    return client->authenticated && !client->scram && !client->ssl_handshake &&
+           !client->job && !client->stream && !client->copy_in && !client->extended &&
+           !client->write_blocked && !client->backend_wait &&
+           pg_buffer_length(&client->in) == 0 && pg_buffer_length(&client->out) == 0 &&
+           (!client->worker->pool || pg_pool_idle(client));
+}
+
+// Keep only the user and database names of the startup arena, in a block
+// just big enough for them; the SCRAM exchange and other parameters go
+static void pg_server_compact_arena(PGClientConn *client) {
+    size_t user_len = client->user ? strlen(client->user) + 1 : 0;
+    size_t database_len = client->database ? strlen(client->database) + 1 : 0;
+    size_t size = (user_len + database_len + 15) & ~(size_t)15;
+    PGArena arena;
+
+    pg_arena_init(&arena, size ? size : 16);
+    char *names = (char *)pg_arena_alloc(&arena, size ? size : 1);
+    if (!names) {
+        return;  // keep the old one
+    }
+    if (client->user) {
+        memcpy(names, client->user, user_len);
+        client->user = names;
+    }
+    if (client->database) {
+        memcpy(names + user_len, client->database, database_len);
+        client->database = names + user_len;
+    }
+    client->application_name = NULL;  // only needed for the startup messages
+    pg_arena_free(&client->arena);
+
+    // Anything allocated later gets ordinary blocks
+    arena.block_size = PG_ARENA_DEFAULT_BLOCK_SIZE;
+    client->arena = arena;
+    client->arena_compacted = true;
+}
+
+// Give back what an idle connection only needs while answering: the I/O
+// buffers go to the worker's pool, the per-query arena and empty statement
+// tables are freed, and the startup arena shrinks to the two names. All of
+// it is allocated again as the next request arrives.
+static void pg_server_hibernate(PGClientConn *client) {
+    pg_buffer_free(&client->in);
+    pg_buffer_free(&client->out);
+    pg_arena_free(&client->query_arena);
+    pg_stmt_cache_compact(&client->stmts);
+    if (!client->arena_compacted) {
+        pg_server_compact_arena(client);
+    }
+    client->hibernating = true;
+    pg_counter_add(&client->worker->metrics->hibernations, 1);
+}
+
+// Start the idle timer for whatever comes first while the connection sits
+// at ReadyForQuery: hibernation, or the idle timeout of its state
+static void pg_server_arm_idle(PGClientConn *client) {
+    int timeout = client->txn_status == PG_TXN_IDLE ? client->idle_session_timeout
+                                                    : client->idle_in_transaction_session_timeout;
+    int hibernate_after = client->server->config.hibernate_after;
+    uint64_t expires = UINT64_MAX;
+
+    if (timeout > 0) {
+        expires = client->idle_since + (uint64_t)timeout;
+    }
+    if (!client->hibernating && hibernate_after > 0 &&
+        client->idle_since + (uint64_t)hibernate_after < expires) {
+        expires = client->idle_since + (uint64_t)hibernate_after;
+    }
+
+    if (expires == UINT64_MAX) {
+        pg_wheel_cancel(&client->timer);
+    } else {
+        pg_wheel_add(&client->worker->timers, &client->timer, expires);
+    }
+}
+
+// The connection has waited at ReadyForQuery for a while: end the session
+// if it has been idle too long, otherwise hibernate it
+static void pg_server_idle_timeout(PGClientConn *client, uint64_t now) {
+    uint64_t idle = now - client->idle_since;
+
+    // Still busy with pipelined input, which ends with another
+    // ReadyForQuery, or with a reply the client is slow to read
+    if (!pg_server_client_idle(client)) {
+        return;
+    }
+
+    bool in_transaction = client->txn_status != PG_TXN_IDLE;
+    int timeout = in_transaction ? client->idle_in_transaction_session_timeout : client->idle_session_timeout;
+    if (timeout > 0 && idle >= (uint64_t)timeout) {
+        pg_counter_add(&client->worker->metrics->idle_timeouts, 1);
+        if (in_transaction) {
+            pg_send_fatal(client, "25P03", "terminating connection due to idle-in-transaction timeout");
+        } else {
+            pg_send_fatal(client, "57P05", "terminating connection due to idle-session timeout");
         }
+        pg_server_flush(client);
+        pg_server_remove_client(client->server, client);
+        return;
     }
 
-    free(client);
-    close(client_fd);
-    return -1;
+    int hibernate_after = client->server->config.hibernate_after;
+    if (!client->hibernating && hibernate_after > 0 && idle >= (uint64_t)hibernate_after) {
+        pg_server_hibernate(client);
+    }
+    pg_server_arm_idle(client);
 }
 
-// Remove client connection
-int pg_server_remove_client(PGServer *server, PGClientConn *client) {
-    for (int i = 0; i < server->config.max_connections; i++) {
-        if (server->clients[i] == client) {
-            close(client->fd);
-            free(client->user);
-            free(client->database);
-            free(client);
-            server->clients[i] = NULL;
-            server->num_clients--;
-            return 0;
+// The client has not finished TLS, startup and authentication in time.
+// Like PostgreSQL, one that has sent its startup packet is told why.
+static void pg_server_auth_timeout(PGClientConn *client) {
+    pg_counter_add(&client->worker->metrics->auth_timeouts, 1);
+    if (client->startup_done && !client->ssl_handshake) {
+        pg_send_fatal(client, "57014", "canceling authentication due to timeout");
+        pg_server_flush(client);
+    }
+    pg_server_remove_client(client->server, client);
+}
+
+// Whether the client of a running statement is still connected: the
+// socket reports neither a hangup nor an error. Data the client has sent
+// since does not count, unlike a plain read.
+static bool pg_server_client_alive(PGClientConn *client) {
+    struct pollfd pfd;
+
+    pfd.fd = client->fd;
+#ifdef POLLRDHUP
+    pfd.events = POLLRDHUP;
+#else
+    pfd.events = POLLIN;
+#endif
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) {
+        return true;
+    }
+#ifdef POLLRDHUP
+    return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+#else
+    char byte;
+    ssize_t n = recv(client->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+#endif
+}
+
+// Whether a statement is still at work: an async job, a stream, or
+// requests the upstream server has not answered
+static bool pg_server_statement_running(PGClientConn *client) {
+    return client->job || client->stream || (client->worker->pool && !pg_pool_idle(client));
+}
+
+// Start the timer for whatever comes first while a statement runs: its
+// timeout, or the next check that the client is still there
+static void pg_server_arm_statement(PGClientConn *client, uint64_t now) {
+    int interval = client->client_connection_check_interval;
+    uint64_t expires = UINT64_MAX;
+
+    if (client->statement_timeout > 0 && !client->statement_timed_out) {
+        expires = client->statement_start + (uint64_t)client->statement_timeout;
+    }
+    if (interval > 0 && now + (uint64_t)interval < expires) {
+        expires = now + (uint64_t)interval;
+    }
+
+    if (expires == UINT64_MAX) {
+        pg_wheel_cancel(&client->timer);
+    } else {
+        pg_wheel_add(&client->worker->timers, &client->timer, expires);
+    }
+}
+
+// A statement has run for a while: cancel it once statement_timeout has
+// passed, and drop the connection if its client has gone away meanwhile
+static void pg_server_statement_timeout(PGClientConn *client, uint64_t now) {
+    PGServer *server = client->server;
+
+    if (client->statement_timeout > 0 && !client->statement_timed_out &&
+        now - client->statement_start >= (uint64_t)client->statement_timeout) {
+        // Nothing to interrupt between messages; the next one starts over
+        client->statement_timed_out = true;
+        if (pg_server_statement_running(client)) {
+            pg_counter_add(&client->worker->metrics->statement_timeouts, 1);
+            if (pg_server_cancel_client(server, client, true) < 0) {
+                pg_server_remove_client(server, client);
+                return;
+            }
+            // The error ended it, and ReadyForQuery started the idle timer
+            if (!client->statement_start) {
+                return;
+            }
+        }
+    } else if (client->client_connection_check_interval > 0 && !pg_server_client_alive(client)) {
+        // A job may poll pg_completion_cancelled to stop early
+        if (client->job) {
+            atomic_store(&client->job->cancelled, true);
         }
+        pg_counter_add(&client->worker->metrics->lost_clients, 1);
+        pg_server_remove_client(server, client);
+        return;
+    }
+    pg_server_arm_statement(client, now);
+}
+
+// Connection timer: the authentication deadline until the client is in,
+// then the statement timeout while one runs, or the idle timers
+static void pg_server_timer(PGTimer *timer) {
+    PGClientConn *client = (PGClientConn *)timer->data;
+    uint64_t now = pg_wheel_now();
+
+    if (client->statement_start) {
+        pg_server_statement_timeout(client, now);
+    } else if (client->idle_since) {
+        pg_server_idle_timeout(client, now);
+    } else if (!client->authenticated) {
+        pg_server_auth_timeout(client);
+    }
+}
+
+// Query, Parse, Bind, Describe and Execute start the statement clock,
+// unless it is already running; as in PostgreSQL it stops when an Execute
+// completes or at ReadyForQuery
+static void pg_server_start_statement(PGClientConn *client, char msg_type) {
+    if (msg_type != PqMsg_Query && msg_type != PqMsg_Parse && msg_type != PqMsg_Bind &&
+        msg_type != PqMsg_Describe && msg_type != PqMsg_Execute) {
+        return;
+    }
+    if ((client->statement_start && !client->statement_timed_out) ||
+        (client->statement_timeout <= 0 && client->client_connection_check_interval <= 0)) {
+        return;
+    }
+    client->statement_start = pg_wheel_now();
+    client->statement_timed_out = false;
+    pg_server_arm_statement(client, client->statement_start);
+}
+
+// The statement finished without ReadyForQuery (an Execute in a pipeline)
+static void pg_server_end_statement(PGClientConn *client) {
+    if (client->statement_start) {
+        client->statement_start = 0;
+        pg_wheel_cancel(&client->timer);
+    }
+}
+
+// Called when ReadyForQuery is queued (or forwarded by the pooler): the
+// statement is over and the connection may now sit idle, which starts its
+// idle timer
+void pg_server_note_ready(PGClientConn *client) {
+    client->statement_start = 0;
+    client->idle_since = pg_wheel_now();
+    pg_server_arm_idle(client);
+}
+
+// Read and dispatch input again after it was paused for something other
+// than the socket (the pooler waiting for an upstream connection); a
+// client still waiting for its socket to drain resumes when it does
+int pg_server_resume_input(PGClientConn *client) {
+    if (client->write_blocked) {
+        return 0;
+    }
+    if (pg_server_watch(client, PG_EVENT_READ) < 0) {
+        return -1;
+    }
+    return pg_server_process_input(client->server, client);
+}
+
+// Allocate memory for the query being answered. It stays valid until the
+// next ReadyForQuery is sent (for an async callback, until its job
+// completes) and is then released in one step, so callbacks need not free
+// it; a stream's state outliving a Sync, like a suspended portal's, must
+// not come from here.
+void *pg_client_alloc(PGClientConn *client, size_t size) {
+    return pg_arena_alloc(&client->query_arena, size);
+}
+
+// Copy a string into per-query memory
+char *pg_client_strdup(PGClientConn *client, const char *s) {
+    return pg_arena_strdup(&client->query_arena, s);
+}
+
+// Format a string into per-query memory
+char *pg_client_printf(PGClientConn *client, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char *s = pg_arena_vprintf(&client->query_arena, format, args);
+    va_end(args);
+    return s;
+}
+
+/* Hot restart. A server started with the handoff socket of a running one
+   takes over from it: the running server stops accepting, sends the
+   process IDs of its connections so the new one keeps their slots free,
+   and passes its listeners, so no connection attempt is refused. Each of
+   its workers then passes on its connections as they go idle outside a
+   transaction, and closes whatever is still busy at the deadline; once
+   none are left it sends the end record and stops. On the new side,
+   worker 0 receives the connections and posts each to the worker that
+   owns its slot, which adopts it where it was left, at ReadyForQuery. */
+
+// Send a record to the server taking over; a failure abandons the handoff
+// and every worker accepts again (called with handoff_lock held)
+static int pg_server_handoff_send(PGServer *server, const void *data, size_t length,
+                                  const int *fds, int num_fds) {
+    if (atomic_load(&server->handoff_state) == HANDOFF_FAILED) {
+        return -1;
+    }
+    if (pg_handoff_send(server->handoff_peer, data, length, fds, num_fds) == 0) {
+        return 0;
+    }
+
+    pg_log_error("Handoff to the new server failed: %s; accepting connections again", strerror(errno));
+    close(server->handoff_peer);
+    server->handoff_peer = -1;
+    server->handoff_pending = server->num_workers;
+    atomic_store(&server->handoff_state, HANDOFF_FAILED);
+    for (int i = 0; i < server->num_workers; i++) {
+        pg_worker_wake(&server->workers[i]);
     }
     return -1;
 }
 
+// A new server connected to the handoff socket (worker 0)
+static void pg_server_accept_handoff(PGServer *server) {
+    int peer = pg_handoff_accept(server->handoff_fd);
+    if (peer < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&server->handoff_lock);
+    if (atomic_load(&server->handoff_state) != HANDOFF_NONE) {
+        // One at a time
+        pthread_mutex_unlock(&server->handoff_lock);
+        close(peer);
+        return;
+    }
+    server->handoff_peer = peer;
+    server->handoff_generation++;
+    server->handoff_pending = server->num_workers;
+    server->handoff_deadline = pg_wheel_now() + (uint64_t)server->config.handoff_timeout;
+    atomic_store(&server->handoff_state, HANDOFF_RESERVING);
+    pthread_mutex_unlock(&server->handoff_lock);
+
+    pg_log_info("Handing off to a new server");
+    for (int i = 0; i < server->num_workers; i++) {
+        pg_worker_wake(&server->workers[i]);
+    }
+}
+
+// Send the process IDs of the worker's connections, in as few records as
+// fit (called with handoff_lock held)
+static int pg_worker_reserve_slots(PGWorker *worker) {
+    PGServer *server = worker->server;
+    int32_t layout[2] = {server->num_workers, server->config.max_connections};
+    char type = PG_HANDOFF_RESERVE;
+    int remaining = worker->num_clients;
+    int result = 0;
+    PGBuffer record;
+
+    pg_buffer_init(&record);
+    for (int i = 0; i < server->config.max_connections && remaining > 0 && result == 0; i++) {
+        PGClientConn *client = worker->clients[i];
+        if (!client) {
+            continue;
+        }
+        remaining--;
+
+        if (pg_buffer_length(&record) == 0 &&
+            (pg_buffer_append(&record, &type, 1) < 0 || pg_buffer_append(&record, layout, sizeof(layout)) < 0)) {
+            result = -1;
+        } else if (pg_buffer_append(&record, &client->backend_pid, sizeof(int32_t)) < 0) {
+            result = -1;
+        } else if (remaining == 0 || pg_buffer_length(&record) + sizeof(int32_t) > PG_HANDOFF_MAX_RECORD) {
+            result = pg_server_handoff_send(server, pg_buffer_read_ptr(&record), pg_buffer_length(&record), NULL, 0);
+            pg_buffer_truncate(&record, 0);
+        }
+    }
+    pg_buffer_free(&record);
+    return result;
+}
+
+// Pass every listener once, the shared one first (called with
+// handoff_lock held)
+static int pg_server_pass_listeners(PGServer *server) {
+    int fds[PG_HANDOFF_MAX_FDS];
+    int num_fds = 0;
+    char type = PG_HANDOFF_LISTENERS;
+
+    for (int i = 0; i < server->num_workers && num_fds < PG_HANDOFF_MAX_FDS; i++) {
+        int fd = server->workers[i].listen_fd;
+        bool seen = false;
+        for (int j = 0; j < num_fds && !seen; j++) {
+            seen = fds[j] == fd;
+        }
+        if (!seen) {
+            fds[num_fds++] = fd;
+        }
+    }
+    return pg_server_handoff_send(server, &type, 1, fds, num_fds);
+}
+
+// End a connection the new server cannot take, the way PostgreSQL does at
+// a fast shutdown
+static void pg_server_terminate(PGClientConn *client) {
+    pg_send_fatal(client, "57P01", "terminating connection due to administrator command");
+    pg_server_flush(client);
+    pg_server_remove_client(client->server, client);
+}
+
+// Pass an idle connection to the new server, or end it if its state
+// cannot go along; the connection stays if the handoff failed
+static void pg_worker_pass_client(PGWorker *worker, PGClientConn *client) {
+    PGServer *server = worker->server;
+    PGBuffer record;
+    int result;
+
+    pg_buffer_init(&record);
+    if (!pg_handoff_portable(client) || pg_handoff_encode(client, &record) < 0) {
+        pg_buffer_free(&record);
+        pg_server_terminate(client);
+        return;
+    }
+
+    pthread_mutex_lock(&server->handoff_lock);
+    result = pg_server_handoff_send(server, pg_buffer_read_ptr(&record), pg_buffer_length(&record),
+                                    &client->fd, 1);
+    pthread_mutex_unlock(&server->handoff_lock);
+    pg_buffer_free(&record);
+
+    // The new server has its own reference to the socket
+    if (result == 0) {
+        pg_server_remove_client(server, client);
+    }
+}
+
+// Pass on the connections that wait at ReadyForQuery outside a
+// transaction; past the deadline, end the ones still busy
+static void pg_worker_pass_clients(PGWorker *worker) {
+    PGServer *server = worker->server;
+    bool expired = pg_wheel_now() >= server->handoff_deadline;
+    int remaining = worker->num_clients;
+
+    for (int i = 0; i < server->config.max_connections && remaining > 0; i++) {
+        PGClientConn *client = worker->clients[i];
+        if (!client) {
+            continue;
+        }
+        remaining--;
+
+        if (atomic_load(&server->handoff_state) != HANDOFF_PASSING) {
+            return;
+        }
+        if (pg_server_client_idle(client) && client->txn_status == PG_TXN_IDLE) {
+            // The loop has to stop receiving and finish sending for the
+            // socket first; that takes a turn or two
+            if (client->completion_io) {
+                if (!client->handoff_paused) {
+                    pg_server_watch(client, 0);
+                    client->handoff_paused = true;
+                }
+                if (pg_event_busy(worker->loop, client->fd)) {
+                    continue;
+                }
+            }
+            pg_worker_pass_client(worker, client);
+        } else if (expired) {
+            pg_server_terminate(client);
+        }
+    }
+}
+
+// Receive again on the connections that were waiting to be passed on
+static void pg_worker_resume_paused(PGWorker *worker) {
+    int remaining = worker->num_clients;
+
+    for (int i = 0; i < worker->server->config.max_connections && remaining > 0; i++) {
+        PGClientConn *client = worker->clients[i];
+        if (!client) {
+            continue;
+        }
+        remaining--;
+
+        if (client->handoff_paused) {
+            client->handoff_paused = false;
+            if (pg_server_watch(client, PG_EVENT_READ) < 0) {
+                pg_server_remove_client(worker->server, client);
+            }
+        }
+    }
+}
+
+// Take the worker through the steps of a handoff; called on every turn of
+// its loop while one is under way
+static void pg_worker_handoff(PGWorker *worker) {
+    PGServer *server = worker->server;
+
+    pthread_mutex_lock(&server->handoff_lock);
+    int state = atomic_load(&server->handoff_state);
+    bool current = worker->handoff_generation == server->handoff_generation;
+
+    if (state == HANDOFF_FAILED) {
+        if (!current || worker->handoff_step != HANDOFF_STEP_RESUMED) {
+            if (current && worker->handoff_step != HANDOFF_STEP_NONE) {
+                pg_event_add(worker->loop, worker->listen_fd, PG_EVENT_READ, NULL);
+                pg_worker_resume_paused(worker);
+            }
+            worker->handoff_generation = server->handoff_generation;
+            worker->handoff_step = HANDOFF_STEP_RESUMED;
+            if (--server->handoff_pending == 0) {
+                atomic_store(&server->handoff_state, HANDOFF_NONE);
+            }
+        }
+    } else if (state != HANDOFF_NONE && !current) {
+        // Stop accepting: the listeners are about to go to the new server,
+        // after the slots of every worker's connections
+        pg_wheel_cancel(&worker->accept_timer);
+        pg_event_remove(worker->loop, worker->listen_fd);
+        worker->handoff_generation = server->handoff_generation;
+        worker->handoff_step = HANDOFF_STEP_RESERVED;
+        if (pg_worker_reserve_slots(worker) == 0 && --server->handoff_pending == 0 &&
+            pg_server_pass_listeners(server) == 0) {
+            pg_log_info("Listeners passed to the new server; %d connections to go",
+                        atomic_load(&server->num_clients));
+            server->handoff_pending = server->num_workers;
+            atomic_store(&server->handoff_state, HANDOFF_PASSING);
+            for (int i = 0; i < server->num_workers; i++) {
+                pg_worker_wake(&server->workers[i]);
+            }
+        }
+    } else if (state == HANDOFF_PASSING && worker->handoff_step == HANDOFF_STEP_RESERVED) {
+        pthread_mutex_unlock(&server->handoff_lock);
+        pg_worker_pass_clients(worker);
+        pthread_mutex_lock(&server->handoff_lock);
+
+        if (worker->num_clients == 0 && atomic_load(&server->handoff_state) == HANDOFF_PASSING) {
+            worker->handoff_step = HANDOFF_STEP_DRAINED;
+            char type = PG_HANDOFF_DONE;
+            if (--server->handoff_pending == 0 && pg_server_handoff_send(server, &type, 1, NULL, 0) == 0) {
+                pg_log_info("Handoff complete; stopping");
+                close(server->handoff_peer);
+                server->handoff_peer = -1;
+                pg_server_stop(server);
+            }
+        }
+    }
+    pthread_mutex_unlock(&server->handoff_lock);
+}
+
+// Put the slots of a worker that are neither used nor kept back on its
+// free list, lowest on top
+static void pg_worker_rebuild_free_slots(PGWorker *worker) {
+    worker->num_free_slots = 0;
+    for (int slot = worker->server->config.max_connections - 1; slot >= 0; slot--) {
+        if (!worker->clients[slot] && !(worker->reserved && worker->reserved[slot])) {
+            worker->free_slots[worker->num_free_slots++] = slot;
+        }
+    }
+}
+
+// Keep free the slots of the previous server's connections, so those
+// passed over get the same slot and keep their backend keys. That needs
+// the same workers and slots; otherwise they get new keys.
+static int pg_server_reserve_slots(PGServer *server, const char *record, size_t length) {
+    int32_t layout[2];
+
+    if (length < 1 + sizeof(layout)) {
+        return -1;
+    }
+    memcpy(layout, record + 1, sizeof(layout));
+    server->handoff_same_layout = layout[0] == server->num_workers &&
+                                  layout[1] == server->config.max_connections;
+    if (!server->handoff_same_layout) {
+        return 0;
+    }
+
+    for (size_t offset = 1 + sizeof(layout); offset + sizeof(int32_t) <= length; offset += sizeof(int32_t)) {
+        int32_t pid;
+        int owner;
+        int slot;
+
+        memcpy(&pid, record + offset, sizeof(pid));
+        if (pg_cancel_slot(server->cancels, pid, &owner, &slot) < 0) {
+            continue;
+        }
+        PGWorker *worker = &server->workers[owner];
+        if (!worker->reserved) {
+            worker->reserved = (bool *)calloc(server->config.max_connections, sizeof(bool));
+            if (!worker->reserved) {
+                return -1;
+            }
+        }
+        if (!worker->reserved[slot]) {
+            worker->reserved[slot] = true;
+            worker->num_reserved++;
+        }
+    }
+    return 0;
+}
+
+// Take over from the server behind the handoff socket, up to its
+// listeners: those are returned, and its connections follow in the loop
+static int pg_server_take_listeners(PGServer *server, int *listeners) {
+    server->handoff_record = (char *)malloc(PG_HANDOFF_MAX_RECORD);
+    if (!server->handoff_record) {
+        return -1;
+    }
+
+    for (;;) {
+        int num_fds;
+        ssize_t n = pg_handoff_recv(server->handoff_peer, server->handoff_record, PG_HANDOFF_MAX_RECORD,
+                                    listeners, PG_HANDOFF_MAX_FDS, &num_fds);
+        if (n <= 0) {
+            pg_log_error("Taking over from the running server failed: %s",
+                         n < 0 ? strerror(errno) : "it closed the handoff socket");
+            return -1;
+        }
+        if (server->handoff_record[0] == PG_HANDOFF_LISTENERS && num_fds > 0) {
+            for (int i = 0; i < server->num_workers; i++) {
+                if (server->workers[i].reserved) {
+                    pg_worker_rebuild_free_slots(&server->workers[i]);
+                }
+            }
+            pg_log_info("Took over %d listening sockets from the running server", num_fds);
+            return num_fds;
+        }
+        while (num_fds > 0) {
+            close(listeners[--num_fds]);
+        }
+        if (server->handoff_record[0] != PG_HANDOFF_RESERVE ||
+            pg_server_reserve_slots(server, server->handoff_record, (size_t)n) < 0) {
+            pg_log_error("Taking over from the running server failed: unexpected record");
+            return -1;
+        }
+    }
+}
+
+// Hand a received connection to a worker; the same slot means the same
+// worker, otherwise they take turns
+static void pg_server_post_adoption(PGServer *server, PGWorker *worker, int fd,
+                                    const char *record, size_t length) {
+    PGAdoption *adoption = (PGAdoption *)malloc(sizeof(PGAdoption) + length);
+    if (!adoption) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    adoption->fd = fd;
+    adoption->length = length;
+    memcpy(adoption->record, record, length);
+
+    int owner;
+    int slot;
+    if (!worker && server->handoff_same_layout &&
+        pg_cancel_slot(server->cancels, pg_handoff_pid(record, length), &owner, &slot) == 0) {
+        worker = &server->workers[owner];
+    } else if (!worker) {
+        worker = &server->workers[server->handoff_next_worker++ % server->num_workers];
+    }
+
+    adoption->next = atomic_load(&worker->adoptions);
+    while (!atomic_compare_exchange_weak(&worker->adoptions, &adoption->next, adoption)) {}
+    pg_worker_wake(worker);
+}
+
+// The previous server has no more connections, or went away: free the
+// slots still kept, and listen for the next server in its place
+static void pg_server_finish_takeover(PGServer *server, bool complete) {
+    PGWorker *worker = &server->workers[0];
+
+    for (int i = 0; i < server->num_workers; i++) {
+        pg_server_post_adoption(server, &server->workers[i], -1, NULL, 0);
+    }
+    pg_event_remove(worker->loop, server->handoff_peer);
+    close(server->handoff_peer);
+    server->handoff_peer = -1;
+    free(server->handoff_record);
+    server->handoff_record = NULL;
+
+    if (complete) {
+        pg_log_info("Took over %d connections from the previous server", server->handoff_adopted);
+    } else {
+        pg_log_warning("The previous server went away after passing %d connections", server->handoff_adopted);
+    }
+
+    server->handoff_fd = pg_handoff_listen(server->config.handoff_socket);
+    if (server->handoff_fd >= 0 &&
+        pg_event_add(worker->loop, server->handoff_fd, PG_EVENT_READ, &server->handoff_fd) < 0) {
+        close(server->handoff_fd);
+        server->handoff_fd = -1;
+    }
+}
+
+// Receive the connections the previous server passes on (worker 0)
+static void pg_server_receive_handoff(PGServer *server) {
+    for (;;) {
+        int fd = -1;
+        int num_fds;
+        ssize_t n = pg_handoff_recv(server->handoff_peer, server->handoff_record, PG_HANDOFF_MAX_RECORD,
+                                    &fd, 1, &num_fds);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+
+        if (n > 0 && server->handoff_record[0] == PG_HANDOFF_CONNECTION && num_fds == 1) {
+            server->handoff_adopted++;
+            pg_server_post_adoption(server, NULL, fd, server->handoff_record, (size_t)n);
+            continue;
+        }
+        if (num_fds > 0) {
+            close(fd);
+        }
+        pg_server_finish_takeover(server, n > 0 && server->handoff_record[0] == PG_HANDOFF_DONE);
+        return;
+    }
+}
+
+// Set up a connection passed over by the previous server, waiting at
+// ReadyForQuery as it was there
+static void pg_worker_adopt(PGWorker *worker, PGAdoption *adoption) {
+    PGServer *server = worker->server;
+    PGClientConn *client = pg_worker_open_client(worker, adoption->fd);
+    int owner;
+    int slot;
+
+    if (!client) {
+        return;
+    }
+    if (pg_handoff_decode(client, adoption->record, adoption->length) < 0) {
+        pg_worker_reject_client(client);
+        return;
+    }
+
+    // The client keeps the backend key it knows if its slot was kept for
+    // it; otherwise cancel requests for it no longer match
+    if (server->handoff_same_layout &&
+        pg_cancel_slot(server->cancels, client->backend_pid, &owner, &slot) == 0 &&
+        owner == worker->id && worker->reserved && worker->reserved[slot]) {
+        worker->reserved[slot] = false;
+        worker->num_reserved--;
+        pg_cancel_restore(server->cancels, worker->id, slot, client->backend_pid, client->secret_key);
+    } else if (worker->num_free_slots > 0) {
+        slot = worker->free_slots[--worker->num_free_slots];
+        if (pg_cancel_register(server->cancels, worker->id, slot,
+                               &client->backend_pid, &client->secret_key) < 0) {
+            worker->free_slots[worker->num_free_slots++] = slot;
+            pg_worker_reject_client(client);
+            return;
+        }
+    } else {
+        pg_worker_reject_client(client);
+        return;
+    }
+
+    if (pg_server_watch(client, PG_EVENT_READ) < 0) {
+        pg_cancel_unregister(server->cancels, worker->id, slot);
+        worker->free_slots[worker->num_free_slots++] = slot;
+        pg_worker_reject_client(client);
+        return;
+    }
+
+    client->slot = slot;
+    worker->clients[slot] = client;
+    worker->num_clients++;
+    client->startup_done = true;
+    client->authenticated = true;
+    if (worker->capture) {
+        client->capture_id = pg_capture_connect(worker->capture);
+    }
+    client->idle_since = pg_wheel_now();
+    pg_server_arm_idle(client);
+}
+
+// Adopt the connections worker 0 received for this worker, in the order
+// they came
+static void pg_worker_adopt_clients(PGWorker *worker) {
+    PGAdoption *list = atomic_exchange(&worker->adoptions, NULL);
+    PGAdoption *ordered = NULL;
+
+    while (list) {
+        PGAdoption *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        PGAdoption *next = ordered->next;
+        if (ordered->fd >= 0) {
+            pg_worker_adopt(worker, ordered);
+        } else if (worker->reserved) {
+            // The rest were closed instead of passed over
+            free(worker->reserved);
+            worker->reserved = NULL;
+            worker->num_reserved = 0;
+            pg_worker_rebuild_free_slots(worker);
+        }
+        free(ordered);
+        ordered = next;
+    }
+}
+
 // Stop server
 int pg_server_stop(PGServer *server) {
-    server->running = false;
-    
-    // Close all client connections
-    for (int i = 0; i < server->config.max_connections; i++) {
-        if (server->clients[i]) {
-            pg_server_remove_client(server, server->clients[i]);
+    atomic_store(&server->running, false);
+
+    // Running loops notice the flag on wakeup and close their own clients;
+    // this only writes to the wakeup pipes, so it is safe in a signal handler
+    for (int i = 0; i < server->num_workers; i++) {
+        pg_worker_wake(&server->workers[i]);
+    }
+    if (atomic_load(&server->active_workers) > 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < server->num_workers; i++) {
+        PGWorker *worker = &server->workers[i];
+
+        // Close all client connections
+        for (int j = 0; j < server->config.max_connections && worker->num_clients > 0; j++) {
+            if (worker->clients[j]) {
+                pg_server_remove_client(server, worker->clients[j]);
+            }
+        }
+
+        // Close per-worker listening socket; listeners passed over by a
+        // previous server may be shared by several workers
+        if (worker->listen_fd >= 0) {
+            bool shared = worker->listen_fd == server->server_fd;
+            for (int j = 0; j < i && !shared; j++) {
+                shared = server->workers[j].listen_fd == worker->listen_fd;
+            }
+            if (worker->loop) {
+                pg_event_remove(worker->loop, worker->listen_fd);
+            }
+            if (!shared) {
+                close(worker->listen_fd);
+            }
+        }
+    }
+    for (int i = 0; i < server->num_workers; i++) {
+        server->workers[i].listen_fd = -1;
+    }
+
+    // The handoff socket stays bound, for a server taking over after this one
+    if (server->handoff_fd >= 0) {
+        if (server->workers[0].loop) {
+            pg_event_remove(server->workers[0].loop, server->handoff_fd);
+        }
+        close(server->handoff_fd);
+        server->handoff_fd = -1;
+    }
+    if (server->handoff_peer >= 0) {
+        if (server->workers[0].loop) {
+            pg_event_remove(server->workers[0].loop, server->handoff_peer);
         }
+        close(server->handoff_peer);
+        server->handoff_peer = -1;
     }
 
     // Close server socket
@@ -267,7 +3743,51 @@ int pg_server_stop(PGServer *server) {
 void pg_server_destroy(PGServer *server) {
     if (server) {
         pg_server_stop(server);
-        free(server->clients);
+
+        // Let queued jobs finish, then free the clients they kept alive
+        pg_executor_destroy(server->executor);
+        server->executor = NULL;
+        for (int i = 0; i < server->num_workers; i++) {
+            pg_worker_drain_completions(&server->workers[i]);
+        }
+        pg_cache_destroy(server->cache);
+        pg_metrics_server_stop(server->metrics_server);
+        pg_metrics_destroy(server->metrics);
+        pg_tls_destroy(server->tls);
+        pg_auth_destroy(server->auth);
+        pg_cancel_registry_destroy(server->cancels);
+
+        for (int i = 0; i < server->num_workers; i++) {
+            PGWorker *worker = &server->workers[i];
+            pg_pool_destroy(worker->pool);
+            pg_capture_writer_destroy(worker->capture);
+            pg_event_loop_destroy(worker->loop);
+            for (int j = 0; j < 2; j++) {
+                if (worker->wake_fds[j] >= 0) {
+                    close(worker->wake_fds[j]);
+                }
+            }
+            pg_worker_free_clients(worker);
+            pg_buffer_pool_destroy(&worker->buffers);
+            free(worker->clients);
+            free(worker->free_slots);
+            free(worker->reserved);
+
+            // Connections received for the worker that it never adopted
+            PGAdoption *adoption = atomic_exchange(&worker->adoptions, NULL);
+            while (adoption) {
+                PGAdoption *next = adoption->next;
+                if (adoption->fd >= 0) {
+                    close(adoption->fd);
+                }
+                free(adoption);
+                adoption = next;
+            }
+        }
+        free(server->handoff_record);
+        pthread_mutex_destroy(&server->handoff_lock);
+        pg_capture_destroy(server->capture);
+        free(server->workers);
         free(server);
     }
 }
@@ -275,76 +3795,121 @@ void pg_server_destroy(PGServer *server) {
 // Helper function to send startup messages
 int pg_server_send_startup_messages(PGClientConn *client) {
     // Send AuthenticationOk
-    char auth_ok[9] = {PqMsg_AuthenticationRequest, 0, 0, 0, 8, 0, 0, 0, 0};
-    if (send(client->fd, auth_ok, 9, 0) < 0) return -1;
+    if (pg_send_auth_ok(client) < 0) return -1;
+    client->authenticated = true;
 
-    // Send ParameterStatus messages
+    // Send ParameterStatus messages; the pooler passes on the upstream server's.
+    // Otherwise these are the settings PostgreSQL reports, which drivers
+    // read instead of asking (libpq's target_session_attrs looks at the
+    // last two), and the session's own.
+    int sent = client->worker->pool ? pg_pool_send_parameters(client) : 0;
+    if (sent < 0) return -1;
     const char *params[][2] = {
         {"server_version", "14.0"},
-        {"client_encoding", "UTF8"},
         {"server_encoding", "UTF8"},
-        {"DateStyle", "ISO, MDY"}
+        {"client_encoding", "UTF8"},
+        {"DateStyle", "ISO, MDY"},
+        {"IntervalStyle", "postgres"},
+        {"TimeZone", "UTC"},
+        {"integer_datetimes", "on"},
+        {"standard_conforming_strings", "on"},
+        {"in_hot_standby", "off"},
+        {"default_transaction_read_only", "off"}
     };
 
-    for (int i = 0; i < 4; i++) {
-        int len = 4 + 1 + strlen(params[i][0]) + 1 + strlen(params[i][1]) + 1;
-        char *msg = malloc(len);
-        char *p = msg;
-        
-        *p++ = PqMsg_ParameterStatus;
-        *(int32_t *)p = htonl(len - 1); p += 4;
-        strcpy(p, params[i][0]); p += strlen(params[i][0]) + 1;
-        strcpy(p, params[i][1]);
-        
-        if (send(client->fd, msg, len, 0) < 0) {
-            free(msg);
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]) && sent == 0; i++) {
+        if (pg_send_parameter_status(client, params[i][0], params[i][1]) < 0) return -1;
+    }
+    if (sent == 0) {
+        if (pg_send_parameter_status(client, "application_name",
+                                     client->application_name ? client->application_name : "") < 0) {
             return -1;
         }
-        free(msg);
+        if (client->user && pg_send_parameter_status(client, "session_authorization", client->user) < 0) {
+            return -1;
+        }
+    }
+
+    // The algorithm agreed on, or "none", for a client that asked for compression
+    if (client->compression_requested &&
+        pg_send_parameter_status(client, PG_COMPRESSION_OPTION, pg_compress_name(client->compression)) < 0) {
+        return -1;
     }
 
     // Send BackendKeyData
-    char key_data[13] = {PqMsg_BackendKeyData, 0, 0, 0, 12};
-    *(int32_t *)(key_data + 5) = htonl(client->backend_pid);
-    *(int32_t *)(key_data + 9) = htonl(client->secret_key);
-    if (send(client->fd, key_data, 13, 0) < 0) return -1;
+    if (pg_send_backend_key_data(client, client->backend_pid, client->secret_key) < 0) return -1;
 
     // Send ReadyForQuery
-    char ready[6] = {PqMsg_ReadyForQuery, 0, 0, 0, 5, 'I'};
-    if (send(client->fd, ready, 6, 0) < 0) return -1;
+    return pg_send_ready_for_query(client, client->txn_status);
+}
 
-    return 0;
+// Parse a time setting the way PostgreSQL does: milliseconds, or a number
+// followed by ms, s, min, h or d; fallback if it does not parse
+static int pg_server_parse_ms(const char *value, int fallback) {
+    static const struct {
+        const char *unit;
+        long ms;
+    } units[] = {{"", 1}, {"ms", 1}, {"s", 1000}, {"min", 60000}, {"h", 3600000}, {"d", 86400000}};
+    char *end;
+    long n = strtol(value, &end, 10);
+
+    if (end == value || n < 0) {
+        return fallback;
+    }
+    while (*end == ' ') {
+        end++;
+    }
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        if (strcmp(end, units[i].unit) == 0) {
+            return n > INT_MAX / units[i].ms ? INT_MAX : (int)(n * units[i].ms);
+        }
+    }
+    return fallback;
 }
 
 // Default callback implementations
 int pg_default_startup_callback(PGClientConn *client, const char *buffer, int length) {
-    // Parse startup message and extract parameters
+    // Parse startup message and extract parameters; an unterminated name
+    // or value ends the list
     const char *p = buffer + 8; // Skip length and protocol version
-    while (p < buffer + length) {
+    const char *end = buffer + length;
+    while (p < end) {
         const char *param = p;
-        p += strlen(p) + 1;
+        size_t n = pg_simd_find_nul(p, (size_t)(end - p));
+        if (n == (size_t)(end - p) || n == 0) break;
+        p += n + 1;
         const char *value = p;
-        p += strlen(p) + 1;
-        
-        if (*param == 0) break;
+        n = pg_simd_find_nul(p, (size_t)(end - p));
+        if (n == (size_t)(end - p)) break;
+        p += n + 1;
 
         if (strcmp(param, "user") == 0) {
-            client->user = strdup(value);
+            client->user = pg_arena_strdup(&client->arena, value);
         } else if (strcmp(param, "database") == 0) {
-            client->database = strdup(value);
+            client->database = pg_arena_strdup(&client->arena, value);
+        } else if (strcmp(param, "application_name") == 0) {
+            client->application_name = pg_arena_strdup(&client->arena, value);
+        } else if (strcmp(param, "idle_session_timeout") == 0) {
+            client->idle_session_timeout = pg_server_parse_ms(value, client->idle_session_timeout);
+        } else if (strcmp(param, "idle_in_transaction_session_timeout") == 0) {
+            client->idle_in_transaction_session_timeout =
+                pg_server_parse_ms(value, client->idle_in_transaction_session_timeout);
+        } else if (strcmp(param, "statement_timeout") == 0) {
+            client->statement_timeout = pg_server_parse_ms(value, client->statement_timeout);
+        } else if (strcmp(param, "client_connection_check_interval") == 0) {
+            client->client_connection_check_interval =
+                pg_server_parse_ms(value, client->client_connection_check_interval);
         }
     }
 
+    // With a credential file, the startup messages follow a SCRAM exchange
+    if (client->server->auth) {
+        return pg_auth_start(client);
+    }
     return pg_server_send_startup_messages(client);
 }
 
-// Implement other default callbacks
-int pg_default_query_callback(PGClientConn *client, const char *query) {
-    // Send EmptyQueryResponse or RowDescription + DataRow(s) + CommandComplete
-    char empty_response[6] = {PqMsg_EmptyQueryResponse, 0, 0, 0, 4};
-    return send(client->fd, empty_response, 5, 0);
-}
-
+// The default query callback is in pg_query.c
 
 // Callback setters
 void pg_server_set_callbacks(PGServer *server, const PGCallbacks *callbacks) {
@@ -399,10 +3964,108 @@ void pg_server_set_unknown_callback(PGServer *server, PGUnknownCallback callback
     server->callbacks.unknown = callback ? callback : pg_default_unknown_callback;
 }
 
+void pg_server_set_copy_in_start_callback(PGServer *server, PGCopyStartCallback callback) {
+    server->callbacks.copy_in_start = callback ? callback : pg_default_copy_in_start_callback;
+}
+
+void pg_server_set_copy_data_callback(PGServer *server, PGCopyDataCallback callback) {
+    server->callbacks.copy_data = callback ? callback : pg_default_copy_data_callback;
+}
+
+void pg_server_set_copy_done_callback(PGServer *server, PGCopyDoneCallback callback) {
+    server->callbacks.copy_done = callback ? callback : pg_default_copy_done_callback;
+}
+
+void pg_server_set_copy_fail_callback(PGServer *server, PGCopyFailCallback callback) {
+    server->callbacks.copy_fail = callback ? callback : pg_default_copy_fail_callback;
+}
+
+void pg_server_set_copy_out_start_callback(PGServer *server, PGCopyStartCallback callback) {
+    server->callbacks.copy_out_start = callback ? callback : pg_default_copy_out_start_callback;
+}
+
+// Async callbacks have no default: NULL goes back to the synchronous callback.
+// They must be set before pg_server_start, which creates the executor.
+void pg_server_set_async_query_callback(PGServer *server, PGAsyncQueryCallback callback) {
+    server->callbacks.async_query = callback;
+}
+
+void pg_server_set_async_execute_callback(PGServer *server, PGAsyncExecuteCallback callback) {
+    server->callbacks.async_execute = callback;
+}
+
+// Let the shared cache keep the reply the query callback is sending, so the
+// same query text is answered from the cache without calling it again. Only
+// for replies that are the same for every connection.
+void pg_server_cache_response(PGClientConn *client) {
+    client->cache_response = true;
+}
+
+// Drop the cached replies for a query, or all of them when query is NULL;
+// for callbacks whose writes change what other queries return
+void pg_server_invalidate_cache(PGServer *server, const char *query) {
+    if (!server->cache) {
+        return;
+    }
+    if (query) {
+        pg_cache_invalidate(server->cache, query);
+    } else {
+        pg_cache_invalidate_all(server->cache);
+    }
+}
+
+// Queue a reply message on a completion; may be called from any thread
+// until pg_completion_finish
+int pg_completion_send(PGCompletion *completion, char msg_type, const char *data, int length) {
+    PGBuffer *out = &completion->out;
+    int32_t msg_len = htonl(length + 4);
+
+    if (pg_buffer_reserve(out, 5 + length) < 0) {
+        return -1;
+    }
+    pg_buffer_append(out, &msg_type, 1);
+    pg_buffer_append(out, &msg_len, 4);
+    if (length > 0) {
+        pg_buffer_append(out, data, length);
+    }
+    if (msg_type == PqMsg_ErrorResponse) {
+        completion->failed = true;
+    }
+    return 0;
+}
+
+// Post a completion back to the connection's worker; result < 0 closes the
+// connection. The completion must not be touched afterwards.
+void pg_completion_finish(PGCompletion *completion, int result) {
+    PGWorker *worker = completion->client->worker;
+
+    completion->result = result;
+    completion->next = atomic_load(&worker->completions);
+    while (!atomic_compare_exchange_weak(&worker->completions, &completion->next, completion)) {}
+
+    pg_worker_wake(worker);
+}
+
+// Whether a CancelRequest arrived for the connection of a job; a long
+// callback may check this from time to time and finish early
+bool pg_completion_cancelled(PGCompletion *completion) {
+    return atomic_load_explicit(&completion->cancelled, memory_order_relaxed);
+}
+
+// Cancel what the connection with a backend process ID and secret key is
+// running, whichever worker owns it; may be called from any thread
+int pg_server_cancel_backend(PGServer *server, int32_t pid, int32_t key) {
+    int worker = pg_cancel_request(server->cancels, pid, key);
+    if (worker < 0) {
+        return -1;
+    }
+    pg_worker_wake(&server->workers[worker]);
+    return 0;
+}
+
 int pg_default_password_callback(PGClientConn *client, const char *password) {
     // Send AuthenticationOk by default
-    char auth_ok[9] = {PqMsg_AuthenticationRequest, 0, 0, 0, 8, 0, 0, 0, AUTH_REQ_OK};
-    return send(client->fd, auth_ok, 9, 0);
+    return pg_send_auth_ok(client);
 }
 
 int pg_default_terminate_callback(PGClientConn *client) {
@@ -412,65 +4075,44 @@ int pg_default_terminate_callback(PGClientConn *client) {
 
 int pg_default_sync_callback(PGClientConn *client) {
     // Send ReadyForQuery with idle status
-    char ready[6] = {PqMsg_ReadyForQuery, 0, 0, 0, 5, 'I'};
-    return send(client->fd, ready, 6, 0);
+    return pg_send_ready_for_query(client, client->txn_status);
 }
 
-int pg_default_describe_callback(PGClientConn *client, char describe_type, const char *name) {
-    // Send NoData response
-    char no_data[5] = {PqMsg_NoData, 0, 0, 0, 4};
-    return send(client->fd, no_data, 5, 0);
-}
+// The default describe callback is in pg_query.c
 
 int pg_default_bind_callback(PGClientConn *client, const char *data, int length) {
     // Send BindComplete
-    char bind_complete[5] = {PqMsg_BindComplete, 0, 0, 0, 4};
-    return send(client->fd, bind_complete, 5, 0);
+    return pg_send_message(client, PqMsg_BindComplete, NULL, 0);
 }
 
-int pg_default_execute_callback(PGClientConn *client, const char *portal, int max_rows) {
-    // Send EmptyQueryResponse
-    char empty_response[5] = {PqMsg_EmptyQueryResponse, 0, 0, 0, 4};
-    if (send(client->fd, empty_response, 5, 0) < 0) return -1;
+// The default execute callback is in pg_query.c
 
-    // Send CommandComplete with empty tag
-    char command_complete[6] = {PqMsg_CommandComplete, 0, 0, 0, 5, 0};
-    return send(client->fd, command_complete, 6, 0);
-}
-
-int pg_default_parse_callback(PGClientConn *client, const char *query, const char *stmt_name, int num_params) {
+int pg_default_parse_callback(PGClientConn *client, const char *stmt_name, const char *query, int num_params) {
     // Send ParseComplete
-    char parse_complete[5] = {PqMsg_ParseComplete, 0, 0, 0, 4};
-    return send(client->fd, parse_complete, 5, 0);
+    return pg_send_message(client, PqMsg_ParseComplete, NULL, 0);
 }
 
 int pg_default_cancel_callback(PGClientConn *client, int32_t pid, int32_t key) {
-    // By default, just acknowledge the cancel request
+    // Requests that match no connection are ignored, like PostgreSQL
+    if (pg_server_cancel_backend(client->server, pid, key) == 0) {
+        pg_counter_add(&client->worker->metrics->cancel_requests, 1);
+    }
     return 0;
 }
 
 int pg_default_ssl_request_callback(PGClientConn *client) {
-    // By default, reject SSL
-    char reject_ssl = 'N';
-    return send(client->fd, &reject_ssl, 1, 0);
+    // Accept SSL when the server has a certificate, otherwise reject it
+    return pg_server_accept_ssl(client);
 }
 
 int pg_default_unknown_callback(PGClientConn *client, char msg_type, const char *data, int length) {
-    // Send ErrorResponse for unknown message types
-    char error_msg[] = {
-        PqMsg_ErrorResponse,       // Error message type
-        0, 0, 0, 85,              // Length
-        'S', 'E', 'R', 'R', 'O', 'R', 0,           // Severity
-        'C', '4', '2', '6', '0', '1', 0,           // Code
-        'M', 'U', 'n', 'k', 'n', 'o', 'w', 'n', ' ',
-        'm', 'e', 's', 's', 'a', 'g', 'e', ' ',
-        't', 'y', 'p', 'e', 0,                      // Message
-        0                          // Terminator
-    };
-    
-    if (send(client->fd, error_msg, sizeof(error_msg), 0) < 0) return -1;
-
-    // Send ReadyForQuery
-    char ready[6] = {PqMsg_ReadyForQuery, 0, 0, 0, 5, 'I'};
-    return send(client->fd, ready, 6, 0);
-}
\ No newline at end of file
+    // Like PostgreSQL, an unknown message type is a protocol violation that
+    // ends the connection: the rest of the stream cannot be trusted, and an
+    // error in extended mode would otherwise be answered twice, here and at
+    // the next Sync
+    char message[64];
+    snprintf(message, sizeof(message), "invalid frontend message type %d", (unsigned char)msg_type);
+    pg_send_fatal(client, "08P01", message);
+    pg_server_flush(client);
+    return -1;
+}
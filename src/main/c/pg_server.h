@@ -10,10 +10,31 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "pg_event.h"
+#include "pg_buffer.h"
+#include "pg_arena.h"
+#include "pg_executor.h"
+#include "pg_stmt.h"
+#include "pg_cache.h"
+#include "pg_metrics.h"
+#include "pg_tls.h"
+#include "pg_auth.h"
+#include "pg_cancel.h"
+#include "pg_pool.h"
+#include "pg_capture.h"
+#include "pg_wheel.h"
+#include "pg_compress.h"
 
 /* Forward declarations */
 typedef struct PGServer PGServer;
 typedef struct PGClientConn PGClientConn;
+typedef struct PGWorker PGWorker;
+typedef struct PGCompletion PGCompletion;
+typedef struct PGClientSlab PGClientSlab;
+typedef struct PGAdoption PGAdoption;
 
 /* Server configuration */
 typedef struct {
@@ -26,20 +47,110 @@ typedef struct {
     const char *ssl_cert;    /* SSL certificate path */
     const char *ssl_key;     /* SSL key path */
     bool verbose;            /* Enable verbose logging */
+    PGEventBackend event_backend; /* Event loop backend (epoll, kqueue, select) */
+    int worker_threads;      /* Number of event loop threads (0 or 1: run on the calling thread) */
+    int executor_threads;    /* Threads running async callbacks (0: one per CPU) */
+    size_t query_cache_size; /* Bytes for the shared reply cache (0: no cache) */
+    int metrics_port;        /* Port of the Prometheus metrics endpoint (0: none) */
+    const char *auth_file;   /* Credential file for SCRAM-SHA-256 (NULL: data_dir/pg_passwd if it exists, else trust) */
+    const char *upstream_host; /* Server the pooler forwards to (NULL: answer queries here) */
+    int upstream_port;       /* Port of the upstream server */
+    const char *upstream_user; /* User the pooler logs in as */
+    const char *upstream_password; /* Its password (NULL: none) */
+    const char *upstream_database; /* Database on the upstream server (NULL: same as the user) */
+    int pool_size;           /* Upstream connections, split across the workers */
+    PGPoolMode pool_mode;    /* When a client gives its upstream connection back */
+    const char *capture_file; /* File client traffic is recorded to (NULL: none) */
+    int idle_session_timeout; /* Milliseconds a session may sit idle outside a transaction (0: no limit) */
+    int idle_in_transaction_session_timeout; /* Same inside a transaction block (0: no limit) */
+    int hibernate_after;     /* Milliseconds at ReadyForQuery before an idle connection gives its buffers back (0: never) */
+    int authentication_timeout; /* Milliseconds to complete TLS, startup and authentication (0: no limit) */
+    int statement_timeout;   /* Milliseconds a statement may run before it is cancelled (0: no limit) */
+    int client_connection_check_interval; /* Milliseconds between checks that the client of a running statement is still there (0: never) */
+    int tcp_keepalives_idle; /* Seconds of silence before TCP keepalives are sent (0: system default) */
+    int tcp_keepalives_interval; /* Seconds between unanswered keepalives (0: system default) */
+    int tcp_keepalives_count; /* Unanswered keepalives before the connection is dropped (0: system default) */
+    int compression_threshold; /* Smallest run of DataRow or CopyData bytes sent compressed to clients that asked for _pq_.compression (0: never compress) */
+    const char *handoff_socket; /* Unix socket a restarted server takes the listeners and idle connections over through (NULL: no hot restart) */
+    int handoff_timeout;     /* Milliseconds a server handing off waits for busy connections to go idle before closing them */
 } PGServerConfig;
 
-/* Client connection state */
+/* Client connection state. The first part is what a connection keeps
+   while it sits idle at ReadyForQuery; the rest is per-request state whose
+   storage (I/O buffers, per-query arena, empty statement tables) is given
+   back when the connection hibernates and taken again as it wakes up. */
 struct PGClientConn {
+    /* Hot: touched on every event, kept while hibernating */
     int fd;                  /* Client socket file descriptor */
-    char *user;              /* Authenticated user */
-    char *database;          /* Connected database */
-    bool authenticated;      /* Whether client is authenticated */
+    int slot;                /* Index in the worker's clients table */
+    PGWorker *worker;        /* Event loop thread that owns the connection */
+    PGServer *server;        /* Reference to the server */
+    int watch_events;        /* Events the loop watches the socket for */
+    bool completion_io;      /* The loop receives and sends for the socket (io_uring) */
     char txn_status;         /* Transaction status (I, T, E) */
+    bool startup_done;       /* Whether the startup packet has been received */
+    bool authenticated;      /* Whether client is authenticated */
+    bool hibernating;        /* Idle, with its buffers given back to the pool */
+    uint8_t protocol_minor;  /* Protocol minor version agreed on at startup */
+    bool compression_requested; /* The startup packet had _pq_.compression */
     int32_t backend_pid;     /* Backend process ID */
     int32_t secret_key;      /* Secret key for cancel requests */
+    char *user;              /* Authenticated user (in arena) */
+    char *database;          /* Connected database (in arena) */
+    char *application_name;  /* From the startup packet, reported back in ParameterStatus (in arena; NULL once compacted) */
+    PGCompressAlgorithm compression; /* Algorithm agreed on for _pq_.compression (NONE: not requested or none in common) */
+    PGCompressor *compressor; /* Its stream, kept while hibernating since later messages refer back to earlier ones */
+    PGArena arena;           /* Startup parameters; released in one step on disconnect */
+    bool arena_compacted;    /* arena holds only user and database, in one small block */
+    PGTimer timer;           /* Authentication deadline, statement timeout and liveness checks, or hibernation and idle timeouts */
+    uint64_t idle_since;     /* When the last ReadyForQuery was sent, in pg_wheel_now milliseconds */
+    int idle_session_timeout; /* Milliseconds, from the config or the startup packet (0: no limit) */
+    int idle_in_transaction_session_timeout;
+    int statement_timeout;
+    int client_connection_check_interval;
     void *ssl;               /* SSL connection (if enabled) */
     void *user_data;         /* User-defined data */
-    PGServer *server;        /* Reference to the server */
+    PGStmtCache stmts;       /* Prepared statements and portals */
+    PGClientConn *next_free; /* Link in the worker's pool while unused */
+
+    /* Cold: state of the request being answered */
+    PGBuffer in;             /* Received bytes not yet framed into messages */
+    PGBuffer out;            /* Reply bytes not yet written to the socket */
+    size_t out_wire;         /* Bytes at the head of out already in wire form; the rest may still be compressed */
+    PGArena query_arena;     /* Callback memory (pg_client_alloc); released at ReadyForQuery */
+    PGScram *scram;          /* SCRAM exchange in progress (in arena), or NULL */
+    bool ssl_handshake;      /* TLS handshake in progress; the loop drives it */
+    bool ssl_direct;         /* TLS began without an SSLRequest (direct negotiation) */
+    bool ssl_kernel_send;    /* The kernel encrypts writes (kTLS), so the socket is written directly */
+    uint64_t ssl_start;      /* When the handshake began, for the latency metrics */
+    bool in_batch;           /* Dispatching input; the flush happens at the end of the batch */
+    bool write_blocked;      /* Socket full; input is paused until out drains */
+    bool handoff_paused;     /* Receiving stopped so the connection can be passed on */
+    size_t msg_start;        /* Offset of the message being built from out's read position */
+    bool msg_failed;         /* A put into the message being built failed */
+    uint64_t bytes_sent;     /* Bytes that left out so far: written to the socket, or replaced by CompressedData */
+    uint64_t request_time;   /* When input began waiting for a reply (0: none), for time to first byte */
+    uint64_t statement_start; /* When the running statement's first message arrived (0: none), in pg_wheel_now milliseconds */
+    bool statement_timed_out; /* statement_timeout already cancelled it */
+    bool cache_response;     /* The query callback allowed its reply to be cached */
+    PGStream *stream;        /* Result rows being streamed, or NULL */
+    const char *execute_portal; /* Portal of the Execute being dispatched, or NULL */
+    int execute_max_rows;    /* Row limit of the Execute being dispatched */
+    bool copy_in;            /* In copy-in mode: CopyData goes to the copy callbacks */
+    bool copy_discard;       /* Copy-in ended in an error; CopyData, CopyDone and CopyFail are dropped */
+    bool copy_simple;        /* The COPY came from a simple Query; ReadyForQuery follows it */
+    bool extended;           /* Extended-protocol messages came since the last Query or Sync */
+    bool skip_to_sync;       /* One of them failed; input is discarded up to Sync */
+    size_t copy_remaining;   /* Bytes of the current CopyData (or skipped message) not yet received */
+    int64_t copy_rows;       /* Rows counted by the copy callbacks */
+    PGCompletion *job;       /* Async callback in flight; input is paused until it completes */
+    bool closing;            /* Removed while a job was in flight; freed when it completes */
+    PGBackend *backend;      /* Upstream connection held in pooler mode, or NULL */
+    bool backend_wait;       /* Input is paused until an upstream connection is free or drains */
+    bool backend_skip;       /* The pooler reported an error; messages are dropped until Sync */
+    PGClientConn *next_waiting; /* Links in the pool's queue of waiting clients */
+    PGClientConn *prev_waiting;
+    uint64_t capture_id;     /* Connection id in the capture file (0: not recorded) */
 };
 
 /* Message callback function types */
@@ -56,6 +167,26 @@ typedef int (*PGCancelCallback)(PGClientConn *client, int32_t pid, int32_t key);
 typedef int (*PGSSLRequestCallback)(PGClientConn *client);
 typedef int (*PGUnknownCallback)(PGClientConn *client, char type, const char *buffer, int length);
 
+/* COPY callback types. copy_in_start and copy_out_start are called by the
+   default query handler for COPY ... FROM STDIN and COPY ... TO STDOUT;
+   copy_data receives the CopyData payloads in place, in chunks that need
+   not match message or row boundaries */
+typedef int (*PGCopyStartCallback)(PGClientConn *client, const char *query);
+typedef int (*PGCopyDataCallback)(PGClientConn *client, const char *data, int length);
+typedef int (*PGCopyDoneCallback)(PGClientConn *client);
+typedef int (*PGCopyFailCallback)(PGClientConn *client, const char *message);
+
+/* Row producer for streamed results: sends at most max_rows DataRow
+   messages (CopyData rows for COPY OUT) and returns how many it sent, 0
+   once exhausted, or -1 on error */
+typedef int (*PGRowProducer)(PGClientConn *client, void *state, int max_rows);
+typedef void (*PGRowProducerClose)(void *state);
+
+/* Async callback function types; these run on an executor thread and must
+   reply through the completion instead of writing to client->fd */
+typedef int (*PGAsyncQueryCallback)(PGClientConn *client, const char *query, PGCompletion *completion);
+typedef int (*PGAsyncExecuteCallback)(PGClientConn *client, const char *portal, int max_rows, PGCompletion *completion);
+
 /* Callback structure */
 typedef struct {
     PGStartupCallback startup;
@@ -70,17 +201,74 @@ typedef struct {
     PGCancelCallback cancel;
     PGSSLRequestCallback ssl_request;
     PGUnknownCallback unknown;
+    PGCopyStartCallback copy_in_start;
+    PGCopyDataCallback copy_data;
+    PGCopyDoneCallback copy_done;         /* Sends the CommandComplete */
+    PGCopyFailCallback copy_fail;         /* The server sends the ErrorResponse */
+    PGCopyStartCallback copy_out_start;
+    PGAsyncQueryCallback async_query;     /* Replaces query when set */
+    PGAsyncExecuteCallback async_execute; /* Replaces execute when set */
 } PGCallbacks;
 
+/* Event loop thread; each one owns its own slice of the clients */
+struct PGWorker {
+    int id;                  /* Worker index */
+    PGServer *server;        /* Reference to the server */
+    PGEventLoop *loop;       /* Event loop watching this worker's sockets */
+    int listen_fd;           /* Own SO_REUSEPORT listener, or the shared one */
+    int wake_fds[2];         /* Self-pipe used to interrupt the loop */
+    PGClientConn **clients;  /* Client connections owned by this worker */
+    int num_clients;         /* Number of clients owned by this worker */
+    int *free_slots;         /* Unused indexes of clients, a stack */
+    int num_free_slots;      /* Number of unused indexes */
+    PGClientConn *free_clients; /* Pooled connection objects, most recently used first */
+    int num_free_clients;    /* Number of pooled objects */
+    PGClientSlab *slabs;     /* Blocks the connection objects are allocated in */
+    pthread_t thread;        /* Thread running the loop (unused for worker 0) */
+    _Atomic(PGCompletion *) completions; /* Finished async jobs posted by executor threads */
+    PGMetricsShard *metrics; /* Counters written only by this worker */
+    PGPool *pool;            /* Upstream connections in pooler mode (NULL otherwise) */
+    PGCaptureWriter *capture; /* This worker's share of the capture file (NULL when not capturing) */
+    PGWheel timers;          /* Timers of this worker's clients; the loop sleeps until the next one */
+    PGTimer accept_timer;    /* Watches the listener again after accepting ran out of descriptors */
+    PGBufferPool buffers;    /* I/O buffer storage shared by this worker's clients */
+    _Atomic(PGAdoption *) adoptions; /* Connections taken over from the previous process, posted by worker 0 */
+    bool *reserved;          /* Slots kept for connections the previous process may still pass on (NULL: none) */
+    int num_reserved;        /* Number of them */
+    unsigned handoff_generation; /* Handoff this worker has acted on */
+    int handoff_step;        /* What it has done for it */
+};
+
 /* Server context */
 struct PGServer {
     PGServerConfig config;   /* Server configuration */
     int server_fd;           /* Server socket file descriptor */
-    PGClientConn **clients;  /* Array of client connections */
-    int num_clients;         /* Number of active clients */
-    bool running;            /* Whether server is running */
+    PGWorker *workers;       /* Event loop threads */
+    int num_workers;         /* Number of event loop threads */
+    atomic_int num_clients;  /* Number of active clients across all workers */
+    atomic_int active_workers; /* Number of workers inside their loop */
+    atomic_bool running;     /* Whether server is running */
     void *user_data;         /* User-defined data */
     PGCallbacks callbacks;   /* Message callbacks */
+    PGExecutor *executor;    /* Runs async callbacks and credential reloads (NULL when neither is needed) */
+    PGCache *cache;          /* Replies shared by all connections (NULL when disabled) */
+    PGMetrics *metrics;      /* Counters and latencies, one shard per worker */
+    PGMetricsServer *metrics_server; /* Prometheus endpoint (NULL when disabled) */
+    PGTls *tls;              /* Context shared by TLS connections (NULL when SSL is disabled) */
+    PGAuth *auth;            /* Credentials for SCRAM-SHA-256 (NULL: trust) */
+    PGCancelRegistry *cancels; /* Backend keys of all connections, for CancelRequest */
+    PGCapture *capture;      /* Traffic capture file (NULL when not capturing) */
+    int handoff_fd;          /* Unix socket a new process connects to in order to take over (-1: none) */
+    int handoff_peer;        /* Process taking over from this one, or being taken over from (-1: none) */
+    atomic_int handoff_state; /* Progress of handing off to a new process */
+    unsigned handoff_generation; /* Handoffs begun so far */
+    int handoff_pending;     /* Workers yet to finish the current step */
+    uint64_t handoff_deadline; /* When connections still busy are closed, in pg_wheel_now milliseconds */
+    pthread_mutex_t handoff_lock; /* Orders the workers' records and guards the fields above */
+    bool handoff_same_layout; /* The previous process had the same workers and slots, so backend keys carry over */
+    int handoff_next_worker; /* Worker the next taken-over connection goes to, without the same layout */
+    int handoff_adopted;     /* Connections taken over so far */
+    char *handoff_record;    /* Receive buffer while taking over */
 };
 
 /* Function declarations */
@@ -91,7 +279,7 @@ int pg_server_stop(PGServer *server);
 void pg_server_destroy(PGServer *server);
 
 int pg_server_handle_client(PGServer *server, PGClientConn *client);
-int pg_server_add_client(PGServer *server, int client_fd);
+int pg_server_add_client(PGWorker *worker, int client_fd);
 int pg_server_remove_client(PGServer *server, PGClientConn *client);
 
 /* Set callback functions */
@@ -108,6 +296,21 @@ void pg_server_set_parse_callback(PGServer *server, PGParseCallback callback);
 void pg_server_set_cancel_callback(PGServer *server, PGCancelCallback callback);
 void pg_server_set_ssl_request_callback(PGServer *server, PGSSLRequestCallback callback);
 void pg_server_set_unknown_callback(PGServer *server, PGUnknownCallback callback);
+void pg_server_set_copy_in_start_callback(PGServer *server, PGCopyStartCallback callback);
+void pg_server_set_copy_data_callback(PGServer *server, PGCopyDataCallback callback);
+void pg_server_set_copy_done_callback(PGServer *server, PGCopyDoneCallback callback);
+void pg_server_set_copy_fail_callback(PGServer *server, PGCopyFailCallback callback);
+void pg_server_set_copy_out_start_callback(PGServer *server, PGCopyStartCallback callback);
+void pg_server_set_async_query_callback(PGServer *server, PGAsyncQueryCallback callback);
+void pg_server_set_async_execute_callback(PGServer *server, PGAsyncExecuteCallback callback);
+
+/* Async completion */
+int pg_completion_send(PGCompletion *completion, char msg_type, const char *data, int length);
+void pg_completion_finish(PGCompletion *completion, int result);
+bool pg_completion_cancelled(PGCompletion *completion);
+
+/* Cancellation */
+int pg_server_cancel_backend(PGServer *server, int32_t pid, int32_t key);
 
 /* Default callback implementations */
 int pg_default_startup_callback(PGClientConn *client, const char *buffer, int length);
@@ -122,6 +325,45 @@ int pg_default_parse_callback(PGClientConn *client, const char *stmt_name, const
 int pg_default_cancel_callback(PGClientConn *client, int32_t pid, int32_t key);
 int pg_default_ssl_request_callback(PGClientConn *client);
 int pg_default_unknown_callback(PGClientConn *client, char type, const char *buffer, int length);
+int pg_default_copy_in_start_callback(PGClientConn *client, const char *query);
+int pg_default_copy_data_callback(PGClientConn *client, const char *data, int length);
+int pg_default_copy_done_callback(PGClientConn *client);
+int pg_default_copy_fail_callback(PGClientConn *client, const char *message);
+int pg_default_copy_out_start_callback(PGClientConn *client, const char *query);
+
+/* Streamed results */
+int pg_server_stream_rows(PGClientConn *client, const char *tag,
+                          PGRowProducer produce, PGRowProducerClose close, void *state);
+
+/* COPY */
+int pg_server_copy_in(PGClientConn *client, int16_t format, int num_columns, const int16_t *formats);
+int pg_server_copy_out(PGClientConn *client, int16_t format, int num_columns, const int16_t *formats);
+int pg_server_copy_data(PGClientConn *client, const char *data, int length);
+int pg_server_copy_out_done(PGClientConn *client, int64_t rows);
+int pg_server_stream_copy(PGClientConn *client, PGRowProducer produce, PGRowProducerClose close, void *state);
+int pg_server_copy_out_fd(PGClientConn *client, int fd, int64_t rows);
+int pg_server_copy_error(PGClientConn *client, const char *code, const char *message);
+
+/* TLS */
+int pg_server_accept_ssl(PGClientConn *client);
+
+/* Per-query memory */
+void *pg_client_alloc(PGClientConn *client, size_t size);
+char *pg_client_strdup(PGClientConn *client, const char *s);
+char *pg_client_printf(PGClientConn *client, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Output buffering */
+int pg_server_send(PGClientConn *client, const void *data, size_t length);
+int pg_server_sendv(PGClientConn *client, const struct iovec *iov, int iovcnt);
+int pg_server_flush(PGClientConn *client);
+int pg_server_end_message(PGClientConn *client, char msg_type);
+int pg_server_resume_input(PGClientConn *client);
+void pg_server_note_ready(PGClientConn *client);
+
+/* Shared reply cache */
+void pg_server_cache_response(PGClientConn *client);
+void pg_server_invalidate_cache(PGServer *server, const char *query);
 
 /* Helper functions */
 int pg_server_send_startup_messages(PGClientConn *client);
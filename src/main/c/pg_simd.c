@@ -0,0 +1,230 @@
+/**
+ * pg_simd.c
+ * Vectorized Byte Kernels
+ *
+ * This file contains the implementation of the kernels declared in
+ * pg_simd.h. On x86-64, SSE2 is part of the baseline and AVX2 and SSSE3
+ * are compiled with target attributes, so the binary runs on any x86-64
+ * and uses them only where the CPU reports them. NEON is part of the
+ * AArch64 baseline. Kernels never read past the bytes they are given, so
+ * they are safe at the end of a buffer.
+ */
+
+#include "pg_simd.h"
+#include <stdatomic.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PG_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define PG_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef size_t (*PGFindNulFn)(const char *p, size_t length);
+typedef void (*PGHexEncodeFn)(const uint8_t *data, size_t length, char *hex);
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Portable kernels; the vector ones finish their tails with these */
+
+static size_t pg_find_nul_scalar(const char *p, size_t length) {
+    size_t i = 0;
+    while (i < length && p[i] != '\0') {
+        i++;
+    }
+    return i;
+}
+
+static void pg_hex_encode_scalar(const uint8_t *data, size_t length, char *hex) {
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = hex_digits[data[i] >> 4];
+        hex[2 * i + 1] = hex_digits[data[i] & 15];
+    }
+}
+
+#ifdef PG_SIMD_X86
+
+static size_t pg_find_nul_sse2(const char *p, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + pg_find_nul_scalar(p + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t pg_find_nul_avx2(const char *p, size_t length) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + pg_find_nul_sse2(p + i, length - i);
+}
+
+// Each byte's nibbles index a 16-entry table of digits; interleaving the
+// high and low digits gives the text in order
+__attribute__((target("ssse3")))
+static void pg_hex_encode_ssse3(const uint8_t *data, size_t length, char *hex) {
+    const __m128i digits = _mm_loadu_si128((const __m128i *)hex_digits);
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, low_nibble));
+        _mm_storeu_si128((__m128i *)(hex + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(hex + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    pg_hex_encode_scalar(data + i, length - i, hex + 2 * i);
+}
+
+__attribute__((target("avx2")))
+static void pg_hex_encode_avx2(const uint8_t *data, size_t length, char *hex) {
+    const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hex_digits));
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibble));
+        __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, low_nibble));
+        // Unpacking works within 128-bit lanes; put the halves back in order
+        __m256i first = _mm256_unpacklo_epi8(hi, lo);
+        __m256i second = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i *)(hex + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *)(hex + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    pg_hex_encode_ssse3(data + i, length - i, hex + 2 * i);
+}
+
+#endif /* PG_SIMD_X86 */
+
+#ifdef PG_SIMD_NEON
+
+static size_t pg_find_nul_neon(const char *p, size_t length) {
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t eq = vceqzq_u8(vld1q_u8((const uint8_t *)(p + i)));
+        // Narrow each byte's match to 4 bits of a 64-bit mask
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask) {
+            return i + (size_t)(__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return i + pg_find_nul_scalar(p + i, length - i);
+}
+
+static void pg_hex_encode_neon(const uint8_t *data, size_t length, char *hex) {
+    const uint8x16_t digits = vld1q_u8((const uint8_t *)hex_digits);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16x2_t out;
+        out.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+        out.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+        vst2q_u8((uint8_t *)(hex + 2 * i), out);
+    }
+    pg_hex_encode_scalar(data + i, length - i, hex + 2 * i);
+}
+
+#endif /* PG_SIMD_NEON */
+
+/* Dispatch: the entries start at resolvers that install the best kernels */
+
+static size_t pg_find_nul_resolve(const char *p, size_t length);
+static void pg_hex_encode_resolve(const uint8_t *data, size_t length, char *hex);
+
+static _Atomic(PGFindNulFn) find_nul_impl = pg_find_nul_resolve;
+static _Atomic(PGHexEncodeFn) hex_encode_impl = pg_hex_encode_resolve;
+static _Atomic(const char *) simd_level = "scalar";
+
+// Racing first calls all store the same kernels, so no lock is needed
+static void pg_simd_select(void) {
+    PGFindNulFn find_nul = pg_find_nul_scalar;
+    PGHexEncodeFn hex_encode = pg_hex_encode_scalar;
+    const char *level = "scalar";
+
+#if defined(PG_SIMD_X86)
+    __builtin_cpu_init();
+    find_nul = pg_find_nul_sse2;
+    level = "sse2";
+    if (__builtin_cpu_supports("ssse3")) {
+        hex_encode = pg_hex_encode_ssse3;
+        level = "ssse3";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        find_nul = pg_find_nul_avx2;
+        hex_encode = pg_hex_encode_avx2;
+        level = "avx2";
+    }
+#elif defined(PG_SIMD_NEON)
+    find_nul = pg_find_nul_neon;
+    hex_encode = pg_hex_encode_neon;
+    level = "neon";
+#endif
+
+    atomic_store_explicit(&simd_level, level, memory_order_relaxed);
+    atomic_store_explicit(&find_nul_impl, find_nul, memory_order_release);
+    atomic_store_explicit(&hex_encode_impl, hex_encode, memory_order_relaxed);
+}
+
+static size_t pg_find_nul_resolve(const char *p, size_t length) {
+    pg_simd_select();
+    return pg_simd_find_nul(p, length);
+}
+
+static void pg_hex_encode_resolve(const uint8_t *data, size_t length, char *hex) {
+    pg_simd_select();
+    pg_simd_hex_encode(data, length, hex);
+}
+
+/**
+ * Find the NUL ending a C string inside a message, like strnlen
+ *
+ * @param p Start of the string
+ * @param length Bytes that may be examined
+ * @return Offset of the first NUL, or length if there is none
+ */
+size_t pg_simd_find_nul(const char *p, size_t length) {
+    return atomic_load_explicit(&find_nul_impl, memory_order_relaxed)(p, length);
+}
+
+/**
+ * Encode bytes as lower-case hex digits, two per byte, without a
+ * terminating NUL
+ *
+ * @param data Bytes
+ * @param length Number of bytes
+ * @param hex Output (2 * length bytes)
+ */
+void pg_simd_hex_encode(const uint8_t *data, size_t length, char *hex) {
+    atomic_load_explicit(&hex_encode_impl, memory_order_relaxed)(data, length, hex);
+}
+
+/**
+ * Name of the widest instruction set the kernels use on this CPU
+ *
+ * @return "avx2", "ssse3", "sse2", "neon" or "scalar"
+ */
+const char *pg_simd_level(void) {
+    if (atomic_load_explicit(&find_nul_impl, memory_order_acquire) == pg_find_nul_resolve) {
+        pg_simd_select();
+    }
+    return atomic_load_explicit(&simd_level, memory_order_relaxed);
+}
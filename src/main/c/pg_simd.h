@@ -0,0 +1,23 @@
+/**
+ * pg_simd.h
+ * Vectorized Byte Kernels
+ *
+ * This file contains declarations for the byte-scanning and encoding
+ * kernels on the per-message path: finding the NUL that ends a C string
+ * in a message, and hex encoding (bytea and uuid text output). Each has
+ * SSE2/SSSE3, AVX2 and NEON versions next to a portable one; the best the
+ * CPU supports is picked on first use.
+ */
+
+#ifndef PG_SIMD_H
+#define PG_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Function declarations */
+size_t pg_simd_find_nul(const char *p, size_t length);
+void pg_simd_hex_encode(const uint8_t *data, size_t length, char *hex);
+const char *pg_simd_level(void);
+
+#endif /* PG_SIMD_H */
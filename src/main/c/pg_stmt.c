@@ -0,0 +1,652 @@
+/**
+ * pg_stmt.c
+ * Prepared Statement and Portal Cache
+ *
+ * This file contains the implementation of the statement and portal store
+ * declared in pg_stmt.h, including the parsing of Parse and Bind messages.
+ */
+
+#include "pg_stmt.h"
+#include "pg_types.h"
+#include "pg_simd.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define INITIAL_BUCKETS 16
+
+/* Hash map entry; the key is the name owned by the value */
+struct PGNameEntry {
+    const char *name;
+    uint32_t hash;
+    void *value;
+    PGNameEntry *next;
+};
+
+/* Bounds-checked reader over a message payload */
+typedef struct {
+    const char *p;
+    const char *end;
+} PGReader;
+
+// Read the format code at an index of a network-order int16 array
+static int16_t pg_format_code(const char *formats, int index) {
+    uint16_t code;
+    memcpy(&code, formats + index * 2, 2);
+    return (int16_t)ntohs(code);
+}
+
+/**
+ * FNV-1a hash of a name
+ *
+ * @param name Name
+ * @return Hash value
+ */
+static uint32_t pg_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the link that points to the entry for a name
+ *
+ * @param map Hash map
+ * @param name Name
+ * @param hash Hash of the name
+ * @return Link to the entry, or to the end of its chain if absent
+ */
+static PGNameEntry **pg_name_map_link(PGNameMap *map, const char *name, uint32_t hash) {
+    PGNameEntry **link = &map->buckets[hash & (map->num_buckets - 1)];
+
+    while (*link && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * Look up a name
+ *
+ * @param map Hash map
+ * @param name Name
+ * @return Value, or NULL if absent
+ */
+static void *pg_name_map_get(PGNameMap *map, const char *name) {
+    if (map->count == 0) {
+        return NULL;
+    }
+
+    PGNameEntry *entry = *pg_name_map_link(map, name, pg_name_hash(name));
+    return entry ? entry->value : NULL;
+}
+
+/**
+ * Add a value under a name that is not in the map yet
+ *
+ * @param map Hash map
+ * @param name Name (must stay valid while the entry exists)
+ * @param value Value
+ * @return 0 on success, -1 on allocation failure
+ */
+static int pg_name_map_put(PGNameMap *map, const char *name, void *value) {
+    // Grow at a load factor of 1 so chains stay short
+    if (map->count >= map->num_buckets) {
+        size_t num_buckets = map->num_buckets ? map->num_buckets * 2 : INITIAL_BUCKETS;
+        PGNameEntry **buckets = (PGNameEntry **)calloc(num_buckets, sizeof(PGNameEntry *));
+        if (!buckets) {
+            return -1;
+        }
+        for (size_t i = 0; i < map->num_buckets; i++) {
+            PGNameEntry *entry = map->buckets[i];
+            while (entry) {
+                PGNameEntry *next = entry->next;
+                PGNameEntry **bucket = &buckets[entry->hash & (num_buckets - 1)];
+                entry->next = *bucket;
+                *bucket = entry;
+                entry = next;
+            }
+        }
+        free(map->buckets);
+        map->buckets = buckets;
+        map->num_buckets = num_buckets;
+    }
+
+    PGNameEntry *entry = (PGNameEntry *)malloc(sizeof(PGNameEntry));
+    if (!entry) {
+        return -1;
+    }
+
+    entry->name = name;
+    entry->hash = pg_name_hash(name);
+    entry->value = value;
+    PGNameEntry **bucket = &map->buckets[entry->hash & (map->num_buckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    map->count++;
+    return 0;
+}
+
+/**
+ * Remove a name from the map
+ *
+ * @param map Hash map
+ * @param name Name
+ * @return The value that was stored under the name, or NULL if absent
+ */
+static void *pg_name_map_take(PGNameMap *map, const char *name) {
+    if (map->count == 0) {
+        return NULL;
+    }
+
+    PGNameEntry **link = pg_name_map_link(map, name, pg_name_hash(name));
+    PGNameEntry *entry = *link;
+    if (!entry) {
+        return NULL;
+    }
+
+    void *value = entry->value;
+    *link = entry->next;
+    free(entry);
+    map->count--;
+    return value;
+}
+
+static const char *pg_reader_cstring(PGReader *reader) {
+    const char *s = reader->p;
+    size_t room = reader->p < reader->end ? (size_t)(reader->end - reader->p) : 0;
+    size_t length = pg_simd_find_nul(s, room);
+
+    if (length == room) {
+        return NULL;
+    }
+    reader->p = s + length + 1;
+    return s;
+}
+
+static bool pg_reader_int16(PGReader *reader, int *value) {
+    uint16_t n;
+
+    if (reader->end - reader->p < 2) {
+        return false;
+    }
+    memcpy(&n, reader->p, 2);
+    reader->p += 2;
+    *value = (int16_t)ntohs(n);
+    return true;
+}
+
+static bool pg_reader_int32(PGReader *reader, int32_t *value) {
+    uint32_t n;
+
+    if (reader->end - reader->p < 4) {
+        return false;
+    }
+    memcpy(&n, reader->p, 4);
+    reader->p += 4;
+    *value = (int32_t)ntohl(n);
+    return true;
+}
+
+static void pg_statement_free(PGStatement *statement) {
+    free(statement->name);
+    free(statement->query);
+    free(statement->param_types);
+    free(statement->row_description);
+    free(statement);
+}
+
+static void pg_portal_free(PGPortal *portal) {
+    if (portal->stream) {
+        pg_server_free_stream(portal->stream);
+    }
+    free(portal->name);
+    free(portal->bind_data);
+    free(portal->param_values);
+    free(portal->param_lengths);
+    free(portal);
+}
+
+/**
+ * Initialize an empty cache
+ *
+ * @param cache Cache
+ */
+void pg_stmt_cache_init(PGStmtCache *cache) {
+    memset(cache, 0, sizeof(PGStmtCache));
+}
+
+/**
+ * Release all statements and portals of a cache
+ *
+ * @param cache Cache
+ */
+void pg_stmt_cache_free(PGStmtCache *cache) {
+    pg_portal_close_all(cache);
+    free(cache->portals.buckets);
+
+    for (size_t i = 0; i < cache->statements.num_buckets; i++) {
+        PGNameEntry *entry = cache->statements.buckets[i];
+        while (entry) {
+            PGNameEntry *next = entry->next;
+            pg_statement_free((PGStatement *)entry->value);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(cache->statements.buckets);
+
+    pg_stmt_cache_init(cache);
+}
+
+/**
+ * Release the hash tables of an empty statement or portal map
+ *
+ * Used when a connection goes idle; the tables are allocated again by the
+ * next Parse or Bind.
+ *
+ * @param cache Cache
+ */
+void pg_stmt_cache_compact(PGStmtCache *cache) {
+    if (cache->portals.count == 0) {
+        free(cache->portals.buckets);
+        memset(&cache->portals, 0, sizeof(cache->portals));
+    }
+    if (cache->statements.count == 0) {
+        free(cache->statements.buckets);
+        memset(&cache->statements, 0, sizeof(cache->statements));
+    }
+}
+
+/**
+ * Create a prepared statement from a Parse message
+ *
+ * A new unnamed statement replaces the previous one; a named statement
+ * must be closed before its name can be reused.
+ *
+ * @param cache Cache
+ * @param data Parse message payload
+ * @param length Length of the payload
+ * @param statement Set to the new statement on success
+ * @return PG_STMT_OK or an error code
+ */
+int pg_stmt_parse(PGStmtCache *cache, const char *data, int length, PGStatement **statement) {
+    PGReader reader = {data, data + length};
+    const char *name = pg_reader_cstring(&reader);
+    const char *query = pg_reader_cstring(&reader);
+    int num_params;
+
+    if (!name || !query || !pg_reader_int16(&reader, &num_params) || num_params < 0 ||
+        reader.end - reader.p < (ptrdiff_t)num_params * 4) {
+        return PG_STMT_MALFORMED;
+    }
+
+    if (pg_name_map_get(&cache->statements, name)) {
+        if (name[0]) {
+            return PG_STMT_DUPLICATE;
+        }
+        pg_stmt_close(cache, name);
+    }
+
+    PGStatement *stmt = (PGStatement *)calloc(1, sizeof(PGStatement));
+    if (!stmt) {
+        return PG_STMT_NO_MEMORY;
+    }
+    stmt->name = strdup(name);
+    stmt->query = strdup(query);
+    stmt->num_params = num_params;
+    stmt->param_types = (uint32_t *)malloc((num_params ? num_params : 1) * sizeof(uint32_t));
+    if (!stmt->name || !stmt->query || !stmt->param_types) {
+        pg_statement_free(stmt);
+        return PG_STMT_NO_MEMORY;
+    }
+
+    for (int i = 0; i < num_params; i++) {
+        int32_t oid = 0;
+        pg_reader_int32(&reader, &oid);
+        stmt->param_types[i] = (uint32_t)oid;
+    }
+
+    if (pg_name_map_put(&cache->statements, stmt->name, stmt) < 0) {
+        pg_statement_free(stmt);
+        return PG_STMT_NO_MEMORY;
+    }
+
+    *statement = stmt;
+    return PG_STMT_OK;
+}
+
+/**
+ * Look up a prepared statement
+ *
+ * @param cache Cache
+ * @param name Statement name
+ * @return Statement, or NULL if it does not exist
+ */
+PGStatement *pg_stmt_lookup(PGStmtCache *cache, const char *name) {
+    return (PGStatement *)pg_name_map_get(&cache->statements, name);
+}
+
+/**
+ * Call a function for every prepared statement, in no particular order
+ *
+ * The function must not create or close statements.
+ *
+ * @param cache Cache
+ * @param visit Called with each statement; a negative result stops the walk
+ * @param arg Passed to visit
+ * @return 0, or the negative result that stopped the walk
+ */
+int pg_stmt_each(PGStmtCache *cache, int (*visit)(PGStatement *statement, void *arg), void *arg) {
+    for (size_t i = 0; i < cache->statements.num_buckets; i++) {
+        for (PGNameEntry *entry = cache->statements.buckets[i]; entry; entry = entry->next) {
+            int result = visit((PGStatement *)entry->value, arg);
+            if (result < 0) {
+                return result;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Close a prepared statement and every portal bound from it
+ *
+ * Closing a statement that does not exist is not an error.
+ *
+ * @param cache Cache
+ * @param name Statement name
+ */
+void pg_stmt_close(PGStmtCache *cache, const char *name) {
+    PGStatement *stmt = (PGStatement *)pg_name_map_take(&cache->statements, name);
+    if (!stmt) {
+        return;
+    }
+
+    for (size_t i = 0; i < cache->portals.num_buckets; i++) {
+        PGNameEntry **link = &cache->portals.buckets[i];
+        while (*link) {
+            PGNameEntry *entry = *link;
+            PGPortal *portal = (PGPortal *)entry->value;
+            if (portal->statement == stmt) {
+                *link = entry->next;
+                free(entry);
+                cache->portals.count--;
+                pg_portal_free(portal);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+
+    pg_statement_free(stmt);
+}
+
+/**
+ * Cache the result shape of a statement
+ *
+ * @param statement Statement
+ * @param data RowDescription payload, or NULL if the statement returns no rows
+ * @param length Length of the payload
+ * @return 0 on success, -1 on allocation failure
+ */
+int pg_stmt_set_row_description(PGStatement *statement, const char *data, int length) {
+    char *copy = NULL;
+
+    if (data) {
+        copy = (char *)malloc(length > 0 ? length : 1);
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy, data, length);
+    }
+
+    free(statement->row_description);
+    statement->row_description = copy;
+    statement->row_description_len = data ? length : 0;
+    statement->described = true;
+    return 0;
+}
+
+/**
+ * Create a portal from a Bind message
+ *
+ * A new unnamed portal replaces the previous one; a named portal must be
+ * closed before its name can be reused.
+ *
+ * @param cache Cache
+ * @param data Bind message payload
+ * @param length Length of the payload
+ * @param portal Set to the new portal on success
+ * @return PG_STMT_OK or an error code
+ */
+int pg_portal_bind(PGStmtCache *cache, const char *data, int length, PGPortal **portal) {
+    PGPortal *p = (PGPortal *)calloc(1, sizeof(PGPortal));
+    if (!p) {
+        return PG_STMT_NO_MEMORY;
+    }
+
+    // The parameter values point into a private copy of the message
+    p->bind_data = (char *)malloc(length > 0 ? length : 1);
+    if (!p->bind_data) {
+        pg_portal_free(p);
+        return PG_STMT_NO_MEMORY;
+    }
+    memcpy(p->bind_data, data, length);
+
+    PGReader reader = {p->bind_data, p->bind_data + length};
+    const char *name = pg_reader_cstring(&reader);
+    const char *stmt_name = pg_reader_cstring(&reader);
+    int n;
+
+    if (!name || !stmt_name || !pg_reader_int16(&reader, &n) || n < 0 ||
+        reader.end - reader.p < (ptrdiff_t)n * 2) {
+        pg_portal_free(p);
+        return PG_STMT_MALFORMED;
+    }
+    p->num_param_formats = n;
+    p->param_formats = reader.p;
+    reader.p += n * 2;
+
+    if (!pg_reader_int16(&reader, &n) || n < 0) {
+        pg_portal_free(p);
+        return PG_STMT_MALFORMED;
+    }
+    p->num_params = n;
+    p->param_values = (const char **)calloc(n ? n : 1, sizeof(const char *));
+    p->param_lengths = (int *)calloc(n ? n : 1, sizeof(int));
+    if (!p->param_values || !p->param_lengths) {
+        pg_portal_free(p);
+        return PG_STMT_NO_MEMORY;
+    }
+    for (int i = 0; i < n; i++) {
+        int32_t value_len;
+        if (!pg_reader_int32(&reader, &value_len) || value_len < -1 ||
+            reader.end - reader.p < (ptrdiff_t)(value_len > 0 ? value_len : 0)) {
+            pg_portal_free(p);
+            return PG_STMT_MALFORMED;
+        }
+        p->param_values[i] = value_len < 0 ? NULL : reader.p;
+        p->param_lengths[i] = value_len < 0 ? 0 : value_len;
+        reader.p += value_len > 0 ? value_len : 0;
+    }
+
+    if (!pg_reader_int16(&reader, &n) || n < 0 || reader.end - reader.p < (ptrdiff_t)n * 2) {
+        pg_portal_free(p);
+        return PG_STMT_MALFORMED;
+    }
+    p->num_result_formats = n;
+    p->result_formats = reader.p;
+
+    // One format code for all, or one per parameter; each text or binary
+    if (p->num_param_formats > 1 && p->num_param_formats != p->num_params) {
+        pg_portal_free(p);
+        return PG_STMT_INVALID;
+    }
+    for (int i = 0; i < p->num_param_formats + p->num_result_formats; i++) {
+        int16_t format = i < p->num_param_formats ? pg_portal_param_format(p, i)
+                                                 : pg_format_code(p->result_formats, i - p->num_param_formats);
+        if (format != PG_FORMAT_TEXT && format != PG_FORMAT_BINARY) {
+            pg_portal_free(p);
+            return PG_STMT_INVALID;
+        }
+    }
+
+    p->statement = pg_stmt_lookup(cache, stmt_name);
+    if (!p->statement) {
+        pg_portal_free(p);
+        return PG_STMT_NOT_FOUND;
+    }
+
+    if (pg_name_map_get(&cache->portals, name)) {
+        if (name[0]) {
+            pg_portal_free(p);
+            return PG_STMT_DUPLICATE;
+        }
+        pg_portal_close(cache, name);
+    }
+
+    p->name = strdup(name);
+    if (!p->name || pg_name_map_put(&cache->portals, p->name, p) < 0) {
+        pg_portal_free(p);
+        return PG_STMT_NO_MEMORY;
+    }
+
+    *portal = p;
+    return PG_STMT_OK;
+}
+
+/**
+ * Get the format of a parameter of a portal
+ *
+ * @param portal Portal
+ * @param index Parameter index
+ * @return PG_FORMAT_TEXT or PG_FORMAT_BINARY
+ */
+int16_t pg_portal_param_format(const PGPortal *portal, int index) {
+    if (portal->num_param_formats == 0) {
+        return PG_FORMAT_TEXT;
+    }
+    return pg_format_code(portal->param_formats, portal->num_param_formats == 1 ? 0 : index);
+}
+
+/**
+ * Get the format a result column of a portal is to be sent in
+ *
+ * @param portal Portal, or NULL for a simple Query (all text)
+ * @param column Column index
+ * @return PG_FORMAT_TEXT or PG_FORMAT_BINARY
+ */
+int16_t pg_portal_result_format(const PGPortal *portal, int column) {
+    if (!portal || portal->num_result_formats == 0) {
+        return PG_FORMAT_TEXT;
+    }
+    if (portal->num_result_formats == 1) {
+        return pg_format_code(portal->result_formats, 0);
+    }
+    // PostgreSQL rejects a count that does not match the columns; take text
+    return column < portal->num_result_formats ? pg_format_code(portal->result_formats, column)
+                                               : PG_FORMAT_TEXT;
+}
+
+/**
+ * Decode a parameter of a portal using its statement's parameter type
+ *
+ * @param portal Portal
+ * @param index Parameter index
+ * @param value Set to the decoded value
+ * @param buf Scratch buffer (see pg_value_decode)
+ * @param size Size of the scratch buffer
+ * @return 0 on success, -1 if the index is out of range or the value is invalid
+ */
+int pg_portal_param(const PGPortal *portal, int index, PGValue *value, char *buf, size_t size) {
+    const PGStatement *stmt = portal->statement;
+
+    if (index < 0 || index >= portal->num_params) {
+        return -1;
+    }
+    return pg_value_decode(index < stmt->num_params ? stmt->param_types[index] : 0,
+                           pg_portal_param_format(portal, index),
+                           portal->param_values[index], portal->param_lengths[index],
+                           value, buf, size);
+}
+
+/**
+ * Rewrite the format codes of a RowDescription payload for a portal
+ *
+ * @param data RowDescription payload
+ * @param length Length of the payload
+ * @param portal Portal, or NULL for all text (as for a statement)
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int pg_row_description_set_formats(char *data, int length, const PGPortal *portal) {
+    PGReader reader = {data, data + length};
+    int num_fields;
+
+    if (!pg_reader_int16(&reader, &num_fields)) {
+        return -1;
+    }
+    for (int i = 0; i < num_fields; i++) {
+        if (!pg_reader_cstring(&reader) || reader.end - reader.p < 18) {
+            return -1;
+        }
+        // Table OID, attribute number, type OID, type size and modifier precede the format
+        uint16_t format = htons((uint16_t)pg_portal_result_format(portal, i));
+        memcpy((char *)reader.p + 16, &format, 2);
+        reader.p += 18;
+    }
+    return 0;
+}
+
+/**
+ * Look up a portal
+ *
+ * @param cache Cache
+ * @param name Portal name
+ * @return Portal, or NULL if it does not exist
+ */
+PGPortal *pg_portal_lookup(PGStmtCache *cache, const char *name) {
+    return (PGPortal *)pg_name_map_get(&cache->portals, name);
+}
+
+/**
+ * Close a portal
+ *
+ * Closing a portal that does not exist is not an error.
+ *
+ * @param cache Cache
+ * @param name Portal name
+ */
+void pg_portal_close(PGStmtCache *cache, const char *name) {
+    PGPortal *portal = (PGPortal *)pg_name_map_take(&cache->portals, name);
+    if (portal) {
+        pg_portal_free(portal);
+    }
+}
+
+/**
+ * Close every portal, as happens at the end of a transaction
+ *
+ * @param cache Cache
+ */
+void pg_portal_close_all(PGStmtCache *cache) {
+    if (cache->portals.count == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < cache->portals.num_buckets; i++) {
+        PGNameEntry *entry = cache->portals.buckets[i];
+        while (entry) {
+            PGNameEntry *next = entry->next;
+            pg_portal_free((PGPortal *)entry->value);
+            free(entry);
+            entry = next;
+        }
+        cache->portals.buckets[i] = NULL;
+    }
+    cache->portals.count = 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * pg_stmt.h
+ * Prepared Statement and Portal Cache
+ *
+ * This file contains declarations for the per-connection store of prepared
+ * statements (created by Parse) and portals (created by Bind) used by the
+ * extended query protocol. Both are kept in hash maps keyed by name; the
+ * unnamed statement and portal use the empty name.
+ */
+
+#ifndef PG_STMT_H
+#define PG_STMT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct PGStream PGStream;
+typedef struct PGValue PGValue;
+
+/* Result codes */
+#define PG_STMT_OK          0
+#define PG_STMT_MALFORMED  -1    /* Message does not parse (protocol violation) */
+#define PG_STMT_NO_MEMORY  -2    /* Allocation failed */
+#define PG_STMT_NOT_FOUND  -3    /* Referenced statement does not exist */
+#define PG_STMT_DUPLICATE  -4    /* Named statement or portal already exists */
+#define PG_STMT_INVALID    -5    /* Bind format codes are not valid */
+
+/* Prepared statement */
+typedef struct {
+    char *name;              /* Statement name ("" for the unnamed statement) */
+    char *query;             /* Query text */
+    int num_params;          /* Number of parameter types given by Parse */
+    uint32_t *param_types;   /* Parameter type OIDs (0: unspecified) */
+    bool described;          /* Whether row_description holds the result shape */
+    char *row_description;   /* Cached RowDescription payload (NULL: NoData) */
+    int row_description_len; /* Length of row_description */
+    uint32_t upstream;       /* Id of the statement prepared upstream by the pooler (0: none) */
+} PGStatement;
+
+/* Portal: a statement bound to parameter values */
+typedef struct {
+    char *name;              /* Portal name ("" for the unnamed portal) */
+    PGStatement *statement;  /* Statement the portal was bound from */
+    char *bind_data;         /* Copy of the Bind message the fields point into */
+    int num_param_formats;   /* Number of parameter format codes */
+    const char *param_formats; /* Parameter format codes (int16, network order) */
+    int num_params;          /* Number of parameter values */
+    const char **param_values; /* Parameter values (NULL: SQL NULL) */
+    int *param_lengths;      /* Parameter value lengths */
+    int num_result_formats;  /* Number of result format codes */
+    const char *result_formats; /* Result format codes (int16, network order) */
+    PGStream *stream;        /* Rows left by an Execute that hit its row limit */
+} PGPortal;
+
+/* Hash map from name to statement or portal */
+typedef struct PGNameEntry PGNameEntry;
+typedef struct {
+    PGNameEntry **buckets;   /* Bucket chains (NULL until first insert) */
+    size_t num_buckets;      /* Number of buckets (power of two) */
+    size_t count;            /* Number of entries */
+} PGNameMap;
+
+/* Statements and portals of one connection */
+typedef struct {
+    PGNameMap statements;
+    PGNameMap portals;
+} PGStmtCache;
+
+/* Function declarations */
+void pg_stmt_cache_init(PGStmtCache *cache);
+void pg_stmt_cache_free(PGStmtCache *cache);
+void pg_stmt_cache_compact(PGStmtCache *cache);
+
+int pg_stmt_parse(PGStmtCache *cache, const char *data, int length, PGStatement **statement);
+PGStatement *pg_stmt_lookup(PGStmtCache *cache, const char *name);
+void pg_stmt_close(PGStmtCache *cache, const char *name);
+int pg_stmt_set_row_description(PGStatement *statement, const char *data, int length);
+int pg_stmt_each(PGStmtCache *cache, int (*visit)(PGStatement *statement, void *arg), void *arg);
+
+int pg_portal_bind(PGStmtCache *cache, const char *data, int length, PGPortal **portal);
+PGPortal *pg_portal_lookup(PGStmtCache *cache, const char *name);
+void pg_portal_close(PGStmtCache *cache, const char *name);
+void pg_portal_close_all(PGStmtCache *cache);
+int16_t pg_portal_param_format(const PGPortal *portal, int index);
+int16_t pg_portal_result_format(const PGPortal *portal, int column);
+int pg_portal_param(const PGPortal *portal, int index, PGValue *value, char *buf, size_t size);
+int pg_row_description_set_formats(char *data, int length, const PGPortal *portal);
+
+/* Release a stream parked on a portal (implemented in pg_server.c) */
+void pg_server_free_stream(PGStream *stream);
+
+#endif /* PG_STMT_H */
@@ -0,0 +1,345 @@
+/**
+ * pg_tls.c
+ * TLS Connections
+ *
+ * This file contains the implementation of the TLS layer declared in
+ * pg_tls.h. Sockets are non-blocking, so every call that would block
+ * reports it instead: the handshake returns what it waits for, and reads
+ * and writes fail with EAGAIN like their socket counterparts, letting the
+ * server keep its plain-socket code paths.
+ */
+
+#include "pg_tls.h"
+#include "pg_log.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_SESSION_CONTEXT "pgprotocol"
+#define TLS_SESSION_TIMEOUT 3600     // seconds a ticket or cached session stays valid
+#define TLS_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20:DHE+AESGCM:DHE+CHACHA20"  // kTLS can offload these
+
+/* ALPN protocol list: the only protocol offered, in wire format */
+static const unsigned char alpn_protocols[] = "\x0apostgresql";
+
+struct PGTls {
+    SSL_CTX *ctx;            /* Shared by all connections and threads */
+};
+
+/**
+ * Log the oldest queued OpenSSL error
+ *
+ * @param what What failed
+ */
+static void pg_tls_log_error(const char *what) {
+    char message[256];
+    ERR_error_string_n(ERR_get_error(), message, sizeof(message));
+    pg_log_error("%s: %s", what, message);
+    ERR_clear_error();
+}
+
+/**
+ * Select the ALPN protocol. A client that offers protocols must offer
+ * "postgresql"; one that offers none is accepted, except after direct
+ * negotiation, which the server checks once the handshake is done.
+ */
+static int pg_tls_select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                              const unsigned char *in, unsigned int inlen, void *arg) {
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, outlen, alpn_protocols, sizeof(alpn_protocols) - 1,
+                              in, inlen) == OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_OK;
+    }
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+/**
+ * Create the shared TLS context
+ *
+ * @param cert_file Certificate chain in PEM format
+ * @param key_file Private key in PEM format
+ * @return TLS context, or NULL on error (logged)
+ */
+PGTls *pg_tls_create(const char *cert_file, const char *key_file) {
+    if (!cert_file || !key_file) {
+        pg_log_error("SSL needs both a certificate and a key file");
+        return NULL;
+    }
+
+    PGTls *tls = (PGTls *)calloc(1, sizeof(PGTls));
+    if (!tls) {
+        return NULL;
+    }
+
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls->ctx) {
+        pg_tls_log_error("Cannot create SSL context");
+        free(tls);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(tls->ctx, TLS_CIPHERS);
+
+    // Writes may be partial and retried from wherever the output buffer has
+    // moved; idle connections give their record buffers back
+    SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                               SSL_MODE_RELEASE_BUFFERS);
+
+    long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+    // Used only if OpenSSL, the kernel and the cipher all support it
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(tls->ctx, options);
+
+    // Resumption: tickets for TLS 1.3 and ticket-capable 1.2 clients, the
+    // server-side cache for the rest. One ticket is enough for a client
+    // that reconnects with it.
+    SSL_CTX_set_session_id_context(tls->ctx, (const unsigned char *)TLS_SESSION_CONTEXT,
+                                   sizeof(TLS_SESSION_CONTEXT) - 1);
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_timeout(tls->ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(tls->ctx, 1);
+
+    SSL_CTX_set_alpn_select_cb(tls->ctx, pg_tls_select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx, cert_file) != 1) {
+        pg_tls_log_error("Cannot load SSL certificate");
+        pg_tls_destroy(tls);
+        return NULL;
+    }
+    if (SSL_CTX_use_PrivateKey_file(tls->ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls->ctx) != 1) {
+        pg_tls_log_error("Cannot load SSL key");
+        pg_tls_destroy(tls);
+        return NULL;
+    }
+
+    return tls;
+}
+
+/**
+ * Destroy the TLS context; connections still open keep it alive
+ *
+ * @param tls TLS context (may be NULL)
+ */
+void pg_tls_destroy(PGTls *tls) {
+    if (tls) {
+        SSL_CTX_free(tls->ctx);
+        free(tls);
+    }
+}
+
+/**
+ * Create the TLS state of an accepted connection
+ *
+ * @param tls TLS context
+ * @param fd Non-blocking client socket
+ * @return Connection, or NULL on error
+ */
+void *pg_tls_accept(PGTls *tls, int fd) {
+    SSL *ssl = SSL_new(tls->ctx);
+    if (!ssl) {
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+/**
+ * Continue the handshake
+ *
+ * @param ssl Connection
+ * @return 0 once it is done, PG_TLS_WANT_READ or PG_TLS_WANT_WRITE when it
+ *         waits for the socket, -1 on failure
+ */
+int pg_tls_handshake(void *ssl) {
+    ERR_clear_error();
+    int result = SSL_do_handshake((SSL *)ssl);
+    if (result == 1) {
+        return 0;
+    }
+
+    switch (SSL_get_error((SSL *)ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+            return PG_TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return PG_TLS_WANT_WRITE;
+        default:
+            // Clients that give up or fail verification are routine
+            pg_log_debug("SSL handshake failed: %s", ERR_reason_error_string(ERR_peek_error()));
+            ERR_clear_error();
+            return -1;
+    }
+}
+
+/**
+ * Send close_notify if the socket takes it; the connection is closed
+ * either way, so the peer's reply is not awaited
+ *
+ * @param ssl Connection
+ */
+void pg_tls_shutdown(void *ssl) {
+    if (SSL_is_init_finished((SSL *)ssl)) {
+        ERR_clear_error();
+        SSL_shutdown((SSL *)ssl);
+        ERR_clear_error();
+    }
+}
+
+/**
+ * Free the TLS state of a connection
+ *
+ * @param ssl Connection (may be NULL)
+ */
+void pg_tls_free(void *ssl) {
+    SSL_free((SSL *)ssl);
+}
+
+/**
+ * Map a failed read or write to errno
+ *
+ * @return -1 with errno EAGAIN if the call would block, 0 if the peer
+ *         closed the connection, -1 with errno ECONNRESET otherwise
+ */
+static ssize_t pg_tls_io_result(SSL *ssl, int result) {
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) errno = ECONNRESET;
+            ERR_clear_error();
+            return -1;
+        default:
+            ERR_clear_error();
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+/**
+ * Read decrypted bytes, like recv
+ *
+ * @param ssl Connection
+ * @param buffer Destination
+ * @param length Bytes wanted
+ * @return Bytes read, 0 if the peer closed the connection, -1 on error
+ *         (errno EAGAIN if nothing can be read yet)
+ */
+ssize_t pg_tls_read(void *ssl, void *buffer, size_t length) {
+    size_t n = 0;
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_read_ex((SSL *)ssl, buffer, length, &n);
+    return result == 1 ? (ssize_t)n : pg_tls_io_result((SSL *)ssl, result);
+}
+
+/**
+ * Encrypt and write bytes, like send. After a failure with EAGAIN the
+ * same bytes must be written again, though they may have moved.
+ *
+ * @param ssl Connection
+ * @param buffer Bytes to write
+ * @param length Number of bytes
+ * @return Bytes written (possibly fewer than length), or -1 on error
+ *         (errno EAGAIN if the socket is full)
+ */
+ssize_t pg_tls_write(void *ssl, const void *buffer, size_t length) {
+    size_t n = 0;
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_write_ex((SSL *)ssl, buffer, length, &n);
+    if (result == 1) {
+        return (ssize_t)n;
+    }
+    if (pg_tls_io_result((SSL *)ssl, result) == 0) {
+        errno = EPIPE;  // close_notify received
+    }
+    return -1;
+}
+
+/**
+ * Decrypted bytes held by OpenSSL. The socket will not report them as
+ * readable again, so they must be read before waiting for it.
+ *
+ * @param ssl Connection
+ * @return Number of bytes
+ */
+size_t pg_tls_pending(void *ssl) {
+    int pending = SSL_pending((SSL *)ssl);
+    return pending > 0 ? (size_t)pending : 0;
+}
+
+/**
+ * Send part of a file, encrypted by the kernel; only valid when
+ * pg_tls_kernel_send is true
+ *
+ * @param ssl Connection
+ * @param fd File descriptor
+ * @param offset File offset
+ * @param length Bytes to send
+ * @return Bytes sent, or -1 on error (errno EAGAIN if the socket is full)
+ */
+ssize_t pg_tls_sendfile(void *ssl, int fd, off_t offset, size_t length) {
+    ERR_clear_error();
+    errno = 0;
+    ossl_ssize_t sent = SSL_sendfile((SSL *)ssl, fd, offset, length, 0);
+    if (sent < 0) {
+        // errno is left as sendfile set it
+        ERR_clear_error();
+        return -1;
+    }
+    return (ssize_t)sent;
+}
+
+/**
+ * Whether the handshake resumed an earlier session
+ *
+ * @param ssl Connection
+ * @return true if it did
+ */
+bool pg_tls_session_reused(void *ssl) {
+    return SSL_session_reused((SSL *)ssl) == 1;
+}
+
+/**
+ * Whether the client negotiated the "postgresql" ALPN protocol
+ *
+ * @param ssl Connection
+ * @return true if it did
+ */
+bool pg_tls_alpn_selected(void *ssl) {
+    const unsigned char *protocol = NULL;
+    unsigned int length = 0;
+
+    SSL_get0_alpn_selected((SSL *)ssl, &protocol, &length);
+    return length == sizeof(alpn_protocols) - 2 && memcmp(protocol, alpn_protocols + 1, length) == 0;
+}
+
+/**
+ * Whether the kernel encrypts what is written to the socket, so that it
+ * can be written (and files sent to it) without going through OpenSSL
+ *
+ * @param ssl Connection whose handshake is done
+ * @return true if kTLS is active for sending
+ */
+bool pg_tls_kernel_send(void *ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio((SSL *)ssl)) == 1;
+#else
+    (void)ssl;
+    return false;
+#endif
+}
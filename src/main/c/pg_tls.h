@@ -0,0 +1,44 @@
+/**
+ * pg_tls.h
+ * TLS Connections
+ *
+ * This file contains declarations for the server's TLS support, a thin
+ * layer over OpenSSL. One context is shared by all worker threads, so
+ * session tickets and cached sessions issued on one connection resume
+ * handshakes on any other. Where the kernel supports it, record
+ * encryption for writes is handed to the kernel (kTLS), so the socket can
+ * be written directly and files sent with sendfile.
+ */
+
+#ifndef PG_TLS_H
+#define PG_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* What an unfinished handshake waits for */
+#define PG_TLS_WANT_READ   1
+#define PG_TLS_WANT_WRITE  2
+
+typedef struct PGTls PGTls;
+
+/* Function declarations */
+PGTls *pg_tls_create(const char *cert_file, const char *key_file);
+void pg_tls_destroy(PGTls *tls);
+
+void *pg_tls_accept(PGTls *tls, int fd);
+int pg_tls_handshake(void *ssl);
+void pg_tls_shutdown(void *ssl);
+void pg_tls_free(void *ssl);
+
+ssize_t pg_tls_read(void *ssl, void *buffer, size_t length);
+ssize_t pg_tls_write(void *ssl, const void *buffer, size_t length);
+size_t pg_tls_pending(void *ssl);
+ssize_t pg_tls_sendfile(void *ssl, int fd, off_t offset, size_t length);
+
+bool pg_tls_session_reused(void *ssl);
+bool pg_tls_alpn_selected(void *ssl);
+bool pg_tls_kernel_send(void *ssl);
+
+#endif /* PG_TLS_H */
@@ -0,0 +1,1102 @@
+/**
+ * pg_types.c
+ * Data Types and Wire Formats
+ *
+ * This file contains the conversions declared in pg_types.h. Binary
+ * formats follow the send/recv functions of the PostgreSQL server: integers
+ * and floats in network byte order, timestamps as int64 microseconds since
+ * 2000-01-01, numerics as base-10000 digit groups.
+ */
+
+#include "pg_types.h"
+#include "pg_simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#define NUMERIC_POS   0x0000
+#define NUMERIC_NEG   0x4000
+#define NUMERIC_NAN   0xC000
+#define NUMERIC_PINF  0xD000
+#define NUMERIC_NINF  0xF000
+#define NUMERIC_MAX_DIGITS 4096   // longest numeric text handled
+#define NUMERIC_NBASE 10000       // base of the digit groups
+
+#define USECS_PER_SEC INT64_C(1000000)
+#define USECS_PER_DAY (INT64_C(86400) * USECS_PER_SEC)
+#define EPOCH_DAYS    10957       // days from 1970-01-01 to 2000-01-01
+
+#define PG_FLOAT_TEXT_MAX      32  // longest float text, with its NUL
+#define PG_TIMESTAMP_TEXT_MAX  40  // longest timestamp text ("294277-01-09 04:00:54.775807+00 BC")
+
+_Static_assert(PG_FLOAT_TEXT_MAX <= PG_COLUMN_ENCODED_MAX && PG_TIMESTAMP_TEXT_MAX <= PG_COLUMN_ENCODED_MAX,
+               "column values are encoded in place");
+
+/* Bounded output; like snprintf, counts what did not fit */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t n;
+} PGWriter;
+
+static void pg_write(PGWriter *w, const void *data, size_t length) {
+    if (w->n < w->size) {
+        size_t room = w->size - w->n;
+        memcpy(w->buf + w->n, data, length < room ? length : room);
+    }
+    w->n += length;
+}
+
+static void pg_write_byte(PGWriter *w, char c) {
+    pg_write(w, &c, 1);
+}
+
+static void pg_write_uint16(PGWriter *w, uint16_t value) {
+    uint16_t n = htons(value);
+    pg_write(w, &n, 2);
+}
+
+static void pg_write_uint32(PGWriter *w, uint32_t value) {
+    uint32_t n = htonl(value);
+    pg_write(w, &n, 4);
+}
+
+static void pg_write_uint64(PGWriter *w, uint64_t value) {
+    pg_write_uint32(w, (uint32_t)(value >> 32));
+    pg_write_uint32(w, (uint32_t)value);
+}
+
+static void pg_put_uint16(char *p, uint16_t value) {
+    uint16_t n = htons(value);
+    memcpy(p, &n, 2);
+}
+
+static void pg_put_uint32(char *p, uint32_t value) {
+    uint32_t n = htonl(value);
+    memcpy(p, &n, 4);
+}
+
+static void pg_put_uint64(char *p, uint64_t value) {
+    pg_put_uint32(p, (uint32_t)(value >> 32));
+    pg_put_uint32(p + 4, (uint32_t)value);
+}
+
+static uint16_t pg_get_uint16(const char *p) {
+    uint16_t n;
+    memcpy(&n, p, 2);
+    return ntohs(n);
+}
+
+static uint32_t pg_get_uint32(const char *p) {
+    uint32_t n;
+    memcpy(&n, p, 4);
+    return ntohl(n);
+}
+
+static uint64_t pg_get_uint64(const char *p) {
+    return (uint64_t)pg_get_uint32(p) << 32 | pg_get_uint32(p + 4);
+}
+
+// Copy a value that is not null-terminated into buf, trimming whitespace
+static bool pg_copy_token(const char *data, int length, char *buf, size_t size) {
+    while (length > 0 && isspace((unsigned char)*data)) {
+        data++;
+        length--;
+    }
+    while (length > 0 && isspace((unsigned char)data[length - 1])) {
+        length--;
+    }
+    if (length <= 0 || (size_t)length >= size) {
+        return false;
+    }
+    memcpy(buf, data, length);
+    buf[length] = '\0';
+    return true;
+}
+
+/* Calendar conversions (proleptic Gregorian) */
+
+static int64_t pg_days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void pg_civil_from_days(int64_t z, int64_t *y, int *m, int *d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = yoe + era * 400 + (*m <= 2);
+}
+
+/* Text formats */
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Powers of ten that are exact as doubles and floats */
+static const double pow10_double[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+static const float pow10_float[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f};
+
+// Digits of an unsigned integer, two per division
+static int pg_uint_text(char *out, uint64_t value) {
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    while (value >= 100) {
+        unsigned pair = (unsigned)(value % 100);
+        value /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * pair, 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * value, 2);
+    } else {
+        *--p = (char)('0' + value);
+    }
+
+    int n = (int)(digits + sizeof(digits) - p);
+    memcpy(out, p, n);
+    return n;
+}
+
+static int pg_int_text(char *out, int64_t value) {
+    if (value < 0) {
+        *out = '-';
+        return 1 + pg_uint_text(out + 1, 0 - (uint64_t)value);
+    }
+    return pg_uint_text(out, (uint64_t)value);
+}
+
+// Exactly `width` digits of a value below 10^width
+static void pg_fixed_digits(char *out, unsigned value, int width) {
+    while (width >= 2) {
+        width -= 2;
+        memcpy(out + width, digit_pairs + 2 * (value % 100), 2);
+        value /= 100;
+    }
+    if (width) {
+        out[0] = (char)('0' + value % 10);
+    }
+}
+
+// The decimal -m / 10^k or m / 10^k in fixed notation
+static int pg_decimal_text(char *out, bool negative, uint64_t m, int k) {
+    char digits[20];
+    int n = pg_uint_text(digits, m);
+    char *p = out;
+
+    if (negative) {
+        *p++ = '-';
+    }
+    if (n > k) {
+        memcpy(p, digits, n - k);
+        p += n - k;
+        if (k > 0) {
+            *p++ = '.';
+            memcpy(p, digits + n - k, k);
+            p += k;
+        }
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', k - n);
+        p += k - n;
+        memcpy(p, digits, n);
+        p += n;
+    }
+    return (int)(p - out);
+}
+
+// The text pg_float_text's fallback would produce, without printf, for
+// values %g shows in fixed notation with at most 15 (float4: 6)
+// significant digits. The fewest decimals m / 10^k that read back as
+// the value are that text: the value's rounding interval is narrower than
+// half the spacing of such decimals, so they are also its rounding to 15
+// (6) digits. Returns 0 when there are none, leaving it to the fallback.
+static int pg_float_text_fast(char *out, double value, bool single) {
+    double magnitude = value < 0 ? -value : value;
+    double limit = single ? 1e6 : 1e15;
+    int max_scale = single ? 9 : 18;
+
+    if (!(magnitude >= 1e-4 && magnitude < limit)) {
+        return 0;
+    }
+    for (int k = 0; k <= max_scale; k++) {
+        double scaled = magnitude * pow10_double[k];
+        if (scaled >= limit) {
+            return 0;
+        }
+        uint64_t m = (uint64_t)(scaled + 0.5);   // exact: scaled's ulp is at most 1/8
+        // Both divisions are exact operands, so correctly rounded like strtod
+        bool exact = single ? (float)m / pow10_float[k] == (float)magnitude
+                            : (double)m / pow10_double[k] == magnitude;
+        if (exact) {
+            return m < (uint64_t)limit ? pg_decimal_text(out, value < 0, m, k) : 0;
+        }
+    }
+    return 0;
+}
+
+// Shortest precision (at least 15, float4: 6) that reads back to the same
+// value, as %g
+static int pg_float_text(char *out, double value, bool single) {
+    if (isnan(value)) {
+        memcpy(out, "NaN", 3);
+        return 3;
+    }
+    if (isinf(value)) {
+        const char *text = value > 0 ? "Infinity" : "-Infinity";
+        memcpy(out, text, strlen(text));
+        return (int)strlen(text);
+    }
+    if (value == 0) {
+        const char *text = signbit(value) ? "-0" : "0";
+        memcpy(out, text, strlen(text));
+        return (int)strlen(text);
+    }
+
+    int n = pg_float_text_fast(out, value, single);
+    if (n > 0) {
+        return n;
+    }
+
+    int precision = single ? 6 : 15;
+    int max_precision = single ? 9 : 17;
+    for (; precision <= max_precision; precision++) {
+        n = snprintf(out, PG_FLOAT_TEXT_MAX, "%.*g", precision, value);
+        if (single ? strtof(out, NULL) == (float)value : strtod(out, NULL) == value) {
+            break;
+        }
+    }
+    return n;
+}
+
+static void pg_format_float(PGWriter *w, double value, bool single) {
+    char text[PG_FLOAT_TEXT_MAX];
+    pg_write(w, text, pg_float_text(text, value, single));
+}
+
+// "YYYY-MM-DD HH:MM:SS[.ffffff][+00][ BC]", or (-)infinity
+static int pg_timestamp_text(char *out, int64_t timestamp, bool with_zone) {
+    if (timestamp == INT64_MAX) {
+        memcpy(out, "infinity", 8);
+        return 8;
+    }
+    if (timestamp == INT64_MIN) {
+        memcpy(out, "-infinity", 9);
+        return 9;
+    }
+
+    int64_t days = timestamp / USECS_PER_DAY;
+    int64_t usecs = timestamp % USECS_PER_DAY;
+    if (usecs < 0) {
+        usecs += USECS_PER_DAY;
+        days--;
+    }
+
+    int64_t year;
+    int month, day;
+    pg_civil_from_days(days + EPOCH_DAYS, &year, &month, &day);
+
+    int secs = (int)(usecs / USECS_PER_SEC);
+    int fraction = (int)(usecs % USECS_PER_SEC);
+    bool bc = year <= 0;
+    uint64_t shown_year = (uint64_t)(bc ? 1 - year : year);
+    char *p = out;
+
+    if (shown_year < 10000) {
+        pg_fixed_digits(p, (unsigned)shown_year, 4);
+        p += 4;
+    } else {
+        p += pg_uint_text(p, shown_year);
+    }
+    *p++ = '-';
+    pg_fixed_digits(p, (unsigned)month, 2);
+    p[2] = '-';
+    pg_fixed_digits(p + 3, (unsigned)day, 2);
+    p[5] = ' ';
+    pg_fixed_digits(p + 6, (unsigned)(secs / 3600), 2);
+    p[8] = ':';
+    pg_fixed_digits(p + 9, (unsigned)(secs / 60 % 60), 2);
+    p[11] = ':';
+    pg_fixed_digits(p + 12, (unsigned)(secs % 60), 2);
+    p += 14;
+
+    if (fraction) {
+        int digits = 6;
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            digits--;
+        }
+        *p++ = '.';
+        pg_fixed_digits(p, (unsigned)fraction, digits);
+        p += digits;
+    }
+    if (with_zone) {
+        memcpy(p, "+00", 3);
+        p += 3;
+    }
+    if (bc) {
+        memcpy(p, " BC", 3);
+        p += 3;
+    }
+    return (int)(p - out);
+}
+
+static void pg_format_timestamp(PGWriter *w, int64_t timestamp, bool with_zone) {
+    char text[PG_TIMESTAMP_TEXT_MAX];
+    pg_write(w, text, pg_timestamp_text(text, timestamp, with_zone));
+}
+
+static void pg_format_uuid(PGWriter *w, const uint8_t *uuid) {
+    char digits[32];
+    char text[36];
+
+    pg_simd_hex_encode(uuid, 16, digits);
+    memcpy(text, digits, 8);
+    text[8] = '-';
+    memcpy(text + 9, digits + 8, 4);
+    text[13] = '-';
+    memcpy(text + 14, digits + 12, 4);
+    text[18] = '-';
+    memcpy(text + 19, digits + 16, 4);
+    text[23] = '-';
+    memcpy(text + 24, digits + 20, 12);
+    pg_write(w, text, sizeof(text));
+}
+
+static void pg_format_bytea(PGWriter *w, const char *data, int length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t n = (size_t)length;
+
+    pg_write(w, "\\x", 2);
+    if (n > 0 && w->n + 2 * n <= w->size) {
+        pg_simd_hex_encode(bytes, n, w->buf + w->n);
+        w->n += 2 * n;
+        return;
+    }
+
+    // Too long for the buffer: go through pg_write, which only counts the overflow
+    char chunk[512];
+    while (n > 0) {
+        size_t part = n < sizeof(chunk) / 2 ? n : sizeof(chunk) / 2;
+        pg_simd_hex_encode(bytes, part, chunk);
+        pg_write(w, chunk, 2 * part);
+        bytes += part;
+        n -= part;
+    }
+}
+
+static int pg_parse_int(const char *data, int length, int64_t min, int64_t max, int64_t *value) {
+    char text[32];
+    char *end;
+
+    if (!pg_copy_token(data, length, text, sizeof(text))) {
+        return -1;
+    }
+    errno = 0;
+    long long n = strtoll(text, &end, 10);
+    if (errno || *end || n < min || n > max) {
+        return -1;
+    }
+    *value = n;
+    return 0;
+}
+
+static int pg_parse_float(const char *data, int length, bool single, double *value) {
+    char text[512];
+    char *end;
+
+    if (!pg_copy_token(data, length, text, sizeof(text))) {
+        return -1;
+    }
+    errno = 0;
+    double f = single ? strtof(text, &end) : strtod(text, &end);
+    if (*end || (errno == ERANGE && isinf(f))) {
+        return -1;
+    }
+    *value = f;
+    return 0;
+}
+
+static int pg_parse_bool(const char *data, int length, bool *value) {
+    static const char *const true_words[] = {"t", "true", "y", "yes", "on", "1"};
+    static const char *const false_words[] = {"f", "false", "n", "no", "off", "0"};
+    char text[8];
+
+    if (!pg_copy_token(data, length, text, sizeof(text))) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(true_words) / sizeof(true_words[0]); i++) {
+        if (strcasecmp(text, true_words[i]) == 0) {
+            *value = true;
+            return 0;
+        }
+        if (strcasecmp(text, false_words[i]) == 0) {
+            *value = false;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int pg_hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int pg_parse_uuid(const char *data, int length, uint8_t *uuid) {
+    int digits = 0;
+    int i = 0;
+
+    if (length > 0 && data[0] == '{') {
+        if (data[length - 1] != '}') return -1;
+        i = 1;
+        length--;
+    }
+    for (; i < length; i++) {
+        if (data[i] == '-' && digits > 0 && digits % 4 == 0 && digits < 32) {
+            continue;
+        }
+        int v = pg_hex_value(data[i]);
+        if (v < 0 || digits == 32) {
+            return -1;
+        }
+        if (digits % 2 == 0) uuid[digits / 2] = (uint8_t)(v << 4);
+        else uuid[digits / 2] |= (uint8_t)v;
+        digits++;
+    }
+    return digits == 32 ? 0 : -1;
+}
+
+// Parse "YYYY-MM-DD[ T]HH:MM:SS[.ffffff][Z|+HH[:MM]|-HH[:MM]][ BC]"
+static int pg_parse_timestamp(const char *data, int length, bool with_zone, int64_t *value) {
+    char text[64];
+    int year, month, day, hour = 0, minute = 0, second = 0, consumed = 0;
+    int64_t fraction = 0;
+
+    if (!pg_copy_token(data, length, text, sizeof(text))) {
+        return -1;
+    }
+    if (strcasecmp(text, "infinity") == 0 || strcasecmp(text, "+infinity") == 0) {
+        *value = INT64_MAX;
+        return 0;
+    }
+    if (strcasecmp(text, "-infinity") == 0) {
+        *value = INT64_MIN;
+        return 0;
+    }
+
+    if (sscanf(text, "%d-%d-%d%n", &year, &month, &day, &consumed) != 3) {
+        return -1;
+    }
+    const char *p = text + consumed;
+    if (*p == ' ' || *p == 'T') {
+        if (sscanf(p + 1, "%d:%d:%d%n", &hour, &minute, &second, &consumed) != 3) {
+            return -1;
+        }
+        p += 1 + consumed;
+        if (*p == '.') {
+            int64_t scale = 100000;
+            for (p++; isdigit((unsigned char)*p); p++) {
+                fraction += (*p - '0') * scale;
+                scale /= 10;
+            }
+        }
+    }
+
+    int64_t offset = 0;
+    if (*p == 'Z' || *p == 'z') {
+        p++;
+    } else if (*p == '+' || *p == '-') {
+        int sign = *p == '-' ? -1 : 1;
+        int zone_hour = 0, zone_minute = 0;
+        if (sscanf(p + 1, "%2d%n", &zone_hour, &consumed) != 1) return -1;
+        p += 1 + consumed;
+        if (*p == ':') p++;
+        if (isdigit((unsigned char)*p)) {
+            if (sscanf(p, "%2d%n", &zone_minute, &consumed) != 1) return -1;
+            p += consumed;
+        }
+        offset = sign * (zone_hour * 3600 + zone_minute * 60) * USECS_PER_SEC;
+    }
+    if (strcasecmp(p, " BC") == 0) {
+        year = 1 - year;
+        p += 3;
+    }
+    if (*p || month < 1 || month > 12 || day < 1 || day > 31 ||
+        hour > 24 || minute > 59 || second > 60) {
+        return -1;
+    }
+    (void)with_zone;  // without a zone, timestamptz input is taken as UTC
+
+    int64_t days = pg_days_from_civil(year, month, day) - EPOCH_DAYS;
+    *value = days * USECS_PER_DAY + ((int64_t)hour * 3600 + minute * 60 + second) * USECS_PER_SEC +
+             fraction - offset;
+    return 0;
+}
+
+static int pg_parse_bytea(const char *data, int length, PGValue *value, char *buf, size_t size) {
+    size_t n = 0;
+
+    if (length >= 2 && data[0] == '\\' && data[1] == 'x') {
+        // Hex format
+        for (int i = 2; i < length; i++) {
+            if (isspace((unsigned char)data[i])) continue;
+            int hi = pg_hex_value(data[i]);
+            int lo = i + 1 < length ? pg_hex_value(data[i + 1]) : -1;
+            if (hi < 0 || lo < 0 || n >= size) return -1;
+            buf[n++] = (char)(hi << 4 | lo);
+            i++;
+        }
+    } else {
+        // Escape format: \\ and \ooo
+        for (int i = 0; i < length; i++) {
+            char c = data[i];
+            if (c == '\\') {
+                if (i + 1 < length && data[i + 1] == '\\') {
+                    i++;
+                } else if (i + 3 < length &&
+                           data[i + 1] >= '0' && data[i + 1] <= '3' &&
+                           data[i + 2] >= '0' && data[i + 2] <= '7' &&
+                           data[i + 3] >= '0' && data[i + 3] <= '7') {
+                    c = (char)((data[i + 1] - '0') << 6 | (data[i + 2] - '0') << 3 | (data[i + 3] - '0'));
+                    i += 3;
+                } else {
+                    return -1;
+                }
+            }
+            if (n >= size) return -1;
+            buf[n++] = c;
+        }
+    }
+
+    value->v.str.data = buf;
+    value->v.str.length = (int)n;
+    return 0;
+}
+
+/* Numeric */
+
+// Encode decimal text as a binary numeric
+static int pg_numeric_send(PGWriter *w, const char *data, int length) {
+    char text[NUMERIC_MAX_DIGITS + 8];
+    uint16_t sign = NUMERIC_POS;
+
+    if (!pg_copy_token(data, length, text, sizeof(text))) {
+        return -1;
+    }
+
+    const char *p = text;
+    if (strcasecmp(p, "NaN") == 0 || strcasecmp(p, "Infinity") == 0 ||
+        strcasecmp(p, "+Infinity") == 0 || strcasecmp(p, "-Infinity") == 0) {
+        sign = p[0] == 'N' || p[0] == 'n' ? NUMERIC_NAN : p[0] == '-' ? NUMERIC_NINF : NUMERIC_PINF;
+        pg_write_uint16(w, 0);
+        pg_write_uint16(w, 0);
+        pg_write_uint16(w, sign);
+        pg_write_uint16(w, 0);
+        return 0;
+    }
+
+    if (*p == '+' || *p == '-') {
+        sign = *p == '-' ? NUMERIC_NEG : NUMERIC_POS;
+        p++;
+    }
+
+    // Split into integer and fraction digits
+    const char *int_digits = p;
+    while (isdigit((unsigned char)*p)) p++;
+    int int_len = (int)(p - int_digits);
+    const char *frac_digits = p;
+    int frac_len = 0;
+    if (*p == '.') {
+        frac_digits = ++p;
+        while (isdigit((unsigned char)*p)) p++;
+        frac_len = (int)(p - frac_digits);
+    }
+    if (*p || int_len + frac_len == 0) {
+        return -1;  // exponents are not supported
+    }
+
+    while (int_len > 0 && *int_digits == '0') {
+        int_digits++;
+        int_len--;
+    }
+    if (int_len + frac_len > NUMERIC_MAX_DIGITS) {
+        return -1;  // more groups than fit below
+    }
+
+    // Line the digits up on base-10000 groups around the decimal point
+    int int_groups = (int_len + 3) / 4;
+    int frac_groups = (frac_len + 3) / 4;
+    int total = int_groups + frac_groups;
+    int16_t groups[NUMERIC_MAX_DIGITS / 4 + 2];
+    int pad = int_groups * 4 - int_len;
+
+    for (int g = 0; g < total; g++) {
+        int v = 0;
+        for (int k = 0; k < 4; k++) {
+            int pos = g * 4 + k - pad;  // index into int digits followed by fraction digits
+            int digit = 0;
+            if (pos >= 0 && pos < int_len) digit = int_digits[pos] - '0';
+            else if (pos >= int_len && pos - int_len < frac_len) digit = frac_digits[pos - int_len] - '0';
+            v = v * 10 + digit;
+        }
+        groups[g] = (int16_t)v;
+    }
+
+    // Drop zero groups at both ends
+    int first = 0, last = total;
+    while (first < last && groups[first] == 0) first++;
+    while (last > first && groups[last - 1] == 0) last--;
+
+    int16_t weight = (int16_t)(int_groups - 1 - first);
+    int ndigits = last - first;
+    if (ndigits == 0) {
+        weight = 0;
+        sign = NUMERIC_POS;
+    }
+
+    pg_write_uint16(w, (uint16_t)ndigits);
+    pg_write_uint16(w, (uint16_t)weight);
+    pg_write_uint16(w, sign);
+    pg_write_uint16(w, (uint16_t)frac_len);
+    for (int g = first; g < last; g++) {
+        pg_write_uint16(w, (uint16_t)groups[g]);
+    }
+    return 0;
+}
+
+// Decode a binary numeric to decimal text
+static int pg_numeric_recv(PGWriter *w, const char *data, int length) {
+    if (length < 8) {
+        return -1;
+    }
+
+    int ndigits = pg_get_uint16(data);
+    int weight = (int16_t)pg_get_uint16(data + 2);
+    uint16_t sign = pg_get_uint16(data + 4);
+    int dscale = pg_get_uint16(data + 6);
+    const char *digits = data + 8;
+
+    if (length != 8 + ndigits * 2 || dscale > NUMERIC_MAX_DIGITS) {
+        return -1;
+    }
+    if (sign == NUMERIC_NAN || sign == NUMERIC_PINF || sign == NUMERIC_NINF) {
+        const char *text = sign == NUMERIC_NAN ? "NaN" : sign == NUMERIC_PINF ? "Infinity" : "-Infinity";
+        pg_write(w, text, strlen(text));
+        return 0;
+    }
+    if (sign != NUMERIC_POS && sign != NUMERIC_NEG) {
+        return -1;
+    }
+
+    // Like PostgreSQL: a group out of range is an invalid digit, and zero
+    // has no sign
+    bool zero = true;
+    for (int i = 0; i < ndigits; i++) {
+        int v = pg_get_uint16(digits + i * 2);
+        if (v >= NUMERIC_NBASE) {
+            return -1;
+        }
+        if (v) {
+            zero = false;
+        }
+    }
+
+    if (sign == NUMERIC_NEG && !zero) {
+        pg_write_byte(w, '-');
+    }
+
+    // Group i has weight (weight - i)
+    if (weight < 0) {
+        pg_write_byte(w, '0');
+    }
+    for (int i = 0; i <= weight; i++) {
+        int v = i < ndigits ? pg_get_uint16(digits + i * 2) : 0;
+        char text[8];
+        int len = snprintf(text, sizeof(text), i == 0 ? "%d" : "%04d", v);
+        pg_write(w, text, len);
+    }
+
+    if (dscale > 0) {
+        pg_write_byte(w, '.');
+        for (int k = 1, written = 0; written < dscale; k++) {
+            int i = weight + k;
+            int v = i >= 0 && i < ndigits ? pg_get_uint16(digits + i * 2) : 0;
+            char text[8];
+            snprintf(text, sizeof(text), "%04d", v);
+            for (int j = 0; j < 4 && written < dscale; j++, written++) {
+                pg_write_byte(w, text[j]);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get the storage size of a type, as reported in RowDescription
+ *
+ * @param type Type OID
+ * @return Size in bytes, or -1 for variable-length types
+ */
+int16_t pg_type_length(uint32_t type) {
+    switch (type) {
+        case PG_TYPE_BOOL:        return 1;
+        case PG_TYPE_INT2:        return 2;
+        case PG_TYPE_INT4:        return 4;
+        case PG_TYPE_FLOAT4:      return 4;
+        case PG_TYPE_INT8:        return 8;
+        case PG_TYPE_FLOAT8:      return 8;
+        case PG_TYPE_TIMESTAMP:   return 8;
+        case PG_TYPE_TIMESTAMPTZ: return 8;
+        case PG_TYPE_UUID:        return 16;
+        default:                  return -1;
+    }
+}
+
+/**
+ * Encode a value in a wire format
+ *
+ * Like snprintf, returns the full length even when it does not fit in buf,
+ * so the caller can retry with a larger buffer. Values of other types are
+ * sent as the bytes given in v.str, whatever the format.
+ *
+ * @param value Value (not NULL)
+ * @param format PG_FORMAT_TEXT or PG_FORMAT_BINARY
+ * @param buf Output buffer
+ * @param size Size of the buffer
+ * @return Length of the encoded value, or -1 if it cannot be encoded
+ */
+int pg_value_encode(const PGValue *value, int16_t format, char *buf, size_t size) {
+    PGWriter w = {buf, size, 0};
+    bool binary = format == PG_FORMAT_BINARY;
+
+    switch (value->type) {
+        case PG_TYPE_BOOL:
+            if (binary) pg_write_byte(&w, value->v.b ? 1 : 0);
+            else pg_write_byte(&w, value->v.b ? 't' : 'f');
+            break;
+
+        case PG_TYPE_INT2:
+        case PG_TYPE_INT4:
+        case PG_TYPE_INT8:
+            if (binary) {
+                if (value->type == PG_TYPE_INT2) pg_write_uint16(&w, (uint16_t)value->v.i);
+                else if (value->type == PG_TYPE_INT4) pg_write_uint32(&w, (uint32_t)value->v.i);
+                else pg_write_uint64(&w, (uint64_t)value->v.i);
+            } else {
+                char text[24];
+                pg_write(&w, text, pg_int_text(text, value->v.i));
+            }
+            break;
+
+        case PG_TYPE_FLOAT4:
+            if (binary) {
+                float f = (float)value->v.f;
+                uint32_t bits;
+                memcpy(&bits, &f, 4);
+                pg_write_uint32(&w, bits);
+            } else {
+                pg_format_float(&w, value->v.f, true);
+            }
+            break;
+
+        case PG_TYPE_FLOAT8:
+            if (binary) {
+                uint64_t bits;
+                memcpy(&bits, &value->v.f, 8);
+                pg_write_uint64(&w, bits);
+            } else {
+                pg_format_float(&w, value->v.f, false);
+            }
+            break;
+
+        case PG_TYPE_TIMESTAMP:
+        case PG_TYPE_TIMESTAMPTZ:
+            if (binary) pg_write_uint64(&w, (uint64_t)value->v.timestamp);
+            else pg_format_timestamp(&w, value->v.timestamp, value->type == PG_TYPE_TIMESTAMPTZ);
+            break;
+
+        case PG_TYPE_UUID:
+            if (binary) pg_write(&w, value->v.uuid, 16);
+            else pg_format_uuid(&w, value->v.uuid);
+            break;
+
+        case PG_TYPE_BYTEA:
+            if (binary) pg_write(&w, value->v.str.data, value->v.str.length);
+            else pg_format_bytea(&w, value->v.str.data, value->v.str.length);
+            break;
+
+        case PG_TYPE_NUMERIC:
+            if (!binary) {
+                pg_write(&w, value->v.str.data, value->v.str.length);
+            } else if (pg_numeric_send(&w, value->v.str.data, value->v.str.length) < 0) {
+                return -1;
+            }
+            break;
+
+        default:
+            pg_write(&w, value->v.str.data, value->v.str.length);
+            break;
+    }
+
+    return (int)w.n;
+}
+
+/**
+ * Whether pg_column_encode handles columns of a type
+ *
+ * @param type Type OID
+ * @return true for the types listed in PGColumn
+ */
+bool pg_column_type_supported(uint32_t type) {
+    switch (type) {
+        case PG_TYPE_BOOL:
+        case PG_TYPE_INT2:
+        case PG_TYPE_INT4:
+        case PG_TYPE_INT8:
+        case PG_TYPE_FLOAT4:
+        case PG_TYPE_FLOAT8:
+        case PG_TYPE_TIMESTAMP:
+        case PG_TYPE_TIMESTAMPTZ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Encode one value of a column in a wire format
+ *
+ * The text forms are the same as pg_value_encode's, produced without
+ * printf for all but unusual floats.
+ *
+ * @param column Column (of a supported type)
+ * @param row Row index
+ * @param format PG_FORMAT_TEXT or PG_FORMAT_BINARY
+ * @param buf Output buffer of at least PG_COLUMN_ENCODED_MAX bytes
+ * @return Length of the encoding, or -1 if the value is NULL (as DataRow
+ *         sends it)
+ */
+int pg_column_encode(const PGColumn *column, int row, int16_t format, char *buf) {
+    bool binary = format == PG_FORMAT_BINARY;
+
+    if (column->nulls && (column->nulls[row >> 3] >> (row & 7) & 1)) {
+        return -1;
+    }
+
+    switch (column->type) {
+        case PG_TYPE_BOOL: {
+            bool b = ((const bool *)column->values)[row];
+            buf[0] = binary ? (char)b : b ? 't' : 'f';
+            return 1;
+        }
+        case PG_TYPE_INT2: {
+            int16_t i = ((const int16_t *)column->values)[row];
+            if (binary) {
+                pg_put_uint16(buf, (uint16_t)i);
+                return 2;
+            }
+            return pg_int_text(buf, i);
+        }
+        case PG_TYPE_INT4: {
+            int32_t i = ((const int32_t *)column->values)[row];
+            if (binary) {
+                pg_put_uint32(buf, (uint32_t)i);
+                return 4;
+            }
+            return pg_int_text(buf, i);
+        }
+        case PG_TYPE_INT8: {
+            int64_t i = ((const int64_t *)column->values)[row];
+            if (binary) {
+                pg_put_uint64(buf, (uint64_t)i);
+                return 8;
+            }
+            return pg_int_text(buf, i);
+        }
+        case PG_TYPE_FLOAT4: {
+            float f = ((const float *)column->values)[row];
+            if (binary) {
+                uint32_t bits;
+                memcpy(&bits, &f, 4);
+                pg_put_uint32(buf, bits);
+                return 4;
+            }
+            return pg_float_text(buf, f, true);
+        }
+        case PG_TYPE_FLOAT8: {
+            double f = ((const double *)column->values)[row];
+            if (binary) {
+                uint64_t bits;
+                memcpy(&bits, &f, 8);
+                pg_put_uint64(buf, bits);
+                return 8;
+            }
+            return pg_float_text(buf, f, false);
+        }
+        default: {
+            // Timestamps
+            int64_t timestamp = ((const int64_t *)column->values)[row];
+            if (binary) {
+                pg_put_uint64(buf, (uint64_t)timestamp);
+                return 8;
+            }
+            return pg_timestamp_text(buf, timestamp, column->type == PG_TYPE_TIMESTAMPTZ);
+        }
+    }
+}
+
+/**
+ * Decode a value from a wire format, e.g. a Bind parameter
+ *
+ * Text-like results point into data when no conversion is needed and into
+ * buf otherwise (decoded bytea text, numeric binary); buf must stay alive
+ * as long as the value is used.
+ *
+ * @param type Type OID (0, the unspecified type, is read as text)
+ * @param format PG_FORMAT_TEXT or PG_FORMAT_BINARY
+ * @param data Encoded value, or NULL for SQL NULL
+ * @param length Length of the encoded value
+ * @param value Set to the decoded value
+ * @param buf Scratch buffer
+ * @param size Size of the scratch buffer
+ * @return 0 on success, -1 if the value is invalid or buf is too small
+ */
+int pg_value_decode(uint32_t type, int16_t format, const char *data, int length,
+                    PGValue *value, char *buf, size_t size) {
+    bool binary = format == PG_FORMAT_BINARY;
+    int64_t n;
+
+    memset(value, 0, sizeof(*value));
+    value->type = type ? type : PG_TYPE_TEXT;
+    if (!data) {
+        value->isnull = true;
+        return 0;
+    }
+    if (format != PG_FORMAT_TEXT && format != PG_FORMAT_BINARY) {
+        return -1;
+    }
+
+    switch (value->type) {
+        case PG_TYPE_BOOL:
+            if (binary) {
+                if (length != 1) return -1;
+                value->v.b = data[0] != 0;
+                return 0;
+            }
+            return pg_parse_bool(data, length, &value->v.b);
+
+        case PG_TYPE_INT2:
+            if (binary) {
+                if (length != 2) return -1;
+                value->v.i = (int16_t)pg_get_uint16(data);
+                return 0;
+            }
+            return pg_parse_int(data, length, INT16_MIN, INT16_MAX, &value->v.i);
+
+        case PG_TYPE_INT4:
+            if (binary) {
+                if (length != 4) return -1;
+                value->v.i = (int32_t)pg_get_uint32(data);
+                return 0;
+            }
+            return pg_parse_int(data, length, INT32_MIN, INT32_MAX, &value->v.i);
+
+        case PG_TYPE_INT8:
+            if (binary) {
+                if (length != 8) return -1;
+                value->v.i = (int64_t)pg_get_uint64(data);
+                return 0;
+            }
+            if (pg_parse_int(data, length, INT64_MIN, INT64_MAX, &n) < 0) return -1;
+            value->v.i = n;
+            return 0;
+
+        case PG_TYPE_FLOAT4:
+            if (binary) {
+                uint32_t bits;
+                float f;
+                if (length != 4) return -1;
+                bits = pg_get_uint32(data);
+                memcpy(&f, &bits, 4);
+                value->v.f = f;
+                return 0;
+            }
+            return pg_parse_float(data, length, true, &value->v.f);
+
+        case PG_TYPE_FLOAT8:
+            if (binary) {
+                uint64_t bits;
+                if (length != 8) return -1;
+                bits = pg_get_uint64(data);
+                memcpy(&value->v.f, &bits, 8);
+                return 0;
+            }
+            return pg_parse_float(data, length, false, &value->v.f);
+
+        case PG_TYPE_TIMESTAMP:
+        case PG_TYPE_TIMESTAMPTZ:
+            if (binary) {
+                if (length != 8) return -1;
+                value->v.timestamp = (int64_t)pg_get_uint64(data);
+                return 0;
+            }
+            return pg_parse_timestamp(data, length, value->type == PG_TYPE_TIMESTAMPTZ,
+                                      &value->v.timestamp);
+
+        case PG_TYPE_UUID:
+            if (binary) {
+                if (length != 16) return -1;
+                memcpy(value->v.uuid, data, 16);
+                return 0;
+            }
+            return pg_parse_uuid(data, length, value->v.uuid);
+
+        case PG_TYPE_BYTEA:
+            if (!binary) {
+                return pg_parse_bytea(data, length, value, buf, size);
+            }
+            break;
+
+        case PG_TYPE_NUMERIC:
+            if (binary) {
+                PGWriter w = {buf, size, 0};
+                if (pg_numeric_recv(&w, data, length) < 0 || w.n > size) return -1;
+                value->v.str.data = buf;
+                value->v.str.length = (int)w.n;
+                return 0;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    value->v.str.data = data;
+    value->v.str.length = length;
+    return 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * pg_types.h
+ * Data Types and Wire Formats
+ *
+ * This file contains declarations for converting values of common
+ * PostgreSQL types to and from their text and binary wire formats, as used
+ * in DataRow columns and Bind parameters.
+ */
+
+#ifndef PG_TYPES_H
+#define PG_TYPES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Type OIDs */
+#define PG_TYPE_BOOL         16
+#define PG_TYPE_BYTEA        17
+#define PG_TYPE_INT8         20
+#define PG_TYPE_INT2         21
+#define PG_TYPE_INT4         23
+#define PG_TYPE_TEXT         25
+#define PG_TYPE_FLOAT4       700
+#define PG_TYPE_FLOAT8       701
+#define PG_TYPE_VARCHAR      1043
+#define PG_TYPE_TIMESTAMP    1114
+#define PG_TYPE_TIMESTAMPTZ  1184
+#define PG_TYPE_NUMERIC      1700
+#define PG_TYPE_UUID         2950
+
+/* Format codes */
+#define PG_FORMAT_TEXT       0
+#define PG_FORMAT_BINARY     1
+
+/* Microseconds from the Unix epoch to the PostgreSQL epoch (2000-01-01) */
+#define PG_EPOCH_OFFSET_USEC INT64_C(946684800000000)
+
+/* A value of one of the types above */
+typedef struct PGValue {
+    uint32_t type;           /* Type OID */
+    bool isnull;             /* SQL NULL */
+    union {
+        bool b;              /* bool */
+        int64_t i;           /* int2, int4, int8 */
+        double f;            /* float4, float8 */
+        int64_t timestamp;   /* timestamp, timestamptz: microseconds since 2000-01-01 UTC */
+        uint8_t uuid[16];    /* uuid */
+        struct {
+            const char *data;
+            int length;
+        } str;               /* bytea: raw bytes; numeric: decimal text; other types: text form */
+    } v;
+} PGValue;
+
+/* A column of values for pg_send_data_rows, one array element per row */
+typedef struct PGColumn {
+    uint32_t type;           /* PG_TYPE_BOOL, INT2, INT4, INT8, FLOAT4, FLOAT8, TIMESTAMP or TIMESTAMPTZ */
+    const void *values;      /* bool, int16_t, int32_t, int64_t, float, double, or int64_t
+                                microseconds since 2000-01-01 for timestamps */
+    const uint8_t *nulls;    /* Bit (row % 8) of byte (row / 8) set for NULL, or NULL for none */
+} PGColumn;
+
+/* Longest encoding of a column value, in either format */
+#define PG_COLUMN_ENCODED_MAX 40
+
+/* Function declarations */
+int16_t pg_type_length(uint32_t type);
+int pg_value_encode(const PGValue *value, int16_t format, char *buf, size_t size);
+int pg_value_decode(uint32_t type, int16_t format, const char *data, int length,
+                    PGValue *value, char *buf, size_t size);
+bool pg_column_type_supported(uint32_t type);
+int pg_column_encode(const PGColumn *column, int row, int16_t format, char *buf);
+
+#endif /* PG_TYPES_H */
@@ -0,0 +1,222 @@
+/**
+ * pg_wheel.c
+ * Timer Wheel
+ *
+ * This file contains the implementation of the timer wheel declared in
+ * pg_wheel.h. Slots are singly linked lists whose entries point back at the
+ * link referring to them, so a timer leaves its list without knowing which
+ * one it is in. The occupancy bitmaps are only cleared lazily, when a
+ * search finds a slot empty, so cancelling a timer does not touch them.
+ */
+
+#include "pg_wheel.h"
+#include <limits.h>
+#include <time.h>
+
+#define WHEEL_MASK ((uint64_t)PG_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (PG_WHEEL_BITS * PG_WHEEL_LEVELS))
+#define WHEEL_NEVER UINT64_MAX
+
+_Static_assert(PG_WHEEL_SLOTS == 64, "occupancy bitmaps are one uint64_t per level");
+
+/**
+ * Initialize an empty wheel
+ *
+ * @param wheel Wheel
+ * @param now Current time in milliseconds (pg_wheel_now)
+ */
+void pg_wheel_init(PGWheel *wheel, uint64_t now) {
+    wheel->now = now;
+    for (int level = 0; level < PG_WHEEL_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+        for (int slot = 0; slot < PG_WHEEL_SLOTS; slot++) {
+            wheel->slots[level][slot] = NULL;
+        }
+    }
+}
+
+// Put a timer in the slot covering its deadline, on the lowest level that
+// reaches it; a deadline already past goes in the slot processed next
+static void pg_wheel_place(PGWheel *wheel, PGTimer *timer) {
+    uint64_t tick = timer->expires > wheel->now ? timer->expires : wheel->now;
+    uint64_t delta = tick - wheel->now;
+    int level = 0;
+
+    if (delta >= WHEEL_SPAN) {
+        // Placed again from the last slot once the wheel gets there
+        delta = WHEEL_SPAN - 1;
+        tick = wheel->now + delta;
+    }
+    while (delta >> (PG_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    int slot = (int)((tick >> (PG_WHEEL_BITS * level)) & WHEEL_MASK);
+    PGTimer **head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/**
+ * Start a timer, or move it if it is already running
+ *
+ * @param wheel Wheel of the thread the timer's callback runs on
+ * @param timer Timer
+ * @param expires Deadline in milliseconds (pg_wheel_now)
+ */
+void pg_wheel_add(PGWheel *wheel, PGTimer *timer, uint64_t expires) {
+    pg_wheel_cancel(timer);
+    timer->expires = expires;
+    pg_wheel_place(wheel, timer);
+}
+
+/**
+ * Stop a timer; nothing happens if it is not running
+ *
+ * @param timer Timer
+ */
+void pg_wheel_cancel(PGTimer *timer) {
+    if (!timer->pprev) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Tick at which the wheel next reaches an occupied slot: on level 0 the
+// deadline of its timers, above it the moment they move down a level.
+// WHEEL_NEVER when the wheel is empty.
+static uint64_t pg_wheel_next(PGWheel *wheel) {
+    uint64_t next = WHEEL_NEVER;
+
+    for (int level = 0; level < PG_WHEEL_LEVELS; level++) {
+        int shift = PG_WHEEL_BITS * level;
+        uint64_t unit = (uint64_t)1 << shift;
+        uint64_t start = (wheel->now + unit - 1) & ~(unit - 1);  // first slot boundary
+        int first = (int)((start >> shift) & WHEEL_MASK);
+
+        while (wheel->occupied[level]) {
+            uint64_t occupied = wheel->occupied[level];
+            uint64_t rotated = first ? (occupied >> first) | (occupied << (PG_WHEEL_SLOTS - first)) : occupied;
+            int distance = __builtin_ctzll(rotated);
+            int slot = (first + distance) & (int)WHEEL_MASK;
+
+            if (!wheel->slots[level][slot]) {
+                // Emptied by cancellations since it was marked
+                wheel->occupied[level] &= ~((uint64_t)1 << slot);
+                continue;
+            }
+            uint64_t tick = start + ((uint64_t)distance << shift);
+            if (tick < next) {
+                next = tick;
+            }
+            break;
+        }
+    }
+    return next;
+}
+
+/**
+ * Milliseconds until the next timer may expire, for the loop's wait
+ *
+ * @param wheel Wheel
+ * @param now Current time in milliseconds (pg_wheel_now)
+ * @return Timeout in milliseconds, 0 if a timer is due, -1 if there are none
+ */
+int pg_wheel_timeout(PGWheel *wheel, uint64_t now) {
+    uint64_t next = pg_wheel_next(wheel);
+
+    if (next == WHEEL_NEVER) {
+        return -1;
+    }
+    if (next <= now) {
+        return 0;
+    }
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+// Move the timers of a slot down to the levels their deadlines now fall in
+static void pg_wheel_cascade(PGWheel *wheel, int level, int slot) {
+    PGTimer *list = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    while (list) {
+        PGTimer *timer = list;
+        list = timer->next;
+        pg_wheel_place(wheel, timer);
+    }
+}
+
+/**
+ * Run the callbacks of every timer whose deadline has passed
+ *
+ * Ticks on which no slot is reached are skipped over, so the cost does not
+ * depend on how long the loop slept.
+ *
+ * @param wheel Wheel
+ * @param now Current time in milliseconds (pg_wheel_now)
+ */
+void pg_wheel_advance(PGWheel *wheel, uint64_t now) {
+    while (wheel->now <= now) {
+        uint64_t tick = pg_wheel_next(wheel);
+        if (tick > now) {
+            wheel->now = now + 1;
+            return;
+        }
+        wheel->now = tick;
+
+        // Slots of higher levels that begin on this tick move down first,
+        // the highest first, so their timers can go all the way to level 0
+        int top = 0;
+        while (top + 1 < PG_WHEEL_LEVELS &&
+               (tick & (((uint64_t)1 << (PG_WHEEL_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            pg_wheel_cascade(wheel, level, (int)((tick >> (PG_WHEEL_BITS * level)) & WHEEL_MASK));
+        }
+
+        // Take the expired timers off the wheel first: a callback may start
+        // timers for this same tick, which then wait for the next one
+        int slot = (int)(tick & WHEEL_MASK);
+        PGTimer *expired = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~((uint64_t)1 << slot);
+        if (expired) {
+            expired->pprev = &expired;
+        }
+        wheel->now = tick + 1;
+
+        while (expired) {
+            PGTimer *timer = expired;
+            expired = timer->next;
+            if (expired) {
+                expired->pprev = &expired;
+            }
+            timer->next = NULL;
+            timer->pprev = NULL;
+            timer->callback(timer);
+        }
+    }
+}
+
+/**
+ * Current time for the wheel
+ *
+ * @return Milliseconds of the monotonic clock
+ */
+uint64_t pg_wheel_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
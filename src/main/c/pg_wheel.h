@@ -0,0 +1,72 @@
+/**
+ * pg_wheel.h
+ * Timer Wheel
+ *
+ * This file contains declarations for the timers of an event loop thread.
+ * Timers are kept in a hierarchical wheel of millisecond ticks: level 0 has
+ * a slot for each of the next 64 ticks, and every level above has slots 64
+ * times as wide. A timer goes into the slot covering its deadline on the
+ * lowest level that reaches it, and moves down a level when the wheel
+ * enters that slot, so starting, cancelling and expiring a timer are all
+ * O(1) whatever the number of timers. A bitmap of occupied slots per level
+ * tells the loop how long it may sleep without looking at any timer.
+ */
+
+#ifndef PG_WHEEL_H
+#define PG_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Wheel geometry: 5 levels of 64 slots span 2^30 ms (12 days); later
+   deadlines wait in the last slot and are placed again when it is reached */
+#define PG_WHEEL_BITS   6
+#define PG_WHEEL_SLOTS  (1 << PG_WHEEL_BITS)
+#define PG_WHEEL_LEVELS 5
+
+typedef struct PGTimer PGTimer;
+
+/* Called on the wheel's thread when a timer expires; it may start the
+   timer again, or start and cancel others */
+typedef void (*PGTimerCallback)(PGTimer *timer);
+
+/* Timer, embedded in the object it times */
+struct PGTimer {
+    PGTimer *next;           /* Next timer in the slot */
+    PGTimer **pprev;         /* Link pointing at this timer (NULL: not running) */
+    uint64_t expires;        /* Deadline, in milliseconds of the monotonic clock */
+    PGTimerCallback callback;
+    void *data;              /* Object the timer belongs to */
+};
+
+/* Timers of one thread */
+typedef struct {
+    uint64_t now;            /* Next tick to be processed */
+    uint64_t occupied[PG_WHEEL_LEVELS]; /* Slots that may hold timers */
+    PGTimer *slots[PG_WHEEL_LEVELS][PG_WHEEL_SLOTS];
+} PGWheel;
+
+/* Function declarations */
+void pg_wheel_init(PGWheel *wheel, uint64_t now);
+void pg_wheel_add(PGWheel *wheel, PGTimer *timer, uint64_t expires);
+void pg_wheel_cancel(PGTimer *timer);
+int pg_wheel_timeout(PGWheel *wheel, uint64_t now);
+void pg_wheel_advance(PGWheel *wheel, uint64_t now);
+uint64_t pg_wheel_now(void);
+
+/* Set up a timer that is not running */
+static inline void pg_timer_init(PGTimer *timer, PGTimerCallback callback, void *data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/* Whether a timer is waiting to expire */
+static inline bool pg_timer_pending(const PGTimer *timer) {
+    return timer->pprev != NULL;
+}
+
+#endif /* PG_WHEEL_H */